@@ -0,0 +1,620 @@
+/**
+ * @FilePath: /simple_file_system_test/bcache.c
+ * @Description: 块缓存，按块号缓存磁盘块，CLOCK换出
+ * @Copyright    : G AUTOMOBILE RESEARCH INSTITUTE CO.,LTD Copyright (c) 2025.
+*/
+#include <pthread.h>
+#include "stdint.h"
+#include "string.h"
+#include "stdio.h"
+#include "malloc.h"
+#include "stdlib.h"
+#include "bcache.h"
+
+typedef struct bcache
+{
+    disk_t *disk;
+    uint64_t block_size;        // 块大小(字节)
+    uint64_t sectors_per_block; // 每块扇区数
+    uint64_t capacity;          // 缓存块数
+    bcache_buf_t *bufs;         // 缓存槽位
+    uint8_t *pool;              // 所有槽位的数据区
+    bcache_buf_t **hash;        // 块号哈希表
+    uint32_t hash_shift;
+    uint64_t hand;              // CLOCK指针
+    uint64_t used;              // 已经用过的槽位数
+    uint64_t dirty;             // 脏块数
+    bcache_writeback_t writeback; // 为NULL时换出脏块直接写回所有脏块
+    void *writeback_arg;
+    uint64_t writing;           // 正在写回的块数
+    pthread_mutex_t lock;       // 保护槽位、哈希表和标志；读写磁盘和调用写回回调时都不持有
+    pthread_cond_t cond;        // 块读入完成或者写回完成时广播
+}bcache_t;
+
+
+static inline uint64_t bcache_hash(bcache_t *bc, uint64_t blk)
+{
+    return (blk * 0x9E3779B97F4A7C15ULL) >> bc->hash_shift;
+}
+
+static void bcache_hash_insert(bcache_t *bc, bcache_buf_t *buf)
+{
+    uint64_t h = bcache_hash(bc, buf->blk);
+    buf->hash_next = bc->hash[h];
+    bc->hash[h] = buf;
+}
+
+static void bcache_hash_remove(bcache_t *bc, bcache_buf_t *buf)
+{
+    bcache_buf_t **pp = &bc->hash[bcache_hash(bc, buf->blk)];
+    while(*pp!=NULL)
+    {
+        if(*pp==buf)
+        {
+            *pp = buf->hash_next;
+            buf->hash_next = NULL;
+            return;
+        }
+        pp = &(*pp)->hash_next;
+    }
+}
+
+static bcache_buf_t* bcache_find(bcache_t *bc, uint64_t blk)
+{
+    bcache_buf_t *buf = bc->hash[bcache_hash(bc, blk)];
+    while(buf!=NULL && buf->blk!=blk)
+    {
+        buf = buf->hash_next;
+    }
+    return buf;
+}
+
+/**
+ * @brief 查找块，块正在从磁盘读入时等它读完
+ *
+ * 等待时会放开bc->lock，读失败的块会从哈希表中去掉，所以每次醒来都重新查找。
+ */
+static bcache_buf_t* bcache_find_ready(bcache_t *bc, uint64_t blk)
+{
+    bcache_buf_t *buf;
+    while((buf = bcache_find(bc, blk))!=NULL && (buf->flags & BCACHE_BUSY))
+    {
+        pthread_cond_wait(&bc->cond, &bc->lock);
+    }
+    return buf;
+}
+
+static void bcache_set_dirty(bcache_t *bc, bcache_buf_t *buf)
+{
+    if(!(buf->flags & BCACHE_DIRTY))
+    {
+        buf->flags |= BCACHE_DIRTY;
+        bc->dirty++;
+    }
+}
+
+static void bcache_set_clean(bcache_t *bc, bcache_buf_t *buf)
+{
+    if(buf->flags & BCACHE_DIRTY)
+    {
+        buf->flags &= ~BCACHE_DIRTY;
+        bc->dirty--;
+    }
+}
+
+
+/**
+ * @brief 创建块缓存
+ *
+ * @param disk 缓存对应的磁盘
+ * @param block_size 块大小(字节)，必须是扇区大小的整数倍
+ * @param capacity 缓存块数
+ *
+ * @return 成功返回缓存指针，失败返回NULL
+ */
+bcache_t* bcache_create(disk_t *disk, uint64_t block_size, uint64_t capacity)
+{
+    if(disk==NULL || block_size==0 || block_size%disk->sector_size!=0 || capacity==0)
+    {
+        printf("bcache: bcache args error\n");
+        return NULL;
+    }
+
+    bcache_t *bc = (bcache_t*)malloc(sizeof(bcache_t));
+    if(bc==NULL)
+    {
+        printf("bcache: bcache malloc error\n");
+        return NULL;
+    }
+    memset(bc, 0, sizeof(bcache_t));
+    bc->disk = disk;
+    bc->block_size = block_size;
+    bc->sectors_per_block = block_size / disk->sector_size;
+    bc->capacity = capacity;
+
+    // 哈希桶数取不小于2倍容量的2的幂
+    uint32_t bits = 1;
+    while((1ULL<<bits) < capacity*2)
+    {
+        bits++;
+    }
+    bc->hash_shift = 64 - bits;
+
+    bc->bufs = (bcache_buf_t*)calloc(capacity, sizeof(bcache_buf_t));
+    bc->pool = (uint8_t*)malloc(capacity * block_size);
+    bc->hash = (bcache_buf_t**)calloc(1ULL<<bits, sizeof(bcache_buf_t*));
+    if(bc->bufs==NULL || bc->pool==NULL || bc->hash==NULL)
+    {
+        printf("bcache: bcache pool malloc error\n");
+        free(bc->bufs);
+        free(bc->pool);
+        free(bc->hash);
+        free(bc);
+        return NULL;
+    }
+    for(uint64_t i=0;i<capacity;i++)
+    {
+        bc->bufs[i].data = bc->pool + i*block_size;
+    }
+    pthread_mutex_init(&bc->lock, NULL);
+    pthread_cond_init(&bc->cond, NULL);
+    return bc;
+}
+
+int64_t bcache_destroy(bcache_t **bc)
+{
+    if(bc==NULL || *bc==NULL)
+    {
+        printf("bcache: bcache is not created\n");
+        return -1;
+    }
+    int64_t ret = bcache_sync(*bc);
+    pthread_mutex_destroy(&(*bc)->lock);
+    pthread_cond_destroy(&(*bc)->cond);
+    free((*bc)->bufs);
+    free((*bc)->pool);
+    free((*bc)->hash);
+    free(*bc);
+    *bc = NULL;
+    return ret;
+}
+
+static int bcache_cmp_blk(const void *a, const void *b)
+{
+    uint64_t x = (*(bcache_buf_t* const*)a)->blk;
+    uint64_t y = (*(bcache_buf_t* const*)b)->blk;
+    return x<y ? -1 : (x>y ? 1 : 0);
+}
+
+/**
+ * @brief 把脏块写回磁盘
+ *
+ * 脏块按块号排序后一次性交给disk_writev，相邻的块由磁盘层合并成大的传输。
+ * 写之前先清掉脏标志并引用这些块，写的时候不持有bc->lock；写的过程中又被改脏的块留给下一次写回，
+ * 写失败时重新标记为脏。完整的同步还要等别的线程正在写的块落盘，换出时的写回不等。
+ *
+ * @param want 为0时写回所有脏块，否则只写回带有这些标志的脏块
+ * @param unpinned 为1时跳过被引用的块：换出时别的线程可能正在改这些块，写回留给下一次同步
+ *
+ * @return 成功返回0，失败返回-1
+ */
+static int64_t bcache_sync_some(bcache_t *bc, uint32_t want, int unpinned)
+{
+    if(bc==NULL)
+    {
+        return -1;
+    }
+    pthread_mutex_lock(&bc->lock);
+
+    bcache_buf_t **dirty = (bcache_buf_t**)malloc(sizeof(bcache_buf_t*) * bc->used);
+    disk_iovec_t *iov = (disk_iovec_t*)malloc(sizeof(disk_iovec_t) * bc->used);
+    if((dirty==NULL || iov==NULL) && bc->used>0)
+    {
+        free(dirty);
+        free(iov);
+        pthread_mutex_unlock(&bc->lock);
+        printf("bcache: sync malloc error\n");
+        return -1;
+    }
+
+    uint64_t n = 0;
+    for(uint64_t i=0;i<bc->used;i++)
+    {
+        if((bc->bufs[i].flags & BCACHE_DIRTY) && (want==0 || (bc->bufs[i].flags & want)) && !(unpinned && bc->bufs[i].pin>0))
+        {
+            dirty[n++] = &bc->bufs[i];
+        }
+    }
+    qsort(dirty, n, sizeof(bcache_buf_t*), bcache_cmp_blk);
+    for(uint64_t i=0;i<n;i++)
+    {
+        iov[i] = (disk_iovec_t){dirty[i]->blk * bc->sectors_per_block, bc->sectors_per_block, dirty[i]->data};
+        bcache_set_clean(bc, dirty[i]);
+        dirty[i]->pin++;
+    }
+    bc->writing += n;
+    pthread_mutex_unlock(&bc->lock);
+
+    int64_t ret = disk_writev(bc->disk, iov, n);
+
+    pthread_mutex_lock(&bc->lock);
+    for(uint64_t i=0;i<n;i++)
+    {
+        dirty[i]->pin--;
+        if(ret<0)
+        {
+            bcache_set_dirty(bc, dirty[i]);
+        }
+    }
+    bc->writing -= n;
+    pthread_cond_broadcast(&bc->cond);
+    while(!unpinned && bc->writing>0)
+    {
+        pthread_cond_wait(&bc->cond, &bc->lock);
+    }
+    pthread_mutex_unlock(&bc->lock);
+    free(dirty);
+    free(iov);
+    return ret;
+}
+
+/**
+ * @brief 把所有脏块写回磁盘
+ *
+ * @return 成功返回0，失败返回-1
+ */
+int64_t bcache_sync(bcache_t *bc)
+{
+    return bcache_sync_some(bc, 0, 0);
+}
+
+/**
+ * @brief 只把文件数据的脏块写回磁盘，元数据块留给日志
+ *
+ * @return 成功返回0，失败返回-1
+ */
+int64_t bcache_sync_data(bcache_t *bc)
+{
+    return bcache_sync_some(bc, BCACHE_DATA, 0);
+}
+
+/**
+ * @brief 取出所有脏的元数据块，按块号排序
+ *
+ * @param out 至少能放缓存容量个指针
+ *
+ * @return 脏的元数据块数
+ */
+uint64_t bcache_collect_meta(bcache_t *bc, bcache_buf_t **out)
+{
+    pthread_mutex_lock(&bc->lock);
+    uint64_t n = 0;
+    for(uint64_t i=0;i<bc->used;i++)
+    {
+        if((bc->bufs[i].flags & (BCACHE_DIRTY|BCACHE_DATA)) == BCACHE_DIRTY)
+        {
+            out[n++] = &bc->bufs[i];
+        }
+    }
+    pthread_mutex_unlock(&bc->lock);
+    qsort(out, n, sizeof(bcache_buf_t*), bcache_cmp_blk);
+    return n;
+}
+
+/**
+ * @brief 设置换出脏的元数据块时的回调，日志用它保证元数据先进日志再写回原位
+ */
+void bcache_set_writeback(bcache_t *bc, bcache_writeback_t fn, void *arg)
+{
+    pthread_mutex_lock(&bc->lock);
+    bc->writeback = fn;
+    bc->writeback_arg = arg;
+    pthread_mutex_unlock(&bc->lock);
+}
+
+/**
+ * @brief 找一个可以复用的槽位
+ *
+ * 先用从未用过的槽位，满了之后按CLOCK算法跳过被引用和最近访问过的块。
+ * 选中的块如果是脏的，先把所有没被引用的脏块一起写回，避免一块一块地写。
+ * 调用者持有bc->lock；写回时放开锁，回来后这一块可能又被引用或者改脏，需要重新判断。
+ */
+static bcache_buf_t* bcache_evict(bcache_t *bc)
+{
+    if(bc->used < bc->capacity)
+    {
+        return &bc->bufs[bc->used++];
+    }
+
+    for(uint64_t step=0;step<2*bc->capacity+1;step++)
+    {
+        bcache_buf_t *buf = &bc->bufs[bc->hand];
+        bc->hand = (bc->hand+1) % bc->capacity;
+        if(buf->pin>0)
+        {
+            continue;
+        }
+        if(!(buf->flags & BCACHE_VALID))
+        {
+            return buf;
+        }
+        if(buf->ref)
+        {
+            buf->ref = 0;
+            continue;
+        }
+        if(buf->flags & BCACHE_DIRTY)
+        {
+            bcache_writeback_t writeback = bc->writeback;
+            void *arg = bc->writeback_arg;
+            uint32_t data = buf->flags & BCACHE_DATA;
+            int64_t ret;
+            pthread_mutex_unlock(&bc->lock);
+            if(writeback==NULL)
+            {
+                ret = bcache_sync_some(bc, 0, 1);
+            }
+            else if(data)
+            {
+                ret = bcache_sync_some(bc, BCACHE_DATA, 1);
+            }
+            else
+            {
+                ret = writeback(arg); // 元数据现在还不能写回时当作被引用
+            }
+            pthread_mutex_lock(&bc->lock);
+            if(ret<0 && (writeback==NULL || data))
+            {
+                return NULL;
+            }
+            if(buf->pin>0 || buf->ref || (buf->flags & BCACHE_DIRTY))
+            {
+                continue;
+            }
+            if(!(buf->flags & BCACHE_VALID))
+            {
+                return buf;
+            }
+        }
+        bcache_hash_remove(bc, buf);
+        buf->flags = 0;
+        return buf;
+    }
+
+    printf("bcache: all buffers are pinned\n");
+    return NULL;
+}
+
+/**
+ * @brief 在缓存中找到或者装入一个块并引用它
+ *
+ * 读盘时块标记为BCACHE_BUSY并且不持有bc->lock，别的线程查到这一块会等它读完。
+ * 调用者持有bc->lock。
+ */
+static bcache_buf_t* bcache_grab(bcache_t *bc, uint64_t blk, int read)
+{
+    bcache_buf_t *buf;
+    while(1)
+    {
+        buf = bcache_find_ready(bc, blk);
+        if(buf!=NULL)
+        {
+            buf->pin++;
+            buf->ref = 1;
+            return buf;
+        }
+
+        buf = bcache_evict(bc);
+        if(buf==NULL)
+        {
+            return NULL;
+        }
+        if(bcache_find(bc, blk)==NULL)
+        {
+            break;
+        }
+        // 换出时放开过锁，别的线程已经装入了这一块，这个槽位留着给别人用
+    }
+
+    buf->blk = blk;
+    buf->pin = 1;
+    buf->ref = 1;
+    if(read)
+    {
+        buf->flags = BCACHE_BUSY;
+        bcache_hash_insert(bc, buf);
+        pthread_mutex_unlock(&bc->lock);
+        int64_t ret = disk_read_range(bc->disk, buf->data, blk * bc->sectors_per_block, bc->sectors_per_block);
+        pthread_mutex_lock(&bc->lock);
+        pthread_cond_broadcast(&bc->cond);
+        if(ret<0)
+        {
+            bcache_hash_remove(bc, buf);
+            buf->flags = 0;
+            buf->pin = 0;
+            return NULL;
+        }
+        buf->flags = BCACHE_VALID;
+    }
+    else
+    {
+        memset(buf->data, 0, bc->block_size);
+        buf->flags = BCACHE_VALID | BCACHE_DIRTY;
+        bc->dirty++;
+        bcache_hash_insert(bc, buf);
+    }
+    return buf;
+}
+
+/**
+ * @brief 获取一个块，不在缓存中时从磁盘读入
+ *
+ * 返回的块被引用，用完必须调用bcache_put。
+ *
+ * @return 成功返回缓存块，失败返回NULL
+ */
+bcache_buf_t* bcache_get(bcache_t *bc, uint64_t blk)
+{
+    pthread_mutex_lock(&bc->lock);
+    bcache_buf_t *buf = bcache_grab(bc, blk, 1);
+    pthread_mutex_unlock(&bc->lock);
+    return buf;
+}
+
+/**
+ * @brief 获取一个新分配的块，内容清零并标记为脏，不读磁盘
+ *
+ * 新块默认是元数据块，用来存放文件数据时再调用bcache_mark_data。
+ */
+bcache_buf_t* bcache_get_new(bcache_t *bc, uint64_t blk)
+{
+    pthread_mutex_lock(&bc->lock);
+    bcache_buf_t *buf = bcache_grab(bc, blk, 0);
+    if(buf!=NULL)
+    {
+        memset(buf->data, 0, bc->block_size);
+        buf->flags &= ~BCACHE_DATA;
+        bcache_set_dirty(bc, buf);
+    }
+    pthread_mutex_unlock(&bc->lock);
+    return buf;
+}
+
+/**
+ * @brief 只在缓存中查找块，不会读磁盘
+ *
+ * @return 命中返回被引用的缓存块，未命中返回NULL
+ */
+bcache_buf_t* bcache_lookup(bcache_t *bc, uint64_t blk)
+{
+    pthread_mutex_lock(&bc->lock);
+    bcache_buf_t *buf = bcache_find_ready(bc, blk);
+    if(buf!=NULL)
+    {
+        buf->pin++;
+        buf->ref = 1;
+    }
+    pthread_mutex_unlock(&bc->lock);
+    return buf;
+}
+
+void bcache_put(bcache_t *bc, bcache_buf_t *buf)
+{
+    if(buf==NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&bc->lock);
+    if(buf->pin>0)
+    {
+        buf->pin--;
+    }
+    pthread_mutex_unlock(&bc->lock);
+}
+
+void bcache_mark_dirty(bcache_t *bc, bcache_buf_t *buf)
+{
+    pthread_mutex_lock(&bc->lock);
+    bcache_set_dirty(bc, buf);
+    pthread_mutex_unlock(&bc->lock);
+}
+
+/**
+ * @brief 标记块中是文件数据并且被修改，写回时不经过日志
+ */
+void bcache_mark_data(bcache_t *bc, bcache_buf_t *buf)
+{
+    pthread_mutex_lock(&bc->lock);
+    buf->flags |= BCACHE_DATA;
+    bcache_set_dirty(bc, buf);
+    pthread_mutex_unlock(&bc->lock);
+}
+
+/**
+ * @brief 块的内容已经由调用者写到磁盘上，清除脏标志
+ */
+void bcache_mark_clean(bcache_t *bc, bcache_buf_t *buf)
+{
+    pthread_mutex_lock(&bc->lock);
+    bcache_set_clean(bc, buf);
+    pthread_mutex_unlock(&bc->lock);
+}
+
+/**
+ * @brief 数据已经直接写到磁盘时，刷新缓存中[blk, blk+num)的副本
+ *
+ * 整段只加一次锁，不在缓存中的块跳过。
+ *
+ * @param data 连续存放这num个块的数据
+ */
+void bcache_update(bcache_t *bc, uint64_t blk, uint64_t num, const void *data)
+{
+    pthread_mutex_lock(&bc->lock);
+    for(uint64_t i=0;i<num;i++)
+    {
+        bcache_buf_t *buf = bcache_find_ready(bc, blk + i);
+        if(buf!=NULL)
+        {
+            memcpy(buf->data, (const uint8_t*)data + i*bc->block_size, bc->block_size);
+            bcache_set_clean(bc, buf);
+        }
+    }
+    pthread_mutex_unlock(&bc->lock);
+}
+
+/**
+ * @brief 直接从磁盘读了[blk, blk+num)之后，用缓存中的副本覆盖读到的内容
+ *
+ * 缓存中的块可能比磁盘新。整段只加一次锁，不在缓存中的块保留磁盘上的内容。
+ *
+ * @param data 连续存放这num个块的数据
+ */
+void bcache_read_cached(bcache_t *bc, uint64_t blk, uint64_t num, void *data)
+{
+    pthread_mutex_lock(&bc->lock);
+    for(uint64_t i=0;i<num;i++)
+    {
+        bcache_buf_t *buf = bcache_find_ready(bc, blk + i);
+        if(buf!=NULL)
+        {
+            memcpy((uint8_t*)data + i*bc->block_size, buf->data, bc->block_size);
+        }
+    }
+    pthread_mutex_unlock(&bc->lock);
+}
+
+/**
+ * @brief 块被释放后丢弃缓存中的副本，脏数据不再写回
+ */
+void bcache_invalidate(bcache_t *bc, uint64_t blk)
+{
+    pthread_mutex_lock(&bc->lock);
+    bcache_buf_t *buf = bcache_find_ready(bc, blk);
+    if(buf!=NULL)
+    {
+        bcache_set_clean(bc, buf);
+        if(buf->pin==0)
+        {
+            bcache_hash_remove(bc, buf);
+            buf->flags = 0;
+        }
+    }
+    pthread_mutex_unlock(&bc->lock);
+}
+
+uint64_t bcache_get_capacity(bcache_t *bc)
+{
+    return bc==NULL ? 0 : bc->capacity;
+}
+
+uint64_t bcache_get_dirty(bcache_t *bc)
+{
+    if(bc==NULL)
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&bc->lock);
+    uint64_t dirty = bc->dirty;
+    pthread_mutex_unlock(&bc->lock);
+    return dirty;
+}
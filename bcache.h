@@ -0,0 +1,55 @@
+/**
+ * @FilePath: /simple_file_system_test/bcache.h
+ * @Description: 块缓存，按块号缓存磁盘块，CLOCK换出
+ * @Copyright    : G AUTOMOBILE RESEARCH INSTITUTE CO.,LTD Copyright (c) 2025.
+*/
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#include "stdint.h"
+#include "virtdisk.h"
+
+#define BCACHE_DEFAULT_CAPACITY 1024 // 默认缓存块数
+
+#define BCACHE_VALID (1U<<0) // 缓存内容有效
+#define BCACHE_DIRTY (1U<<1) // 缓存内容比磁盘新，需要写回
+#define BCACHE_DATA  (1U<<2) // 文件数据块，其余的块(目录、extent、间接块)都当作元数据
+#define BCACHE_BUSY  (1U<<3) // 正在从磁盘读入，内容还不能用
+
+// 换出脏的元数据块前调用，返回0表示已经把它写回，返回负数表示现在不能写，跳过这一块
+typedef int64_t (*bcache_writeback_t)(void *arg);
+
+// 所有接口都可以在多个线程中调用；块内容不加锁，由调用者保证同一块不会同时被改写
+typedef struct bcache bcache_t;
+
+typedef struct bcache_buf
+{
+    uint64_t blk;      // 块号
+    uint8_t *data;     // 块数据
+    uint32_t flags;    // BCACHE_VALID/BCACHE_DIRTY
+    uint32_t ref;      // CLOCK引用位
+    uint32_t pin;      // 被引用次数，非0时不会被换出
+    struct bcache_buf *hash_next;
+}bcache_buf_t;
+
+bcache_t* bcache_create(disk_t *disk, uint64_t block_size, uint64_t capacity);
+int64_t bcache_destroy(bcache_t **bc);
+
+bcache_buf_t* bcache_get(bcache_t *bc, uint64_t blk);
+bcache_buf_t* bcache_get_new(bcache_t *bc, uint64_t blk);
+bcache_buf_t* bcache_lookup(bcache_t *bc, uint64_t blk);
+void    bcache_put(bcache_t *bc, bcache_buf_t *buf);
+void    bcache_mark_dirty(bcache_t *bc, bcache_buf_t *buf);
+void    bcache_mark_data(bcache_t *bc, bcache_buf_t *buf);
+void    bcache_mark_clean(bcache_t *bc, bcache_buf_t *buf);
+void    bcache_update(bcache_t *bc, uint64_t blk, uint64_t num, const void *data);
+void    bcache_read_cached(bcache_t *bc, uint64_t blk, uint64_t num, void *data);
+void    bcache_invalidate(bcache_t *bc, uint64_t blk);
+int64_t bcache_sync(bcache_t *bc);
+int64_t bcache_sync_data(bcache_t *bc);
+uint64_t bcache_collect_meta(bcache_t *bc, bcache_buf_t **out);
+void    bcache_set_writeback(bcache_t *bc, bcache_writeback_t fn, void *arg);
+uint64_t bcache_get_capacity(bcache_t *bc);
+uint64_t bcache_get_dirty(bcache_t *bc);
+
+#endif
@@ -11,15 +11,35 @@
 #include "stdio.h"
 #include "string.h"
 #include "malloc.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BITMAP_X86 1
+#endif
 
 #define PAGE_SIZE 4096
+#define BITMAP_MAX_LEVEL 10 // 64^11个字，足够任何磁盘
+#define BITMAP_NONE UINT64_MAX
 
+/*
+ * 多级摘要：第k层(k>=1)的第i位描述第k-1层的第i个字，第0层就是arr本身。
+ * full[k]的位为1表示下层这个字全为1（已用满），empty[k]的位为1表示下层这个字全空闲。
+ * 摘要末尾多出来的填充位在两套摘要中都置1，保证上层判断"全满/全空"时不受影响。
+ * 最高层只有一个字。
+ */
 typedef struct bitmap
 {
     uint64_t *arr;   // bitmap数组
     size_t size; // bitmap大小（位数）
+    uint64_t hint;   // 下次扫描的起始字（next-fit）
+    uint32_t levels; // 摘要层数，arr只有一个字时为0
+    uint64_t words[BITMAP_MAX_LEVEL+1];  // 每层的字数，words[0]是arr的字数
+    uint64_t *full[BITMAP_MAX_LEVEL+1];  // full[0]不用
+    uint64_t *empty[BITMAP_MAX_LEVEL+1]; // empty[0]不用
+    uint64_t *summary; // 所有摘要层共用的一块内存
 }bitmap_t;
 
+static void bitmap_summary_update(bitmap_t *bm, uint64_t w0, uint64_t w1);
+
 
 bitmap_t* bitmap_create(size_t size)
 {
@@ -35,19 +55,52 @@ bitmap_t* bitmap_create(size_t size)
         printf("bitmap: bitmap malloc error\n");
         return NULL;
     }
+    memset(bm, 0, sizeof(bitmap_t));
 
     bm->size = size;
+    bm->hint = 0;
     uint64_t bytes_num = (size+7)/8;
     uint64_t pages_num = (bytes_num+PAGE_SIZE-1)/PAGE_SIZE;
     bm->arr = (uint64_t *)malloc(pages_num*PAGE_SIZE);
     if(bm->arr==NULL)
     {
         printf("bitmap: bitmap.arr malloc error\n");
+        free(bm);
         return NULL;
     }
 
     memset(bm->arr,0,pages_num*PAGE_SIZE);
 
+    // 计算每层摘要的大小，直到某一层只剩一个字
+    bm->words[0] = (size+63)/64;
+    uint64_t summary_words = 0;
+    while(bm->words[bm->levels]>1 && bm->levels<BITMAP_MAX_LEVEL)
+    {
+        bm->levels++;
+        bm->words[bm->levels] = (bm->words[bm->levels-1]+63)/64;
+        summary_words += bm->words[bm->levels];
+    }
+    if(summary_words>0)
+    {
+        bm->summary = (uint64_t *)malloc(2*summary_words*sizeof(uint64_t));
+        if(bm->summary==NULL)
+        {
+            printf("bitmap: bitmap.summary malloc error\n");
+            free(bm->arr);
+            free(bm);
+            return NULL;
+        }
+        uint64_t *p = bm->summary;
+        for(uint32_t k=1;k<=bm->levels;k++)
+        {
+            bm->full[k] = p;
+            p += bm->words[k];
+            bm->empty[k] = p;
+            p += bm->words[k];
+        }
+    }
+    bitmap_refresh(bm);
+
     return bm;
 }
 int64_t bitmap_destory(bitmap_t **bm)
@@ -61,12 +114,92 @@ int64_t bitmap_destory(bitmap_t **bm)
     (*bm)->size = 0;
     free((*bm)->arr);
     (*bm)->arr = NULL;
+    free((*bm)->summary);
     free((*bm));
     *bm = NULL;
 
     return 0;
 }
 
+// arr中第w个字超出size的填充位
+static inline uint64_t bitmap_pad_mask(bitmap_t *bm, uint64_t w)
+{
+    if(w!=bm->words[0]-1 || bm->size%64==0)
+    {
+        return 0;
+    }
+    return UINT64_MAX << (bm->size%64);
+}
+
+/*
+ * 重新计算第k层第i位。
+ * 返回这一位是否有变化，没有变化时更上层也不用再算。
+ */
+static int bitmap_summary_bit(bitmap_t *bm, uint32_t k, uint64_t i)
+{
+    int is_full, is_empty;
+    if(k==1)
+    {
+        uint64_t pad = bitmap_pad_mask(bm, i);
+        is_full = (bm->arr[i] | pad)==UINT64_MAX;
+        is_empty = (bm->arr[i] & ~pad)==0;
+    }
+    else
+    {
+        is_full = bm->full[k-1][i]==UINT64_MAX;
+        is_empty = bm->empty[k-1][i]==UINT64_MAX;
+    }
+
+    uint64_t bit = 1ULL << (i%64);
+    uint64_t old_full = bm->full[k][i/64], old_empty = bm->empty[k][i/64];
+    bm->full[k][i/64] = is_full ? (old_full|bit) : (old_full&~bit);
+    bm->empty[k][i/64] = is_empty ? (old_empty|bit) : (old_empty&~bit);
+    return old_full!=bm->full[k][i/64] || old_empty!=bm->empty[k][i/64];
+}
+
+/*
+ * arr中[w0,w1]这些字被修改后，自下而上更新摘要
+ */
+static void bitmap_summary_update(bitmap_t *bm, uint64_t w0, uint64_t w1)
+{
+    for(uint32_t k=1;k<=bm->levels;k++)
+    {
+        int changed = 0;
+        for(uint64_t i=w0;i<=w1;i++)
+        {
+            changed |= bitmap_summary_bit(bm, k, i);
+        }
+        if(!changed)
+        {
+            break;
+        }
+        w0 /= 64;
+        w1 /= 64;
+    }
+}
+
+/**
+ * @brief 位图数据被直接改写（例如从磁盘读入）后，重建全部摘要
+ */
+void bitmap_refresh(bitmap_t *bm)
+{
+    if(bm==NULL||bm->arr==NULL)
+    {
+        printf("bitmap: bitmap is not created\n");
+        return;
+    }
+    for(uint32_t k=1;k<=bm->levels;k++)
+    {
+        // 填充位置1，其余位在下面重新计算
+        memset(bm->full[k], 0xFF, bm->words[k]*sizeof(uint64_t));
+        memset(bm->empty[k], 0xFF, bm->words[k]*sizeof(uint64_t));
+        for(uint64_t i=0;i<bm->words[k-1];i++)
+        {
+            bitmap_summary_bit(bm, k, i);
+        }
+    }
+}
+
 int64_t bitmap_set_bit(bitmap_t *bm, uint64_t index)
 {
 
@@ -86,6 +219,7 @@ int64_t bitmap_set_bit(bitmap_t *bm, uint64_t index)
     uint64_t bit_index = index % 64;
 
     bm->arr[uint64_index] |= (1ULL << bit_index);
+    bitmap_summary_update(bm, uint64_index, uint64_index);
 
     return 0;   
 }
@@ -106,10 +240,67 @@ int64_t bitmap_clear_bit(bitmap_t *bm, uint64_t index)
     uint64_t uint64_index = index / 64;
     uint64_t bit_index = index % 64;
     bm->arr[uint64_index] &= ~(1ULL << bit_index);
+    bitmap_summary_update(bm, uint64_index, uint64_index);
     return 0;   
 
 }
 
+static int64_t bitmap_change_range(bitmap_t *bm, uint64_t start, uint64_t num, int set)
+{
+    if(bm==NULL||bm->arr==NULL)
+    {
+        printf("bitmap: bitmap is not created\n");
+        return -1;
+    }
+    if(num==0)
+    {
+        return 0;
+    }
+    if(start>=bm->size || num>bm->size-start)
+    {
+        printf( ("bitmap: index out of range\n"));
+        return -1;
+    }
+
+    uint64_t end = start+num; // 不含
+    uint64_t w0 = start/64, w1 = (end-1)/64;
+    for(uint64_t w=w0;w<=w1;w++)
+    {
+        uint64_t mask = UINT64_MAX;
+        if(w==w0)
+        {
+            mask &= UINT64_MAX << (start%64);
+        }
+        if(w==w1 && end%64!=0)
+        {
+            mask &= UINT64_MAX >> (64-end%64);
+        }
+        bm->arr[w] = set ? (bm->arr[w]|mask) : (bm->arr[w]&~mask);
+    }
+    bitmap_summary_update(bm, w0, w1);
+    return 0;
+}
+
+/**
+ * @brief 把[start,start+num)这些位置1
+ *
+ * @return 成功返回0，越界返回-1
+ */
+int64_t bitmap_set_range(bitmap_t *bm, uint64_t start, uint64_t num)
+{
+    return bitmap_change_range(bm, start, num, 1);
+}
+
+/**
+ * @brief 把[start,start+num)这些位清0
+ *
+ * @return 成功返回0，越界返回-1
+ */
+int64_t bitmap_clear_range(bitmap_t *bm, uint64_t start, uint64_t num)
+{
+    return bitmap_change_range(bm, start, num, 0);
+}
+
 int64_t bitmap_test_bit(bitmap_t *bm, uint64_t index)
 {
     if(bm==NULL||bm->arr==NULL)
@@ -148,6 +339,144 @@ size_t bitmap_get_bytes_num(bitmap_t *bm)
     return (bm->size+7)/8;
 }
 
+void* bitmap_get_data(bitmap_t *bm)
+{
+    if(bm==NULL||bm->arr==NULL)
+    {
+        printf("bitmap: bitmap is not created\n");
+        return NULL;
+    }
+    return bm->arr;
+}
+
+/*
+ * 在[from,to)字范围内找第一个不等于skip的字，找不到返回to。
+ * x86上一次比较256位(AVX2)或128位(SSE2)，整段都等于skip的区域直接跳过。
+ */
+static uint64_t bitmap_find_word_scalar(const uint64_t *arr, uint64_t from, uint64_t to, uint64_t skip)
+{
+    while(from<to && arr[from]==skip)
+    {
+        from++;
+    }
+    return from;
+}
+
+#ifdef BITMAP_X86
+__attribute__((target("avx2")))
+static uint64_t bitmap_find_word_avx2(const uint64_t *arr, uint64_t from, uint64_t to, uint64_t skip)
+{
+    // 先按标量对齐到4个字，减少跨缓存行的加载
+    while(from<to && (from&3)!=0)
+    {
+        if(arr[from]!=skip)
+        {
+            return from;
+        }
+        from++;
+    }
+    const __m256i pattern = _mm256_set1_epi64x((long long)skip);
+    while(from+4<=to)
+    {
+        __m256i v = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(arr+from)), pattern);
+        if(!_mm256_testz_si256(v, v)) // testz为1表示4个字都等于skip
+        {
+            break;
+        }
+        from += 4;
+    }
+    return bitmap_find_word_scalar(arr, from, to, skip);
+}
+
+__attribute__((target("sse2")))
+static uint64_t bitmap_find_word_sse2(const uint64_t *arr, uint64_t from, uint64_t to, uint64_t skip)
+{
+    if(from<to && (from&1)!=0)
+    {
+        if(arr[from]!=skip)
+        {
+            return from;
+        }
+        from++;
+    }
+    const __m128i pattern = _mm_set1_epi64x((long long)skip);
+    while(from+2<=to)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(arr+from));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(v, pattern))!=0xFFFF)
+        {
+            break;
+        }
+        from += 2;
+    }
+    return bitmap_find_word_scalar(arr, from, to, skip);
+}
+#endif
+
+static uint64_t bitmap_find_word(const uint64_t *arr, uint64_t from, uint64_t to, uint64_t skip)
+{
+#ifdef BITMAP_X86
+    static int has_avx2 = -1;
+    if(has_avx2<0)
+    {
+        __builtin_cpu_init();
+        has_avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+    }
+    return has_avx2 ? bitmap_find_word_avx2(arr, from, to, skip) : bitmap_find_word_sse2(arr, from, to, skip);
+#else
+    return bitmap_find_word_scalar(arr, from, to, skip);
+#endif
+}
+
+/*
+ * 在第k层找第一个序号>=pos的目标位，找不到返回BITMAP_NONE。
+ * one为0时找arr中的0位，借助full摘要跳过已满的字；
+ * one为1时找arr中的1位，借助empty摘要跳过全空闲的字。
+ * 当前字里没有目标位时，递归到上一层找下一个可能有目标位的字，每层最多看一个字。
+ */
+static uint64_t bitmap_find(bitmap_t *bm, uint32_t k, uint64_t pos, int one)
+{
+    uint64_t nbits = k==0 ? bm->size : bm->words[k-1];
+    while(pos<nbits)
+    {
+        uint64_t w = pos/64;
+        uint64_t word;
+        if(k==0)
+        {
+            word = one ? bm->arr[w] : ~bm->arr[w];
+        }
+        else
+        {
+            word = ~(one ? bm->empty[k][w] : bm->full[k][w]);
+        }
+        word &= UINT64_MAX << (pos%64);
+        if(word!=0)
+        {
+            uint64_t index = w*64 + (uint64_t)__builtin_ctzll(word);
+            return index<nbits ? index : BITMAP_NONE; // 只有arr最后一个字的填充位会越界
+        }
+        if(k==bm->levels)
+        {
+            return BITMAP_NONE;
+        }
+        uint64_t next = bitmap_find(bm, k+1, w+1, one);
+        if(next==BITMAP_NONE)
+        {
+            return BITMAP_NONE;
+        }
+        pos = next*64;
+    }
+    return BITMAP_NONE;
+}
+
+/**
+ * @brief 查找一个为0的位
+ *
+ * 从上次找到的位置继续向后找（next-fit），到末尾后回绕到开头。
+ * 借助full摘要逐层跳过已满的区域，代价和位图有多满无关。
+ *
+ * @return 找到返回位序号，没有空闲位返回-1
+ */
 int64_t bitmap_scan_0(bitmap_t *bm)
 {
     if(bm==NULL||bm->arr==NULL)
@@ -156,25 +485,128 @@ int64_t bitmap_scan_0(bitmap_t *bm)
         return -1;
     }
 
-    for(uint64_t i=0;i<bm->size;i++)
+    uint64_t index = bitmap_find(bm, 0, bm->hint*64, 0);
+    if(index==BITMAP_NONE && bm->hint!=0)
+    {
+        index = bitmap_find(bm, 0, 0, 0);
+    }
+    if(index==BITMAP_NONE)
     {
-        if(bm->arr[i]!=UINT64_MAX)
+        return -1;
+    }
+    bm->hint = index/64;
+    return (int64_t)index;
+}
+
+/*
+ * 从pos开始找第一段长度>=num的连续0位。
+ *
+ * 长度不小于2*64^k-1的连续空闲段一定包含一个按64^k对齐、在empty[k]中为1的整块，
+ * 所以num较大时只在empty[k]里找整块，再向两边扩展，碎片再多也不用逐段检查；
+ * num较小时在arr中交替找下一个0位和下一个1位，每一步都借助摘要跳过。
+ */
+static uint64_t bitmap_find_run(bitmap_t *bm, uint64_t num, uint64_t pos)
+{
+    uint32_t k = 0;
+    uint64_t chunk = 1;
+    while(k<bm->levels && 2*chunk*64-1<=num)
+    {
+        k++;
+        chunk *= 64;
+    }
+
+    while(pos<bm->size)
+    {
+        uint64_t start;
+        if(k==0)
+        {
+            start = bitmap_find(bm, 0, pos, 0);
+            if(start==BITMAP_NONE)
+            {
+                return BITMAP_NONE;
+            }
+        }
+        else
         {
-            uint8_t* arr=(uint8_t*)&bm->arr[i];
-            for(uint8_t j=0;j<8;j++)
+            uint64_t c = (pos+chunk-1)/chunk;
+            uint64_t w = c/64;
+            uint64_t word = 0;
+            if(w<bm->words[k])
             {
-                if(arr[j]!=UINT8_MAX)
+                word = bm->empty[k][w] & (UINT64_MAX << (c%64));
+                if(word==0)
                 {
-                    for(uint8_t k=0;k<8;k++)
-                    {
-                        if((arr[j]&(1<<k)) == 0)
-                        {
-                            return i*64+j*8+k;
-                        }
-                    }
+                    w = bitmap_find_word(bm->empty[k], w+1, bm->words[k], 0);
+                    word = w<bm->words[k] ? bm->empty[k][w] : 0;
                 }
             }
+            if(word==0)
+            {
+                return BITMAP_NONE;
+            }
+            c = w*64 + (uint64_t)__builtin_ctzll(word);
+            if(c>=bm->words[k-1])
+            {
+                return BITMAP_NONE; // 摘要的填充位
+            }
+            // 向前扩展到上一个1位，最多扩展不到一个整块
+            start = c*chunk;
+            while(start>pos)
+            {
+                uint64_t bw = (start-1)/64;
+                uint64_t used = bm->arr[bw] & (UINT64_MAX >> (63-(start-1)%64));
+                if(used!=0)
+                {
+                    uint64_t last = bw*64 + 63 - (uint64_t)__builtin_clzll(used);
+                    start = last+1>pos ? last+1 : pos;
+                    break;
+                }
+                start = bw*64>pos ? bw*64 : pos;
+            }
+        }
+
+        uint64_t end = bitmap_find(bm, 0, start, 1);
+        if(end==BITMAP_NONE)
+        {
+            end = bm->size;
+        }
+        if(end-start>=num)
+        {
+            return start;
         }
+        pos = end;
+    }
+    return BITMAP_NONE;
+}
+
+/**
+ * @brief 查找一段连续num个为0的位
+ *
+ * @param num 需要的连续位数
+ * @param hint 从这一位开始向后找，到末尾后再从头找一遍
+ *
+ * @return 找到返回这一段的起始位序号，找不到返回-1；不会修改位图
+ */
+int64_t bitmap_scan_0_run(bitmap_t *bm, uint64_t num, uint64_t hint)
+{
+    if(bm==NULL||bm->arr==NULL)
+    {
+        printf("bitmap: bitmap is not created\n");
+        return -1;
+    }
+    if(num==0 || num>bm->size)
+    {
+        return -1;
     }
-    return -1;
-}  
\ No newline at end of file
+    if(hint>=bm->size)
+    {
+        hint = 0;
+    }
+
+    uint64_t start = bitmap_find_run(bm, num, hint);
+    if(start==BITMAP_NONE && hint!=0)
+    {
+        start = bitmap_find_run(bm, num, 0);
+    }
+    return start==BITMAP_NONE ? -1 : (int64_t)start;
+}
@@ -23,6 +23,11 @@ int64_t bitmap_clear_bit(bitmap_t *bm, uint64_t index);
 int64_t bitmap_test_bit(bitmap_t *bm, uint64_t index);
 size_t  bitmap_get_size(bitmap_t *bm);
 size_t  bitmap_get_bytes_num(bitmap_t *bm);
+void*   bitmap_get_data(bitmap_t *bm);
 int64_t bitmap_scan_0(bitmap_t *bm);
+int64_t bitmap_scan_0_run(bitmap_t *bm, uint64_t num, uint64_t hint); // 查找连续num个0位
+int64_t bitmap_set_range(bitmap_t *bm, uint64_t start, uint64_t num);
+int64_t bitmap_clear_range(bitmap_t *bm, uint64_t start, uint64_t num);
+void    bitmap_refresh(bitmap_t *bm); // 直接改写位图数据后重建摘要
 
 #endif
\ No newline at end of file
@@ -0,0 +1,281 @@
+/**
+ * @FilePath: /simple_file_system_test/dcache.c
+ * @Description: 目录项缓存，按(父目录inode, 名字)缓存查找结果
+ * @Copyright    : G AUTOMOBILE RESEARCH INSTITUTE CO.,LTD Copyright (c) 2025.
+*/
+#include <pthread.h>
+#include "stdint.h"
+#include "string.h"
+#include "stdio.h"
+#include "malloc.h"
+#include "stdlib.h"
+#include "dcache.h"
+
+typedef struct dentry
+{
+    uint64_t parent;            // 所在目录的inode索引
+    int64_t inode_idx;          // 对应的inode索引，DCACHE_NEGATIVE表示不存在
+    uint64_t hash;              // (parent, name)的哈希值，比较名字前先比较它
+    uint32_t valid;
+    uint32_t ref;               // CLOCK引用位
+    struct dentry *hash_next;
+    char name[DCACHE_NAME_LEN];
+}dentry_t;
+
+typedef struct dcache
+{
+    uint64_t capacity;   // 缓存项数
+    dentry_t *entries;   // 所有缓存项
+    dentry_t **hash;     // 哈希桶
+    uint64_t hash_mask;
+    uint64_t hand;       // CLOCK指针
+    uint64_t used;       // 已经用过的缓存项数
+    pthread_mutex_t lock;
+}dcache_t;
+
+
+// FNV-1a，父目录的inode号也参与哈希
+static uint64_t dcache_hash(uint64_t parent, const char *name, uint64_t *len)
+{
+    uint64_t h = 0xcbf29ce484222325ULL ^ (parent * 0x9E3779B97F4A7C15ULL);
+    uint64_t n = 0;
+    for(;name[n]!='\0';n++)
+    {
+        h ^= (uint8_t)name[n];
+        h *= 0x100000001b3ULL;
+    }
+    *len = n;
+    return h;
+}
+
+static dentry_t** dcache_find(dcache_t *dc, uint64_t parent, const char *name, uint64_t hash)
+{
+    dentry_t **pp = &dc->hash[hash & dc->hash_mask];
+    while(*pp!=NULL)
+    {
+        dentry_t *d = *pp;
+        if(d->hash==hash && d->parent==parent && strcmp(d->name, name)==0)
+        {
+            return pp;
+        }
+        pp = &d->hash_next;
+    }
+    return NULL;
+}
+
+static void dcache_unlink(dcache_t *dc, dentry_t *d)
+{
+    dentry_t **pp = &dc->hash[d->hash & dc->hash_mask];
+    while(*pp!=NULL)
+    {
+        if(*pp==d)
+        {
+            *pp = d->hash_next;
+            break;
+        }
+        pp = &(*pp)->hash_next;
+    }
+    d->hash_next = NULL;
+    d->valid = 0;
+}
+
+
+/**
+ * @brief 创建目录项缓存
+ *
+ * @param capacity 最多缓存的目录项数
+ *
+ * @return 成功返回缓存指针，失败返回NULL
+ */
+dcache_t* dcache_create(uint64_t capacity)
+{
+    if(capacity==0)
+    {
+        printf("dcache: dcache args error\n");
+        return NULL;
+    }
+
+    dcache_t *dc = (dcache_t*)malloc(sizeof(dcache_t));
+    if(dc==NULL)
+    {
+        printf("dcache: dcache malloc error\n");
+        return NULL;
+    }
+    memset(dc, 0, sizeof(dcache_t));
+    dc->capacity = capacity;
+
+    // 哈希桶数取不小于2倍容量的2的幂
+    uint64_t buckets = 1;
+    while(buckets < capacity*2)
+    {
+        buckets <<= 1;
+    }
+    dc->hash_mask = buckets - 1;
+
+    dc->entries = (dentry_t*)calloc(capacity, sizeof(dentry_t));
+    dc->hash = (dentry_t**)calloc(buckets, sizeof(dentry_t*));
+    if(dc->entries==NULL || dc->hash==NULL)
+    {
+        printf("dcache: dcache pool malloc error\n");
+        free(dc->entries);
+        free(dc->hash);
+        free(dc);
+        return NULL;
+    }
+    pthread_mutex_init(&dc->lock, NULL);
+    return dc;
+}
+
+int64_t dcache_destroy(dcache_t **dc)
+{
+    if(dc==NULL || *dc==NULL)
+    {
+        printf("dcache: dcache is not created\n");
+        return -1;
+    }
+    pthread_mutex_destroy(&(*dc)->lock);
+    free((*dc)->entries);
+    free((*dc)->hash);
+    free(*dc);
+    *dc = NULL;
+    return 0;
+}
+
+
+/**
+ * @brief 查找目录parent下名为name的目录项
+ *
+ * @param inode_idx 命中时返回inode索引，负缓存命中时为DCACHE_NEGATIVE
+ *
+ * @return 命中返回1，不在缓存中返回0
+ */
+int64_t dcache_lookup(dcache_t *dc, uint64_t parent, const char *name, int64_t *inode_idx)
+{
+    if(dc==NULL || name==NULL)
+    {
+        return 0;
+    }
+    uint64_t len;
+    uint64_t hash = dcache_hash(parent, name, &len);
+    if(len >= DCACHE_NAME_LEN)
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&dc->lock);
+    dentry_t **pp = dcache_find(dc, parent, name, hash);
+    if(pp!=NULL)
+    {
+        (*pp)->ref = 1;
+        *inode_idx = (*pp)->inode_idx;
+    }
+    pthread_mutex_unlock(&dc->lock);
+    return pp!=NULL;
+}
+
+
+/**
+ * @brief 记录目录parent下name对应的inode，已有的记录直接覆盖
+ *
+ * 缓存满时按CLOCK算法换出最近没有用过的项。
+ *
+ * @param inode_idx inode索引，DCACHE_NEGATIVE表示记录这个名字不存在
+ */
+void dcache_insert(dcache_t *dc, uint64_t parent, const char *name, int64_t inode_idx)
+{
+    if(dc==NULL || name==NULL)
+    {
+        return;
+    }
+    uint64_t len;
+    uint64_t hash = dcache_hash(parent, name, &len);
+    if(len >= DCACHE_NAME_LEN)
+    {
+        return;
+    }
+    pthread_mutex_lock(&dc->lock);
+    dentry_t **pp = dcache_find(dc, parent, name, hash);
+    if(pp!=NULL)
+    {
+        (*pp)->inode_idx = inode_idx;
+        (*pp)->ref = 1;
+        pthread_mutex_unlock(&dc->lock);
+        return;
+    }
+
+    dentry_t *d = NULL;
+    if(dc->used < dc->capacity)
+    {
+        d = &dc->entries[dc->used++];
+    }
+    else
+    {
+        while(d==NULL)
+        {
+            dentry_t *cur = &dc->entries[dc->hand];
+            dc->hand = (dc->hand+1) % dc->capacity;
+            if(cur->valid && cur->ref)
+            {
+                cur->ref = 0;
+                continue;
+            }
+            if(cur->valid)
+            {
+                dcache_unlink(dc, cur);
+            }
+            d = cur;
+        }
+    }
+
+    d->parent = parent;
+    d->inode_idx = inode_idx;
+    d->hash = hash;
+    d->valid = 1;
+    d->ref = 1;
+    memcpy(d->name, name, len + 1);
+    d->hash_next = dc->hash[hash & dc->hash_mask];
+    dc->hash[hash & dc->hash_mask] = d;
+    pthread_mutex_unlock(&dc->lock);
+}
+
+
+/**
+ * @brief 丢弃目录parent下name的记录
+ */
+void dcache_remove(dcache_t *dc, uint64_t parent, const char *name)
+{
+    if(dc==NULL || name==NULL)
+    {
+        return;
+    }
+    uint64_t len;
+    uint64_t hash = dcache_hash(parent, name, &len);
+    if(len >= DCACHE_NAME_LEN)
+    {
+        return;
+    }
+    pthread_mutex_lock(&dc->lock);
+    dentry_t **pp = dcache_find(dc, parent, name, hash);
+    if(pp!=NULL)
+    {
+        dcache_unlink(dc, *pp);
+    }
+    pthread_mutex_unlock(&dc->lock);
+}
+
+
+/**
+ * @brief 丢弃所有记录，重新格式化或加载文件系统时使用
+ */
+void dcache_clear(dcache_t *dc)
+{
+    if(dc==NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&dc->lock);
+    memset(dc->hash, 0, (dc->hash_mask + 1) * sizeof(dentry_t*));
+    memset(dc->entries, 0, dc->capacity * sizeof(dentry_t));
+    dc->used = 0;
+    dc->hand = 0;
+    pthread_mutex_unlock(&dc->lock);
+}
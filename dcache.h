@@ -0,0 +1,26 @@
+/**
+ * @FilePath: /simple_file_system_test/dcache.h
+ * @Description: 目录项缓存，按(父目录inode, 名字)缓存查找结果
+ * @Copyright    : G AUTOMOBILE RESEARCH INSTITUTE CO.,LTD Copyright (c) 2025.
+*/
+#ifndef DCACHE_H
+#define DCACHE_H
+
+#include "stdint.h"
+
+#define DCACHE_DEFAULT_CAPACITY 4096 // 默认缓存的目录项数
+#define DCACHE_NAME_LEN 120          // 能缓存的最长文件名(含结束符)，更长的名字不进缓存
+
+#define DCACHE_NEGATIVE (-1) // 负缓存：确认目录下没有这个名字
+
+typedef struct dcache dcache_t;
+
+dcache_t* dcache_create(uint64_t capacity);
+int64_t dcache_destroy(dcache_t **dc);
+
+int64_t dcache_lookup(dcache_t *dc, uint64_t parent, const char *name, int64_t *inode_idx);
+void    dcache_insert(dcache_t *dc, uint64_t parent, const char *name, int64_t inode_idx);
+void    dcache_remove(dcache_t *dc, uint64_t parent, const char *name);
+void    dcache_clear(dcache_t *dc);
+
+#endif
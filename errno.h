@@ -21,6 +21,7 @@
 #define        ERROR_TIMEOUT  -8// 超时
 #define        ERROR_INVALID_ARG  -9// 无效参数错误
 #define        ERROR_DUPLICATE  -10// 重复错误
+#define        ERROR_BUSY  -11// 资源正在被使用
 
     
 #endif 
\ No newline at end of file
@@ -7,29 +7,21 @@
  * @LastEditors: scuec_weiqiang scuec_weiqiang@qq.com
  * @Copyright    : G AUTOMOBILE RESEARCH INSTITUTE CO.,LTD Copyright (c) 2025.
 */
+#define _GNU_SOURCE // pthread_rwlock_t
+#include <pthread.h>
 #include "stdint.h"
 #include "bitmap.h"
 #include "malloc.h"
 #include "virtdisk.h"
+#include "bcache.h"
+#include "dcache.h"
 #include "string.h"
 #include "stdio.h"
 #include "assert.h"
 #include "errno.h"
-
-char *strdup(const char *s) {
-    if (s == NULL) return NULL;
-    
-    size_t len = strlen(s) + 1;  // 计算长度（含结束符）
-    char *dup = malloc(len);     // 分配内存
-    
-    if (dup != NULL) {
-        strcpy(dup, s);          // 复制字符串
-    }
-    
-    return dup;
-}
-
-#define EXT2_INODE_DENSITY_PER_GIB 2048
+#include "stdlib.h"
+#include "unistd.h"
+#include "ext2.h"
 
 typedef struct ext2_super_block {
 #define EXT2_SUPER_MAGIC 0xEF53
@@ -40,11 +32,24 @@ typedef struct ext2_super_block {
     uint64_t blocks_count;      // 块总数
     uint64_t free_blocks_count; // 空闲块数
     uint64_t block_size;    // 块大小(字节)
+    uint64_t features;      // EXT2_FEATURE_*，决定新inode用哪种块映射
+    uint64_t blocks_per_group;  // 每组的块数
+    uint64_t inodes_per_group;  // 每组的inode数
+    uint64_t groups_count;      // 块组数
+    uint64_t journal_start;     // 日志区的起始块，开启EXT2_FEATURE_JOURNAL时有效
+    uint64_t journal_blocks;    // 日志区的块数
+    uint64_t reserved_blocks_count; // 保留的块数，文件数据不能用，留给目录和块映射
     // ... 其他字段
 }ext2_super_block_t;
 
+/*
+ * 磁盘按EXT2_BLOCKS_PER_GROUP分成若干块组，每组依次是：块位图、inode位图、inode表、数据块。
+ * 第0组前面还有超级块和组描述符表。一个位图块正好描述一组的块，所以内存中整张块位图的第g个扇区就是第g组的块位图。
+ */
+#define EXT2_BLOCKS_PER_GROUP(block_size) ((block_size)*8)
+
 typedef struct ext2_group_descriptor {
-#define EXT2_GROUP_DESCRIPTOR_IDX 1
+#define EXT2_GROUP_DESCRIPTOR_IDX 1 // 组描述符表的起始块
     uint64_t block_bitmap_start_idx;     // 块位图起始索引
     uint64_t block_bitmap_block_num;
 
@@ -58,8 +63,21 @@ typedef struct ext2_group_descriptor {
     uint64_t data_block_num;
 
     uint64_t root_inode_idx;
+
+    uint64_t free_blocks_count; // 本组空闲块数
+    uint64_t free_inodes_count; // 本组空闲inode数
+    uint64_t used_dirs_count;   // 本组的目录数
+#define EXT2_BG_INODE_UNINIT 0x1 // inode位图和inode表还没写过，内容当作全0
+#define EXT2_BG_BLOCK_UNINIT 0x2 // 块位图还没写过，按本组的布局推算
+#define EXT2_BG_UNINIT (EXT2_BG_INODE_UNINIT|EXT2_BG_BLOCK_UNINIT)
+    uint64_t flags;             // EXT2_BG_*
+    uint64_t reserved[3];       // 补齐到128字节，一个扇区放4个
 }ext2_group_descriptor_t;
 
+#define EXT2_GDT_BLOCKS(groups, block_size) (((groups) * sizeof(ext2_group_descriptor_t) + (block_size) - 1) / (block_size))
+// 块位图按整组分配，最后一组不足的部分在格式化时置1
+#define EXT2_BLOCK_BITMAP_BITS(super) ((super)->groups_count * (super)->blocks_per_group)
+
 typedef struct ext2_inode {
 #define ROOT_INODE_IDX 0
 
@@ -69,1235 +87,6142 @@ typedef struct ext2_inode {
     uint32_t priv;        // 权限
     uint64_t size;        // 文件大小(字节)
     uint64_t ctime;       // 创建时间
-#define MAX_BLK_NUM 13
-    uint64_t blk_idx[MAX_BLK_NUM];  // 所在块号
+#define EXT2_INODE_EXTENTS 0x1 // blk_idx中存放的是extent树的根
+#define EXT2_INODE_INDEX   0x2 // 目录使用哈希索引，第0块是索引根
+    uint32_t flags;
+    uint32_t blocks;      // 已映射的逻辑块数，逻辑块[0,blocks)都有对应的物理块
+#define EXT2_N_BLOCKS 12
+#define EXT2_NDIR_BLOCKS 9                  // 不用extent时：前9项是直接块
+#define EXT2_IND_BLOCK   EXT2_NDIR_BLOCKS   // 一次间接块
+#define EXT2_DIND_BLOCK  (EXT2_IND_BLOCK+1) // 二次间接块
+#define EXT2_TIND_BLOCK  (EXT2_DIND_BLOCK+1)// 三次间接块
+    uint64_t blk_idx[EXT2_N_BLOCKS];  // 块映射区，按flags解释
 }ext2_inode_t;
 
+#define EXT2_PTRS_PER_BLOCK(fs) ((fs)->block_size / sizeof(uint64_t)) // 每个间接块中的块号数
 
-typedef struct ext2_dir_entry {
-#define MAX_FILENAME_LEN 120 
-    char name[MAX_FILENAME_LEN];  // 文件名
-    uint64_t inode_idx;           // inode索引
-} ext2_dir_entry_t;
-
-typedef struct ext2_fs
-{
-    ext2_super_block_t *super; 
-    ext2_group_descriptor_t *group; 
-    bitmap_t *block_bitmap; 
-    bitmap_t *inode_bitmap; 
-    ext2_inode_t *inode_table; 
-    uint64_t cwd_inode_idx; // 当前工作目录的inode索引
-}ext2_fs_t;
-
+#define EXT2_MAX_FILE_BLOCKS UINT32_MAX // 逻辑块号用32位表示
 
-/**
- * @brief 创建一个ext2文件系统
- *
- * 该函数用于创建一个新的ext2文件系统。它会为文件系统分配内存，并初始化其超级块、组描述符、块位图、inode位图以及inode表。
- *
- * @return 指向新创建的ext2文件系统的指针，如果创建失败则返回NULL。
+/*
+ * extent树：每个节点以ext2_extent_header_t开头，后面跟着记录。
+ * 叶子节点(depth==0)的记录是ext2_extent_t，描述一段逻辑和物理上都连续的块；
+ * 索引节点的记录是ext2_extent_idx_t，指向下一层节点所在的块。
+ * 根节点放在inode的blk_idx里，其余节点各占一个块，记录都按lblk升序排列。
  */
-ext2_fs_t* ext2_fs_create()
-{
-    // 分配 ext2_fs_t 结构体内存
-    ext2_fs_t* fs = malloc(sizeof(ext2_fs_t));
-    assert(fs!=NULL,return NULL);
-   
-    // 分配 ext2_super_block_t 结构体内存，并初始化
-    fs->super = (ext2_super_block_t *)malloc(BLOCK_SIZE);
-    // 设置文件系统魔数
-    fs->super->magic = EXT2_SUPER_MAGIC; 
-    // 设置 inode 数量
-    fs->super->inodes_count = 128;
-    // 设置块大小
-    fs->super->block_size = BLOCK_SIZE;
-    // 设置块数量
-    fs->super->blocks_count = DISK_SIZE / fs->super->block_size;
-
-    // 分配 ext2_group_descriptor_t 结构体内存
-    fs->group = (ext2_group_descriptor_t *)malloc(BLOCK_SIZE);
-    // 创建块位图
-    fs->block_bitmap = bitmap_create(fs->super->blocks_count);  
-    // 创建 inode 位图
-    fs->inode_bitmap = bitmap_create(fs->super->inodes_count);
-    // 分配 inode 表内存
-    fs->inode_table = (ext2_inode_t *)malloc(sizeof(ext2_inode_t) * fs->super->inodes_count);
-    // 初始化当前工作目录为根目录
-    fs->cwd_inode_idx = ROOT_INODE_IDX; 
-    return fs;
-}
+typedef struct ext2_extent_header {
+#define EXT2_EXT_MAGIC 0xF30A
+    uint16_t magic;
+    uint16_t entries;  // 已用的记录数
+    uint16_t max;      // 最多能放的记录数
+    uint16_t depth;    // 节点到叶子的层数，叶子为0
+    uint64_t reserved;
+}ext2_extent_header_t;
+
+typedef struct ext2_extent {
+    uint32_t lblk;  // 起始逻辑块号
+    uint32_t len;   // 块数
+    uint64_t pblk;  // 起始物理块号
+}ext2_extent_t;
+
+typedef struct ext2_extent_idx {
+    uint32_t lblk;     // 子树中第一个逻辑块号，和ext2_extent_t.lblk位置相同
+    uint32_t reserved;
+    uint64_t child;    // 子节点所在的块
+}ext2_extent_idx_t;
+
+#define EXT2_EXT_MAX_DEPTH 5
+#define EXT2_EXT_MAX_LEN   0x80000000U // 单个extent最多的块数
+#define EXT2_EXT_ROOT_MAX  ((sizeof(uint64_t)*EXT2_N_BLOCKS - sizeof(ext2_extent_header_t)) / sizeof(ext2_extent_t))
+#define EXT2_EXT_NODE_MAX(fs) (((fs)->block_size - sizeof(ext2_extent_header_t)) / sizeof(ext2_extent_t))
+#define EXT2_EXT_LEAF(h)   ((ext2_extent_t*)((ext2_extent_header_t*)(h) + 1))
+#define EXT2_EXT_INDEX(h)  ((ext2_extent_idx_t*)((ext2_extent_header_t*)(h) + 1))
+
+#define EXT2_IOV_BATCH 64 // 文件读写时一次提交的最多传输段数
 
-
-/**
- * @brief 格式化 ext2 文件系统
- *
- * 该函数用于初始化并格式化 ext2 文件系统。它将文件系统结构（如超级块、组描述符、位图和 inode 表）写入磁盘，
- * 并配置各个结构的位置和大小。
- *
- * @param fs ext2 文件系统结构体指针
- *
- * @return 格式化成功返回 0，失败返回 -1
+/*
+ * 元数据日志：日志区第0块是日志超级块，从第1块开始最多放一个事务：
+ * [描述块][描述块记录的各块]...[描述块][...][提交块]。
+ * 提交块写到磁盘后事务才算完成，之后元数据才写回原位，写完再把日志超级块的序号加1。
  */
-int64_t ext2_fs_format(ext2_fs_t *fs)
-{
-    uint64_t now_block_pos = 0;
+#define EXT2_JOURNAL_BLOCKS 1024 // 默认日志区块数，第0组放不下时缩小
 
-    uint64_t super_block_pos_start = 0,super_block_num = 0;
-    uint64_t group_block_pos_start = 0,group_block_num = 0;
-    uint64_t block_bitmap_block_pos_start = 0,block_bitmap_block_num = 0;
-    uint64_t inode_bitmap_block_pos_start = 0,inode_bitmap_block_num = 0;
-    uint64_t inode_table_block_pos_start = 0,inode_table_block_num = 0;
-    uint64_t data_block_pos_start = 0,data_block_num=0;
+typedef struct ext2_journal_super {
+#define EXT2_JOURNAL_MAGIC 0x4A4E524CU
+    uint64_t magic;
+    uint64_t blocks;   // 日志区块数，含这一块
+    uint64_t sequence; // 下一个事务的序号，更小的事务都已经写回原位
+}ext2_journal_super_t;
 
-    // 配置super_block
-    super_block_pos_start = now_block_pos;
-    super_block_num = 1;
-    assert(fs->super!=NULL,return -1);
-    fs->super->magic = EXT2_SUPER_MAGIC; 
-    fs->super->free_blocks_count = DISK_SIZE / fs->super->block_size;
-    fs->super->free_inodes_count = 128;
-    now_block_pos += super_block_num;
+typedef struct ext2_journal_header {
+#define EXT2_JOURNAL_DESCRIPTOR 1
+#define EXT2_JOURNAL_COMMIT     2
+    uint32_t magic;
+    uint32_t type;
+    uint64_t sequence;
+    uint64_t count;    // 描述块：后面跟着的块数；提交块：事务中的总块数
+    uint64_t checksum; // 提交块：事务中所有目标块号和内容的校验和
+}ext2_journal_header_t;
 
+#define EXT2_JOURNAL_TAGS(fs) (((fs)->block_size - sizeof(ext2_journal_header_t)) / sizeof(uint64_t)) // 每个描述块记录的块数
 
-    // 配置group_descriptor
-    group_block_pos_start = now_block_pos; //记录group的位置
-    group_block_num = 1;
-    //不急着配置group_descriptor,先预留空间,因为他的值要和后面的位图和inode表的位置有关
-    assert(fs->group!=NULL,return -1);
-    now_block_pos += group_block_num;
 
+typedef struct ext2_dir_entry {
+#define MAX_FILENAME_LEN 120 
+    char name[MAX_FILENAME_LEN];  // 文件名
+    uint64_t inode_idx;           // inode索引
+} ext2_dir_entry_t;
 
-    // 配置两个位图
-    block_bitmap_block_pos_start = now_block_pos;
-    assert(fs->block_bitmap!=NULL,return -1);
-    block_bitmap_block_num = (bitmap_get_bytes_num(fs->block_bitmap)+511)/BLOCK_SIZE; //计算块位图所占的块数
-    now_block_pos += block_bitmap_block_num;
+#define EXT2_DIR_ENTRIES_PER_BLOCK(fs) ((fs)->block_size / sizeof(ext2_dir_entry_t))
+
+// 索引目录的索引节点，第0块是根，各层格式相同
+typedef struct ext2_dx_header {
+#define EXT2_DX_MAGIC 0x44584458U
+#define EXT2_DX_HASH_FNV1A 0 // 文件名哈希算法
+    uint32_t magic;
+    uint16_t count;        // 已用的索引项数
+    uint16_t limit;        // 最多的索引项数
+    uint16_t levels;       // 下面还有几层索引节点，为0时索引项指向叶子块
+    uint16_t hash_version; // 只在根中有意义
+    uint32_t reserved;
+}ext2_dx_header_t;
+
+typedef struct ext2_dx_entry {
+    uint32_t hash; // 子树中最小的哈希值，第一项不用比较
+    uint32_t lblk; // 子节点在目录中的逻辑块号
+}ext2_dx_entry_t;
+
+#define EXT2_DX_LIMIT(fs) (((fs)->block_size - sizeof(ext2_dx_header_t)) / sizeof(ext2_dx_entry_t))
+#define EXT2_DX_ENTRIES(h) ((ext2_dx_entry_t*)((ext2_dx_header_t*)(h) + 1))
+#define EXT2_DX_MAX_LEVELS 2 // 根下面最多再有两层索引节点
+
+// 从索引根到叶子经过的块
+typedef struct ext2_dx_path
+{
+    bcache_buf_t *buf[EXT2_DX_MAX_LEVELS + 1]; // 各层索引节点，buf[0]是根
+    uint64_t at[EXT2_DX_MAX_LEVELS + 1];       // 各层选中的索引项
+    uint64_t num;                              // 索引节点层数
+    bcache_buf_t *leaf;                        // 叶子块
+    uint64_t leaf_lblk;
+}ext2_dx_path_t;
+
+// 一组扇区的修改记录：位图去重，列表记下修改了哪些扇区，写回代价只和修改的扇区数有关
+typedef struct ext2_dirty_set
+{
+    bitmap_t *map;
+    uint64_t *list;
+    uint64_t num;
+    pthread_mutex_t lock; // 不同inode、不同组的修改可能同时标记同一个扇区
+}ext2_dirty_set_t;
+
+// 记住最近用到的最后一级间接块，顺序读写时不用每次都从inode逐级查找
+typedef struct ext2_map_cache
+{
+    uint64_t inode_idx;
+    uint64_t base; // 这个间接块第一项对应的逻辑块号
+    uint64_t blk;  // 间接块的块号，0表示无效
+}ext2_map_cache_t;
 
-    inode_bitmap_block_pos_start = now_block_pos;
-    assert(fs->inode_bitmap!=NULL,return -1);
-    inode_bitmap_block_num = (bitmap_get_bytes_num(fs->inode_bitmap)+511)/BLOCK_SIZE; //计算inode位图所占的块数
-    now_block_pos += inode_bitmap_block_num;
+#define EXT2_RESV_BLOCKS 64 // 线程每次预留的连续块数，比它少的分配从预留中取
+#define EXT2_RESV_INODES 8  // 线程每次预留的inode数
+#define EXT2_RESV_SHARDS 16 // 预留块计数的分片数，各线程的预留轮流落在不同分片上
 
+// 一个计数分片，独占一个缓存行，不同分片上的更新互不干扰
+typedef struct ext2_count_shard
+{
+    uint64_t count;
+    uint64_t pad[7];
+}ext2_count_shard_t;
 
-    // 配置inode表
-    inode_table_block_pos_start = now_block_pos;
-    assert(fs->inode_table!=NULL,return -1);
-    memset(fs->inode_table, 0, sizeof(ext2_inode_t) * fs->super->inodes_count);
-    inode_table_block_num = (sizeof(ext2_inode_t) * fs->super->inodes_count)/BLOCK_SIZE; //计算inode表所占的块数
-    now_block_pos += inode_table_block_num;
+// 一个线程预留的块和inode，线程内分配不加锁；每次提交日志前和线程退出时还给位图
+typedef struct ext2_resv
+{
+    ext2_fs_t *fs;
+    uint64_t block_start;             // 预留的一段连续块中还没用的第一块
+    uint64_t block_num;               // 还没用的块数，只有所属线程修改，分配时不碰分片
+    uint64_t counted;                 // 记在分片上的块数，预留和归还时才和block_num对齐
+    uint64_t shard;                   // 所在的计数分片
+    uint64_t inodes[EXT2_RESV_INODES];
+    uint64_t inode_num;
+    struct ext2_resv *next;
+}ext2_resv_t;
+
+// 当前事务中释放的一段块
+typedef struct ext2_free_run
+{
+    uint64_t start;
+    uint64_t num;
+}ext2_free_run_t;
 
+// 一个文件最近一次块映射的结果，同一个文件连续读写时不用每次都查extent树或间接块
+typedef struct ext2_map_hint
+{
+    uint64_t gen;  // 取到这个结果时fs->map_gen的值，不相等说明期间有文件被截断过
+    uint64_t lblk;
+    uint64_t pblk;
+    uint64_t len;  // 为0表示无效
+    pthread_mutex_t lock; // 同一个句柄可以被多个线程在inode读锁下同时读，读读之间也会更新上面几项
+}ext2_map_hint_t;
 
-    // 配置数据块
-    data_block_pos_start = now_block_pos;
-    data_block_num = fs->super->blocks_count - now_block_pos;
+typedef struct ext2_fs
+{
+    disk_t *disk; // 文件系统所在的磁盘
+    bcache_t *bcache; // 块缓存，目录块和文件末尾块经过它读写
+    dcache_t *dcache; // 目录项缓存，(父目录, 文件名) -> inode，也记录不存在的名字
+    ext2_super_block_t *super;
+    uint64_t block_size; // 块大小，等于super->block_size，磁盘的扇区和块缓存都以它为单位
+    ext2_group_descriptor_t *group; // 组描述符表，共super->groups_count项
+    bitmap_t *block_bitmap; // 所有组的块位图拼在一起
+    bitmap_t *inode_bitmap; // 所有组的inode位图拼在一起
+    ext2_inode_t *inode_table; // 所有组的inode表拼在一起
+    ext2_dirty_set_t inode_dirty;        // inode表中被修改过的扇区
+    ext2_dirty_set_t block_bitmap_dirty; // 块位图被修改过的组
+    ext2_dirty_set_t inode_bitmap_dirty; // inode位图被修改过的组
+    ext2_dirty_set_t group_dirty;        // 组描述符表中被修改过的扇区
+    ext2_dirty_set_t group_init;         // 下次提交前要写好位图和inode表的未初始化组
+    uint64_t super_dirty;                // 超级块的空闲计数被修改过
+    ext2_map_cache_t map_cache;          // 最近一次间接块查找的结果
+    uint64_t map_gen;                    // 每次释放文件的块时加1，让ext2_map_hint_t失效
+    uint64_t journal_handles;            // 正在进行的元数据操作数，不为0时不能提交日志
+    uint64_t journal_committing;         // 正在提交，新的元数据操作要等提交结束
+    uint64_t journal_sequence;           // 下一个事务的序号
+    pthread_mutex_t journal_lock;        // 保护journal_handles和journal_committing
+    pthread_cond_t journal_cond;         // 操作数归零或提交结束时广播
+    pthread_rwlock_t *inode_locks;       // 每个inode一把读写锁，和inode_table一一对应
+    uint64_t inode_lock_num;
+    uint32_t *open_count;                // 每个inode打开的句柄数，在inode的写锁下修改，不为0时不能删除
+    uint32_t *view_count;                // 每个inode还没释放的ext2_pread_views次数，原子地修改，不为0时不能截断或删除
+    pthread_mutex_t balloc_lock;         // 块位图、空闲块计数
+    pthread_mutex_t ialloc_lock;         // inode位图、空闲inode计数和目录计数
+    pthread_mutex_t map_lock;            // map_cache
+    pthread_key_t resv_key;              // 每个线程自己的ext2_resv_t
+    pthread_mutex_t resv_lock;           // 保护resv_list
+    ext2_resv_t *resv_list;              // 所有线程的预留，提交时逐个归还
+    uint64_t resv_shard_next;            // 下一个新建的预留用的分片，在resv_lock下修改
+    ext2_count_shard_t resv_shard[EXT2_RESV_SHARDS]; // 各分片上的预留中的块数，预留和归还时原子地更新
+    ext2_free_run_t *free_pending;       // 开启日志时当前事务中释放的块，提交时才还给位图，在balloc_lock下修改
+    uint64_t free_pending_num;
+    uint64_t free_pending_cap;
+    pthread_t lazy_thread;               // 后台初始化未初始化组的线程
+    uint64_t lazy_running;               // lazy_thread已经启动还没有回收
+    uint64_t lazy_stop;                  // 通知lazy_thread退出
+    uint64_t cwd_inode_idx; // 当前工作目录的inode索引
+}ext2_fs_t;
 
-    // 配置group_descriptor
-    fs->group->block_bitmap_start_idx = block_bitmap_block_pos_start;
-    fs->group->block_bitmap_block_num = block_bitmap_block_num;
-    fs->group->inode_bitmap_start_idx = inode_bitmap_block_pos_start;
-    fs->group->inode_bitmap_block_num = inode_bitmap_block_num;
-    fs->group->inode_table_start_idx = inode_table_block_pos_start;
-    fs->group->inode_table_block_num = inode_table_block_num;
-    fs->group->data_block_start_idx = data_block_pos_start;
-    fs->group->data_block_num = data_block_num;
+/*
+ * 并发模型：
+ * 每个inode一把读写锁，读文件、查目录加读锁，写文件、增删目录项加写锁，同时要两把时先父目录后子节点。
+ * 修改元数据的操作先ext2_journal_start再加inode锁，解锁后再ext2_journal_stop，
+ * 提交日志时等所有操作结束，提交期间不持有任何inode锁，因此不会和操作互相等待。
+ * 块分配器和inode分配器各有一把锁，inode分配器挑组时会短暂取块分配器的锁，反过来不行。
+ * 每个线程从位图中成批预留块和inode，小的分配直接从自己的预留中取，不用取分配器的锁。
+ * 块缓存、目录项缓存和修改记录内部自己加锁。
+ * 格式化、加载、卸载和调整缓存容量时不能有其他线程在用这个文件系统；
+ * 同一个ext2_file_t可以在多个线程中同时使用，句柄中的映射提示有自己的锁。
+ */
 
-    // printf("super_block_start_idx=%ld\n",super_block_pos_start);
-    // printf("block_bitmap_start_idx=%ld\n",fs->group->block_bitmap_start_idx);
-    // printf("inode_bitmap_start_idx=%ld\n",fs->group->inode_bitmap_start_idx);
-    // printf("inode_table_start_idx=%ld\n",fs->group->inode_table_start_idx);
-    // printf("data_block_start_idx=%ld\n",fs->group->data_block_start_idx);
+static void ext2_map_init(ext2_fs_t *fs, ext2_inode_t *inode);
+static void ext2_resv_drain_all(ext2_fs_t *fs);
+static int64_t ext2_free_blocks(ext2_fs_t *fs, uint64_t start, uint64_t num);
+static void ext2_free_pending_apply(ext2_fs_t *fs, int64_t delta);
+static void ext2_resv_exit(void *arg);
+static void ext2_resv_reset(ext2_fs_t *fs);
+static int ext2_lazy_init_stop(ext2_fs_t *fs);
 
 
-    // 把前面占用的block写入block_bitmap
-    for (size_t i = super_block_pos_start; i < data_block_pos_start; i++)
+static void ext2_dirty_free(ext2_dirty_set_t *set)
+{
+    if(set->map != NULL)
     {
-        bitmap_set_bit(fs->block_bitmap,i);
-        // printf("%d,blockbitmap = %lx\n",i,((uint64_t*)((uint64_t*)fs->block_bitmap)[0])[0] );
+        bitmap_destory(&set->map);
     }
-    
-    bitmap_set_bit(fs->inode_bitmap, ROOT_INODE_IDX); // 设置根目录的inode位图
-    fs->super->free_inodes_count--; // 根目录的inode已经被分配
-    fs->inode_table[ROOT_INODE_IDX].type = FILE_TYPE_DIR; // 第一个inode设为根目录
-    fs->inode_table[ROOT_INODE_IDX].priv = 0; // 权限设置为0
-    fs->inode_table[ROOT_INODE_IDX].size = 0; // 初始大小为0
-    fs->inode_table[ROOT_INODE_IDX].ctime = 1; // 创建时间设为1
-    // fs->inode_table[ROOT_INODE_IDX].blk_idx[0] = ext2_alloc_block(fs); // 分配一个数据块给根目录
-    printf("free inode num = %ld\n", fs->super->free_inodes_count);
-    printf("free block num = %ld\n\n", fs->super->free_blocks_count);
-    // 统一写入
-    DISK_WRITE(fs->super,super_block_pos_start,super_block_num);
-    DISK_WRITE(fs->group,group_block_pos_start,group_block_num);
-    DISK_WRITE(fs->block_bitmap,block_bitmap_block_pos_start,block_bitmap_block_num);
-    DISK_WRITE(fs->inode_bitmap,inode_bitmap_block_pos_start,inode_bitmap_block_num);
-    DISK_WRITE(fs->inode_table,inode_table_block_pos_start,inode_table_block_num);
+    free(set->list);
+    set->list = NULL;
+    set->num = 0;
+}
 
+
+static int64_t ext2_dirty_init(ext2_dirty_set_t *set, uint64_t sector_num)
+{
+    ext2_dirty_free(set);
+    set->map = bitmap_create(sector_num);
+    set->list = (uint64_t*)malloc(sizeof(uint64_t) * sector_num);
+    assert(set->map!=NULL&&set->list!=NULL,return -1;);
     return 0;
 }
 
 
-/*
-* @brief 加载 ext2 文件系统
-*
-* 该函数用于从磁盘加载 ext2 文件系统的超级块、组描述符、块位图、inode 位图和 inode 表。
-*
-* @param fs 指向 ext2 文件系统的指针
-*
-* @return 成功返回 0，失败返回 -1
-*/
-int64_t ext2_fs_load(ext2_fs_t *fs)
+static void ext2_dirty_mark(ext2_dirty_set_t *set, uint64_t sector)
 {
-    assert(fs!=NULL,return -1;);
+    pthread_mutex_lock(&set->lock);
+    if(bitmap_test_bit(set->map, sector) == 0)
+    {
+        bitmap_set_bit(set->map, sector);
+        set->list[set->num++] = sector;
+    }
+    pthread_mutex_unlock(&set->lock);
+}
 
-    DISK_READ(fs->super,EXT2_SUPER_BLOCK_IDX,1);
-    DISK_READ(fs->group,EXT2_GROUP_DESCRIPTOR_IDX,1);
 
-    // printf("magic = %x\n",fs->super->magic);
-    // printf("free_inodes_count = %d\n",fs->super->free_inodes_count);
+static uint64_t ext2_dirty_num(ext2_dirty_set_t *set)
+{
+    pthread_mutex_lock(&set->lock);
+    uint64_t num = set->num;
+    pthread_mutex_unlock(&set->lock);
+    return num;
+}
 
-    DISK_READ(fs->block_bitmap,fs->group->block_bitmap_start_idx,fs->group->block_bitmap_block_num);
-    DISK_READ(fs->inode_bitmap,fs->group->inode_bitmap_start_idx,fs->group->inode_bitmap_block_num);
-    DISK_READ(fs->inode_table,fs->group->inode_table_start_idx,fs->group->inode_table_block_num);
 
+static void ext2_dirty_reset(ext2_dirty_set_t *set)
+{
+    pthread_mutex_lock(&set->lock);
+    for(uint64_t i = 0;i<set->num;i++)
+    {
+        bitmap_clear_bit(set->map, set->list[i]);
+    }
+    set->num = 0;
+    pthread_mutex_unlock(&set->lock);
 }
 
 
 /**
- * @brief 分配一个新的块
- *
- * 该函数用于分配一个新的块，并更新文件系统的空闲块计数。
+ * @brief 按当前的几何参数建立inode表和两个位图的修改记录
  *
- * @param fs 指向ext2文件系统的指针
+ * @param fs ext2 文件系统结构体指针
  *
- * @return 成功返回新分配的块索引，失败返回-1。
+ * @return 成功返回 0，失败返回 -1
  */
-int64_t ext2_alloc_block(ext2_fs_t *fs)
+static int64_t ext2_dirty_init_all(ext2_fs_t *fs)
 {
-    assert(fs!=NULL,return -1;);
-    assert(fs->super->free_blocks_count>=0,return -1;);
-
-    int64_t ret = bitmap_scan_0(fs->block_bitmap);
-    
-    if(ret<0)
+    uint64_t inode_sector_num = (sizeof(ext2_inode_t) * fs->super->inodes_count + fs->block_size - 1) / fs->block_size;
+    fs->super_dirty = 0;
+    if(ext2_dirty_init(&fs->inode_dirty, inode_sector_num) < 0 ||
+       ext2_dirty_init(&fs->block_bitmap_dirty, fs->super->groups_count) < 0 ||
+       ext2_dirty_init(&fs->inode_bitmap_dirty, fs->super->groups_count) < 0 ||
+       ext2_dirty_init(&fs->group_dirty, EXT2_GDT_BLOCKS(fs->super->groups_count, fs->block_size)) < 0 ||
+       ext2_dirty_init(&fs->group_init, fs->super->groups_count) < 0)
     {
-        printf("No free blocks available.\n");
-        return ERROR_NOT_FREE; // 没有可用的块
+        return -1;
     }
-   
-    bitmap_set_bit(fs->block_bitmap,ret);
-    fs->super->free_blocks_count--;
-    return ret;
-
+    return 0;
 }
 
 
 /**
- * @brief 释放指定的块
- *
- * 该函数用于释放指定的块，并更新文件系统的空闲块计数。
+ * @brief 标记inode被修改
  *
- * @param fs 指向ext2文件系统的指针
- * @param idx 要释放的块索引
+ * 只记录inode所在的inode表扇区，真正写盘推迟到ext2_fs_sync，
+ * 多次修改同一扇区中的inode只会写一次。
  *
- * @return 成功返回0，失败返回-1。
+ * @param fs ext2 文件系统结构体指针
+ * @param inode_idx 被修改的inode索引
  */
-int64_t ext2_free_block(ext2_fs_t *fs,uint64_t idx)
+static void ext2_mark_inode_dirty(ext2_fs_t *fs, uint64_t inode_idx)
 {
-    assert(fs!=NULL,return -1;);
-    int64_t ret = bitmap_clear_bit(fs->block_bitmap,idx);
-    if(ret<0)
-    {
-        return FAILED; // 没有可用的块
-    }
-    fs->super->free_blocks_count++;
-    return ret;
+    ext2_dirty_mark(&fs->inode_dirty, inode_idx * sizeof(ext2_inode_t) / fs->block_size);
 }
 
 
 /**
- * @brief 分配一个新的inode
- *
- * 该函数用于分配一个新的inode，并更新文件系统的空闲inode计数。
- *
- * @param fs 指向ext2文件系统的指针
- *
- * @return 成功返回新分配的inode索引，失败返回-1。
+ * @brief 标记第g组的组描述符被修改
  */
-int64_t ext2_alloc_inode(ext2_fs_t *fs)
+static void ext2_mark_group_dirty(ext2_fs_t *fs, uint64_t g)
 {
-    assert(fs!=NULL,return -1;);
-    assert(fs->super->free_inodes_count>=0,return -1;);
+    ext2_dirty_mark(&fs->group_dirty, g * sizeof(ext2_group_descriptor_t) / fs->block_size);
+}
 
-    int64_t ret =  bitmap_scan_0(fs->inode_bitmap);
-    if(ret<0)
-    {
-        printf("No free inodes available.\n");
-        return ret; // 没有可用的inode
-    }
-  
-    bitmap_set_bit(fs->inode_bitmap,(uint64_t)ret);
-    fs->super->free_inodes_count--;
-    return ret;
 
+// 块分配器和inode分配器都会改超级块的计数，各自持有不同的锁
+static void ext2_mark_super_dirty(ext2_fs_t *fs)
+{
+    __atomic_store_n(&fs->super_dirty, 1, __ATOMIC_RELAXED);
 }
 
 
 /**
- * @brief 释放指定的inode
- *
- * 该函数用于释放指定的inode，并更新文件系统的空闲inode计数。
- *
- * @param fs 指向ext2文件系统的指针
- * @param idx 要释放的inode索引
+ * @brief 按inode总数建立每个inode的读写锁、打开计数和视图计数
  *
- * @return 成功返回0，失败返回-1。
+ * @return 成功返回 0，失败返回 -1
  */
-int64_t ext2_free_inode(ext2_fs_t *fs,uint64_t idx)
+static int64_t ext2_inode_locks_init(ext2_fs_t *fs, uint64_t num)
 {
-    assert(fs!=NULL,return -1;);
-    int64_t ret = bitmap_clear_bit(fs->inode_bitmap,idx);
-    if(ret<0)
+    for(uint64_t i = 0;i<fs->inode_lock_num;i++)
     {
-        return FAILED;// 没有可用的inode
+        pthread_rwlock_destroy(&fs->inode_locks[i]);
     }
-    fs->super->free_inodes_count++;
-    return ret;
+    free(fs->inode_locks);
+    free(fs->open_count);
+    free(fs->view_count);
+    fs->inode_lock_num = 0;
+    fs->inode_locks = (pthread_rwlock_t*)malloc(sizeof(pthread_rwlock_t) * num);
+    fs->open_count = (uint32_t*)calloc(num, sizeof(uint32_t));
+    fs->view_count = (uint32_t*)calloc(num, sizeof(uint32_t));
+    assert(fs->inode_locks!=NULL&&fs->open_count!=NULL&&fs->view_count!=NULL,return -1;);
+    for(uint64_t i = 0;i<num;i++)
+    {
+        pthread_rwlock_init(&fs->inode_locks[i], NULL);
+    }
+    fs->inode_lock_num = num;
+    return 0;
 }
 
 
-/**
- * @brief 覆盖写数据到指定inode的文件
- *
- * 该函数用于将数据覆盖写到指定inode的文件中，并更新inode的大小和修改时间。
- *
- * @param fs 指向ext2文件系统的指针
- * @param inode_idx 要覆盖写数据的inode索引
- * @param data 要覆盖写的数据
- * @param size 要覆盖写的数据大小
- *
- * @return 成功返回0，失败返回-1。
- */
-int64_t ext2_overwrite_file(ext2_fs_t *fs, uint64_t inode_idx, const void *data, uint64_t size)
+static void ext2_inode_rdlock(ext2_fs_t *fs, uint64_t inode_idx)
 {
-    assert(fs!=NULL,return -1;);
-    
-    assert(inode_idx<fs->super->inodes_count,return -1;);
-    assert(data!=NULL,return -1;);
+    pthread_rwlock_rdlock(&fs->inode_locks[inode_idx]);
+}
+
+
+static void ext2_inode_wrlock(ext2_fs_t *fs, uint64_t inode_idx)
+{
+    pthread_rwlock_wrlock(&fs->inode_locks[inode_idx]);
+}
+
 
-    uint64_t blocks_needed = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    assert(blocks_needed<=13&&blocks_needed<=fs->super->free_blocks_count,return -1;);
+static void ext2_inode_unlock(ext2_fs_t *fs, uint64_t inode_idx)
+{
+    pthread_rwlock_unlock(&fs->inode_locks[inode_idx]);
+}
 
-    uint64_t blocks_used = (fs->inode_table[inode_idx].size + BLOCK_SIZE - 1) / BLOCK_SIZE;
 
-    if(blocks_needed <= blocks_used) //
+/*
+ * 磁盘上每组的inode位图占一个块，内存中各组的inode位图首尾相接，读写时逐位转换
+ */
+static void ext2_inode_bitmap_pack(ext2_fs_t *fs, uint64_t g, uint8_t *blk)
+{
+    uint64_t ipg = fs->super->inodes_per_group;
+    memset(blk, 0, fs->block_size);
+    for(uint64_t i = 0;i<ipg;i++)
     {
-        for(uint64_t i = blocks_needed;i<blocks_used;i++) // 将多余的空间释放
+        if(bitmap_test_bit(fs->inode_bitmap, g*ipg + i) == 1)
         {
-            ext2_free_block(fs,fs->inode_table[inode_idx].blk_idx[i]);
+            blk[i/8] |= (uint8_t)(1U << (i%8));
         }
     }
-    else
+}
+
+
+static void ext2_inode_bitmap_unpack(ext2_fs_t *fs, uint64_t g, const uint8_t *blk)
+{
+    uint64_t ipg = fs->super->inodes_per_group;
+    for(uint64_t i = 0;i<ipg;i++)
     {
-        for(uint64_t i=blocks_used;i<blocks_needed;i++)
+        if(blk[i/8] & (1U << (i%8)))
         {
-            fs->inode_table[inode_idx].blk_idx[i] = ext2_alloc_block(fs); // 多出来的部分分配空间
+            bitmap_set_bit(fs->inode_bitmap, g*ipg + i);
         }
     }
+}
 
-    for(uint64_t i = 0;i<blocks_needed;i++)
-    {
-        disk_write((uint8_t*)data+i*BLOCK_SIZE,fs->inode_table[inode_idx].blk_idx[i]);
-    }
-
-    fs->inode_table[inode_idx].size = size;
-    fs->inode_table[inode_idx].ctime++;
-
-    DISK_WRITE(fs->inode_table, fs->group->inode_table_start_idx, fs->group->inode_table_block_num);
-    // disk_write(fs->inode_table, fs->group->inode_table_start_idx + inode_idx * sizeof(ext2_inode_t)/ BLOCK_SIZE);
-    return 0;
 
+static int ext2_cmp_iov(const void *a, const void *b)
+{
+    uint64_t x = ((const disk_iovec_t*)a)->sector;
+    uint64_t y = ((const disk_iovec_t*)b)->sector;
+    return x<y ? -1 : (x>y ? 1 : 0);
 }
 
 
 /**
- * @brief 追加数据到指定inode的文件
+ * @brief 收集修改过的超级块、组描述符、位图和inode表扇区
  *
- * 该函数用于将数据追加到指定inode的文件中，并更新inode的大小和修改时间。
+ * 内存中连续的inode表和位图按组换算成各组在磁盘上的位置，结果按扇区号排好。
  *
- * @param fs 指向ext2文件系统的指针
- * @param inode_idx 要追加数据的inode索引
- * @param data 要追加的数据
- * @param size 要追加的数据大小
+ * @param iov 返回的传输请求，每项一个扇区，用完后free
+ * @param stage 返回的inode位图暂存区，用完后free
  *
- * @return 成功返回0，失败返回-1。
+ * @return 成功返回请求数，失败返回-1
  */
-int64_t ext2_append_file(ext2_fs_t *fs, uint64_t inode_idx, const void *data, uint64_t size)
+static int64_t ext2_collect_metadata(ext2_fs_t *fs, disk_iovec_t **iov, uint8_t **stage)
 {
-    assert(fs!=NULL,return -1;);
-    assert(inode_idx<fs->super->inodes_count,return -1;);
-    assert(data!=NULL,return -1;);
-
-    ext2_inode_t *dir_inode = &fs->inode_table[inode_idx];
-    // 计算追加之后需要的块数
-    uint64_t blocks_needed = (dir_inode->size + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    
-    assert(blocks_needed<=13&&blocks_needed<=fs->super->free_blocks_count,return -1;);
-
-    uint64_t blocks_used = (dir_inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-
-    for(uint64_t i=blocks_used;i<blocks_needed;i++)
+    uint64_t total = 1 + fs->inode_dirty.num + fs->block_bitmap_dirty.num + fs->inode_bitmap_dirty.num + fs->group_dirty.num;
+    *iov = (disk_iovec_t*)malloc(sizeof(disk_iovec_t) * total);
+    *stage = (uint8_t*)malloc(fs->block_size * (fs->inode_bitmap_dirty.num + 1)); // inode位图按块拼好后再写
+    if(*iov==NULL || *stage==NULL)
     {
-        dir_inode->blk_idx[i] = ext2_alloc_block(fs); // 多出来的部分分配空间
+        free(*iov);
+        free(*stage);
+        printf("ext2: flush malloc error\n");
+        return -1;
     }
 
-    for(uint64_t i = blocks_used;i<blocks_needed;i++)
+    disk_iovec_t *v = *iov;
+    uint64_t n = 0;
+    if(fs->super_dirty)
     {
-        uint64_t append_in_which_byte = dir_inode->size % BLOCK_SIZE; // 追加到这个块的哪个字节
-        uint8_t *data_ptr = (uint8_t*)data;
-        uint8_t temp_buf[BLOCK_SIZE];
-        // 读取当前块内容
-        disk_read(temp_buf, dir_inode->blk_idx[i]);
-        
-        // 将新目录项写入到当前块
-        memcpy(temp_buf + append_in_which_byte,data_ptr, BLOCK_SIZE- append_in_which_byte);
-        data_ptr += BLOCK_SIZE - append_in_which_byte; // 更新指针，指向下一个要写入的数据
-        // 写回块
-        disk_write(temp_buf, dir_inode->blk_idx[i]);
+        v[n++] = (disk_iovec_t){EXT2_SUPER_BLOCK_IDX, 1, fs->super};
     }
-        
-    dir_inode->size += size;
-    dir_inode->ctime++;
-    // 更新目录的inode信息
-    DISK_WRITE(fs->inode_table, fs->group->inode_table_start_idx, fs->group->inode_table_block_num);
+    for(uint64_t i = 0;i<fs->group_dirty.num;i++)
+    {
+        uint64_t sector = fs->group_dirty.list[i];
+        v[n++] = (disk_iovec_t){EXT2_GROUP_DESCRIPTOR_IDX + sector, 1, (uint8_t*)fs->group + sector*fs->block_size};
+    }
+    for(uint64_t i = 0;i<fs->block_bitmap_dirty.num;i++)
+    {
+        uint64_t g = fs->block_bitmap_dirty.list[i];
+        v[n++] = (disk_iovec_t){fs->group[g].block_bitmap_start_idx, 1, (uint8_t*)bitmap_get_data(fs->block_bitmap) + g*fs->block_size};
+    }
+    for(uint64_t i = 0;i<fs->inode_bitmap_dirty.num;i++)
+    {
+        uint64_t g = fs->inode_bitmap_dirty.list[i];
+        ext2_inode_bitmap_pack(fs, g, *stage + i*fs->block_size);
+        v[n++] = (disk_iovec_t){fs->group[g].inode_bitmap_start_idx, 1, *stage + i*fs->block_size};
+    }
+    uint64_t itb = fs->group[0].inode_table_block_num; // 每组的inode表块数都相同
+    for(uint64_t i = 0;i<fs->inode_dirty.num;i++)
+    {
+        uint64_t sector = fs->inode_dirty.list[i];
+        v[n++] = (disk_iovec_t){fs->group[sector/itb].inode_table_start_idx + sector%itb, 1, (uint8_t*)fs->inode_table + sector*fs->block_size};
+    }
+    qsort(v, n, sizeof(disk_iovec_t), ext2_cmp_iov);
+    return (int64_t)n;
+}
 
-    return 0;
 
+static void ext2_metadata_clean(ext2_fs_t *fs)
+{
+    __atomic_store_n(&fs->super_dirty, 0, __ATOMIC_RELAXED);
+    ext2_dirty_reset(&fs->block_bitmap_dirty);
+    ext2_dirty_reset(&fs->inode_bitmap_dirty);
+    ext2_dirty_reset(&fs->inode_dirty);
+    ext2_dirty_reset(&fs->group_dirty);
 }
 
 
 /**
- * @brief 读取指定inode的文件内容
+ * @brief 把修改过的超级块、组描述符、位图和inode表扇区写回磁盘
  *
- * 该函数用于从指定inode中读取文件内容，并将其存储到buf中。
+ * 所有脏扇区按扇区号排好后一次提交，相邻的扇区由磁盘层合并。
  *
- * @param fs 指向ext2文件系统的指针
- * @param inode_idx 要读取的inode索引
- * @param buf 用于存储读取的文件内容的缓冲区
+ * @param fs ext2 文件系统结构体指针
  *
- * @return 成功返回0，失败返回-1。
+ * @return 成功返回 0，失败返回 -1
  */
-int64_t ext2_read_file(ext2_fs_t *fs, uint64_t inode_idx, void *buf)
+static int64_t ext2_flush_metadata(ext2_fs_t *fs)
 {
-    assert(fs!=NULL,return -1;);
-    assert(inode_idx<fs->super->inodes_count,return -1;);
-    assert(buf!=NULL,return -1;);
-
-    uint64_t blocks_used = (fs->inode_table[inode_idx].size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-
-    for(uint64_t i = 0;i<blocks_used;i++)
+    disk_iovec_t *iov;
+    uint8_t *stage;
+    int64_t n = ext2_collect_metadata(fs, &iov, &stage);
+    if(n < 0)
+    {
+        return -1;
+    }
+    int64_t ret = disk_writev(fs->disk, iov, (uint64_t)n);
+    free(iov);
+    free(stage);
+    if(ret < 0)
     {
-        disk_read((uint8_t*)buf+i*BLOCK_SIZE,fs->inode_table[inode_idx].blk_idx[i]);
+        return -1;
     }
+    ext2_metadata_clean(fs);
     return 0;
 }
 
 
 /**
- * @brief 删除指定inode的文件或目录
+ * @brief 在提交之前原地写好这次要用到的未初始化组
  *
- * 该函数用于删除指定inode的文件或目录，包括释放其占用的块和inode，并清空inode信息。
- *
- * @param fs 指向ext2文件系统的指针
- * @param inode_idx 要删除的inode索引
+ * 本次修改涉及的组和后台线程排进group_init的组，把内存中的整组位图和inode表直接写到原位并刷新磁盘，
+ * 再清掉组描述符中的标志，标志随这次提交一起写回。写到一半崩溃时标志还在，加载时仍然当作全0，
+ * 所以这些块不用经过日志。
  *
- * @return 成功返回0，失败返回-1。
+ * @return 成功返回 0，失败返回 -1
  */
-int64_t ext2_delete_inode_data(ext2_fs_t *fs, uint64_t inode_idx)
+static int64_t ext2_init_groups(ext2_fs_t *fs)
 {
-    assert(fs!=NULL,return -1;);
-    assert(inode_idx<fs->super->inodes_count,return -1;);
-
-    // 释放块
-    for(uint64_t i = 0;i<13;i++)
+    uint64_t itb = fs->group[0].inode_table_block_num;
+    for(uint64_t i = 0;i<fs->inode_bitmap_dirty.num;i++)
     {
-        if(fs->inode_table[inode_idx].blk_idx[i] != 0)
+        uint64_t g = fs->inode_bitmap_dirty.list[i];
+        if(fs->group[g].flags & EXT2_BG_INODE_UNINIT)
         {
-            ext2_free_block(fs,fs->inode_table[inode_idx].blk_idx[i]);
+            ext2_dirty_mark(&fs->group_init, g);
         }
     }
-    // 释放inode
-    ext2_free_inode(fs,inode_idx);
-    // 清空inode信息
-    memset(&fs->inode_table[inode_idx], 0, sizeof(ext2_inode_t));
-    
-    DISK_WRITE(fs->inode_table, fs->group->inode_table_start_idx, fs->group->inode_table_block_num);
-    
-    return SUCCESS;
-}
-
-
-/**
- * @brief 获取指定目录下的目录项
- *
- * 该函数用于在指定的ext2文件系统中查找指定目录下的目录项，并将其信息存储在entry_ret中。
- *
- * @param fs 指向ext2文件系统的指针
- * @param inode_idx 目录的inode索引
- * @param name 要查找的文件名
- * @param entry_ret 用于存储找到的目录项信息
- *
- * @return 成功返回0，未找到返回-1。
- */
-int64_t ext2_get_entry(ext2_fs_t *fs, uint64_t inode_idx, const char *name, ext2_dir_entry_t *entry_ret)
-{
-    assert(fs!=NULL,return ERROR_INVALID_ARG;);
-    assert(name!=NULL,return ERROR_INVALID_ARG;);
-    assert(inode_idx<fs->super->inodes_count,return ERROR_INVALID_ARG;);
-    // assert(fs->inode_table[inode_idx].type == FILE_TYPE_DIR,return -1;);
-
-    uint64_t blocks_used_num = (fs->inode_table[inode_idx].size + BLOCK_SIZE - 1) / BLOCK_SIZE;
-    uint64_t all_entry_num =  fs->inode_table[inode_idx].size / sizeof(ext2_dir_entry_t);
+    for(uint64_t i = 0;i<fs->inode_dirty.num;i++)
+    {
+        uint64_t g = fs->inode_dirty.list[i] / itb;
+        if(fs->group[g].flags & EXT2_BG_INODE_UNINIT)
+        {
+            ext2_dirty_mark(&fs->group_init, g);
+        }
+    }
+    for(uint64_t i = 0;i<fs->block_bitmap_dirty.num;i++)
+    {
+        uint64_t g = fs->block_bitmap_dirty.list[i];
+        if(fs->group[g].flags & EXT2_BG_BLOCK_UNINIT)
+        {
+            ext2_dirty_mark(&fs->group_init, g);
+        }
+    }
+    uint64_t num = fs->group_init.num;
+    if(num == 0)
+    {
+        return 0;
+    }
 
-    for(uint64_t i = 0; i < blocks_used_num; i++)
+    disk_iovec_t *iov = (disk_iovec_t*)malloc(sizeof(disk_iovec_t) * 3 * num);
+    uint8_t *stage = (uint8_t*)malloc(fs->block_size * num);
+    if(iov==NULL || stage==NULL)
     {
-        // 获取目录块索引，并读取该块的全部内容
-        uint64_t blk_idx =  fs->inode_table[inode_idx].blk_idx[i];
-        uint8_t entry_buf[BLOCK_SIZE];
-        disk_read((uint8_t*)&entry_buf, blk_idx); 
-        // 计算当前块中目录项的数量
-        uint64_t block_entry_num = all_entry_num - i * (BLOCK_SIZE / sizeof(ext2_dir_entry_t));
-        if(block_entry_num > BLOCK_SIZE / sizeof(ext2_dir_entry_t)) 
+        free(iov);
+        free(stage);
+        printf("ext2: group init malloc error\n");
+        return -1;
+    }
+    uint64_t n = 0;
+    for(uint64_t i = 0;i<num;i++)
+    {
+        uint64_t g = fs->group_init.list[i];
+        ext2_group_descriptor_t *gd = &fs->group[g];
+        if(gd->flags & EXT2_BG_BLOCK_UNINIT)
         {
-            block_entry_num = BLOCK_SIZE / sizeof(ext2_dir_entry_t);
+            iov[n++] = (disk_iovec_t){gd->block_bitmap_start_idx, 1, (uint8_t*)bitmap_get_data(fs->block_bitmap) + g*fs->block_size};
         }
-        for(uint64_t i = 0; i < block_entry_num;i++)
+        if(gd->flags & EXT2_BG_INODE_UNINIT)
         {
-            ext2_dir_entry_t entry;
-            entry = ((ext2_dir_entry_t*)entry_buf)[i]; // 读取目录项 
-            // 检查文件名是否匹配
-            if (strcmp(entry.name, name) == 0)
-            {
-                *entry_ret = entry; // 将找到的目录项复制到输出参数
-                return SUCCESS; 
-            }
+            ext2_inode_bitmap_pack(fs, g, stage + i*fs->block_size);
+            iov[n++] = (disk_iovec_t){gd->inode_bitmap_start_idx, 1, stage + i*fs->block_size};
+            iov[n++] = (disk_iovec_t){gd->inode_table_start_idx, itb, (uint8_t*)fs->inode_table + g*itb*fs->block_size};
+        }
+    }
+    qsort(iov, n, sizeof(disk_iovec_t), ext2_cmp_iov);
+    int64_t ret = n == 0 ? 0 : disk_writev(fs->disk, iov, n);
+    if(ret == 0 && n > 0)
+    {
+        ret = disk_flush(fs->disk);
+    }
+    free(iov);
+    free(stage);
+    if(ret < 0)
+    {
+        return -1;
+    }
+    for(uint64_t i = 0;i<num;i++)
+    {
+        uint64_t g = fs->group_init.list[i];
+        if(fs->group[g].flags & EXT2_BG_UNINIT)
+        {
+            fs->group[g].flags &= ~(uint64_t)EXT2_BG_UNINIT;
+            ext2_mark_group_dirty(fs, g);
         }
     }
-    return ERROR_NOT_FOUND;
+    ext2_dirty_reset(&fs->group_init);
+    return 0;
+}
+
+
+static uint64_t ext2_journal_checksum(uint64_t h, const void *data, uint64_t len)
+{
+    const uint8_t *p = (const uint8_t*)data;
+    for(uint64_t i = 0;i<len;i++)
+    {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+
+// 一个事务最多能放的块数，描述块和提交块也要占日志区
+static uint64_t ext2_journal_capacity(ext2_fs_t *fs)
+{
+    return (fs->super->journal_blocks - 3) * EXT2_JOURNAL_TAGS(fs) / (EXT2_JOURNAL_TAGS(fs) + 1);
+}
+
+
+static int64_t ext2_journal_write_super(ext2_fs_t *fs)
+{
+    uint8_t blk[EXT2_MAX_BLOCK_SIZE];
+    memset(blk, 0, fs->block_size);
+    *(ext2_journal_super_t*)blk = (ext2_journal_super_t){EXT2_JOURNAL_MAGIC, fs->super->journal_blocks, fs->journal_sequence};
+    return disk_write(fs->disk, blk, fs->super->journal_start);
 }
 
 
 /**
- * @brief 在目录中查找文件或子目录
+ * @brief 把num个块作为一个事务写进日志，等它落盘后再写回原位
  *
- * 在指定的ext2文件系统中，查找指定目录下的文件名对应的inode索引。
+ * 描述块、各块内容和提交块在日志区中连续，整个事务是一次顺序写。
  *
- * @param fs 指向ext2文件系统的指针
- * @param dir_inode_idx 目录的inode索引
- * @param name 要查找的文件名
+ * @param blk 每块的目标块号和内容，每项一个块
  *
- * @return 如果找到匹配的文件名，则返回对应的inode索引；否则返回-1。
+ * @return 成功返回 0，失败返回 -1
  */
-int64_t ext2_find_entry(ext2_fs_t *fs, uint64_t inode_idx, const char *name)
+static int64_t ext2_journal_write_txn(ext2_fs_t *fs, const disk_iovec_t *blk, uint64_t num)
 {
-    assert(fs!=NULL,return ERROR_INVALID_ARG;);
-    assert(name!=NULL,return ERROR_INVALID_ARG;);
-    assert(inode_idx<fs->super->inodes_count,return ERROR_INVALID_ARG;);
-    // assert(fs->inode_table[inode_idx].type == FILE_TYPE_DIR,return -1;);
+    uint64_t desc_num = (num + EXT2_JOURNAL_TAGS(fs) - 1) / EXT2_JOURNAL_TAGS(fs);
+    uint8_t *stage = (uint8_t*)calloc(desc_num + 1, fs->block_size);
+    disk_iovec_t *iov = (disk_iovec_t*)malloc(sizeof(disk_iovec_t) * (num + desc_num + 1));
+    if(stage==NULL || iov==NULL)
+    {
+        free(stage);
+        free(iov);
+        printf("ext2: journal malloc error\n");
+        return -1;
+    }
 
-    ext2_dir_entry_t entry;
-    int64_t ret = ext2_get_entry(fs, inode_idx, name, &entry);
-    if(ret == SUCCESS) // 如果找到了目录项
+    uint64_t seq = fs->journal_sequence;
+    uint64_t pos = fs->super->journal_start + 1;
+    uint64_t checksum = 0xcbf29ce484222325ULL ^ seq;
+    uint64_t n = 0;
+    for(uint64_t i = 0;i<num;i+=EXT2_JOURNAL_TAGS(fs))
     {
-        return entry.inode_idx; // 返回对应的inode索引
+        uint8_t *desc = stage + (i / EXT2_JOURNAL_TAGS(fs)) * fs->block_size;
+        uint64_t cnt = num - i < EXT2_JOURNAL_TAGS(fs) ? num - i : EXT2_JOURNAL_TAGS(fs);
+        *(ext2_journal_header_t*)desc = (ext2_journal_header_t){EXT2_JOURNAL_MAGIC, EXT2_JOURNAL_DESCRIPTOR, seq, cnt, 0};
+        uint64_t *tags = (uint64_t*)(desc + sizeof(ext2_journal_header_t));
+        iov[n++] = (disk_iovec_t){pos++, 1, desc};
+        for(uint64_t j = 0;j<cnt;j++)
+        {
+            tags[j] = blk[i+j].sector;
+            checksum = ext2_journal_checksum(checksum, &tags[j], sizeof(uint64_t));
+            checksum = ext2_journal_checksum(checksum, blk[i+j].buf, fs->block_size);
+            iov[n++] = (disk_iovec_t){pos++, 1, blk[i+j].buf};
+        }
     }
-    else
+    uint8_t *commit = stage + desc_num * fs->block_size;
+    *(ext2_journal_header_t*)commit = (ext2_journal_header_t){EXT2_JOURNAL_MAGIC, EXT2_JOURNAL_COMMIT, seq, num, checksum};
+    iov[n++] = (disk_iovec_t){pos++, 1, commit};
+
+    // 日志落盘后事务才算提交，之后才能改原位的元数据；写回原位后再让日志作废
+    int64_t ret = -1;
+    if(disk_writev(fs->disk, iov, n) == 0 && disk_flush(fs->disk) == 0 &&
+       disk_writev(fs->disk, blk, num) == 0 && disk_flush(fs->disk) == 0)
     {
-        // printf("Directory entry '%s' not found in inode %lu.\n", name, inode_idx);
-        return ERROR_NOT_FOUND;
+        fs->journal_sequence++;
+        ret = ext2_journal_write_super(fs);
     }
-    // 如果没有找到目录项
-
-    
+    free(stage);
+    free(iov);
+    return ret;
 }
 
 
 /**
- * @brief 初始化一个新的目录项
- *
- * 该函数用于初始化一个新的目录项，包括设置名称、inode索引和类型。
+ * @brief 提交日志：把所有修改过的元数据作为一个事务写进日志，再写回原位
  *
- * @param fs 指向ext2文件系统的指针
- * @param new_entry 指向要初始化的目录项结构体
- * @param inode_idx 新目录项对应的inode索引
- * @param name 新目录项的名称
- * @param type 新目录项的类型（文件或目录）
+ * 两次提交之间的所有元数据操作合成一个事务，只有一次顺序的日志写。
+ * 文件数据不进日志，在元数据之前直接写回，崩溃后已提交的元数据不会指向没写的数据。
+ * 这期间释放的块在这里才还给位图，事务写成之前不会被新文件拿去写数据。
+ * 修改太多、一个事务放不下时拆成几个事务依次提交，这时它们之间不保证原子性。
  *
- * @return 成功返回0，失败返回-1。
+ * @return 成功返回 0，失败返回 -1
  */
-static int64_t ext2_init_entry(ext2_fs_t *fs, ext2_dir_entry_t *new_entry, uint64_t inode_idx, const char *name, uint32_t type)
+static int64_t ext2_journal_commit(ext2_fs_t *fs)
 {
-    strncpy(new_entry->name, name, MAX_FILENAME_LEN);
-    new_entry->name[MAX_FILENAME_LEN - 1] = '\0';
-    new_entry->inode_idx =  inode_idx;// 分配一个新的inode
-    fs->inode_table[inode_idx].type = type; // 设置新inode的类型
-    fs->inode_table[inode_idx].priv = 0; // 设置新inode的权限为0
-    fs->inode_table[inode_idx].size = 0; 
-    return SUCCESS;
+    ext2_resv_drain_all(fs);
+    if(ext2_init_groups(fs) < 0)
+    {
+        return -1;
+    }
+    if(!(fs->super->features & EXT2_FEATURE_JOURNAL))
+    {
+        if(bcache_sync(fs->bcache)<0 || ext2_flush_metadata(fs)<0)
+        {
+            return -1;
+        }
+        return 0;
+    }
+    if(bcache_sync_data(fs->bcache) < 0)
+    {
+        return -1;
+    }
+
+    ext2_free_pending_apply(fs, 1);
+    disk_iovec_t *meta;
+    uint8_t *stage;
+    int64_t meta_num = ext2_collect_metadata(fs, &meta, &stage);
+    if(meta_num < 0)
+    {
+        ext2_free_pending_apply(fs, -1);
+        return -1;
+    }
+    uint64_t cap = bcache_get_capacity(fs->bcache);
+    bcache_buf_t **bufs = (bcache_buf_t**)malloc(sizeof(bcache_buf_t*) * cap);
+    disk_iovec_t *blk = (disk_iovec_t*)malloc(sizeof(disk_iovec_t) * ((uint64_t)meta_num + cap));
+    if(bufs==NULL || blk==NULL)
+    {
+        free(meta);
+        free(stage);
+        free(bufs);
+        free(blk);
+        ext2_free_pending_apply(fs, -1);
+        printf("ext2: journal malloc error\n");
+        return -1;
+    }
+    uint64_t buf_num = bcache_collect_meta(fs->bcache, bufs);
+    uint64_t num = 0;
+    for(int64_t i = 0;i<meta_num;i++)
+    {
+        blk[num++] = meta[i];
+    }
+    for(uint64_t i = 0;i<buf_num;i++)
+    {
+        blk[num++] = (disk_iovec_t){bufs[i]->blk, 1, bufs[i]->data};
+    }
+
+    int64_t ret = 0;
+    uint64_t txn_max = ext2_journal_capacity(fs);
+    for(uint64_t i = 0;i<num && ret==0;i+=txn_max)
+    {
+        ret = ext2_journal_write_txn(fs, blk + i, num - i < txn_max ? num - i : txn_max);
+    }
+    if(ret == 0)
+    {
+        for(uint64_t i = 0;i<buf_num;i++)
+        {
+            bcache_mark_clean(fs->bcache, bufs[i]);
+        }
+        ext2_metadata_clean(fs);
+        __atomic_store_n(&fs->free_pending_num, 0, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        ext2_free_pending_apply(fs, -1); // 事务没写成，删除可能没有落盘，块还不能给别人用
+    }
+    free(meta);
+    free(stage);
+    free(bufs);
+    free(blk);
+    return ret;
 }
 
 
 /**
- * @brief 在指定目录中添加一个新的目录项
+ * @brief 挂载时重放日志中已经提交、还没写回原位的事务
  *
- * 该函数用于在指定的目录中添加一个新的目录项，但是不会检查目录项是否重复
+ * 提交块不完整或校验和不对的事务当作没有发生。
  *
- * @param fs 指向ext2文件系统的指针
- * @param dir_inode_idx 目录的inode索引
- * @param name 要添加的目录项名称
- *
- * @return 成功添加返回新目录项的inode索引，失败返回-1。
+ * @return 成功返回 0，失败返回 -1
  */
-int64_t ext2_add_entry(ext2_fs_t *fs, uint64_t dir_inode_idx, const char *name,uint32_t type)
+static int64_t ext2_journal_recover(ext2_fs_t *fs)
 {
-    assert(fs!=NULL,return -1;);
-    assert(name!=NULL,return -1;);
-    assert(dir_inode_idx<fs->super->inodes_count,return -1;);
-    assert(fs->inode_table[dir_inode_idx].type == FILE_TYPE_DIR,return -1;);
-    
-    // 获取目录的inode信息
-    ext2_inode_t *dir_inode = &fs->inode_table[dir_inode_idx];
-    
-    // 计算写入后需要的块数
-    uint64_t blocks_needed = (dir_inode->size + sizeof(ext2_dir_entry_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
-
-    // 确保有足够的空间
-    if(blocks_needed > 13) // 超过直接块数量，需要扩展
+    uint64_t start = fs->super->journal_start;
+    uint64_t blocks = fs->super->journal_blocks;
+    assert(blocks > 3 && start + blocks <= fs->super->blocks_count,return -1;);
+    uint8_t *area = (uint8_t*)malloc(blocks * fs->block_size);
+    disk_iovec_t *blk = (disk_iovec_t*)malloc(sizeof(disk_iovec_t) * blocks);
+    if(area==NULL || blk==NULL || DISK_READ(fs->disk, area, start, blocks) < 0)
     {
-        return -1; // 暂不支持超过13个直接块的情况
+        free(area);
+        free(blk);
+        printf("ext2: failed to read the journal\n");
+        return -1;
     }
-
-    //遍历目录中所有的块，找到空位
-    for(uint64_t i=0;i<MAX_BLK_NUM;i++)
+    ext2_journal_super_t *jsb = (ext2_journal_super_t*)area;
+    if(jsb->magic != EXT2_JOURNAL_MAGIC || jsb->blocks != blocks)
     {
-        if(dir_inode->blk_idx[i] == 0) // 如果没有分配块，则分配一个新的块
+        free(area);
+        free(blk);
+        printf("ext2: bad journal\n");
+        return -1;
+    }
+    fs->journal_sequence = jsb->sequence;
+
+    uint64_t seq = jsb->sequence;
+    uint64_t checksum = 0xcbf29ce484222325ULL ^ seq;
+    uint64_t pos = 1;
+    uint64_t num = 0;
+    int64_t ret = 0;
+    while(pos < blocks)
+    {
+        ext2_journal_header_t *h = (ext2_journal_header_t*)(area + pos*fs->block_size);
+        if(h->magic != EXT2_JOURNAL_MAGIC || h->sequence != seq)
         {
-            int64_t new_block_idx_ret = ext2_alloc_block(fs);
-            if(new_block_idx_ret < 0) // 分配失败                       
-            {
-                return -1; // 分配块失败
-            }
-            dir_inode->blk_idx[i] = (uint64_t)new_block_idx_ret; // 更新块索引
+            break;
         }
-
-        ext2_dir_entry_t buffer[BLOCK_SIZE/sizeof(ext2_dir_entry_t)];
-        for(uint64_t j=0;j<BLOCK_SIZE/sizeof(ext2_dir_entry_t);j++)
+        if(h->type == EXT2_JOURNAL_COMMIT)
         {
-            disk_read((uint8_t*)buffer,dir_inode->blk_idx[i]);
-            if(buffer[j].inode_idx==0)//找到可用的位置
+            if(h->count == num && h->checksum == checksum)
             {
-                // 分配一个新的目录项
-                ext2_dir_entry_t new_entry;
-                uint64_t new_inode_idx;
-                int64_t ret = ext2_alloc_inode(fs);
-                if(ret < 0) // 分配inode失败
+                printf("ext2: replaying journal transaction %lu, %lu blocks\n", seq, num);
+                ret = disk_writev(fs->disk, blk, num);
+                if(ret == 0 && (ret = disk_flush(fs->disk)) == 0)
                 {
-                    printf("Failed to allocate inode.\n");
-                    return ret; // 返回错误
+                    fs->journal_sequence++;
+                    ret = ext2_journal_write_super(fs);
                 }
-                new_inode_idx = (uint64_t)ret; // 获取新分配的inode索引
-                ext2_init_entry(fs, &new_entry, new_inode_idx, name, type);
-
-                
-                buffer[j] = new_entry;
-                disk_write((uint8_t*)buffer,dir_inode->blk_idx[i]);
-                
-                dir_inode->ctime++;
-                dir_inode->size += sizeof(ext2_dir_entry_t);
-                DISK_WRITE(fs->inode_table, fs->group->inode_table_start_idx, fs->group->inode_table_block_num);
-
-                return new_entry.inode_idx;
             }
+            break;
+        }
+        if(h->type != EXT2_JOURNAL_DESCRIPTOR || h->count > EXT2_JOURNAL_TAGS(fs) || pos + 1 + h->count >= blocks)
+        {
+            break;
+        }
+        uint64_t *tags = (uint64_t*)(area + pos*fs->block_size + sizeof(ext2_journal_header_t));
+        for(uint64_t j = 0;j<h->count;j++)
+        {
+            uint8_t *data = area + (pos + 1 + j)*fs->block_size;
+            if(tags[j] >= fs->super->blocks_count)
+            {
+                break;
+            }
+            checksum = ext2_journal_checksum(checksum, &tags[j], sizeof(uint64_t));
+            checksum = ext2_journal_checksum(checksum, data, fs->block_size);
+            blk[num++] = (disk_iovec_t){tags[j], 1, data};
         }
+        pos += 1 + h->count;
+    }
+    free(area);
+    free(blk);
+    return ret < 0 ? -1 : 0;
+}
+
 
+/**
+ * @brief 开始一个元数据操作
+ *
+ * 操作进行中元数据可能处于中间状态，这期间不提交日志，块缓存也不会把脏的元数据块换出。
+ * 正在提交时等提交结束。调用时不能持有inode锁，也不能已经在一个操作中。
+ */
+static void ext2_journal_start(ext2_fs_t *fs)
+{
+    pthread_mutex_lock(&fs->journal_lock);
+    while(fs->journal_committing)
+    {
+        pthread_cond_wait(&fs->journal_cond, &fs->journal_lock);
     }
-    return FAILED;
+    fs->journal_handles++;
+    pthread_mutex_unlock(&fs->journal_lock);
 }
 
 
 /**
- * @brief 删除指定目录中的目录项
+ * @brief 等进行中的元数据操作都结束后提交
  *
- * 该函数用于在指定的目录中删除一个目录项。它会查找目录项，如果找到则释放对应的inode并更新目录的创建时间和大小。
+ * 从开始等待到提交结束，新的操作都在ext2_journal_start中等待。
  *
- * @param fs 指向ext2文件系统的指针
- * @param dir_inode_idx 目录的inode索引
- * @param name 要删除的目录项名称
+ * @param wait 别的线程正在提交时，为0直接返回，为1等它结束后再提交一次，保证调用前的修改都已写回
  *
- * @return 成功删除返回0，失败返回-1。
+ * @return 成功返回 0，失败返回 -1
  */
-int64_t ext2_remove_entry(ext2_fs_t *fs, uint64_t dir_inode_idx, const char *name)
+static int64_t ext2_journal_flush(ext2_fs_t *fs, int wait)
 {
-    assert(fs!=NULL,return -1;);
-    assert(name!=NULL,return -1;);
-    assert(dir_inode_idx<fs->super->inodes_count,return -1;);
-    assert(fs->inode_table[dir_inode_idx].type == FILE_TYPE_DIR,return -1;);
-
-    ext2_dir_entry_t entry;
-    // 获取要删除的entry信息
-    int64_t ret = ext2_get_entry(fs, dir_inode_idx, name, &entry);
-    if(ret != SUCCESS) // 如果获取目录项失败
-    {
-        printf("Failed to get directory entry.\n");
-        return ret; // 返回错误
-    }
-    // 检查要删除的entry是否是目录
-    if (fs->inode_table[entry.inode_idx].type == FILE_TYPE_DIR) 
+    pthread_mutex_lock(&fs->journal_lock);
+    while(fs->journal_committing)
     {
-        if(entry.inode_idx == ROOT_INODE_IDX) // 如果是根目录
-        {
-            printf("Cannot remove root directory.\n");
-            return -1; // 返回错误
-        }
-        if(fs->inode_table[entry.inode_idx].size > 0)
+        if(!wait)
         {
-            // 不能删除非空目录
-            printf("Cannot remove non-empty directory.\n");
-            return -1; // 返回错误
+            pthread_mutex_unlock(&fs->journal_lock);
+            return 0;
         }
+        pthread_cond_wait(&fs->journal_cond, &fs->journal_lock);
     }
-    
-    ext2_delete_inode_data(fs, entry.inode_idx); // 删除inode数据
-    
-    entry.name[0] = '\0'; // 清空名称
-    entry.inode_idx = 0; // 清空inode索引
+    fs->journal_committing = 1;
+    while(fs->journal_handles > 0)
+    {
+        pthread_cond_wait(&fs->journal_cond, &fs->journal_lock);
+    }
+    pthread_mutex_unlock(&fs->journal_lock);
 
-    // 更新目录的创建时间和大小
-    fs->inode_table[dir_inode_idx].ctime++;
-    fs->inode_table[dir_inode_idx].size -= sizeof(ext2_dir_entry_t);
+    int64_t ret = ext2_journal_commit(fs);
 
-    DISK_WRITE(fs->inode_table, fs->group->inode_table_start_idx, fs->group->inode_table_block_num);
-    
-    return 0; // 成功删除
+    pthread_mutex_lock(&fs->journal_lock);
+    fs->journal_committing = 0;
+    pthread_cond_broadcast(&fs->journal_cond);
+    pthread_mutex_unlock(&fs->journal_lock);
+    return ret;
 }
 
 
-void print_entry(ext2_fs_t *fs,const ext2_dir_entry_t *entry) 
+/**
+ * @brief 结束一个元数据操作
+ *
+ * 不是每个操作都提交：修改积累到日志或块缓存容量的一半时才把它们合成一个事务提交，
+ * ext2_fs_sync总是提交。没有开启日志时同样按这个阈值写回，脏的元数据不会占满块缓存。
+ */
+static void ext2_journal_stop(ext2_fs_t *fs)
 {
-    // ANSI颜色代码定义
-    #define COLOR_RESET   "\033[0m"      // 重置颜色
-    #define COLOR_BLUE    "\033[1;34m"   // 蓝色（目录）
-    #define COLOR_WHITE   "\033[1;37m"   // 白色（普通文件）
-    #define COLOR_GREEN   "\033[1;32m"   // 绿色（可执行文件）
-    
-    if (entry->inode_idx == 0) {
-        return; // 跳过无效的目录项
+    pthread_mutex_lock(&fs->journal_lock);
+    if(--fs->journal_handles == 0)
+    {
+        pthread_cond_broadcast(&fs->journal_cond);
     }
-    
-    // 获取inode信息来判断文件类型
-    ext2_inode_t *inode = &fs->inode_table[entry->inode_idx];
-    
-    // 根据文件类型设置颜色
-    const char *color = COLOR_WHITE; // 默认白色
-    const char *type_indicator = "";
-    
-    if (inode->type == FILE_TYPE_DIR) {
-        color = COLOR_BLUE;
-        type_indicator = "/";
-    } else if (inode->type == FILE_TYPE_FILE) {
-        color = COLOR_WHITE;
-        type_indicator = "";
+    pthread_mutex_unlock(&fs->journal_lock);
+
+    uint64_t pending = __atomic_load_n(&fs->super_dirty, __ATOMIC_RELAXED) + ext2_dirty_num(&fs->inode_dirty) + ext2_dirty_num(&fs->block_bitmap_dirty) +
+                       ext2_dirty_num(&fs->inode_bitmap_dirty) + ext2_dirty_num(&fs->group_dirty) + bcache_get_dirty(fs->bcache) +
+                       __atomic_load_n(&fs->free_pending_num, __ATOMIC_RELAXED);
+    uint64_t limit = bcache_get_capacity(fs->bcache);
+    if((fs->super->features & EXT2_FEATURE_JOURNAL) && limit > ext2_journal_capacity(fs))
+    {
+        limit = ext2_journal_capacity(fs);
+    }
+    if(pending >= limit / 2 && ext2_journal_flush(fs, 0) < 0)
+    {
+        printf("ext2: journal commit failed\n");
     }
-    
-    // 输出带颜色的文件名和类型指示符
-    printf("%s%-20s%s%s  inode: %lu  size: %lu bytes\n", 
-           color, entry->name, type_indicator, COLOR_RESET, 
-           entry->inode_idx, inode->size);
 }
 
 
-/**
- * @brief 遍历指定目录中的所有目录项
- *
- * 该函数用于遍历指定目录中的所有目录项，并对每个目录项执行回调函数。
- *
- * @param fs 指向ext2文件系统的指针
- * @param dir_inode_idx 目录的inode索引
- * @param callback 回调函数，用于处理每个目录项
- *
- * @return 成功返回0，失败返回-1。
- */
-int64_t ext2_walk_entry(ext2_fs_t *fs, uint64_t dir_inode_idx, void (*callback)(ext2_fs_t *,const ext2_dir_entry_t *)) 
+// 块缓存要换出脏的元数据块时调用，调用者可能正处在某个操作中间，不能等别的操作结束；
+// 有操作在进行时元数据可能只改了一半，不能提交，就不写
+static int64_t ext2_journal_writeback(void *arg)
 {
-    assert(fs != NULL,return ERROR_INVALID_ARG;);
-    ext2_inode_t *inode = &fs->inode_table[dir_inode_idx];
-
-    if (inode->type != FILE_TYPE_DIR) {
-        return -1;  // 不是目录
-    }
-
-    uint64_t entries_per_block = BLOCK_SIZE / sizeof(ext2_dir_entry_t);
-    uint8_t block_buf[BLOCK_SIZE];
-
-    for (uint64_t i = 0; i < MAX_BLK_NUM && inode->blk_idx[i]; i++) {
-        disk_read(block_buf, inode->blk_idx[i]);
-        ext2_dir_entry_t *entries = (ext2_dir_entry_t *)block_buf;
-
-        for (uint64_t j = 0; j < entries_per_block; j++) {
-            if (entries[j].inode_idx != 0) {
-                callback(fs,&entries[j]);
-            }
-        }
+    ext2_fs_t *fs = (ext2_fs_t*)arg;
+    pthread_mutex_lock(&fs->journal_lock);
+    if(fs->journal_handles > 0 || fs->journal_committing)
+    {
+        pthread_mutex_unlock(&fs->journal_lock);
+        return -1;
     }
+    fs->journal_committing = 1;
+    pthread_mutex_unlock(&fs->journal_lock);
 
-    return 0;
-}
-
+    int64_t ret = ext2_journal_commit(fs);
 
-/**
- * @brief 获取指定inode的大小
- *
- * 该函数用于获取指定inode的大小（以字节为单位）。
- *
- * @param fs 指向ext2文件系统的指针
- * @param inode_idx 要获取大小的inode索引
- *
- * @return 返回inode的大小，如果发生错误则返回-1。
- */
-int64_t ext2_get_inode_size(ext2_fs_t *fs, uint64_t inode_idx)
-{
-    assert(fs!=NULL,return -1;);
-    assert(inode_idx<fs->super->inodes_count,return -1;);
-    return fs->inode_table[inode_idx].size;
+    pthread_mutex_lock(&fs->journal_lock);
+    fs->journal_committing = 0;
+    pthread_cond_broadcast(&fs->journal_cond);
+    pthread_mutex_unlock(&fs->journal_lock);
+    return ret;
 }
 
 
 /**
- * @brief 将路径字符串分割成多个token
- *
- * 该函数用于将给定的路径字符串分割成多个token，每个token表示路径中的一个部分。
- * 如果传入的字符串为NULL，则继续从上次分割的位置开始分割。
+ * @brief 按块总数和期望的inode总数计算块组的划分
  *
- * @param str 要分割的路径字符串，如果为NULL则继续上次分割的位置
+ * 最后一组放不下自己的位图和inode表时去掉这一组。每组的inode数取inode表块的整数倍，
+ * inode总数因此可能比期望的略多。组描述符表必须和第0组的位图、inode表一起放在第0组中。
  *
- * @return 返回下一个token的起始位置，如果没有更多token则返回NULL。
+ * @return 成功返回 0，磁盘太小或者对这个块大小太大返回 -1
  */
-char* ext2_path_split(char *str,const char *delim)
+static int64_t ext2_calc_geometry(ext2_super_block_t *super, uint64_t inodes_wanted)
 {
-    static char* cur_token = NULL; // 用于保存下一个token的起始位置 
-    static char* end = NULL; // 用于保存字符串结束位置
-    
-    if(str != NULL)
+    uint64_t bpg = EXT2_BLOCKS_PER_GROUP(super->block_size);
+    uint64_t inodes_per_block = super->block_size / sizeof(ext2_inode_t);
+    uint64_t groups = (super->blocks_count + bpg - 1) / bpg;
+    while(groups > 0)
     {
-        cur_token = str; // 保存当前token的起始位置
-        end = str;
-        // 如果str不为NULL，说明是第一次调用
-        for(int i = 0; str[i] != '\0'; i++)
+        uint64_t ipg = (inodes_wanted + groups - 1) / groups;
+        ipg = (ipg + inodes_per_block - 1) / inodes_per_block * inodes_per_block;
+        if(ipg > super->block_size*8) // 一个inode位图块最多描述这么多
         {
-            if(str[i] == delim[0]) // 找到路径分隔符
-            {
-                str[i] = '\0'; // 将分隔符替换为字符串结束符
-            }
-            end++; // 更新end指针，直到指向字符串的末尾
+            ipg = super->block_size*8;
         }
-
-    }
-    else
-    {
-        // 如果str为NULL，说明是后续调用
-        while(*cur_token != '\0') //这时cur_token指向上一个token的开头，需要跳过上一段token指向下一个/0分隔符
+        uint64_t overhead = 2 + ipg / inodes_per_block; // 两个位图和inode表
+        uint64_t last = super->blocks_count - (groups - 1) * bpg;
+        if(groups == 1)
         {
-            if(cur_token == end) // 如果
-            {
-                cur_token = NULL;
-                break; // 如果已经到达字符串末尾，返回NULL
-            }
-            cur_token++;
-           
+            overhead += 1 + EXT2_GDT_BLOCKS(1, super->block_size); // 超级块和组描述符表
         }
-    }
-
-    while(*cur_token == '\0') //这时cur_token已经不再指向上一个token的内容，但是有可能上个token结尾有多个/0分隔符，需要跳过这些分隔符指向下一个token开头
-    {
-        // 注意，一定要先判断是否到达字符串末尾，否则不会及时跳出循环，会越界报错
-        if(cur_token == end) 
+        if(1 + EXT2_GDT_BLOCKS(groups, super->block_size) + 2 + ipg / inodes_per_block >= bpg)
+        {
+            return -1;
+        }
+        if(last > overhead)
         {
-            cur_token = NULL;
-            break; // 如果已经到达字符串末尾，返回NULL
+            super->blocks_per_group = bpg;
+            super->inodes_per_group = ipg;
+            super->groups_count = groups;
+            super->inodes_count = ipg * groups;
+            return 0;
         }
-        cur_token++;
+        groups--;
+        super->blocks_count = groups * bpg;
     }
-    
-    return cur_token; 
+    return -1;
+}
+
+
+// 支持的块大小：512到EXT2_MAX_BLOCK_SIZE之间的2的幂
+static int ext2_block_size_valid(uint64_t block_size)
+{
+    return block_size >= 512 && block_size <= EXT2_MAX_BLOCK_SIZE && (block_size & (block_size - 1)) == 0;
 }
 
 
 /**
- * @brief 根据路径查找或创建对应的inode
- *
- * 该函数用于根据给定的路径查找对应的inode，如果不存在则根据auto_create参数决定是否自动创建目录。
+ * @brief 改变块大小，磁盘的扇区大小和块缓存随之改变
  *
- * @param fs 指向ext2文件系统的指针
- * @param path 要查找的路径字符串
- * @param auto_create 是否允许自动创建目录（0表示不允许，1表示允许）
+ * 加载块大小和创建时不同的镜像时调用，原来缓存中的块全部丢弃。
  *
- * @return 返回找到的inode索引，如果没有找到且不允许自动创建则返回-1。
+ * @return 成功返回 0，失败返回 -1
  */
-static int64_t ext2_find_inode_by_path(ext2_fs_t *fs,const char *path,uint64_t auto_create)
+static int64_t ext2_set_block_size(ext2_fs_t *fs, uint64_t block_size)
 {
-    char *copy_path = strdup(path);
-    int64_t parent_inode_idx = 0;
-    int64_t child_inode_idx = 0;
-    char* token = ext2_path_split(copy_path,"/");
-    while(token) 
+    if(block_size == fs->block_size)
     {
-        child_inode_idx = ext2_find_entry(fs, parent_inode_idx, token);
-        if(child_inode_idx < 0) // 如果没有找到父目录,那就建立对应目录
-        {
-            if(auto_create == 0) // 如果不允许自动创建目录
-            {
-                printf("Directory %s not found.\n", token);
-                free(copy_path); // 释放复制的路径字符串
-                return -1; // 返回错误
-            }
-            else
-            {
-                child_inode_idx = ext2_add_entry(fs, parent_inode_idx, token, FILE_TYPE_DIR); // 在父目录下添加新的子目录
-                if(child_inode_idx < 0) // 如果添加目录失败
-                {
-                    return -1; // 返回错误
-                }
-            }
-           
-        }
-        parent_inode_idx = child_inode_idx; // 更新父目录的inode索引
-        token = ext2_path_split(NULL,"/");
+        return 0;
     }
-    free(copy_path); // 释放复制的路径字符串
-    return parent_inode_idx; // 返回最后找到的inode索引
+    assert(ext2_block_size_valid(block_size),return -1;);
+    assert(disk_set_sector_size(fs->disk, block_size)==0,return -1;);
+    bcache_t *bc = bcache_create(fs->disk, block_size, bcache_get_capacity(fs->bcache));
+    assert(bc!=NULL,return -1;);
+    bcache_set_writeback(bc, ext2_journal_writeback, fs);
+    bcache_destroy(&fs->bcache);
+    fs->bcache = bc;
+    fs->block_size = block_size;
+    fs->map_cache.blk = 0;
+    return 0;
 }
 
 
 /**
- * @brief 获取路径的基本名称
+ * @brief 创建一个ext2文件系统
  *
- * 该函数用于从给定的路径字符串中提取基本名称（即最后一个斜杠后的部分）。
+ * 该函数用于创建一个新的ext2文件系统。它会为文件系统分配内存，并初始化其超级块、组描述符、块位图、inode位图以及inode表。
+ * 块大小、块总数和inode总数由params决定，之后ext2_fs_format按它们布局；磁盘的扇区大小被设成块大小。
  *
- * @param path 要处理的路径字符串
+ * @param disk 文件系统所在的磁盘
+ * @param params 创建参数，为NULL时全部取默认值
  *
- * @return 返回指向基本名称的指针，如果路径中没有斜杠，则返回整个路径字符串。
+ * @return 指向新创建的ext2文件系统的指针，如果创建失败则返回NULL。
  */
-int64_t ext2_get_path_basename (char *path,char* basename)
+ext2_fs_t* ext2_fs_create(disk_t *disk, const ext2_fs_params_t *params)
 {
-    if (!path || !*path) return FAILED;
-
-    size_t len = strlen(path);
-    if(len> MAX_FILENAME_LEN-1) 
+    assert(disk!=NULL,return NULL);
+    ext2_fs_params_t p = {0, 0, 0, 0, 0};
+    if(params != NULL)
     {
-        printf("Path length exceeds maximum allowed length.\n");
-        return FAILED; // 路径长度超过最大限制
+        p = *params;
     }
-    uint64_t basename_head = 0;
-    uint64_t basename_tail = len;
-
-    // 去掉尾部的 '/'（如果有）
-    while (basename_tail > 1 && path[basename_tail - 1] == '/') 
+    uint64_t block_size = p.block_size ? p.block_size : EXT2_DEFAULT_BLOCK_SIZE;
+    p.size = p.size ? p.size : disk->size;
+    p.inode_density = p.inode_density ? p.inode_density : EXT2_DEFAULT_INODE_DENSITY;
+    assert(ext2_block_size_valid(block_size),printf("ext2: block size %lu is not supported\n", block_size);return NULL;);
+    assert(p.size<=disk->size&&p.reserved_percent<100,printf("ext2: bad size or reserved space\n");return NULL;);
+
+    // 超级块按最大的块分配，加载块大小不同的镜像时不用重新分配
+    ext2_super_block_t *super = (ext2_super_block_t *)calloc(1, EXT2_MAX_BLOCK_SIZE);
+    assert(super!=NULL,return NULL);
+    // 没有指定inode总数时按容量决定，至少128个
+    uint64_t inodes_wanted = p.inodes_count;
+    if(inodes_wanted == 0)
     {
-        basename_tail--;
+        inodes_wanted = p.size / 1024 * p.inode_density / (1024*1024);
+        inodes_wanted = inodes_wanted > 128 ? inodes_wanted : 128;
     }
-    // 向前查找最后一个 '/'
-    for (int64_t i = basename_tail - 1; i >= 0; i--)
+    // 划分块组；没有指定块大小时，组描述符表在第0组放不下就换更大的块
+    while(1)
     {
-        if (path[i] == '/') 
+        super->block_size = block_size;
+        super->blocks_count = p.size / block_size;
+        if(ext2_calc_geometry(super, inodes_wanted) == 0)
         {
-            basename_head = i + 1;
             break;
         }
+        if(p.block_size != 0 || block_size >= EXT2_MAX_BLOCK_SIZE)
+        {
+            printf("ext2: cannot lay out %lu bytes with %lu-byte blocks\n", p.size, block_size);
+            free(super);
+            return NULL;
+        }
+        block_size <<= 1;
+    }
+    if(disk_set_sector_size(disk, block_size) < 0)
+    {
+        free(super);
+        return NULL;
     }
-    
-    strncpy(basename, path + basename_head, basename_tail - basename_head);
-    basename[basename_tail - basename_head] = '\0';
 
-    return SUCCESS; 
-    
+    // 分配 ext2_fs_t 结构体内存
+    ext2_fs_t* fs = malloc(sizeof(ext2_fs_t));
+    assert(fs!=NULL,free(super);return NULL);
+    fs->disk = disk;
+    fs->block_size = block_size;
+    fs->super = super;
+    // 设置文件系统魔数
+    fs->super->magic = EXT2_SUPER_MAGIC; 
+    // 默认用extent映射文件块，大目录建哈希索引，元数据先写日志
+    fs->super->features = EXT2_FEATURE_EXTENTS | EXT2_FEATURE_DIR_INDEX | EXT2_FEATURE_JOURNAL;
+    fs->super->reserved_blocks_count = fs->super->blocks_count * p.reserved_percent / 100;
+
+    // 分配组描述符表内存
+    fs->group = (ext2_group_descriptor_t *)malloc(EXT2_GDT_BLOCKS(fs->super->groups_count, fs->block_size) * fs->block_size);
+    // 创建块位图
+    fs->block_bitmap = bitmap_create(EXT2_BLOCK_BITMAP_BITS(fs->super));
+    // 创建 inode 位图
+    fs->inode_bitmap = bitmap_create(fs->super->inodes_count);
+    // 分配 inode 表内存
+    fs->inode_table = (ext2_inode_t *)malloc((sizeof(ext2_inode_t) * fs->super->inodes_count + fs->block_size - 1) / fs->block_size * fs->block_size);
+    memset(&fs->inode_dirty, 0, sizeof(ext2_dirty_set_t));
+    memset(&fs->block_bitmap_dirty, 0, sizeof(ext2_dirty_set_t));
+    memset(&fs->inode_bitmap_dirty, 0, sizeof(ext2_dirty_set_t));
+    memset(&fs->group_dirty, 0, sizeof(ext2_dirty_set_t));
+    memset(&fs->group_init, 0, sizeof(ext2_dirty_set_t));
+    pthread_mutex_init(&fs->inode_dirty.lock, NULL);
+    pthread_mutex_init(&fs->block_bitmap_dirty.lock, NULL);
+    pthread_mutex_init(&fs->inode_bitmap_dirty.lock, NULL);
+    pthread_mutex_init(&fs->group_dirty.lock, NULL);
+    pthread_mutex_init(&fs->group_init.lock, NULL);
+    assert(ext2_dirty_init_all(fs)==0,return NULL);
+    // 每个inode的读写锁和分配器的锁
+    fs->inode_locks = NULL;
+    fs->open_count = NULL;
+    fs->view_count = NULL;
+    fs->inode_lock_num = 0;
+    assert(ext2_inode_locks_init(fs, fs->super->inodes_count)==0,return NULL);
+    pthread_mutex_init(&fs->balloc_lock, NULL);
+    pthread_mutex_init(&fs->ialloc_lock, NULL);
+    pthread_mutex_init(&fs->map_lock, NULL);
+    // 每个线程的块和inode预留
+    assert(pthread_key_create(&fs->resv_key, ext2_resv_exit)==0,return NULL);
+    pthread_mutex_init(&fs->resv_lock, NULL);
+    fs->resv_list = NULL;
+    fs->resv_shard_next = 0;
+    memset(fs->resv_shard, 0, sizeof(fs->resv_shard));
+    fs->free_pending = NULL;
+    fs->free_pending_num = 0;
+    fs->free_pending_cap = 0;
+    fs->lazy_running = 0;
+    fs->lazy_stop = 0;
+    // 创建块缓存
+    fs->bcache = bcache_create(disk, fs->block_size, BCACHE_DEFAULT_CAPACITY);
+    assert(fs->bcache!=NULL,return NULL);
+    bcache_set_writeback(fs->bcache, ext2_journal_writeback, fs);
+    fs->journal_handles = 0;
+    fs->journal_committing = 0;
+    fs->journal_sequence = 1;
+    pthread_mutex_init(&fs->journal_lock, NULL);
+    pthread_cond_init(&fs->journal_cond, NULL);
+    // 创建目录项缓存
+    fs->dcache = dcache_create(DCACHE_DEFAULT_CAPACITY);
+    assert(fs->dcache!=NULL,return NULL);
+    fs->map_cache.blk = 0;
+    // 初始化当前工作目录为根目录
+    fs->cwd_inode_idx = ROOT_INODE_IDX; 
+    return fs;
 }
 
 
 /**
- * @brief 获取路径的目录名
+ * @brief 设置文件系统特性
  *
- * 该函数用于从给定的路径字符串中提取目录名（即最后一个斜杠之前的部分）。
+ * 在ext2_fs_format之前调用，例如去掉EXT2_FEATURE_EXTENTS后新文件使用直接/间接块映射。
  *
- * @param path 要处理的路径字符串
- * @param dirname 用于存储目录名的缓冲区
- *
- * @return 返回0表示成功，-1表示失败。
+ * @return 成功返回 0，失败返回 -1
  */
-int64_t ext2_get_path_dirname (char *path,char* dirname)
+int64_t ext2_fs_set_features(ext2_fs_t *fs, uint64_t features)
 {
-    if (!path || !*path) return FAILED;
-
-    size_t len = strlen(path);
-    if(len> MAX_FILENAME_LEN-1) 
-    {
-        printf("Path length exceeds maximum allowed length.\n");
-        return FAILED; // 路径长度超过最大限制
-    }
-
-    uint64_t dirname_tail = len;
-
-    // 去掉尾部的 '/'（如果有）
-    while (dirname_tail > 1 && path[dirname_tail - 1] == '/') 
-    {
-        dirname_tail--;
-    }
-    // 向前查找最后一个 '/'
-    for (int64_t i = dirname_tail - 1; i >= 0; i--)
-    {
-        if (path[i] == '/') 
-        {
-            dirname_tail = i + 1;
-            break;
-        }
-    }
-    
-    strncpy(dirname, path, dirname_tail);
-    dirname[dirname_tail] = '\0';
-
-    return SUCCESS; 
-    
+    assert(fs!=NULL,return -1;);
+    assert((features & ~(uint64_t)(EXT2_FEATURE_EXTENTS|EXT2_FEATURE_DIR_INDEX|EXT2_FEATURE_JOURNAL|EXT2_FEATURE_LAZY_INIT))==0,return -1;);
+    fs->super->features = features;
+    return 0;
 }
 
 
 /**
- * @brief 根据路径创建目录
+ * @brief 调整块缓存的容量
  *
- * 该函数用于根据给定的路径创建一个新的目录。如果路径是根目录，则不需要创建。
- * 如果路径不存在，则会自动创建对应的目录。
+ * 旧缓存中的脏块先经过日志写回磁盘，再按新容量重建缓存。
  *
- * @param fs 指向ext2文件系统的指针
- * @param path 要创建的目录路径
+ * @param fs ext2 文件系统结构体指针
+ * @param capacity 缓存块数
  *
- * @return 成功返回0，失败返回-1。
+ * @return 成功返回 0，失败返回 -1
  */
-int64_t ext2_create_dir_by_path(ext2_fs_t *fs, const char *path)
+int64_t ext2_fs_set_cache_capacity(ext2_fs_t *fs, uint64_t capacity)
 {
-    assert(fs!=NULL&&path!=NULL,return -1;);
-
-    if(strcmp(path, "/") == 0) // 如果路径是根目录
-    {
-        return 0; // 根目录不需要创建
-    }
-    
-    if(ext2_find_inode_by_path(fs, path, 1)<0) // 查找路径对应的inode，如果不存在则创建
+    assert(fs!=NULL&&capacity>0,return -1;);
+    assert(ext2_journal_flush(fs, 1)==0,return -1;);
+    bcache_t *bc = bcache_create(fs->disk, fs->block_size, capacity);
+    assert(bc!=NULL,return -1;);
+    bcache_set_writeback(bc, ext2_journal_writeback, fs);
+    if(bcache_destroy(&fs->bcache)<0)
     {
-        printf("Failed to create directory: %s\n", path);
-        return -1; // 返回错误
+        bcache_destroy(&bc);
+        return -1;
     }
-    printf("Directory created successfully: %s\n", path);
-
-    return 0; // 成功创建目录
+    fs->bcache = bc;
+    return 0;
 }
 
 
 /**
- * @brief 根据路径创建文件
+ * @brief 把缓存中的脏块和修改过的元数据写回磁盘并刷新磁盘
  *
- * 该函数用于根据给定的路径创建一个新的文件。如果路径对应的目录不存在，则会自动创建目录。
+ * 先写文件数据，再把目录块、超级块、位图和inode表中修改过的部分作为一个事务提交到日志，
+ * 然后写回原位。没有开启日志时直接写回。
  *
- * @param fs 指向ext2文件系统的指针
- * @param path 要创建的文件路径
+ * @param fs ext2 文件系统结构体指针
  *
- * @return 成功返回新创建文件的inode索引，失败返回-1。
+ * @return 成功返回 0，失败返回 -1
  */
-int64_t ext2_create_file_by_path(ext2_fs_t *fs, const char *path)
+int64_t ext2_fs_sync(ext2_fs_t *fs)
 {
-    assert(fs!=NULL&&path!=NULL,return -1;);
+    assert(fs!=NULL,return -1;);
+    if(ext2_journal_flush(fs, 1)<0)
+    {
+        return -1;
+    }
+    return disk_flush(fs->disk);
+}
 
-    char base_name[MAX_FILENAME_LEN]; 
-    ext2_get_path_basename (path, base_name);
-    char dir_name[MAX_FILENAME_LEN]; 
-    ext2_get_path_dirname (path, dir_name);
 
-    int64_t dir_inode_idx = ext2_find_inode_by_path(fs, dir_name, 0); // 查找路径对应的inode
-    if( dir_inode_idx < 0)
+#define EXT2_LAZY_INIT_BATCH 64 // 后台线程每排进这么多组提交一次
+
+// 逐组把还没初始化的组排进group_init，由提交写好；读组标志时持有操作句柄，不会和提交同时进行
+static void* ext2_lazy_init_thread(void *arg)
+{
+    ext2_fs_t *fs = (ext2_fs_t*)arg;
+    uint64_t queued = 0;
+    for(uint64_t g = 1;g<fs->super->groups_count;g++)
     {
-        printf("Failed to find for file: %s\n", path);
-        return -1; // 返回错误
+        if(__atomic_load_n(&fs->lazy_stop, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+        ext2_journal_start(fs);
+        if(fs->group[g].flags & EXT2_BG_UNINIT)
+        {
+            ext2_dirty_mark(&fs->group_init, g);
+            queued++;
+        }
+        ext2_journal_stop(fs);
+        if(queued >= EXT2_LAZY_INIT_BATCH)
+        {
+            if(ext2_journal_flush(fs, 1) < 0)
+            {
+                printf("ext2: lazy init commit failed\n");
+                return NULL;
+            }
+            queued = 0;
+        }
     }
-    int64_t file_inode_idx = ext2_add_entry(fs,  dir_inode_idx, base_name, FILE_TYPE_FILE);
-    if(file_inode_idx < 0) // 如果添加文件失败
+    if(queued > 0 && ext2_journal_flush(fs, 1) < 0)
     {
-        printf("Failed to create file: %s\n", base_name);
-        return -1; // 返回错误
+        printf("ext2: lazy init commit failed\n");
     }
+    return NULL;
+}
 
-    printf("File created successfully: %s\n", path);
 
-    return file_inode_idx; // 返回新创建文件的inode索引
+// 让后台初始化线程退出并回收，返回它原来是否在运行
+static int ext2_lazy_init_stop(ext2_fs_t *fs)
+{
+    if(!fs->lazy_running)
+    {
+        return 0;
+    }
+    __atomic_store_n(&fs->lazy_stop, 1, __ATOMIC_RELAXED);
+    pthread_join(fs->lazy_thread, NULL);
+    fs->lazy_running = 0;
+    fs->lazy_stop = 0;
+    return 1;
 }
 
 
 /**
- * @brief 根据路径删除文件
+ * @brief 写好格式化时跳过的组
  *
- * 该函数用于根据给定的路径删除一个文件。如果文件不存在，则返回错误。
+ * 未初始化的组在第一次提交涉及它的修改时总会先写好，不调用这个函数也不影响正确性；
+ * 这里只是提前在空闲时把它们写完，以后分配到这些组时提交不用再多写整组的inode表。
+ * 后台线程在卸载、格式化和加载时退出，没写完的组保持未初始化。
  *
- * @param fs 指向ext2文件系统的指针
- * @param path 要删除的文件路径
+ * @param background 为0时在当前线程写完并提交，为1时启动后台线程逐组进行后立即返回
  *
- * @return 成功返回0，失败返回-1。
+ * @return 成功返回 0，失败返回 -1
  */
-int64_t ext2_unlink_by_path(ext2_fs_t *fs, const char *path)
+int64_t ext2_fs_lazy_init(ext2_fs_t *fs, int background)
 {
-    assert(fs!=NULL&&path!=NULL,return -1;);
-    char base_name[MAX_FILENAME_LEN]; 
-    ext2_get_path_basename (path, base_name);
-    char dir_name[MAX_FILENAME_LEN]; 
-    ext2_get_path_dirname (path, dir_name);
-
-    int64_t dir_inode_idx = ext2_find_inode_by_path(fs, dir_name, 0); // 查找路径对应的inode
-    if( dir_inode_idx < 0)
+    assert(fs!=NULL,return -1;);
+    if(background)
     {
-        printf("Failed to find for file: %s\n", path);
-        return -1; // 返回错误
+        if(fs->lazy_running)
+        {
+            return 0;
+        }
+        assert(pthread_create(&fs->lazy_thread, NULL, ext2_lazy_init_thread, fs)==0,return -1;);
+        fs->lazy_running = 1;
+        return 0;
     }
-    int64_t ret = ext2_remove_entry(fs, (uint64_t)dir_inode_idx, base_name);
-    if(ret < 0) // 如果添加文件失败
+    ext2_lazy_init_stop(fs);
+    ext2_journal_start(fs);
+    for(uint64_t g = 1;g<fs->super->groups_count;g++)
     {
-        printf("Failed to delete file: %s\n", base_name);
-        return ret; // 返回错误
+        if(fs->group[g].flags & EXT2_BG_UNINIT)
+        {
+            ext2_dirty_mark(&fs->group_init, g);
+        }
     }
-
-    printf("File deleted successfully: %s\n", path);
- 
-    return SUCCESS; // 成功删除文件
+    ext2_journal_stop(fs);
+    return ext2_journal_flush(fs, 1);
 }
 
 
 /**
- * @brief 追加数据到指定路径的文件
+ * @brief 卸载文件系统
  *
- * 该函数用于将数据追加到指定路径的文件中。如果文件不存在，则返回错误。
+ * 写回所有修改后释放文件系统占用的内存，磁盘由调用者关闭。
  *
- * @param fs 指向ext2文件系统的指针
- * @param path 要追加数据的文件路径
- * @param data 要追加的数据
- * @param size 要追加的数据大小
+ * @param fs 指向文件系统指针的指针，成功后置为NULL
  *
- * @return 成功返回0，失败返回-1。
+ * @return 成功返回 0，写回失败返回 -1（内存仍会释放）
  */
-int64_t ext2_append_file_by_path(ext2_fs_t *fs, const char *path, const void *data, uint64_t size)
+int64_t ext2_fs_unmount(ext2_fs_t **fs)
 {
-    assert(fs!=NULL&&path!=NULL&&data!=NULL,return -1;);
-    int64_t inode_idx = ext2_find_inode_by_path(fs, path, 0); // 查找路径对应的inode
-    if(inode_idx<0)
+    assert(fs!=NULL&&(*fs)!=NULL,return -1;);
+    ext2_lazy_init_stop(*fs);
+    int64_t ret = ext2_fs_sync(*fs);
+
+    bcache_destroy(&(*fs)->bcache);
+    dcache_destroy(&(*fs)->dcache);
+    ext2_dirty_free(&(*fs)->inode_dirty);
+    ext2_dirty_free(&(*fs)->block_bitmap_dirty);
+    ext2_dirty_free(&(*fs)->inode_bitmap_dirty);
+    ext2_dirty_free(&(*fs)->group_dirty);
+    ext2_dirty_free(&(*fs)->group_init);
+    pthread_mutex_destroy(&(*fs)->inode_dirty.lock);
+    pthread_mutex_destroy(&(*fs)->block_bitmap_dirty.lock);
+    pthread_mutex_destroy(&(*fs)->inode_bitmap_dirty.lock);
+    pthread_mutex_destroy(&(*fs)->group_dirty.lock);
+    pthread_mutex_destroy(&(*fs)->group_init.lock);
+    for(uint64_t i = 0;i<(*fs)->inode_lock_num;i++)
     {
-        printf("Failed to find for file: %s\n", path);
-        return -1; // 返回错误
+        pthread_rwlock_destroy(&(*fs)->inode_locks[i]);
     }
-
-    if(ext2_append_file(fs, inode_idx, data, size)<0) // 如果追加文件失败
+    free((*fs)->inode_locks);
+    free((*fs)->open_count);
+    free((*fs)->view_count);
+    free((*fs)->free_pending);
+    pthread_mutex_destroy(&(*fs)->balloc_lock);
+    pthread_mutex_destroy(&(*fs)->ialloc_lock);
+    pthread_mutex_destroy(&(*fs)->map_lock);
+    pthread_mutex_destroy(&(*fs)->journal_lock);
+    pthread_cond_destroy(&(*fs)->journal_cond);
+    // 同步时预留都已还回去，这里只释放内存
+    pthread_key_delete((*fs)->resv_key);
+    while((*fs)->resv_list != NULL)
     {
-        printf("Failed to write file: %s\n", path);
-        return -1; // 返回错误
+        ext2_resv_t *r = (*fs)->resv_list;
+        (*fs)->resv_list = r->next;
+        free(r);
     }
-    printf("File written successfully: %s\n", path);
-    
-    return 0;
+    pthread_mutex_destroy(&(*fs)->resv_lock);
+    bitmap_destory(&(*fs)->block_bitmap);
+    bitmap_destory(&(*fs)->inode_bitmap);
+    free((*fs)->inode_table);
+    free((*fs)->group);
+    free((*fs)->super);
+    free(*fs);
+    *fs = NULL;
+    return ret;
 }
 
 
 /**
- * @brief 覆盖写数据到指定路径的文件
- *
- * 该函数用于将数据覆盖写到指定路径的文件中。如果文件不存在，则返回错误。
+ * @brief 格式化 ext2 文件系统
  *
- * @param fs 指向ext2文件系统的指针
- * @param path 要覆盖写数据的文件路径
- * @param data 要覆盖写的数据
- * @param size 要覆盖写的数据大小
+ * 该函数用于初始化并格式化 ext2 文件系统。它将文件系统结构（如超级块、组描述符、位图和 inode 表）写入磁盘，
+ * 并配置各个结构的位置和大小。
+ * 开启EXT2_FEATURE_LAZY_INIT时其余组只在组描述符中标记为未初始化，格式化的时间不再随镜像大小增长。
  *
- * @return 成功返回0，失败返回-1。
+ * @param fs ext2 文件系统结构体指针
+ *
+ * @return 格式化成功返回 0，失败返回 -1
  */
-int64_t ext2_overwrite_file_by_path(ext2_fs_t *fs, const char *path, const void *data, uint64_t size)
+int64_t ext2_fs_format(ext2_fs_t *fs)
 {
-    assert(fs!=NULL&&path!=NULL&&data!=NULL,return -1;);
-    int64_t inode_idx = ext2_find_inode_by_path(fs, path, 0); // 查找路径对应的inode
-    if(inode_idx<0)
+    assert(fs!=NULL&&fs->super!=NULL&&fs->group!=NULL,return -1);
+    assert(fs->block_bitmap!=NULL&&fs->inode_bitmap!=NULL&&fs->inode_table!=NULL,return -1);
+    ext2_lazy_init_stop(fs);
+
+    uint64_t groups = fs->super->groups_count;
+    uint64_t bpg = fs->super->blocks_per_group;
+    uint64_t ipg = fs->super->inodes_per_group;
+    uint64_t gdt_blocks = EXT2_GDT_BLOCKS(groups, fs->block_size);
+    uint64_t inode_table_block_num = ipg * sizeof(ext2_inode_t) / fs->block_size; //每组inode表所占的块数
+
+    // 配置super_block
+    fs->super->magic = EXT2_SUPER_MAGIC; 
+    fs->super->free_blocks_count = 0;
+    fs->super->free_inodes_count = fs->super->inodes_count;
+
+    memset(fs->group, 0, gdt_blocks * fs->block_size);
+    memset(fs->inode_table, 0, sizeof(ext2_inode_t) * fs->super->inodes_count);
+    bitmap_clear_range(fs->block_bitmap, 0, EXT2_BLOCK_BITMAP_BITS(fs->super));
+    bitmap_clear_range(fs->inode_bitmap, 0, fs->super->inodes_count);
+    // 最后一组超出磁盘的部分当作已占用
+    bitmap_set_range(fs->block_bitmap, fs->super->blocks_count, EXT2_BLOCK_BITMAP_BITS(fs->super) - fs->super->blocks_count);
+
+    // 整个元数据区会在最后写入，之前的修改记录作废
+    assert(ext2_dirty_init_all(fs)==0,return -1;);
+    dcache_clear(fs->dcache);
+    ext2_resv_reset(fs);
+
+    // 配置每个组：第0组先放超级块和组描述符表，之后每组依次是块位图、inode位图、inode表、数据块
+    for(uint64_t g = 0;g<groups;g++)
     {
-        printf("Failed to find for file: %s\n", path);
-        return -1; // 返回错误
+        uint64_t group_start = g * bpg;
+        uint64_t group_end = group_start + bpg < fs->super->blocks_count ? group_start + bpg : fs->super->blocks_count;
+        uint64_t now_block_pos = group_start;
+        if(g == 0)
+        {
+            now_block_pos += 1 + gdt_blocks;
+        }
+        ext2_group_descriptor_t *gd = &fs->group[g];
+        gd->block_bitmap_start_idx = now_block_pos++;
+        gd->block_bitmap_block_num = 1;
+        gd->inode_bitmap_start_idx = now_block_pos++;
+        gd->inode_bitmap_block_num = 1;
+        gd->inode_table_start_idx = now_block_pos;
+        gd->inode_table_block_num = inode_table_block_num;
+        now_block_pos += inode_table_block_num;
+        gd->data_block_start_idx = now_block_pos;
+        gd->data_block_num = group_end - now_block_pos;
+        gd->root_inode_idx = ROOT_INODE_IDX;
+        gd->free_blocks_count = gd->data_block_num;
+        gd->free_inodes_count = ipg;
+        gd->used_dirs_count = 0;
+        // 第0组放着根目录和日志，总是写好
+        gd->flags = g > 0 && (fs->super->features & EXT2_FEATURE_LAZY_INIT) ? EXT2_BG_UNINIT : 0;
+
+        // 把前面占用的block写入block_bitmap
+        bitmap_set_range(fs->block_bitmap, group_start, now_block_pos - group_start);
+        fs->super->free_blocks_count += gd->data_block_num;
     }
 
-    if(ext2_overwrite_file(fs, inode_idx, data, size)<0) // 如果覆盖文件失败
+    // 日志区放在第0组数据区的开头，第0组太小时缩小日志，再小就不用日志
+    fs->super->journal_start = 0;
+    fs->super->journal_blocks = 0;
+    if(fs->super->features & EXT2_FEATURE_JOURNAL)
     {
-        printf("Failed to write file: %s\n", path);
-        return -1; // 返回错误
+        uint64_t jblocks = fs->group[0].data_block_num / 4 < EXT2_JOURNAL_BLOCKS ? fs->group[0].data_block_num / 4 : EXT2_JOURNAL_BLOCKS;
+        if(jblocks < 16)
+        {
+            fs->super->features &= ~(uint64_t)EXT2_FEATURE_JOURNAL;
+        }
+        else
+        {
+            fs->super->journal_start = fs->group[0].data_block_start_idx;
+            fs->super->journal_blocks = jblocks;
+            bitmap_set_range(fs->block_bitmap, fs->super->journal_start, jblocks);
+            fs->group[0].free_blocks_count -= jblocks;
+            fs->super->free_blocks_count -= jblocks;
+        }
     }
-    printf("File written successfully: %s\n", path);
-    return 0;
+    fs->journal_sequence = 1;
+
+    bitmap_set_bit(fs->inode_bitmap, ROOT_INODE_IDX); // 设置根目录的inode位图
+    fs->super->free_inodes_count--; // 根目录的inode已经被分配
+    fs->group[0].free_inodes_count--;
+    fs->group[0].used_dirs_count++;
+    fs->inode_table[ROOT_INODE_IDX].type = FILE_TYPE_DIR; // 第一个inode设为根目录
+    fs->inode_table[ROOT_INODE_IDX].priv = 0; // 权限设置为0
+    fs->inode_table[ROOT_INODE_IDX].size = 0; // 初始大小为0
+    fs->inode_table[ROOT_INODE_IDX].ctime = 1; // 创建时间设为1
+    ext2_map_init(fs, &fs->inode_table[ROOT_INODE_IDX]); // 根目录还没有数据块
+    printf("free inode num = %ld\n", fs->super->free_inodes_count);
+    printf("free block num = %ld\n\n", fs->super->free_blocks_count);
+
+    // 统一写入，每组的位图和inode表在磁盘上是连续的，由磁盘层合并
+    disk_iovec_t *iov = (disk_iovec_t*)malloc(sizeof(disk_iovec_t) * (3 + 3*groups));
+    uint8_t *stage = (uint8_t*)calloc(groups + 2, fs->block_size);
+    if(iov==NULL || stage==NULL)
+    {
+        free(iov);
+        free(stage);
+        printf("ext2: format malloc error\n");
+        return -1;
+    }
+    uint64_t n = 0;
+    iov[n++] = (disk_iovec_t){EXT2_SUPER_BLOCK_IDX, 1, fs->super};
+    iov[n++] = (disk_iovec_t){EXT2_GROUP_DESCRIPTOR_IDX, gdt_blocks, fs->group};
+    for(uint64_t g = 0;g<groups;g++)
+    {
+        if(fs->group[g].flags & EXT2_BG_UNINIT)
+        {
+            continue;
+        }
+        ext2_inode_bitmap_pack(fs, g, stage + g*fs->block_size);
+        iov[n++] = (disk_iovec_t){fs->group[g].block_bitmap_start_idx, 1, (uint8_t*)bitmap_get_data(fs->block_bitmap) + g*fs->block_size};
+        iov[n++] = (disk_iovec_t){fs->group[g].inode_bitmap_start_idx, 1, stage + g*fs->block_size};
+        iov[n++] = (disk_iovec_t){fs->group[g].inode_table_start_idx, inode_table_block_num, (uint8_t*)fs->inode_table + g*inode_table_block_num*fs->block_size};
+    }
+    if(fs->super->features & EXT2_FEATURE_JOURNAL)
+    {
+        // 日志超级块，后面一块清零，磁盘上原有的内容不会被当成事务
+        uint8_t *jsb = stage + groups*fs->block_size;
+        *(ext2_journal_super_t*)jsb = (ext2_journal_super_t){EXT2_JOURNAL_MAGIC, fs->super->journal_blocks, fs->journal_sequence};
+        iov[n++] = (disk_iovec_t){fs->super->journal_start, 2, jsb};
+    }
+    qsort(iov, n, sizeof(disk_iovec_t), ext2_cmp_iov);
+    int64_t ret = disk_writev(fs->disk, iov, n);
+    free(iov);
+    free(stage);
+    return ret;
+}
+
+
+/*
+* @brief 加载 ext2 文件系统
+*
+* 该函数用于从磁盘加载 ext2 文件系统的超级块、组描述符、块位图、inode 位图和 inode 表。
+* 只读取元数据，数据块留在磁盘上，映射文件后端挂载大镜像也不需要把整个镜像读进来。
+* 标记为未初始化的组不读，inode位图和inode表当作全0，块位图按本组的布局推算。
+*
+* @param fs 指向 ext2 文件系统的指针
+*
+* @return 成功返回 0，失败返回 -1
+*/
+int64_t ext2_fs_load(ext2_fs_t *fs)
+{
+    assert(fs!=NULL,return -1;);
+    ext2_lazy_init_stop(fs);
+
+    // 超级块在镜像开头，按哪种块大小读都能读到
+    DISK_READ(fs->disk,fs->super,EXT2_SUPER_BLOCK_IDX,1);
+    if(fs->super->magic != EXT2_SUPER_MAGIC)
+    {
+        printf("Bad magic number, not an ext2 image.\n");
+        return -1;
+    }
+    if(ext2_set_block_size(fs, fs->super->block_size) < 0)
+    {
+        printf("Unsupported block size %lu.\n", fs->super->block_size);
+        return -1;
+    }
+    if(fs->super->blocks_count * fs->super->block_size > fs->disk->size)
+    {
+        printf("Image is larger than the disk.\n");
+        return -1;
+    }
+    assert(fs->super->groups_count>0&&fs->super->inodes_per_group>0,return -1;);
+    fs->journal_handles = 0;
+    fs->journal_committing = 0;
+    if(fs->super->features & EXT2_FEATURE_JOURNAL)
+    {
+        // 日志中的事务可能改过超级块，重放后重新读
+        assert(ext2_journal_recover(fs)==0,return -1;);
+        assert(DISK_READ(fs->disk,fs->super,EXT2_SUPER_BLOCK_IDX,1)==0,return -1;);
+    }
+
+    // 镜像的几何参数可能和创建时不同，按超级块重新分配组描述符表、位图和inode表
+    uint64_t groups = fs->super->groups_count;
+    uint64_t gdt_blocks = EXT2_GDT_BLOCKS(groups, fs->block_size);
+    free(fs->group);
+    fs->group = (ext2_group_descriptor_t *)malloc(gdt_blocks * fs->block_size);
+    assert(fs->group!=NULL,return -1;);
+    assert(DISK_READ(fs->disk,fs->group,EXT2_GROUP_DESCRIPTOR_IDX,gdt_blocks)==0,return -1;);
+
+    // printf("magic = %x\n",fs->super->magic);
+    // printf("free_inodes_count = %d\n",fs->super->free_inodes_count);
+
+    if(bitmap_get_size(fs->block_bitmap) != EXT2_BLOCK_BITMAP_BITS(fs->super))
+    {
+        bitmap_destory(&fs->block_bitmap);
+        fs->block_bitmap = bitmap_create(EXT2_BLOCK_BITMAP_BITS(fs->super));
+        assert(fs->block_bitmap!=NULL,return -1;);
+    }
+    if(bitmap_get_size(fs->inode_bitmap) != fs->super->inodes_count)
+    {
+        bitmap_destory(&fs->inode_bitmap);
+        fs->inode_bitmap = bitmap_create(fs->super->inodes_count);
+        assert(fs->inode_bitmap!=NULL,return -1;);
+        free(fs->inode_table);
+        fs->inode_table = (ext2_inode_t *)malloc(sizeof(ext2_inode_t) * fs->super->inodes_count);
+        assert(fs->inode_table!=NULL,return -1;);
+        assert(ext2_inode_locks_init(fs, fs->super->inodes_count)==0,return -1;);
+    }
+    bitmap_clear_range(fs->inode_bitmap, 0, fs->super->inodes_count);
+    assert(ext2_dirty_init_all(fs)==0,return -1;);
+    dcache_clear(fs->dcache);
+    ext2_resv_reset(fs);
+    fs->map_cache.blk = 0;
+
+    // 每组的块位图直接读进整张块位图对应的扇区，inode位图先读到暂存区再逐位拼接
+    uint64_t itb = fs->group[0].inode_table_block_num;
+    disk_iovec_t *iov = (disk_iovec_t*)malloc(sizeof(disk_iovec_t) * 3 * groups);
+    uint8_t *stage = (uint8_t*)malloc(fs->block_size * groups);
+    if(iov==NULL || stage==NULL)
+    {
+        free(iov);
+        free(stage);
+        printf("ext2: load malloc error\n");
+        return -1;
+    }
+    uint64_t n = 0;
+    for(uint64_t g = 0;g<groups;g++)
+    {
+        ext2_group_descriptor_t *gd = &fs->group[g];
+        if(gd->flags & EXT2_BG_BLOCK_UNINIT)
+        {
+            // 没有写过的块位图：本组开头的元数据块已占用，最后一组超出磁盘的部分也算占用
+            uint64_t start = g * fs->super->blocks_per_group;
+            bitmap_clear_range(fs->block_bitmap, start, fs->super->blocks_per_group);
+            bitmap_set_range(fs->block_bitmap, start, gd->data_block_start_idx - start);
+            if(g == groups - 1)
+            {
+                bitmap_set_range(fs->block_bitmap, fs->super->blocks_count, EXT2_BLOCK_BITMAP_BITS(fs->super) - fs->super->blocks_count);
+            }
+        }
+        else
+        {
+            iov[n++] = (disk_iovec_t){gd->block_bitmap_start_idx, 1, (uint8_t*)bitmap_get_data(fs->block_bitmap) + g*fs->block_size};
+        }
+        if(gd->flags & EXT2_BG_INODE_UNINIT)
+        {
+            memset((uint8_t*)fs->inode_table + g*itb*fs->block_size, 0, itb*fs->block_size);
+        }
+        else
+        {
+            iov[n++] = (disk_iovec_t){gd->inode_bitmap_start_idx, 1, stage + g*fs->block_size};
+            iov[n++] = (disk_iovec_t){gd->inode_table_start_idx, itb, (uint8_t*)fs->inode_table + g*itb*fs->block_size};
+        }
+    }
+    int64_t ret = disk_readv(fs->disk, iov, n);
+    if(ret == 0)
+    {
+        for(uint64_t g = 0;g<groups;g++)
+        {
+            if(!(fs->group[g].flags & EXT2_BG_INODE_UNINIT))
+            {
+                ext2_inode_bitmap_unpack(fs, g, stage + g*fs->block_size);
+            }
+        }
+        // 位图数据是直接读进来的，重建查找用的摘要
+        bitmap_refresh(fs->block_bitmap);
+    }
+    free(iov);
+    free(stage);
+    return ret;
 }
 
 
 /**
- * @brief 根据路径读取文件内容
+ * @brief 记录[start, start+num)这段块被分配或释放
  *
- * 该函数用于根据给定的路径读取文件内容，并将其存储到buf中。如果文件不存在，则返回错误。
+ * 更新超级块和所涉及各组的空闲块数，并标记对应组的块位图和组描述符需要写回。
  *
- * @param fs 指向ext2文件系统的指针
- * @param path 要读取的文件路径
- * @param buf 用于存储读取的文件内容的缓冲区
+ * @param delta 分配时为-1，释放时为1
+ */
+static void ext2_count_blocks(ext2_fs_t *fs, uint64_t start, uint64_t num, int64_t delta)
+{
+    uint64_t bpg = fs->super->blocks_per_group;
+    __atomic_store_n(&fs->super->free_blocks_count, fs->super->free_blocks_count + (uint64_t)(delta * (int64_t)num), __ATOMIC_RELAXED); // ext2_free_blocks_count不加锁读
+    ext2_mark_super_dirty(fs);
+    while(num > 0)
+    {
+        uint64_t g = start / bpg;
+        uint64_t n = (g + 1) * bpg - start;
+        if(n > num)
+        {
+            n = num;
+        }
+        fs->group[g].free_blocks_count += (uint64_t)(delta * (int64_t)n);
+        ext2_dirty_mark(&fs->block_bitmap_dirty, g);
+        ext2_mark_group_dirty(fs, g);
+        start += n;
+        num -= n;
+    }
+}
+
+
+/**
+ * @brief 文件数据可用的空闲块数，分配前预先判断空间够不够时用
  *
- * @return 成功返回0，失败返回-1。
+ * 各线程预留而没用的块在位图和计数中都算作已占用，这里把各分片上的数加回来；超级块中保留的块不算在内。
+ * 每次写文件都会调用，所以不加分配器的锁，也不遍历预留链表。
+ * 从预留中分配不更新分片，每个线程的预留中已经用掉的块要到下次预留或归还时才减掉，
+ * 所以结果最多比实际多每个线程一次预留的块数，真正分配时还会再检查。
  */
-int64_t ext2_read_file_by_path(ext2_fs_t *fs, const char *path, void *buf)
+static uint64_t ext2_free_blocks_count(ext2_fs_t *fs)
 {
-    assert(fs!=NULL&&path!=NULL,return -1;);
-    int64_t inode_idx = ext2_find_inode_by_path(fs, path, 0); // 查找路径对应的inode
-    if(inode_idx<0)
+    uint64_t free_blocks = __atomic_load_n(&fs->super->free_blocks_count, __ATOMIC_RELAXED);
+    for(uint64_t i = 0;i<EXT2_RESV_SHARDS;i++)
     {
-        printf("Failed to find or create directory for file: %s\n", path);
-        return -1; // 返回错误
+        free_blocks += __atomic_load_n(&fs->resv_shard[i].count, __ATOMIC_RELAXED);
+    }
+    return free_blocks > fs->super->reserved_blocks_count ? free_blocks - fs->super->reserved_blocks_count : 0;
+}
+
+
+// 把预留r中还没用的块数设为num，并把分片上记的数对齐到num，只在预留和归还时调用
+static void ext2_resv_set_blocks(ext2_fs_t *fs, ext2_resv_t *r, uint64_t num)
+{
+    r->block_num = num;
+    if(r->counted != num)
+    {
+        __atomic_fetch_add(&fs->resv_shard[r->shard].count, num - r->counted, __ATOMIC_RELAXED); // 减少时按无符号数回绕
+        r->counted = num;
     }
+}
 
-    if(ext2_read_file(fs, inode_idx, buf)<0) // 如果读取文件失败
+
+/**
+ * @brief 取当前线程在fs上的预留，第一次用时创建
+ *
+ * @return 成功返回预留，内存不够时返回NULL，调用者改用全局分配
+ */
+static ext2_resv_t* ext2_resv_get(ext2_fs_t *fs)
+{
+    ext2_resv_t *r = (ext2_resv_t*)pthread_getspecific(fs->resv_key);
+    if(r != NULL)
     {
-        printf("Failed to read file: %s\n", path);
-     
-        return -1; // 返回错误
+        return r;
     }
-    printf("File read successfully: %s\n", path);
-    return 0;
+    r = (ext2_resv_t*)calloc(1, sizeof(ext2_resv_t));
+    if(r == NULL)
+    {
+        return NULL;
+    }
+    r->fs = fs;
+    pthread_mutex_lock(&fs->resv_lock);
+    r->shard = fs->resv_shard_next++ % EXT2_RESV_SHARDS;
+    r->next = fs->resv_list;
+    fs->resv_list = r;
+    pthread_mutex_unlock(&fs->resv_lock);
+    pthread_setspecific(fs->resv_key, r);
+    return r;
 }
 
 
+// 把预留中还没用的块还给位图
+static void ext2_resv_put_blocks(ext2_fs_t *fs, ext2_resv_t *r)
+{
+    if(r->block_num == 0)
+    {
+        ext2_resv_set_blocks(fs, r, 0); // 预留正好用完时分片上还记着用掉的块
+        return;
+    }
+    pthread_mutex_lock(&fs->balloc_lock);
+    bitmap_clear_range(fs->block_bitmap, r->block_start, r->block_num);
+    ext2_count_blocks(fs, r->block_start, r->block_num, 1);
+    ext2_resv_set_blocks(fs, r, 0);
+    pthread_mutex_unlock(&fs->balloc_lock);
+}
+
 
-int64_t ext2_list_dir_by_path(ext2_fs_t *fs,const char *path)
+/**
+ * @brief 从当前线程的预留中分配最多num个连续块
+ *
+ * 预留用完时从goal开始一次预留EXT2_RESV_BLOCKS个连续块，位图和空闲计数只在预留时改一次。
+ * goal和预留不在同一组时先把预留还回去，再从goal重新预留，和ext2_resv_inode一样让块靠近它的inode。
+ *
+ * @param goal 希望从这个块号开始分配，为0时不挑位置
+ *
+ * @return 成功返回起始块号，没有预留可用返回-1，调用者改用全局分配
+ */
+static int64_t ext2_resv_blocks(ext2_fs_t *fs, uint64_t num, uint64_t goal, uint64_t *got)
 {
-    assert(fs!=NULL&&path!=NULL,return ERROR_INVALID_ARG;);
-    int64_t inode_idx = ext2_find_inode_by_path(fs, path, 0); // 查找路径对应的inode
-    if(inode_idx<0)
+    ext2_resv_t *r = ext2_resv_get(fs);
+    if(r == NULL)
     {
-         printf("Failed to find directory: %s\n", path);
-        return -1; // 返回错误
+        return -1;
     }
-    int64_t ret = ext2_walk_entry(fs, inode_idx, print_entry);
+    uint64_t bpg = fs->super->blocks_per_group;
+    if(r->block_num > 0 && goal != 0 && goal / bpg != r->block_start / bpg)
+    {
+        ext2_resv_put_blocks(fs, r);
+    }
+    if(r->block_num == 0)
+    {
+        pthread_mutex_lock(&fs->balloc_lock);
+        int64_t start = bitmap_scan_0_run(fs->block_bitmap, EXT2_RESV_BLOCKS, goal);
+        if(start >= 0)
+        {
+            bitmap_set_range(fs->block_bitmap, (uint64_t)start, EXT2_RESV_BLOCKS);
+            ext2_resv_set_blocks(fs, r, EXT2_RESV_BLOCKS);
+            ext2_count_blocks(fs, (uint64_t)start, EXT2_RESV_BLOCKS, -1);
+            r->block_start = (uint64_t)start;
+        }
+        pthread_mutex_unlock(&fs->balloc_lock);
+        if(start < 0)
+        {
+            return -1;
+        }
+    }
+    uint64_t n = num < r->block_num ? num : r->block_num;
+    int64_t ret = (int64_t)r->block_start;
+    r->block_start += n;
+    r->block_num -= n;
+    *got = n;
     return ret;
 }
 
 
 /**
- * @brief 根据路径获取文件的大小
+ * @brief 分配一个新的块
  *
- * 该函数用于根据给定的路径获取对应文件的大小（以字节为单位）。
+ * 该函数用于分配一个新的块，并更新文件系统的空闲块计数。
  *
  * @param fs 指向ext2文件系统的指针
- * @param path 要获取大小的文件或目录路径
  *
- * @return 返回文件的大小，如果发生错误则返回-1。
+ * @return 成功返回新分配的块索引，失败返回-1。
  */
-int64_t ext2_get_inode_size_by_path(ext2_fs_t *fs, const char *path)
+int64_t ext2_alloc_block(ext2_fs_t *fs)
+{
+    assert(fs!=NULL,return -1;);
+    assert(fs->super->free_blocks_count>=0,return -1;);
+
+    uint64_t got;
+    int64_t ret = ext2_resv_blocks(fs, 1, 0, &got);
+    if(ret >= 0)
+    {
+        return ret;
+    }
+
+    pthread_mutex_lock(&fs->balloc_lock);
+    ret = bitmap_scan_0(fs->block_bitmap);
+    
+    if(ret<0)
+    {
+        pthread_mutex_unlock(&fs->balloc_lock);
+        printf("No free blocks available.\n");
+        return ERROR_NOT_FREE; // 没有可用的块
+    }
+   
+    bitmap_set_bit(fs->block_bitmap,ret);
+    ext2_count_blocks(fs, (uint64_t)ret, 1, -1);
+    pthread_mutex_unlock(&fs->balloc_lock);
+    return ret;
+
+}
+
+
+/**
+ * @brief 尽量分配一段连续的块
+ *
+ * 先从goal开始找连续num个空闲块，这样文件的块在磁盘上相邻，读写时能合并成大的传输；
+ * 找不到这么长的空闲段时退回单块分配。少于EXT2_RESV_BLOCKS个块时从当前线程的预留中取，可能少于num个。
+ *
+ * @param fs 指向ext2文件系统的指针
+ * @param num 希望分配的块数
+ * @param goal 希望从这个块号开始分配，一般是文件上一个块的下一块
+ * @param got 返回实际分配的块数，为1到num
+ *
+ * @return 成功返回起始块号，失败返回负数。
+ */
+static int64_t ext2_alloc_blocks(ext2_fs_t *fs, uint64_t num, uint64_t goal, uint64_t *got)
+{
+    assert(fs!=NULL&&got!=NULL&&num>0,return -1;);
+
+    int64_t ret = -1;
+    if(num < EXT2_RESV_BLOCKS && (ret = ext2_resv_blocks(fs, num, goal, got)) >= 0)
+    {
+        return ret;
+    }
+    pthread_mutex_lock(&fs->balloc_lock);
+    if(num <= fs->super->free_blocks_count)
+    {
+        ret = bitmap_scan_0_run(fs->block_bitmap, num, goal);
+    }
+    if(ret < 0)
+    {
+        pthread_mutex_unlock(&fs->balloc_lock);
+        *got = 1;
+        return ext2_alloc_block(fs);
+    }
+
+    bitmap_set_range(fs->block_bitmap, (uint64_t)ret, num);
+    ext2_count_blocks(fs, (uint64_t)ret, num, -1);
+    pthread_mutex_unlock(&fs->balloc_lock);
+    *got = num;
+    return ret;
+}
+
+
+/**
+ * @brief 为inode的映射结构（extent节点、间接块）分配一个块，尽量放在inode所在的组
+ */
+static int64_t ext2_alloc_meta_block(ext2_fs_t *fs, uint64_t inode_idx)
 {
+    uint64_t got;
+    uint64_t g = inode_idx / fs->super->inodes_per_group;
+    return ext2_alloc_blocks(fs, 1, fs->group[g].data_block_start_idx, &got);
+}
 
+
+/**
+ * @brief 释放指定的块
+ *
+ * 该函数用于释放指定的块，并更新文件系统的空闲块计数。
+ *
+ * @param fs 指向ext2文件系统的指针
+ * @param idx 要释放的块索引
+ *
+ * @return 成功返回0，失败返回-1。
+ */
+int64_t ext2_free_block(ext2_fs_t *fs,uint64_t idx)
+{
+    assert(fs!=NULL,return -1;);
+    return ext2_free_blocks(fs, idx, 1);
 }
 
+
+/**
+ * @brief 释放一段连续的块
+ *
+ * 开启日志时块先记在当前事务的释放列表中，位图和计数不变，提交时才还给位图。
+ * 文件数据不经过日志直接写盘，如果事务提交前就把块分配给别的文件，掉电后没提交的删除被撤销，
+ * 旧文件指向的块里却已经是新文件的数据。
+ *
+ * @return 成功返回0，失败返回-1。
+ */
+static int64_t ext2_free_blocks(ext2_fs_t *fs, uint64_t start, uint64_t num)
+{
+    assert(fs!=NULL,return -1;);
+    if(num == 0)
+    {
+        return 0;
+    }
+    assert(start + num <= fs->super->blocks_count && start + num > start,return -1;);
+    for(uint64_t i = 0;i<num;i++)
+    {
+        bcache_invalidate(fs->bcache, start + i); // 块要释放了，缓存中的副本不再需要写回；在还给位图之前做，不会丢掉别人刚分配到的块
+    }
+    pthread_mutex_lock(&fs->balloc_lock);
+    if(!(fs->super->features & EXT2_FEATURE_JOURNAL))
+    {
+        bitmap_clear_range(fs->block_bitmap, start, num);
+        ext2_count_blocks(fs, start, num, 1);
+        pthread_mutex_unlock(&fs->balloc_lock);
+        return 0;
+    }
+    uint64_t n = fs->free_pending_num;
+    if(n > 0 && fs->free_pending[n-1].start + fs->free_pending[n-1].num == start)
+    {
+        fs->free_pending[n-1].num += num;
+        pthread_mutex_unlock(&fs->balloc_lock);
+        return 0;
+    }
+    if(n == fs->free_pending_cap)
+    {
+        uint64_t cap = fs->free_pending_cap ? fs->free_pending_cap * 2 : 64;
+        ext2_free_run_t *run = (ext2_free_run_t*)realloc(fs->free_pending, sizeof(ext2_free_run_t) * cap);
+        if(run == NULL)
+        {
+            // 宁可让这些块一直占着，fsck会把它们找回来
+            pthread_mutex_unlock(&fs->balloc_lock);
+            printf("ext2: free list malloc error\n");
+            return FAILED;
+        }
+        fs->free_pending = run;
+        fs->free_pending_cap = cap;
+    }
+    fs->free_pending[n] = (ext2_free_run_t){start, num};
+    __atomic_store_n(&fs->free_pending_num, n + 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&fs->balloc_lock);
+    return 0;
+}
+
+
+/**
+ * @brief 把当前事务中释放的块还给位图，或者在事务没写成时重新占上
+ *
+ * 只在提交时调用，这时没有进行中的操作，还回去的块在提交结束前不会被分配出去，
+ * 它们在位图中的变化随这次提交一起写进日志。
+ *
+ * @param delta 还给位图时为1，重新占上时为-1
+ */
+static void ext2_free_pending_apply(ext2_fs_t *fs, int64_t delta)
+{
+    pthread_mutex_lock(&fs->balloc_lock);
+    for(uint64_t i = 0;i<fs->free_pending_num;i++)
+    {
+        ext2_free_run_t *run = &fs->free_pending[i];
+        if(delta > 0)
+        {
+            bitmap_clear_range(fs->block_bitmap, run->start, run->num);
+        }
+        else
+        {
+            bitmap_set_range(fs->block_bitmap, run->start, run->num);
+        }
+        ext2_count_blocks(fs, run->start, run->num, delta);
+    }
+    pthread_mutex_unlock(&fs->balloc_lock);
+}
+
+
+/**
+ * @brief 为新inode挑一个块组
+ *
+ * 目录分散到空闲inode不少于平均值的组里空闲块最多的那个，让不同目录树各占一片；
+ * 普通文件尽量和父目录放在同一组，父目录所在组满了再按二次探测和线性扫描找其他组。
+ *
+ * @return 成功返回组号，没有空闲inode返回-1
+ */
+static int64_t ext2_find_group(ext2_fs_t *fs, uint64_t parent_idx, uint64_t type)
+{
+    uint64_t groups = fs->super->groups_count;
+    ext2_group_descriptor_t *gd = fs->group;
+    int64_t best = -1;
+
+    if(type == FILE_TYPE_DIR)
+    {
+        uint64_t avg = fs->super->free_inodes_count / groups;
+        for(uint64_t g = 0;g<groups;g++)
+        {
+            if(gd[g].free_inodes_count == 0 || gd[g].free_inodes_count < avg)
+            {
+                continue;
+            }
+            if(best < 0 || gd[g].free_blocks_count > gd[best].free_blocks_count)
+            {
+                best = (int64_t)g;
+            }
+        }
+        if(best >= 0)
+        {
+            return best;
+        }
+    }
+    else
+    {
+        uint64_t parent = parent_idx / fs->super->inodes_per_group;
+        if(parent >= groups)
+        {
+            parent = 0;
+        }
+        if(gd[parent].free_inodes_count > 0 && gd[parent].free_blocks_count > 0)
+        {
+            return (int64_t)parent;
+        }
+        for(uint64_t step = 1;step<groups;step <<= 1)
+        {
+            uint64_t g = (parent + step) % groups;
+            if(gd[g].free_inodes_count > 0 && gd[g].free_blocks_count > 0)
+            {
+                return (int64_t)g;
+            }
+        }
+    }
+
+    // 只要还有空闲inode就行
+    for(uint64_t g = 0;g<groups;g++)
+    {
+        if(gd[g].free_inodes_count > 0)
+        {
+            return (int64_t)g;
+        }
+    }
+    return -1;
+}
+
+
+// 把预留中还没用的inode还给位图
+static void ext2_resv_put_inodes(ext2_fs_t *fs, ext2_resv_t *r)
+{
+    if(r->inode_num == 0)
+    {
+        return;
+    }
+    pthread_mutex_lock(&fs->ialloc_lock);
+    for(uint64_t i = 0;i<r->inode_num;i++)
+    {
+        uint64_t g = r->inodes[i] / fs->super->inodes_per_group;
+        bitmap_clear_bit(fs->inode_bitmap, r->inodes[i]);
+        fs->super->free_inodes_count++;
+        fs->group[g].free_inodes_count++;
+        ext2_dirty_mark(&fs->inode_bitmap_dirty, g);
+        ext2_mark_group_dirty(fs, g);
+    }
+    ext2_mark_super_dirty(fs);
+    pthread_mutex_unlock(&fs->ialloc_lock);
+    r->inode_num = 0;
+}
+
+
+/**
+ * @brief 从当前线程的预留中给普通文件分配inode
+ *
+ * 预留里没有父目录所在组的inode时，把剩下的还回去，再在ext2_find_group挑出的组里一次预留最多
+ * EXT2_RESV_INODES个，这样同一线程连续创建的文件仍然和父目录在一起。
+ *
+ * @return 成功返回inode索引，没有预留可用返回-1，调用者改用全局分配
+ */
+static int64_t ext2_resv_inode(ext2_fs_t *fs, uint64_t parent_idx)
+{
+    ext2_resv_t *r = ext2_resv_get(fs);
+    if(r == NULL)
+    {
+        return -1;
+    }
+    uint64_t ipg = fs->super->inodes_per_group;
+    uint64_t parent = parent_idx / ipg;
+    for(uint64_t i = 0;i<r->inode_num;i++)
+    {
+        if(r->inodes[i] / ipg == parent)
+        {
+            uint64_t ret = r->inodes[i];
+            r->inodes[i] = r->inodes[--r->inode_num];
+            return (int64_t)ret;
+        }
+    }
+    ext2_resv_put_inodes(fs, r);
+
+    pthread_mutex_lock(&fs->ialloc_lock);
+    pthread_mutex_lock(&fs->balloc_lock);
+    int64_t g = ext2_find_group(fs, parent_idx, FILE_TYPE_FILE);
+    pthread_mutex_unlock(&fs->balloc_lock);
+    if(g < 0)
+    {
+        pthread_mutex_unlock(&fs->ialloc_lock);
+        return -1;
+    }
+    uint64_t begin = (uint64_t)g * ipg, end = begin + ipg;
+    int64_t idx = (int64_t)begin;
+    // 扫描到位图末尾会绕回开头，找到的位置不在这一组时就停下
+    while(r->inode_num < EXT2_RESV_INODES && (idx = bitmap_scan_0_run(fs->inode_bitmap, 1, (uint64_t)idx)) >= 0 && (uint64_t)idx >= begin && (uint64_t)idx < end)
+    {
+        bitmap_set_bit(fs->inode_bitmap, (uint64_t)idx);
+        r->inodes[r->inode_num++] = (uint64_t)idx;
+    }
+    if(r->inode_num > 0)
+    {
+        fs->super->free_inodes_count -= r->inode_num;
+        fs->group[g].free_inodes_count -= r->inode_num;
+        ext2_dirty_mark(&fs->inode_bitmap_dirty, (uint64_t)g);
+        ext2_mark_group_dirty(fs, (uint64_t)g);
+        ext2_mark_super_dirty(fs);
+    }
+    pthread_mutex_unlock(&fs->ialloc_lock);
+    if(r->inode_num == 0)
+    {
+        return -1;
+    }
+    return (int64_t)r->inodes[--r->inode_num];
+}
+
+
+/**
+ * @brief 把所有线程预留中没用的块和inode还回去
+ *
+ * 提交前调用，预留只存在于内存中，不会写到磁盘上。调用时没有进行中的元数据操作，各线程不会同时用自己的预留。
+ */
+static void ext2_resv_drain_all(ext2_fs_t *fs)
+{
+    pthread_mutex_lock(&fs->resv_lock);
+    for(ext2_resv_t *r = fs->resv_list;r!=NULL;r = r->next)
+    {
+        ext2_resv_put_blocks(fs, r);
+        ext2_resv_put_inodes(fs, r);
+    }
+    pthread_mutex_unlock(&fs->resv_lock);
+}
+
+
+// 预留的清理函数，线程退出时调用，把预留还回去后释放
+static void ext2_resv_exit(void *arg)
+{
+    ext2_resv_t *r = (ext2_resv_t*)arg;
+    ext2_fs_t *fs = r->fs;
+    ext2_journal_start(fs);
+    ext2_resv_put_blocks(fs, r);
+    ext2_resv_put_inodes(fs, r);
+    pthread_mutex_lock(&fs->resv_lock);
+    for(ext2_resv_t **pp = &fs->resv_list;*pp!=NULL;pp = &(*pp)->next)
+    {
+        if(*pp == r)
+        {
+            *pp = r->next;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&fs->resv_lock);
+    ext2_journal_stop(fs);
+    free(r);
+}
+
+
+// 丢掉所有预留和当前事务中释放的块但不改位图，格式化和加载时位图整个重新来过
+static void ext2_resv_reset(ext2_fs_t *fs)
+{
+    __atomic_store_n(&fs->free_pending_num, 0, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&fs->resv_lock);
+    for(ext2_resv_t *r = fs->resv_list;r!=NULL;r = r->next)
+    {
+        r->block_num = 0;
+        r->counted = 0;
+        r->inode_num = 0;
+    }
+    memset(fs->resv_shard, 0, sizeof(fs->resv_shard));
+    pthread_mutex_unlock(&fs->resv_lock);
+}
+
+
+/**
+ * @brief 分配一个新的inode
+ *
+ * 该函数用于分配一个新的inode，并更新文件系统和所在组的空闲inode计数。
+ * 普通文件先从当前线程的预留中取，目录总是走全局分配，按ext2_find_group的策略分散开。
+ *
+ * @param fs 指向ext2文件系统的指针
+ * @param parent_idx 父目录的inode索引，用来决定新inode放在哪个组
+ * @param type 新inode的类型
+ *
+ * @return 成功返回新分配的inode索引，失败返回-1。
+ */
+int64_t ext2_alloc_inode(ext2_fs_t *fs, uint64_t parent_idx, uint64_t type)
+{
+    assert(fs!=NULL,return -1;);
+    assert(fs->super->free_inodes_count>=0,return -1;);
+
+    int64_t ret;
+    if(type == FILE_TYPE_FILE && (ret = ext2_resv_inode(fs, parent_idx)) >= 0)
+    {
+        return ret;
+    }
+    pthread_mutex_lock(&fs->ialloc_lock);
+    pthread_mutex_lock(&fs->balloc_lock); // 挑组时要读各组的空闲块数
+    int64_t g = ext2_find_group(fs, parent_idx, type);
+    pthread_mutex_unlock(&fs->balloc_lock);
+    ret = g < 0 ? -1 : bitmap_scan_0_run(fs->inode_bitmap, 1, (uint64_t)g * fs->super->inodes_per_group);
+    if(ret<0)
+    {
+        pthread_mutex_unlock(&fs->ialloc_lock);
+        printf("No free inodes available.\n");
+        return ret; // 没有可用的inode
+    }
+    g = ret / (int64_t)fs->super->inodes_per_group; // 组计数不准时以实际找到的位置为准
+  
+    bitmap_set_bit(fs->inode_bitmap,(uint64_t)ret);
+    fs->super->free_inodes_count--;
+    fs->group[g].free_inodes_count--;
+    if(type == FILE_TYPE_DIR)
+    {
+        fs->group[g].used_dirs_count++;
+    }
+    ext2_dirty_mark(&fs->inode_bitmap_dirty, (uint64_t)g);
+    ext2_mark_group_dirty(fs, (uint64_t)g);
+    ext2_mark_super_dirty(fs);
+    pthread_mutex_unlock(&fs->ialloc_lock);
+    return ret;
+
+}
+
+
+/**
+ * @brief 释放指定的inode
+ *
+ * 该函数用于释放指定的inode，并更新文件系统和所在组的空闲inode计数。
+ *
+ * @param fs 指向ext2文件系统的指针
+ * @param idx 要释放的inode索引
+ * @param type 被释放inode的类型，目录要减少所在组的目录数
+ *
+ * @return 成功返回0，失败返回-1。
+ */
+int64_t ext2_free_inode(ext2_fs_t *fs,uint64_t idx, uint64_t type)
+{
+    assert(fs!=NULL,return -1;);
+    pthread_mutex_lock(&fs->ialloc_lock);
+    int64_t ret = bitmap_clear_bit(fs->inode_bitmap,idx);
+    if(ret<0)
+    {
+        pthread_mutex_unlock(&fs->ialloc_lock);
+        return FAILED;// 没有可用的inode
+    }
+    uint64_t g = idx / fs->super->inodes_per_group;
+    fs->super->free_inodes_count++;
+    fs->group[g].free_inodes_count++;
+    if(type == FILE_TYPE_DIR && fs->group[g].used_dirs_count > 0)
+    {
+        fs->group[g].used_dirs_count--;
+    }
+    ext2_dirty_mark(&fs->inode_bitmap_dirty, g);
+    ext2_mark_group_dirty(fs, g);
+    ext2_mark_super_dirty(fs);
+    pthread_mutex_unlock(&fs->ialloc_lock);
+    return ret;
+}
+
+
+static void ext2_ext_init_node(ext2_extent_header_t *h, uint16_t max, uint16_t depth)
+{
+    h->magic = EXT2_EXT_MAGIC;
+    h->entries = 0;
+    h->max = max;
+    h->depth = depth;
+    h->reserved = 0;
+}
+
+
+/*
+ * 在节点中二分查找最后一个lblk<=目标的记录，没有这样的记录返回-1。
+ * 叶子和索引记录的lblk都在开头且大小相同，按叶子记录访问即可。
+ */
+static int64_t ext2_ext_search(ext2_extent_header_t *h, uint64_t lblk)
+{
+    ext2_extent_t *rec = EXT2_EXT_LEAF(h);
+    int64_t lo = 0, hi = (int64_t)h->entries - 1, ret = -1;
+    while(lo <= hi)
+    {
+        int64_t mid = (lo + hi) / 2;
+        if(rec[mid].lblk <= lblk)
+        {
+            ret = mid;
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+    return ret;
+}
+
+
+/**
+ * @brief 查找逻辑块所在的extent
+ *
+ * 索引节点通过块缓存读取，热点文件的查找不会重复读盘。
+ *
+ * @return 成功返回0并填好ext，逻辑块没有映射返回ERROR_NOT_FOUND，读盘失败返回-1。
+ */
+static int64_t ext2_ext_find(ext2_fs_t *fs, ext2_inode_t *inode, uint64_t lblk, ext2_extent_t *ext)
+{
+    ext2_extent_header_t *h = (ext2_extent_header_t*)inode->blk_idx;
+    bcache_buf_t *buf = NULL;
+    int64_t ret = ERROR_NOT_FOUND;
+    while(h->magic == EXT2_EXT_MAGIC)
+    {
+        int64_t i = ext2_ext_search(h, lblk);
+        if(i < 0)
+        {
+            break;
+        }
+        if(h->depth == 0)
+        {
+            ext2_extent_t *e = &EXT2_EXT_LEAF(h)[i];
+            if(lblk < (uint64_t)e->lblk + e->len)
+            {
+                *ext = *e;
+                ret = SUCCESS;
+            }
+            break;
+        }
+        bcache_buf_t *next = bcache_get(fs->bcache, EXT2_EXT_INDEX(h)[i].child);
+        bcache_put(fs->bcache, buf);
+        buf = next;
+        if(buf == NULL)
+        {
+            return -1;
+        }
+        h = (ext2_extent_header_t*)buf->data;
+    }
+    bcache_put(fs->bcache, buf);
+    return ret;
+}
+
+
+/**
+ * @brief 在extent树末尾加入映射[lblk,lblk+len) -> [pblk,pblk+len)
+ *
+ * 文件只会在末尾增长，所以新记录总是加在最右边的叶子上。物理上接续最后一个extent时直接把它加长；
+ * 叶子满了就在最右路径上找最深的有空位的节点，在它下面挂一串新节点；整条路径都满了先把根搬到新块，树长高一层。
+ *
+ * @return 成功返回0，失败返回-1。
+ */
+static int64_t ext2_ext_append(ext2_fs_t *fs, uint64_t inode_idx, uint64_t lblk, uint64_t pblk, uint64_t len)
+{
+    ext2_inode_t *inode = &fs->inode_table[inode_idx];
+    ext2_extent_header_t *root = (ext2_extent_header_t*)inode->blk_idx;
+    ext2_extent_header_t *path[EXT2_EXT_MAX_DEPTH + 1];
+    bcache_buf_t *path_buf[EXT2_EXT_MAX_DEPTH + 1] = {NULL};
+    int64_t ret = -1;
+
+again:
+    path[0] = root;
+    for(uint16_t l = 0;l < root->depth;l++)
+    {
+        path_buf[l+1] = bcache_get(fs->bcache, EXT2_EXT_INDEX(path[l])[path[l]->entries - 1].child);
+        if(path_buf[l+1] == NULL)
+        {
+            goto out;
+        }
+        path[l+1] = (ext2_extent_header_t*)path_buf[l+1]->data;
+    }
+
+    uint16_t depth = root->depth;
+    ext2_extent_header_t *leaf = path[depth];
+    if(leaf->entries > 0)
+    {
+        ext2_extent_t *last = &EXT2_EXT_LEAF(leaf)[leaf->entries - 1];
+        if((uint64_t)last->lblk + last->len == lblk && last->pblk + last->len == pblk && last->len + len <= EXT2_EXT_MAX_LEN)
+        {
+            last->len += len;
+            if(depth > 0)
+            {
+                bcache_mark_dirty(fs->bcache, path_buf[depth]);
+            }
+            ret = 0;
+            goto out;
+        }
+    }
+
+    // 找最深的还有空位的节点
+    int64_t l = depth;
+    while(l >= 0 && path[l]->entries >= path[l]->max)
+    {
+        l--;
+    }
+    if(l < 0)
+    {
+        // 根满了，把根的内容搬到新块里，根变成只有一项的索引节点
+        assert(depth < EXT2_EXT_MAX_DEPTH,goto out;);
+        int64_t blk = ext2_alloc_meta_block(fs, inode_idx);
+        assert(blk >= 0,goto out;);
+        bcache_buf_t *nb = bcache_get_new(fs->bcache, (uint64_t)blk);
+        assert(nb != NULL,ext2_free_block(fs, (uint64_t)blk);goto out;);
+        memcpy(nb->data, root, sizeof(ext2_extent_header_t) + root->entries * sizeof(ext2_extent_t));
+        ((ext2_extent_header_t*)nb->data)->max = EXT2_EXT_NODE_MAX(fs);
+        bcache_put(fs->bcache, nb);
+
+        uint32_t first = EXT2_EXT_LEAF(root)[0].lblk;
+        ext2_ext_init_node(root, EXT2_EXT_ROOT_MAX, depth + 1);
+        root->entries = 1;
+        EXT2_EXT_INDEX(root)[0] = (ext2_extent_idx_t){first, 0, (uint64_t)blk};
+        for(uint16_t i = 1;i <= depth;i++)
+        {
+            bcache_put(fs->bcache, path_buf[i]);
+            path_buf[i] = NULL;
+        }
+        goto again;
+    }
+
+    if(l == depth)
+    {
+        EXT2_EXT_LEAF(leaf)[leaf->entries++] = (ext2_extent_t){(uint32_t)lblk, (uint32_t)len, pblk};
+    }
+    else
+    {
+        // 先分配好整串节点的块，再从叶子往上建一串新节点，最后挂到第l层；中途失败时释放这些块
+        uint64_t blks[EXT2_EXT_MAX_DEPTH];
+        int64_t num = depth - l, got = 0;
+        for(;got < num;got++)
+        {
+            int64_t blk = ext2_alloc_meta_block(fs, inode_idx);
+            if(blk < 0)
+            {
+                break;
+            }
+            blks[got] = (uint64_t)blk;
+        }
+        uint64_t child = 0;
+        for(int64_t k = depth;k > l && got == num;k--)
+        {
+            uint64_t blk = blks[depth - k];
+            bcache_buf_t *nb = bcache_get_new(fs->bcache, blk);
+            if(nb == NULL)
+            {
+                break;
+            }
+            ext2_extent_header_t *h = (ext2_extent_header_t*)nb->data;
+            ext2_ext_init_node(h, EXT2_EXT_NODE_MAX(fs), (uint16_t)(depth - k));
+            h->entries = 1;
+            if(k == depth)
+            {
+                EXT2_EXT_LEAF(h)[0] = (ext2_extent_t){(uint32_t)lblk, (uint32_t)len, pblk};
+            }
+            else
+            {
+                EXT2_EXT_INDEX(h)[0] = (ext2_extent_idx_t){(uint32_t)lblk, 0, child};
+            }
+            bcache_mark_dirty(fs->bcache, nb);
+            bcache_put(fs->bcache, nb);
+            child = blk;
+        }
+        if(got < num || child != blks[num - 1])
+        {
+            for(int64_t i = 0;i < got;i++)
+            {
+                ext2_free_block(fs, blks[i]);
+            }
+            goto out;
+        }
+        EXT2_EXT_INDEX(path[l])[path[l]->entries++] = (ext2_extent_idx_t){(uint32_t)lblk, 0, child};
+    }
+    if(l > 0)
+    {
+        bcache_mark_dirty(fs->bcache, path_buf[l]);
+    }
+    ret = 0;
+
+out:
+    for(uint16_t i = 1;i <= EXT2_EXT_MAX_DEPTH;i++)
+    {
+        bcache_put(fs->bcache, path_buf[i]);
+    }
+    ext2_mark_inode_dirty(fs, inode_idx);
+    return ret;
+}
+
+
+/*
+ * 释放节点h下逻辑块号>=n的映射以及因此变空的子节点，h本身不释放。
+ * 返回h中剩余的记录数，读盘失败返回-1。
+ */
+static int64_t ext2_ext_truncate_node(ext2_fs_t *fs, ext2_extent_header_t *h, uint64_t n)
+{
+    if(h->depth == 0)
+    {
+        while(h->entries > 0)
+        {
+            ext2_extent_t *e = &EXT2_EXT_LEAF(h)[h->entries - 1];
+            if(e->lblk >= n)
+            {
+                ext2_free_blocks(fs, e->pblk, e->len);
+                h->entries--;
+                continue;
+            }
+            if((uint64_t)e->lblk + e->len > n)
+            {
+                uint64_t keep = n - e->lblk;
+                ext2_free_blocks(fs, e->pblk + keep, e->len - keep);
+                e->len = (uint32_t)keep;
+            }
+            break;
+        }
+        return h->entries;
+    }
+
+    while(h->entries > 0)
+    {
+        ext2_extent_idx_t *x = &EXT2_EXT_INDEX(h)[h->entries - 1];
+        bcache_buf_t *buf = bcache_get(fs->bcache, x->child);
+        if(buf == NULL)
+        {
+            return -1;
+        }
+        int64_t left = ext2_ext_truncate_node(fs, (ext2_extent_header_t*)buf->data, n);
+        bcache_mark_dirty(fs->bcache, buf);
+        bcache_put(fs->bcache, buf);
+        if(left < 0)
+        {
+            return -1;
+        }
+        if(left > 0)
+        {
+            break; // 这个子树还有n之前的块，前面的兄弟都在n之前
+        }
+        ext2_free_block(fs, x->child);
+        h->entries--;
+    }
+    return h->entries;
+}
+
+
+/*
+ * 计算逻辑块在直接/间接块中的位置。
+ * off[0]是blk_idx的下标，off[1..depth]是各级间接块中的下标。
+ * 返回间接的级数depth（直接块为0），超出能表示的范围返回-1。
+ */
+static int64_t ext2_ind_path(ext2_fs_t *fs, uint64_t lblk, uint64_t off[4])
+{
+    const uint64_t p = EXT2_PTRS_PER_BLOCK(fs);
+    if(lblk < EXT2_NDIR_BLOCKS)
+    {
+        off[0] = lblk;
+        return 0;
+    }
+    lblk -= EXT2_NDIR_BLOCKS;
+    if(lblk < p)
+    {
+        off[0] = EXT2_IND_BLOCK;
+        off[1] = lblk;
+        return 1;
+    }
+    lblk -= p;
+    if(lblk < p*p)
+    {
+        off[0] = EXT2_DIND_BLOCK;
+        off[1] = lblk / p;
+        off[2] = lblk % p;
+        return 2;
+    }
+    lblk -= p*p;
+    if(lblk < p*p*p)
+    {
+        off[0] = EXT2_TIND_BLOCK;
+        off[1] = lblk / (p*p);
+        off[2] = lblk / p % p;
+        off[3] = lblk % p;
+        return 3;
+    }
+    return -1;
+}
+
+
+/**
+ * @brief 分配从level级到depth级缺少的间接块，并沿off把它们连成一条链
+ *
+ * 整条链都建好后才由调用者挂到上一级，中途分配失败时释放这次分配的块，不会留下挂在映射上的空间接块。
+ *
+ * @param top 返回链头（level级间接块）的块号
+ *
+ * @return 成功返回0，失败返回负数。
+ */
+static int64_t ext2_ind_grow(ext2_fs_t *fs, uint64_t inode_idx, const uint64_t off[4], int64_t level, int64_t depth, uint64_t *top)
+{
+    uint64_t nb[3];
+    int64_t num = depth - level + 1;
+    int64_t ret = SUCCESS, got = 0;
+    for(;got<num;got++)
+    {
+        ret = ext2_alloc_meta_block(fs, inode_idx);
+        if(ret < 0)
+        {
+            break;
+        }
+        nb[got] = (uint64_t)ret;
+    }
+    for(int64_t i = num-1;got == num && i>=0;i--)
+    {
+        bcache_buf_t *zb = bcache_get_new(fs->bcache, nb[i]); // 新间接块全为0
+        if(zb == NULL)
+        {
+            ret = -1;
+            break;
+        }
+        if(i+1 < num)
+        {
+            ((uint64_t*)zb->data)[off[level+i]] = nb[i+1];
+            bcache_mark_dirty(fs->bcache, zb);
+        }
+        bcache_put(fs->bcache, zb);
+    }
+    if(ret < 0)
+    {
+        for(int64_t i = 0;i<got;i++)
+        {
+            ext2_free_block(fs, nb[i]);
+        }
+        return ret;
+    }
+    *top = nb[0];
+    return SUCCESS;
+}
+
+
+/**
+ * @brief 找到保存逻辑块lblk物理块号的位置
+ *
+ * 最后一级间接块记在fs->map_cache里，同一个间接块覆盖的逻辑块再查时直接从缓存块取，不再逐级查找。
+ *
+ * @param create 为1时沿途缺少的间接块会被分配
+ * @param buf_ret 位置在间接块中时返回该缓存块（调用者负责bcache_put，修改后要标脏），在inode中时返回NULL
+ * @param slot_ret 返回指向该位置的指针
+ *
+ * @return 成功返回0，没有映射返回ERROR_NOT_FOUND，其他错误返回负数。
+ */
+static int64_t ext2_ind_slot(ext2_fs_t *fs, uint64_t inode_idx, uint64_t lblk, int create, bcache_buf_t **buf_ret, uint64_t **slot_ret)
+{
+    ext2_inode_t *inode = &fs->inode_table[inode_idx];
+    uint64_t off[4];
+    int64_t depth = ext2_ind_path(fs, lblk, off);
+    if(depth < 0)
+    {
+        return ERROR_INDEX_OUT_OF_BOUNDS;
+    }
+    *buf_ret = NULL;
+    if(depth == 0)
+    {
+        *slot_ret = &inode->blk_idx[off[0]];
+        return SUCCESS;
+    }
+
+    ext2_map_cache_t *mc = &fs->map_cache;
+    uint64_t leaf_base = lblk - off[depth];
+    uint64_t blk = 0;
+    pthread_mutex_lock(&fs->map_lock);
+    if(mc->blk != 0 && mc->inode_idx == inode_idx && mc->base == leaf_base)
+    {
+        blk = mc->blk;
+    }
+    pthread_mutex_unlock(&fs->map_lock);
+    if(blk == 0)
+    {
+        uint64_t *slot = &inode->blk_idx[off[0]];
+        bcache_buf_t *buf = NULL;
+        for(int64_t level = 1;;level++)
+        {
+            if(*slot == 0)
+            {
+                uint64_t nb = 0;
+                int64_t ret = create ? ext2_ind_grow(fs, inode_idx, off, level, depth, &nb) : ERROR_NOT_FOUND;
+                if(ret < 0)
+                {
+                    bcache_put(fs->bcache, buf);
+                    return ret;
+                }
+                *slot = nb;
+                if(buf != NULL)
+                {
+                    bcache_mark_dirty(fs->bcache, buf);
+                }
+                else
+                {
+                    ext2_mark_inode_dirty(fs, inode_idx);
+                }
+            }
+            blk = *slot;
+            if(level == depth)
+            {
+                break;
+            }
+            bcache_buf_t *next = bcache_get(fs->bcache, blk);
+            bcache_put(fs->bcache, buf);
+            buf = next;
+            if(buf == NULL)
+            {
+                return -1;
+            }
+            slot = &((uint64_t*)buf->data)[off[level]];
+        }
+        bcache_put(fs->bcache, buf);
+        pthread_mutex_lock(&fs->map_lock);
+        mc->inode_idx = inode_idx;
+        mc->base = leaf_base;
+        mc->blk = blk;
+        pthread_mutex_unlock(&fs->map_lock);
+    }
+
+    bcache_buf_t *leaf = bcache_get(fs->bcache, blk);
+    if(leaf == NULL)
+    {
+        return -1;
+    }
+    *buf_ret = leaf;
+    *slot_ret = &((uint64_t*)leaf->data)[off[depth]];
+    return SUCCESS;
+}
+
+
+/**
+ * @brief 用直接/间接块映射逻辑块
+ *
+ * len返回同一个间接块（或直接块数组）中从lblk开始物理连续的块数。
+ */
+static int64_t ext2_ind_bmap(ext2_fs_t *fs, ext2_inode_t *inode, uint64_t lblk, uint64_t *pblk, uint64_t *len)
+{
+    bcache_buf_t *buf;
+    uint64_t *slot;
+    int64_t ret = ext2_ind_slot(fs, (uint64_t)(inode - fs->inode_table), lblk, 0, &buf, &slot);
+    if(ret < 0)
+    {
+        return ret;
+    }
+    if(*slot == 0)
+    {
+        bcache_put(fs->bcache, buf);
+        return ERROR_NOT_FOUND;
+    }
+    uint64_t limit = buf == NULL ? EXT2_NDIR_BLOCKS - lblk : EXT2_PTRS_PER_BLOCK(fs) - (uint64_t)(slot - (uint64_t*)buf->data);
+    uint64_t n = 1;
+    while(n < limit && slot[n] == slot[0] + n)
+    {
+        n++;
+    }
+    *pblk = slot[0];
+    *len = n;
+    bcache_put(fs->bcache, buf);
+    return SUCCESS;
+}
+
+
+/**
+ * @brief 把物理块pblk开始的最多len个块依次映射到逻辑块lblk开始的位置
+ *
+ * 一次只填一个间接块（或直接块数组）里的位置。
+ *
+ * @return 成功返回映射的块数，失败返回-1。
+ */
+static int64_t ext2_ind_append(ext2_fs_t *fs, uint64_t inode_idx, uint64_t lblk, uint64_t pblk, uint64_t len)
+{
+    bcache_buf_t *buf;
+    uint64_t *slot;
+    if(ext2_ind_slot(fs, inode_idx, lblk, 1, &buf, &slot) < 0)
+    {
+        return -1;
+    }
+    uint64_t limit = buf == NULL ? EXT2_NDIR_BLOCKS - lblk : EXT2_PTRS_PER_BLOCK(fs) - (uint64_t)(slot - (uint64_t*)buf->data);
+    uint64_t n = len < limit ? len : limit;
+    for(uint64_t i = 0;i<n;i++)
+    {
+        slot[i] = pblk + i;
+    }
+    if(buf != NULL)
+    {
+        bcache_mark_dirty(fs->bcache, buf);
+        bcache_put(fs->bcache, buf);
+    }
+    else
+    {
+        ext2_mark_inode_dirty(fs, inode_idx);
+    }
+    return (int64_t)n;
+}
+
+
+/*
+ * 释放以blk为根的level级间接块中逻辑块号>=n的部分，base是它覆盖的第一个逻辑块。
+ * 整个间接块都在n之后时连同它本身一起释放并返回1，否则返回0，读盘失败返回-1。
+ */
+static int64_t ext2_ind_truncate_tree(ext2_fs_t *fs, uint64_t blk, uint64_t level, uint64_t base, uint64_t n)
+{
+    uint64_t span = 1;
+    for(uint64_t i = 1;i<level;i++)
+    {
+        span *= EXT2_PTRS_PER_BLOCK(fs);
+    }
+    bcache_buf_t *buf = bcache_get(fs->bcache, blk);
+    if(buf == NULL)
+    {
+        return -1;
+    }
+    uint64_t *ptr = (uint64_t*)buf->data;
+    int64_t ret = 0;
+    for(uint64_t i = 0;i<EXT2_PTRS_PER_BLOCK(fs) && ret==0;i++)
+    {
+        uint64_t start = base + i * span;
+        if(ptr[i] == 0 || start + span <= n)
+        {
+            continue;
+        }
+        if(level == 1)
+        {
+            ext2_free_block(fs, ptr[i]);
+            ptr[i] = 0;
+            continue;
+        }
+        ret = ext2_ind_truncate_tree(fs, ptr[i], level - 1, start, n);
+        if(ret == 1)
+        {
+            ptr[i] = 0;
+            ret = 0;
+        }
+    }
+    bcache_mark_dirty(fs->bcache, buf);
+    bcache_put(fs->bcache, buf);
+    if(ret < 0)
+    {
+        return -1;
+    }
+    if(base >= n)
+    {
+        ext2_free_block(fs, blk);
+        return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief 把直接/间接块映射的文件截断到n个块
+ *
+ * @return 成功返回0，失败返回-1。
+ */
+static int64_t ext2_ind_truncate(ext2_fs_t *fs, uint64_t inode_idx, uint64_t n)
+{
+    ext2_inode_t *inode = &fs->inode_table[inode_idx];
+    for(uint64_t i = n;i<EXT2_NDIR_BLOCKS;i++)
+    {
+        if(inode->blk_idx[i] != 0)
+        {
+            ext2_free_block(fs, inode->blk_idx[i]);
+            inode->blk_idx[i] = 0;
+        }
+    }
+
+    uint64_t base = EXT2_NDIR_BLOCKS, span = EXT2_PTRS_PER_BLOCK(fs);
+    int64_t ret = 0;
+    for(uint64_t level = 1;level<=3 && ret>=0;level++)
+    {
+        uint64_t *slot = &inode->blk_idx[EXT2_IND_BLOCK + level - 1];
+        if(*slot != 0 && base + span > n)
+        {
+            ret = ext2_ind_truncate_tree(fs, *slot, level, base, n);
+            if(ret == 1)
+            {
+                *slot = 0;
+            }
+        }
+        base += span;
+        span *= EXT2_PTRS_PER_BLOCK(fs);
+    }
+
+    // 缓存的间接块可能已经被释放
+    pthread_mutex_lock(&fs->map_lock);
+    if(fs->map_cache.inode_idx == inode_idx)
+    {
+        fs->map_cache.blk = 0;
+    }
+    pthread_mutex_unlock(&fs->map_lock);
+    return ret < 0 ? -1 : 0;
+}
+
+
+/**
+ * @brief 初始化inode的块映射，新inode没有任何块
+ *
+ * 文件系统开启EXT2_FEATURE_EXTENTS时用extent树，否则用直接/间接块。
+ */
+static void ext2_map_init(ext2_fs_t *fs, ext2_inode_t *inode)
+{
+    inode->blocks = 0;
+    memset(inode->blk_idx, 0, sizeof(inode->blk_idx));
+    if(fs->super->features & EXT2_FEATURE_EXTENTS)
+    {
+        inode->flags = EXT2_INODE_EXTENTS;
+        ext2_ext_init_node((ext2_extent_header_t*)inode->blk_idx, EXT2_EXT_ROOT_MAX, 0);
+    }
+    else
+    {
+        inode->flags = 0;
+    }
+}
+
+
+/**
+ * @brief 把逻辑块映射成物理块
+ *
+ * @param fs 指向ext2文件系统的指针
+ * @param inode 文件的inode
+ * @param lblk 逻辑块号
+ * @param pblk 返回物理块号
+ * @param len 返回从lblk开始物理上连续的块数，可以据此一次传输多个块
+ *
+ * @return 成功返回0，失败返回负数。
+ */
+static int64_t ext2_bmap(ext2_fs_t *fs, ext2_inode_t *inode, uint64_t lblk, uint64_t *pblk, uint64_t *len)
+{
+    if(lblk >= inode->blocks)
+    {
+        return ERROR_INDEX_OUT_OF_BOUNDS;
+    }
+    if(inode->flags & EXT2_INODE_EXTENTS)
+    {
+        ext2_extent_t e;
+        int64_t ret = ext2_ext_find(fs, inode, lblk, &e);
+        if(ret < 0)
+        {
+            return ret;
+        }
+        *pblk = e.pblk + (lblk - e.lblk);
+        *len = e.lblk + e.len - lblk;
+    }
+    else
+    {
+        int64_t ret = ext2_ind_bmap(fs, inode, lblk, pblk, len);
+        if(ret < 0)
+        {
+            return ret;
+        }
+    }
+    if(*len > inode->blocks - lblk)
+    {
+        *len = inode->blocks - lblk;
+    }
+    return SUCCESS;
+}
+
+
+/**
+ * @brief 带缓存的ext2_bmap
+ *
+ * lblk落在上次取到的物理连续段中时直接算出结果。块只会在截断时被释放，
+ * 截断会改变fs->map_gen，所以缓存的段在gen不变时一直有效。
+ *
+ * @param hint 为NULL时等同于ext2_bmap；只在取结果和记结果时加它的锁，查找本身不持有
+ */
+static int64_t ext2_bmap_hint(ext2_fs_t *fs, ext2_inode_t *inode, uint64_t lblk, uint64_t *pblk, uint64_t *len, ext2_map_hint_t *hint)
+{
+    uint64_t gen = __atomic_load_n(&fs->map_gen, __ATOMIC_ACQUIRE);
+    if(hint != NULL)
+    {
+        pthread_mutex_lock(&hint->lock);
+        int hit = hint->len > 0 && hint->gen == gen && lblk >= hint->lblk && lblk < hint->lblk + hint->len;
+        if(hit)
+        {
+            *pblk = hint->pblk + (lblk - hint->lblk);
+            *len = hint->len - (lblk - hint->lblk);
+        }
+        pthread_mutex_unlock(&hint->lock);
+        if(hit)
+        {
+            return SUCCESS;
+        }
+    }
+    int64_t ret = ext2_bmap(fs, inode, lblk, pblk, len);
+    if(ret == SUCCESS && hint != NULL)
+    {
+        pthread_mutex_lock(&hint->lock);
+        hint->gen = gen;
+        hint->lblk = lblk;
+        hint->pblk = *pblk;
+        hint->len = *len;
+        pthread_mutex_unlock(&hint->lock);
+    }
+    return ret;
+}
+
+
+/**
+ * @brief 把物理块[pblk,pblk+len)映射到文件末尾
+ *
+ * 失败时inode->blocks停在已经映射成功的位置。
+ *
+ * @return 成功返回0，失败返回-1。
+ */
+static int64_t ext2_map_append(ext2_fs_t *fs, uint64_t inode_idx, uint64_t pblk, uint64_t len)
+{
+    ext2_inode_t *inode = &fs->inode_table[inode_idx];
+    assert(inode->blocks + len <= EXT2_MAX_FILE_BLOCKS,return -1;);
+    while(len > 0)
+    {
+        uint64_t n;
+        if(inode->flags & EXT2_INODE_EXTENTS)
+        {
+            n = len < EXT2_EXT_MAX_LEN ? len : EXT2_EXT_MAX_LEN;
+            assert(ext2_ext_append(fs, inode_idx, inode->blocks, pblk, n) == 0,return -1;);
+        }
+        else
+        {
+            int64_t ret = ext2_ind_append(fs, inode_idx, inode->blocks, pblk, len);
+            assert(ret > 0,return -1;);
+            n = (uint64_t)ret;
+        }
+        inode->blocks += n;
+        pblk += n;
+        len -= n;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief 把文件截断到n个块，释放后面的数据块和不再需要的映射块
+ *
+ * @return 成功返回0，还有没释放的视图时返回ERROR_BUSY，其他失败返回-1。
+ */
+static int64_t ext2_map_truncate(ext2_fs_t *fs, uint64_t inode_idx, uint64_t n)
+{
+    ext2_inode_t *inode = &fs->inode_table[inode_idx];
+    if(n >= inode->blocks)
+    {
+        return 0;
+    }
+    if(__atomic_load_n(&fs->view_count[inode_idx], __ATOMIC_ACQUIRE) > 0)
+    {
+        return ERROR_BUSY; // 视图可能直接指向要释放的块，释放后块会被别的文件复用
+    }
+    int64_t ret;
+    if(inode->flags & EXT2_INODE_EXTENTS)
+    {
+        ext2_extent_header_t *root = (ext2_extent_header_t*)inode->blk_idx;
+        ret = ext2_ext_truncate_node(fs, root, n);
+        if(ret == 0 && root->depth > 0)
+        {
+            ext2_ext_init_node(root, EXT2_EXT_ROOT_MAX, 0);
+        }
+    }
+    else
+    {
+        ret = ext2_ind_truncate(fs, inode_idx, n);
+    }
+    inode->blocks = (uint32_t)n;
+    __atomic_fetch_add(&fs->map_gen, 1, __ATOMIC_RELEASE);
+    ext2_mark_inode_dirty(fs, inode_idx);
+    return ret < 0 ? -1 : 0;
+}
+
+
+/**
+ * @brief 给inode分配数据块，直到映射了to个块
+ *
+ * 新块尽量连续，并且紧跟在文件现有的最后一个块后面。
+ *
+ * @return 成功返回0，失败返回-1。
+ */
+static int64_t ext2_alloc_file_blocks(ext2_fs_t *fs, uint64_t inode_idx, uint64_t to)
+{
+    ext2_inode_t *inode = &fs->inode_table[inode_idx];
+    while(inode->blocks < to)
+    {
+        uint64_t goal = fs->group[inode_idx / fs->super->inodes_per_group].data_block_start_idx, len; // 第一个块放在inode所在的组
+        if(inode->blocks > 0 && ext2_bmap(fs, inode, inode->blocks - 1, &goal, &len) == 0)
+        {
+            goal++;
+        }
+        uint64_t got = 0;
+        int64_t ret = ext2_alloc_blocks(fs, to - inode->blocks, goal, &got);
+        assert(ret>=0,return -1;);
+        uint64_t before = inode->blocks;
+        if(ext2_map_append(fs, inode_idx, (uint64_t)ret, got) < 0)
+        {
+            uint64_t mapped = inode->blocks - before;
+            ext2_free_blocks(fs, (uint64_t)ret + mapped, got - mapped);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * @brief 读取一组数据段
+ *
+ * 每段整段交给磁盘，块缓存中的块可能比磁盘上的新，读完后覆盖到对应位置。
+ *
+ * @return 成功返回0，失败返回-1。
+ */
+static int64_t ext2_data_readv(ext2_fs_t *fs, const disk_iovec_t *iov, uint64_t iovcnt)
+{
+    if(disk_readv(fs->disk, iov, iovcnt) < 0)
+    {
+        return -1;
+    }
+    for(uint64_t i = 0;i<iovcnt;i++)
+    {
+        bcache_read_cached(fs->bcache, iov[i].sector, iov[i].count, iov[i].buf);
+    }
+    return 0;
+}
+
+
+/**
+ * @brief 绕过块缓存直接写一组数据段，缓存中已有的副本同步更新
+ *
+ * @return 成功返回0，失败返回-1。
+ */
+static int64_t ext2_data_writev(ext2_fs_t *fs, const disk_iovec_t *iov, uint64_t iovcnt)
+{
+    if(disk_writev(fs->disk, iov, iovcnt) < 0)
+    {
+        return -1;
+    }
+    for(uint64_t i = 0;i<iovcnt;i++)
+    {
+        bcache_update(fs->bcache, iov[i].sector, iov[i].count, iov[i].buf);
+    }
+    return 0;
+}
+
+
+/**
+ * @brief 读写文件从逻辑块lblk开始的num个整块
+ *
+ * 每个物理连续的extent只产生一段传输，攒够一批一起提交。
+ *
+ * @param buf 连续存放这num个块的数据
+ * @param write 为1时写，为0时读
+ * @param hint 文件句柄的块映射缓存，可以为NULL
+ *
+ * @return 成功返回0，失败返回-1。
+ */
+static int64_t ext2_file_rw(ext2_fs_t *fs, ext2_inode_t *inode, uint64_t lblk, uint64_t num, void *buf, int write, ext2_map_hint_t *hint)
+{
+    disk_iovec_t iov[EXT2_IOV_BATCH];
+    uint64_t n = 0;
+    uint8_t *p = (uint8_t*)buf;
+    while(num > 0)
+    {
+        uint64_t pblk, len;
+        if(ext2_bmap_hint(fs, inode, lblk, &pblk, &len, hint) < 0)
+        {
+            return -1;
+        }
+        if(len > num)
+        {
+            len = num;
+        }
+        iov[n++] = (disk_iovec_t){pblk, len, p};
+        lblk += len;
+        num -= len;
+        p += len * fs->block_size;
+        if(n == EXT2_IOV_BATCH || num == 0)
+        {
+            int64_t ret = write ? ext2_data_writev(fs, iov, n) : ext2_data_readv(fs, iov, n);
+            if(ret < 0)
+            {
+                return -1;
+            }
+            n = 0;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * @brief 覆盖写数据到指定inode的文件
+ *
+ * 该函数用于将数据覆盖写到指定inode的文件中，并更新inode的大小和修改时间。
+ *
+ * @param fs 指向ext2文件系统的指针
+ * @param inode_idx 要覆盖写数据的inode索引
+ * @param data 要覆盖写的数据
+ * @param size 要覆盖写的数据大小
+ *
+ * @return 成功返回0，失败返回-1。
+ */
+int64_t ext2_overwrite_file(ext2_fs_t *fs, uint64_t inode_idx, const void *data, uint64_t size)
+{
+    assert(fs!=NULL,return -1;);
+    
+    assert(inode_idx<fs->super->inodes_count,return -1;);
+    assert(data!=NULL,return -1;);
+
+    ext2_inode_t *inode = &fs->inode_table[inode_idx];
+    uint64_t blocks_needed = (size + fs->block_size - 1) / fs->block_size;
+    assert(blocks_needed<=EXT2_MAX_FILE_BLOCKS&&blocks_needed<=inode->blocks+ext2_free_blocks_count(fs),return -1;);
+
+    if(blocks_needed <= inode->blocks)
+    {
+        // 将多余的空间释放
+        assert(ext2_map_truncate(fs, inode_idx, blocks_needed)==0,return -1;);
+    }
+    else
+    {
+        // 多出来的部分分配空间
+        assert(ext2_alloc_file_blocks(fs, inode_idx, blocks_needed)==0,return -1;);
+    }
+
+    // 整块按extent直接从data写出；最后不满一块的部分放进块缓存里补零，避免越过data末尾，后续追加也能直接命中
+    uint64_t full_blocks = size / fs->block_size;
+    if(ext2_file_rw(fs, inode, 0, full_blocks, (void*)data, 1, NULL) < 0)
+    {
+        return -1;
+    }
+    if(full_blocks < blocks_needed)
+    {
+        uint64_t pblk, len;
+        assert(ext2_bmap(fs, inode, full_blocks, &pblk, &len)==0,return -1;);
+        bcache_buf_t *tail = bcache_get_new(fs->bcache, pblk);
+        assert(tail!=NULL,return -1;);
+        memcpy(tail->data, (const uint8_t*)data+full_blocks*fs->block_size, size-full_blocks*fs->block_size);
+        bcache_mark_data(fs->bcache, tail);
+        bcache_put(fs->bcache, tail);
+    }
+
+    fs->inode_table[inode_idx].size = size;
+    fs->inode_table[inode_idx].ctime++;
+
+    ext2_mark_inode_dirty(fs, inode_idx);
+    return 0;
+
+}
+
+
+/**
+ * @brief 追加数据到指定inode的文件
+ *
+ * 该函数用于将数据追加到指定inode的文件中，并更新inode的大小和修改时间。
+ *
+ * @param fs 指向ext2文件系统的指针
+ * @param inode_idx 要追加数据的inode索引
+ * @param data 要追加的数据
+ * @param size 要追加的数据大小
+ *
+ * @return 成功返回0，失败返回-1。
+ */
+int64_t ext2_append_file(ext2_fs_t *fs, uint64_t inode_idx, const void *data, uint64_t size)
+{
+    assert(fs!=NULL,return -1;);
+    assert(inode_idx<fs->super->inodes_count,return -1;);
+    assert(data!=NULL,return -1;);
+
+    ext2_inode_t *dir_inode = &fs->inode_table[inode_idx];
+    if(size == 0)
+    {
+        return 0;
+    }
+    // 计算追加之后需要的块数
+    uint64_t blocks_needed = (dir_inode->size + size + fs->block_size - 1) / fs->block_size;
+    assert(blocks_needed<=EXT2_MAX_FILE_BLOCKS&&blocks_needed<=dir_inode->blocks+ext2_free_blocks_count(fs),return -1;);
+
+    // 多出来的部分分配空间
+    assert(ext2_alloc_file_blocks(fs, inode_idx, blocks_needed)==0,return -1;);
+
+    const uint8_t *data_ptr = (const uint8_t*)data;
+    uint64_t remain = size;
+    uint64_t blk = dir_inode->size / fs->block_size; // 第一个要写的块
+    uint64_t append_in_which_byte = dir_inode->size % fs->block_size; // 追加到这个块的哪个字节
+    uint64_t pblk, len;
+
+    // 最后一个块没写满，在块缓存里拼上新数据，反复追加的末尾块一直留在缓存中
+    if(append_in_which_byte != 0)
+    {
+        uint64_t n = fs->block_size - append_in_which_byte;
+        if(n > remain)
+        {
+            n = remain;
+        }
+        assert(ext2_bmap(fs, dir_inode, blk++, &pblk, &len)==0,return -1;);
+        bcache_buf_t *head = bcache_get(fs->bcache, pblk);
+        assert(head!=NULL,return -1;);
+        memcpy(head->data + append_in_which_byte, data_ptr, n);
+        bcache_mark_data(fs->bcache, head);
+        bcache_put(fs->bcache, head);
+        data_ptr += n;
+        remain -= n;
+    }
+    // 中间的整块按extent直接从data写出
+    uint64_t full_blocks = remain / fs->block_size;
+    if(ext2_file_rw(fs, dir_inode, blk, full_blocks, (void*)data_ptr, 1, NULL) < 0)
+    {
+        return -1;
+    }
+    blk += full_blocks;
+    data_ptr += full_blocks * fs->block_size;
+    remain -= full_blocks * fs->block_size;
+    // 末尾不满一块的部分放进块缓存，剩余部分为零
+    if(remain > 0)
+    {
+        assert(ext2_bmap(fs, dir_inode, blk, &pblk, &len)==0,return -1;);
+        bcache_buf_t *tail = bcache_get_new(fs->bcache, pblk);
+        assert(tail!=NULL,return -1;);
+        memcpy(tail->data, data_ptr, remain);
+        bcache_mark_data(fs->bcache, tail);
+        bcache_put(fs->bcache, tail);
+    }
+        
+    dir_inode->size += size;
+    dir_inode->ctime++;
+    // 更新目录的inode信息
+    ext2_mark_inode_dirty(fs, inode_idx);
+
+    return 0;
+
+}
+
+
+/**
+ * @brief 读文件中[off, off+len)的内容，超过文件末尾的部分不读
+ *
+ * 不满一块的头尾经过块缓存，只拷贝需要的字节；中间的整块按extent直接读进buf。
+ *
+ * @param hint 块映射缓存，可以为NULL
+ *
+ * @return 成功返回实际读到的字节数，off在文件末尾之后返回0，失败返回-1。
+ */
+static int64_t ext2_file_pread(ext2_fs_t *fs, uint64_t inode_idx, void *buf, uint64_t len, uint64_t off, ext2_map_hint_t *hint)
+{
+    ext2_inode_t *inode = &fs->inode_table[inode_idx];
+    if(off >= inode->size)
+    {
+        return 0;
+    }
+    if(len > inode->size - off)
+    {
+        len = inode->size - off;
+    }
+
+    uint8_t *p = (uint8_t*)buf;
+    uint64_t pos = off;
+    uint64_t remain = len;
+    while(remain > 0)
+    {
+        uint64_t boff = pos % fs->block_size;
+        if(boff == 0 && remain >= fs->block_size)
+        {
+            // 中间的整块
+            uint64_t full = remain / fs->block_size;
+            if(ext2_file_rw(fs, inode, pos / fs->block_size, full, p, 0, hint) < 0)
+            {
+                return -1;
+            }
+            p += full * fs->block_size;
+            pos += full * fs->block_size;
+            remain -= full * fs->block_size;
+            continue;
+        }
+        // 头或尾不满一块
+        uint64_t n = fs->block_size - boff;
+        if(n > remain)
+        {
+            n = remain;
+        }
+        uint64_t pblk, blen;
+        assert(ext2_bmap_hint(fs, inode, pos / fs->block_size, &pblk, &blen, hint)==0,return -1;);
+        bcache_buf_t *b = bcache_get(fs->bcache, pblk);
+        assert(b!=NULL,return -1;);
+        memcpy(p, b->data + boff, n);
+        bcache_put(fs->bcache, b);
+        p += n;
+        pos += n;
+        remain -= n;
+    }
+    return (int64_t)len;
+}
+
+
+/**
+ * @brief 把文件中[off, off+len)的内容以只读视图的形式交给调用者，不拷贝数据
+ *
+ * 磁盘是内存或映射后端时，视图直接指向磁盘映像，一个物理连续段只占一个视图；
+ * 块缓存中有比磁盘新的脏块时改为指向缓存块。其他后端逐块指向块缓存。
+ * 指向缓存块的视图会引用该块，必须用ext2_unpin_views释放。
+ *
+ * @param views 存放视图的数组
+ * @param max 数组大小，视图不够时只返回前面一部分，调用者从后面接着取
+ *
+ * @return 成功返回视图个数，off在文件末尾之后返回0，失败返回-1。
+ */
+static int64_t ext2_file_views(ext2_fs_t *fs, uint64_t inode_idx, uint64_t off, uint64_t len, ext2_view_t *views, uint64_t max, ext2_map_hint_t *hint)
+{
+    ext2_inode_t *inode = &fs->inode_table[inode_idx];
+    if(off >= inode->size)
+    {
+        return 0;
+    }
+    if(len > inode->size - off)
+    {
+        len = inode->size - off;
+    }
+
+    uint8_t *base = fs->disk->base;
+    uint64_t n = 0;
+    uint64_t pos = off;
+    uint64_t end = off + len;
+    while(pos < end && n < max)
+    {
+        uint64_t boff = pos % fs->block_size;
+        uint64_t pblk, blen;
+        if(ext2_bmap_hint(fs, inode, pos / fs->block_size, &pblk, &blen, hint) < 0)
+        {
+            break;
+        }
+
+        bcache_buf_t *b = NULL;
+        uint64_t run = 0; // 可以直接指向磁盘映像的块数
+        if(base != NULL)
+        {
+            for(;run<blen;run++)
+            {
+                b = bcache_lookup(fs->bcache, pblk + run);
+                if(b != NULL && (b->flags & BCACHE_DIRTY))
+                {
+                    break;
+                }
+                bcache_put(fs->bcache, b);
+                b = NULL;
+                if(pos - boff + (run + 1) * fs->block_size >= end)
+                {
+                    run++;
+                    break;
+                }
+            }
+        }
+
+        uint64_t span;
+        if(run > 0)
+        {
+            bcache_put(fs->bcache, b);
+            span = run * fs->block_size - boff;
+            views[n].data = base + pblk * fs->block_size + boff;
+            views[n].pin = NULL;
+        }
+        else
+        {
+            if(b == NULL)
+            {
+                b = bcache_get(fs->bcache, pblk);
+                if(b == NULL)
+                {
+                    break; // 缓存块都被引用了
+                }
+            }
+            span = fs->block_size - boff;
+            views[n].data = b->data + boff;
+            views[n].pin = b;
+        }
+        if(span > end - pos)
+        {
+            span = end - pos;
+        }
+        views[n].len = span;
+        n++;
+        pos += span;
+    }
+
+    if(n == 0 && pos < end)
+    {
+        return -1;
+    }
+    return (int64_t)n;
+}
+
+
+/**
+ * @brief 把文件中[from, to)清零，用于写入位置在文件末尾之后时填补中间的空洞
+ *
+ * 调用前这些块已经分配好，from是原来的文件大小，from之后的块整块清零，不读盘。
+ */
+static int64_t ext2_file_zero(ext2_fs_t *fs, ext2_inode_t *inode, uint64_t from, uint64_t to, ext2_map_hint_t *hint)
+{
+    uint64_t old_size = from;
+    while(from < to)
+    {
+        uint64_t boff = from % fs->block_size;
+        uint64_t n = fs->block_size - boff;
+        if(n > to - from)
+        {
+            n = to - from;
+        }
+        uint64_t pblk, blen;
+        assert(ext2_bmap_hint(fs, inode, from / fs->block_size, &pblk, &blen, hint)==0,return -1;);
+        bcache_buf_t *b = from - boff >= old_size ? bcache_get_new(fs->bcache, pblk) : bcache_get(fs->bcache, pblk);
+        assert(b!=NULL,return -1;);
+        memset(b->data + boff, 0, n);
+        bcache_mark_data(fs->bcache, b);
+        bcache_put(fs->bcache, b);
+        from += n;
+    }
+    return 0;
+}
+
+
+/**
+ * @brief 把一组缓冲区依次写到文件off开始的位置，需要时扩展文件
+ *
+ * 所有片段首尾相接，一次分配完需要的块，最后只更新一次inode。
+ * 写入位置在文件末尾之后时中间补零。片段中连续的整块按extent直接写出；
+ * 不满一块或跨片段的块在块缓存里拼好，原来没有数据的块不用从磁盘读。
+ *
+ * @param hint 块映射缓存，可以为NULL
+ *
+ * @return 成功返回写入的字节数，失败返回-1。
+ */
+static int64_t ext2_file_pwritev(ext2_fs_t *fs, uint64_t inode_idx, const ext2_iovec_t *iov, uint64_t iovcnt, uint64_t off, ext2_map_hint_t *hint)
+{
+    ext2_inode_t *inode = &fs->inode_table[inode_idx];
+    uint64_t len = 0;
+    for(uint64_t i=0;i<iovcnt;i++)
+    {
+        assert(iov[i].base!=NULL||iov[i].len==0,return -1;);
+        assert(len + iov[i].len >= len,return -1;);
+        len += iov[i].len;
+    }
+    if(len == 0)
+    {
+        return 0;
+    }
+    assert(off + len > off,return -1;);
+    uint64_t old_size = inode->size;
+    uint64_t blocks_needed = (off + len + fs->block_size - 1) / fs->block_size;
+    if(blocks_needed > inode->blocks)
+    {
+        assert(blocks_needed<=EXT2_MAX_FILE_BLOCKS&&blocks_needed<=inode->blocks+ext2_free_blocks_count(fs),return -1;);
+        assert(ext2_alloc_file_blocks(fs, inode_idx, blocks_needed)==0,return -1;);
+    }
+    if(off > old_size)
+    {
+        assert(ext2_file_zero(fs, inode, old_size, off, hint)==0,return -1;);
+    }
+
+    uint64_t vi = 0;   // 当前片段
+    uint64_t voff = 0; // 当前片段中已经写了的字节数
+    uint64_t pos = off;
+    uint64_t remain = len;
+    while(remain > 0)
+    {
+        while(voff == iov[vi].len)
+        {
+            vi++;
+            voff = 0;
+        }
+        const uint8_t *p = (const uint8_t*)iov[vi].base + voff;
+        uint64_t boff = pos % fs->block_size;
+        if(boff == 0 && iov[vi].len - voff >= fs->block_size)
+        {
+            // 当前片段中连续的整块
+            uint64_t full = (iov[vi].len - voff) / fs->block_size;
+            if(ext2_file_rw(fs, inode, pos / fs->block_size, full, (void*)p, 1, hint) < 0)
+            {
+                return -1;
+            }
+            voff += full * fs->block_size;
+            pos += full * fs->block_size;
+            remain -= full * fs->block_size;
+            continue;
+        }
+        uint64_t n = fs->block_size - boff;
+        if(n > remain)
+        {
+            n = remain;
+        }
+        uint64_t pblk, blen;
+        assert(ext2_bmap_hint(fs, inode, pos / fs->block_size, &pblk, &blen, hint)==0,return -1;);
+        // 块里原来没有数据时不用读盘，清零后直接写
+        uint64_t block_start = pos - boff;
+        bcache_buf_t *b = block_start >= old_size ? bcache_get_new(fs->bcache, pblk) : bcache_get(fs->bcache, pblk);
+        assert(b!=NULL,return -1;);
+        // 这一块可能由几个片段拼成
+        for(uint64_t done = 0;done < n;)
+        {
+            while(voff == iov[vi].len)
+            {
+                vi++;
+                voff = 0;
+            }
+            uint64_t m = iov[vi].len - voff;
+            if(m > n - done)
+            {
+                m = n - done;
+            }
+            memcpy(b->data + boff + done, (const uint8_t*)iov[vi].base + voff, m);
+            voff += m;
+            done += m;
+        }
+        bcache_mark_data(fs->bcache, b);
+        bcache_put(fs->bcache, b);
+        pos += n;
+        remain -= n;
+    }
+
+    if(off + len > inode->size)
+    {
+        inode->size = off + len;
+    }
+    inode->ctime++;
+    ext2_mark_inode_dirty(fs, inode_idx);
+    return (int64_t)len;
+}
+
+
+/**
+ * @brief 把buf写到文件的[off, off+len)，需要时扩展文件
+ *
+ * @param hint 块映射缓存，可以为NULL
+ *
+ * @return 成功返回写入的字节数，失败返回-1。
+ */
+static int64_t ext2_file_pwrite(ext2_fs_t *fs, uint64_t inode_idx, const void *buf, uint64_t len, uint64_t off, ext2_map_hint_t *hint)
+{
+    ext2_iovec_t iov = {buf, len};
+    return ext2_file_pwritev(fs, inode_idx, &iov, 1, off, hint);
+}
+
+
+/**
+ * @brief 读取指定inode的文件内容
+ *
+ * 该函数用于从指定inode中读取文件内容，并将其存储到buf中。只拷贝文件大小那么多字节，
+ * buf不需要按块大小补齐。
+ *
+ * @param fs 指向ext2文件系统的指针
+ * @param inode_idx 要读取的inode索引
+ * @param buf 用于存储读取的文件内容的缓冲区，至少为文件大小
+ *
+ * @return 成功返回0，失败返回-1。
+ */
+int64_t ext2_read_file(ext2_fs_t *fs, uint64_t inode_idx, void *buf)
+{
+    assert(fs!=NULL,return -1;);
+    assert(inode_idx<fs->super->inodes_count,return -1;);
+    assert(buf!=NULL,return -1;);
+
+    // 整块按extent一次传输，最后不满一块的部分经过块缓存
+    return ext2_file_pread(fs, inode_idx, buf, fs->inode_table[inode_idx].size, 0, NULL) < 0 ? -1 : 0;
+}
+
+
+/**
+ * @brief 读取指定inode的文件中[off, off+len)的内容
+ *
+ * 只读覆盖这段范围的块，例如从大文件开头读100字节的头部只需要读一个块。
+ *
+ * @param fs 指向ext2文件系统的指针
+ * @param inode_idx 要读取的inode索引
+ * @param buf 用于存储读取内容的缓冲区，至少len字节
+ * @param off 起始偏移
+ * @param len 要读的字节数，超过文件末尾的部分不读
+ *
+ * @return 成功返回读到的字节数，失败返回-1。
+ */
+int64_t ext2_read_file_range(ext2_fs_t *fs, uint64_t inode_idx, void *buf, uint64_t off, uint64_t len)
+{
+    assert(fs!=NULL,return -1;);
+    assert(inode_idx<fs->super->inodes_count,return -1;);
+    assert(buf!=NULL||len==0,return -1;);
+    return ext2_file_pread(fs, inode_idx, buf, len, off, NULL);
+}
+
+
+/**
+ * @brief 删除指定inode的文件或目录
+ *
+ * 该函数用于删除指定inode的文件或目录，包括释放其占用的块和inode，并清空inode信息。
+ *
+ * @param fs 指向ext2文件系统的指针
+ * @param inode_idx 要删除的inode索引
+ *
+ * @return 成功返回0，失败返回-1。
+ */
+int64_t ext2_delete_inode_data(ext2_fs_t *fs, uint64_t inode_idx)
+{
+    assert(fs!=NULL,return -1;);
+    assert(inode_idx<fs->super->inodes_count,return -1;);
+
+    // 释放块
+    ext2_map_truncate(fs, inode_idx, 0);
+    // 释放inode
+    ext2_free_inode(fs,inode_idx,fs->inode_table[inode_idx].type);
+    // 清空inode信息
+    memset(&fs->inode_table[inode_idx], 0, sizeof(ext2_inode_t));
+    
+    ext2_mark_inode_dirty(fs, inode_idx);
+    
+    return SUCCESS;
+}
+
+
+/*
+ * 哈希索引目录
+ *
+ * 目录超过一个块后第0块改成索引根，之后按文件名的哈希值找目录项所在的叶子块，
+ * 查找、创建、删除只需要读索引路径上的几个块，和目录大小无关。
+ * 索引节点和叶子块都是目录的普通逻辑块，索引项里存的是逻辑块号。
+ * 哈希值相同的目录项总在同一个叶子里，所以找到叶子后不用再看相邻的块。
+ */
+
+// 读目录的第lblk个逻辑块，调用者负责bcache_put
+static bcache_buf_t* ext2_dir_get_block(ext2_fs_t *fs, ext2_inode_t *inode, uint64_t lblk)
+{
+    uint64_t pblk, len;
+    if(ext2_bmap(fs, inode, lblk, &pblk, &len) < 0)
+    {
+        return NULL;
+    }
+    return bcache_get(fs->bcache, pblk);
+}
+
+
+// 在目录末尾加一个清零的块，调用者负责bcache_put
+static bcache_buf_t* ext2_dir_new_block(ext2_fs_t *fs, uint64_t inode_idx, uint64_t *lblk)
+{
+    ext2_inode_t *inode = &fs->inode_table[inode_idx];
+    uint64_t pblk, len;
+    if(ext2_alloc_file_blocks(fs, inode_idx, inode->blocks + 1) < 0 ||
+       ext2_bmap(fs, inode, inode->blocks - 1, &pblk, &len) < 0)
+    {
+        return NULL;
+    }
+    *lblk = inode->blocks - 1;
+    return bcache_get_new(fs->bcache, pblk); // 新块清零，避免旧数据被当成目录项
+}
+
+
+static uint32_t ext2_dx_hash(const char *name)
+{
+    uint32_t h = 0x811c9dc5U;
+    for(;*name!='\0';name++)
+    {
+        h ^= (uint8_t)*name;
+        h *= 0x01000193U;
+    }
+    return h;
+}
+
+
+// 在索引节点中二分查找最后一个hash<=目标的索引项，第一项总是满足
+static uint64_t ext2_dx_search(ext2_dx_header_t *h, uint32_t hash)
+{
+    ext2_dx_entry_t *e = EXT2_DX_ENTRIES(h);
+    uint64_t lo = 1, hi = h->count;
+    while(lo < hi)
+    {
+        uint64_t mid = (lo + hi) / 2;
+        if(e[mid].hash <= hash)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo - 1;
+}
+
+
+static void ext2_dx_release(ext2_fs_t *fs, ext2_dx_path_t *path)
+{
+    for(uint64_t i = 0;i<path->num;i++)
+    {
+        bcache_put(fs->bcache, path->buf[i]);
+        path->buf[i] = NULL;
+    }
+    bcache_put(fs->bcache, path->leaf);
+    path->leaf = NULL;
+    path->num = 0;
+}
+
+
+/**
+ * @brief 从索引根开始按哈希值找到叶子块，记下经过的索引节点
+ *
+ * @return 成功返回0，索引损坏或读盘失败返回-1（已经释放路径上的块）
+ */
+static int64_t ext2_dx_probe(ext2_fs_t *fs, ext2_inode_t *inode, uint32_t hash, ext2_dx_path_t *path)
+{
+    memset(path, 0, sizeof(ext2_dx_path_t));
+    uint64_t lblk = 0;
+    int64_t levels = -1;
+    do
+    {
+        bcache_buf_t *buf = ext2_dir_get_block(fs, inode, lblk);
+        if(buf == NULL)
+        {
+            ext2_dx_release(fs, path);
+            return -1;
+        }
+        ext2_dx_header_t *h = (ext2_dx_header_t*)buf->data;
+        path->buf[path->num++] = buf;
+        if(h->magic != EXT2_DX_MAGIC || h->count == 0 || h->count > h->limit || h->limit > EXT2_DX_LIMIT(fs) ||
+           h->levels > EXT2_DX_MAX_LEVELS || (levels >= 0 && h->levels != levels - 1))
+        {
+            printf("ext2: bad directory index\n");
+            ext2_dx_release(fs, path);
+            return -1;
+        }
+        levels = h->levels;
+        path->at[path->num - 1] = ext2_dx_search(h, hash);
+        lblk = EXT2_DX_ENTRIES(h)[path->at[path->num - 1]].lblk;
+    }while(levels > 0);
+
+    path->leaf = ext2_dir_get_block(fs, inode, lblk);
+    if(path->leaf == NULL)
+    {
+        ext2_dx_release(fs, path);
+        return -1;
+    }
+    path->leaf_lblk = lblk;
+    return 0;
+}
+
+
+// 在索引节点的第pos项之前插入一项
+static void ext2_dx_insert_at(ext2_dx_header_t *h, uint64_t pos, uint32_t hash, uint64_t lblk)
+{
+    ext2_dx_entry_t *e = EXT2_DX_ENTRIES(h);
+    memmove(&e[pos + 1], &e[pos], (h->count - pos) * sizeof(ext2_dx_entry_t));
+    e[pos] = (ext2_dx_entry_t){hash, (uint32_t)lblk};
+    h->count++;
+}
+
+
+/**
+ * @brief 在索引目录中查找目录项
+ *
+ * @return 找到时返回目录项所在的缓存块（调用者负责bcache_put），未找到返回NULL。
+ */
+static bcache_buf_t* ext2_dx_find_slot(ext2_fs_t *fs, ext2_inode_t *inode, const char *name, uint64_t *slot)
+{
+    ext2_dx_path_t path;
+    if(ext2_dx_probe(fs, inode, ext2_dx_hash(name), &path) < 0)
+    {
+        return NULL;
+    }
+    bcache_buf_t *leaf = path.leaf;
+    path.leaf = NULL;
+    ext2_dx_release(fs, &path);
+
+    ext2_dir_entry_t *entries = (ext2_dir_entry_t*)leaf->data;
+    for(uint64_t j = 0; j < EXT2_DIR_ENTRIES_PER_BLOCK(fs); j++)
+    {
+        if(entries[j].inode_idx != 0 && strcmp(entries[j].name, name) == 0)
+        {
+            *slot = j;
+            return leaf;
+        }
+    }
+    bcache_put(fs->bcache, leaf);
+    return NULL;
+}
+
+
+/**
+ * @brief 把只有一个块的普通目录改成索引目录
+ *
+ * 原来第0块的目录项搬到新的第1块，第0块改成只有一项的索引根。
+ *
+ * @return 成功返回0，失败返回-1
+ */
+static int64_t ext2_dx_convert(ext2_fs_t *fs, uint64_t dir_inode_idx)
+{
+    ext2_inode_t *inode = &fs->inode_table[dir_inode_idx];
+    assert(inode->blocks == 1 && !(inode->flags & EXT2_INODE_INDEX),return -1;);
+
+    bcache_buf_t *root = ext2_dir_get_block(fs, inode, 0);
+    assert(root != NULL,return -1;);
+    uint64_t lblk;
+    bcache_buf_t *leaf = ext2_dir_new_block(fs, dir_inode_idx, &lblk);
+    if(leaf == NULL)
+    {
+        bcache_put(fs->bcache, root);
+        return -1;
+    }
+    memcpy(leaf->data, root->data, fs->block_size);
+    bcache_put(fs->bcache, leaf);
+
+    ext2_dx_header_t *h = (ext2_dx_header_t*)root->data;
+    memset(root->data, 0, fs->block_size);
+    h->magic = EXT2_DX_MAGIC;
+    h->limit = EXT2_DX_LIMIT(fs);
+    h->hash_version = EXT2_DX_HASH_FNV1A;
+    ext2_dx_insert_at(h, 0, 0, lblk);
+    bcache_mark_dirty(fs->bcache, root);
+    bcache_put(fs->bcache, root);
+
+    inode->flags |= EXT2_INODE_INDEX;
+    ext2_mark_inode_dirty(fs, dir_inode_idx);
+    return 0;
+}
+
+
+/**
+ * @brief 把目录项放进索引目录
+ *
+ * 叶子满了就按哈希值把叶子一分为二，新叶子挂到父索引节点上；父节点也满了先把它分裂，
+ * 一直满到根时根的内容搬到新块里，索引加深一层。和extent树一样，加深后从头再找一遍。
+ *
+ * @return 成功返回0，失败返回-1
+ */
+static int64_t ext2_dx_add(ext2_fs_t *fs, uint64_t dir_inode_idx, const ext2_dir_entry_t *entry)
+{
+    ext2_inode_t *inode = &fs->inode_table[dir_inode_idx];
+    uint32_t hash = ext2_dx_hash(entry->name);
+    ext2_dx_path_t path;
+
+again:
+    if(ext2_dx_probe(fs, inode, hash, &path) < 0)
+    {
+        return -1;
+    }
+
+    ext2_dir_entry_t *entries = (ext2_dir_entry_t*)path.leaf->data;
+    for(uint64_t j = 0;j<EXT2_DIR_ENTRIES_PER_BLOCK(fs);j++)
+    {
+        if(entries[j].inode_idx == 0)
+        {
+            entries[j] = *entry;
+            bcache_mark_dirty(fs->bcache, path.leaf);
+            ext2_dx_release(fs, &path);
+            return 0;
+        }
+    }
+
+    // 叶子满了，找最低的还有空位的索引节点
+    int64_t k = (int64_t)path.num - 1;
+    while(k >= 0 && ((ext2_dx_header_t*)path.buf[k]->data)->count >= EXT2_DX_LIMIT(fs))
+    {
+        k--;
+    }
+    if(k < 0)
+    {
+        ext2_dx_header_t *root = (ext2_dx_header_t*)path.buf[0]->data;
+        if(root->levels >= EXT2_DX_MAX_LEVELS)
+        {
+            printf("ext2: directory index is full\n");
+            ext2_dx_release(fs, &path);
+            return -1;
+        }
+        uint64_t lblk;
+        bcache_buf_t *nb = ext2_dir_new_block(fs, dir_inode_idx, &lblk);
+        if(nb == NULL)
+        {
+            ext2_dx_release(fs, &path);
+            return -1;
+        }
+        memcpy(nb->data, root, fs->block_size);
+        bcache_put(fs->bcache, nb);
+        root->levels++;
+        root->count = 0;
+        ext2_dx_insert_at(root, 0, 0, lblk);
+        bcache_mark_dirty(fs->bcache, path.buf[0]);
+        ext2_dx_release(fs, &path);
+        goto again;
+    }
+
+    // 从上往下分裂满了的索引节点，每次分裂后父节点多一项
+    for(uint64_t j = (uint64_t)k + 1;j<path.num;j++)
+    {
+        ext2_dx_header_t *h = (ext2_dx_header_t*)path.buf[j]->data;
+        ext2_dx_header_t *parent = (ext2_dx_header_t*)path.buf[j-1]->data;
+        uint64_t lblk;
+        bcache_buf_t *nb = ext2_dir_new_block(fs, dir_inode_idx, &lblk);
+        if(nb == NULL)
+        {
+            ext2_dx_release(fs, &path);
+            return -1;
+        }
+        ext2_dx_header_t *nh = (ext2_dx_header_t*)nb->data;
+        uint64_t half = h->count / 2;
+        *nh = *h;
+        nh->count = h->count - half;
+        memcpy(EXT2_DX_ENTRIES(nh), &EXT2_DX_ENTRIES(h)[half], nh->count * sizeof(ext2_dx_entry_t));
+        h->count = half;
+        ext2_dx_insert_at(parent, path.at[j-1] + 1, EXT2_DX_ENTRIES(nh)[0].hash, lblk);
+        bcache_mark_dirty(fs->bcache, path.buf[j-1]);
+        bcache_mark_dirty(fs->bcache, path.buf[j]);
+        if(path.at[j] >= half) // 要找的位置分到了新节点
+        {
+            bcache_put(fs->bcache, path.buf[j]);
+            path.buf[j] = nb;
+            path.at[j] -= half;
+            path.at[j-1]++;
+        }
+        else
+        {
+            bcache_put(fs->bcache, nb);
+        }
+    }
+
+    // 分裂叶子：连同新目录项按哈希值排序，从中间找一个哈希值变化的位置分开
+    ext2_dir_entry_t all[EXT2_MAX_BLOCK_SIZE / sizeof(ext2_dir_entry_t) + 1];
+    uint32_t hashes[EXT2_MAX_BLOCK_SIZE / sizeof(ext2_dir_entry_t) + 1];
+    uint64_t n = 0;
+    for(uint64_t j = 0;j<=EXT2_DIR_ENTRIES_PER_BLOCK(fs);j++)
+    {
+        ext2_dir_entry_t e = j < EXT2_DIR_ENTRIES_PER_BLOCK(fs) ? entries[j] : *entry;
+        uint32_t eh = j < EXT2_DIR_ENTRIES_PER_BLOCK(fs) ? ext2_dx_hash(e.name) : hash;
+        uint64_t p = n++;
+        for(;p > 0 && hashes[p-1] > eh;p--)
+        {
+            all[p] = all[p-1];
+            hashes[p] = hashes[p-1];
+        }
+        all[p] = e;
+        hashes[p] = eh;
+    }
+    uint64_t split = 0;
+    for(uint64_t d = 0;d<n && split==0;d++)
+    {
+        // 依次试n/2, n/2+1, n/2-1, ...
+        uint64_t m = n/2 + ((d & 1) ? (d+1)/2 : 0) - ((d & 1) ? 0 : d/2);
+        if(m > 0 && m < n && hashes[m-1] != hashes[m])
+        {
+            split = m;
+        }
+    }
+    if(split == 0)
+    {
+        printf("ext2: too many names with the same hash\n");
+        ext2_dx_release(fs, &path);
+        return -1;
+    }
+
+    uint64_t lblk;
+    bcache_buf_t *nb = ext2_dir_new_block(fs, dir_inode_idx, &lblk);
+    if(nb == NULL)
+    {
+        ext2_dx_release(fs, &path);
+        return -1;
+    }
+    memset(entries, 0, fs->block_size);
+    memcpy(entries, all, split * sizeof(ext2_dir_entry_t));
+    memcpy(nb->data, &all[split], (n - split) * sizeof(ext2_dir_entry_t));
+    bcache_put(fs->bcache, nb);
+    bcache_mark_dirty(fs->bcache, path.leaf);
+
+    ext2_dx_header_t *parent = (ext2_dx_header_t*)path.buf[path.num-1]->data;
+    ext2_dx_insert_at(parent, path.at[path.num-1] + 1, hashes[split], lblk);
+    bcache_mark_dirty(fs->bcache, path.buf[path.num-1]);
+    ext2_dx_release(fs, &path);
+    return 0;
+}
+
+
+/**
+ * @brief 按哈希顺序遍历索引目录的所有叶子块
+ *
+ * @param levels lblk是索引节点时为它的levels，是叶子时为-1
+ */
+static int64_t ext2_dx_walk(ext2_fs_t *fs, ext2_inode_t *inode, uint64_t lblk, int64_t levels, void (*callback)(ext2_fs_t *,const ext2_dir_entry_t *))
+{
+    bcache_buf_t *buf = ext2_dir_get_block(fs, inode, lblk);
+    if(buf == NULL)
+    {
+        return -1;
+    }
+    int64_t ret = 0;
+    if(levels < 0)
+    {
+        ext2_dir_entry_t *entries = (ext2_dir_entry_t*)buf->data;
+        for(uint64_t j = 0;j<EXT2_DIR_ENTRIES_PER_BLOCK(fs);j++)
+        {
+            if(entries[j].inode_idx != 0)
+            {
+                callback(fs, &entries[j]);
+            }
+        }
+    }
+    else
+    {
+        ext2_dx_header_t *h = (ext2_dx_header_t*)buf->data;
+        for(uint64_t i = 0;i<h->count && ret==0;i++)
+        {
+            ret = ext2_dx_walk(fs, inode, EXT2_DX_ENTRIES(h)[i].lblk, levels - 1, callback);
+        }
+    }
+    bcache_put(fs->bcache, buf);
+    return ret;
+}
+
+
+/**
+ * @brief 在目录块中定位目录项
+ *
+ * 删除目录项会在块中留下空位，所以要扫描目录所有已分配的块，而不是按目录大小推算。
+ * 索引目录只读索引路径上的块。
+ *
+ * @param fs 指向ext2文件系统的指针
+ * @param inode_idx 目录的inode索引
+ * @param name 要查找的文件名
+ * @param slot 返回目录项在块中的序号
+ *
+ * @return 找到时返回目录项所在的缓存块（调用者负责bcache_put），未找到返回NULL。
+ */
+static bcache_buf_t* ext2_find_entry_slot(ext2_fs_t *fs, uint64_t inode_idx, const char *name, uint64_t *slot)
+{
+    ext2_inode_t *inode = &fs->inode_table[inode_idx];
+    uint64_t entries_per_block = EXT2_DIR_ENTRIES_PER_BLOCK(fs);
+    if(inode->flags & EXT2_INODE_INDEX)
+    {
+        return ext2_dx_find_slot(fs, inode, name, slot);
+    }
+
+    for(uint64_t i = 0; i < inode->blocks; i++)
+    {
+        // 获取目录块，并在缓存中逐项比较
+        uint64_t pblk, len;
+        if(ext2_bmap(fs, inode, i, &pblk, &len) < 0)
+        {
+            return NULL;
+        }
+        bcache_buf_t *buf = bcache_get(fs->bcache, pblk);
+        if(buf == NULL)
+        {
+            return NULL;
+        }
+        ext2_dir_entry_t *entries = (ext2_dir_entry_t*)buf->data;
+        for(uint64_t j = 0; j < entries_per_block; j++)
+        {
+            // 检查文件名是否匹配
+            if(entries[j].inode_idx != 0 && strcmp(entries[j].name, name) == 0)
+            {
+                *slot = j;
+                return buf;
+            }
+        }
+        bcache_put(fs->bcache, buf);
+    }
+    return NULL;
+}
+
+
+/**
+ * @brief 获取指定目录下的目录项
+ *
+ * 该函数用于在指定的ext2文件系统中查找指定目录下的目录项，并将其信息存储在entry_ret中。
+ *
+ * @param fs 指向ext2文件系统的指针
+ * @param inode_idx 目录的inode索引
+ * @param name 要查找的文件名
+ * @param entry_ret 用于存储找到的目录项信息
+ *
+ * @return 成功返回0，未找到返回-1。
+ */
+int64_t ext2_get_entry(ext2_fs_t *fs, uint64_t inode_idx, const char *name, ext2_dir_entry_t *entry_ret)
+{
+    assert(fs!=NULL,return ERROR_INVALID_ARG;);
+    assert(name!=NULL,return ERROR_INVALID_ARG;);
+    assert(inode_idx<fs->super->inodes_count,return ERROR_INVALID_ARG;);
+    // assert(fs->inode_table[inode_idx].type == FILE_TYPE_DIR,return -1;);
+
+    uint64_t slot;
+    bcache_buf_t *buf = ext2_find_entry_slot(fs, inode_idx, name, &slot);
+    if(buf == NULL)
+    {
+        return ERROR_NOT_FOUND;
+    }
+    *entry_ret = ((ext2_dir_entry_t*)buf->data)[slot]; // 将找到的目录项复制到输出参数
+    bcache_put(fs->bcache, buf);
+    return SUCCESS;
+}
+
+
+/**
+ * @brief 在目录中查找文件或子目录
+ *
+ * 在指定的ext2文件系统中，查找指定目录下的文件名对应的inode索引。
+ *
+ * @param fs 指向ext2文件系统的指针
+ * @param dir_inode_idx 目录的inode索引
+ * @param name 要查找的文件名
+ *
+ * @return 如果找到匹配的文件名，则返回对应的inode索引；否则返回-1。
+ */
+int64_t ext2_find_entry(ext2_fs_t *fs, uint64_t inode_idx, const char *name)
+{
+    assert(fs!=NULL,return ERROR_INVALID_ARG;);
+    assert(name!=NULL,return ERROR_INVALID_ARG;);
+    assert(inode_idx<fs->super->inodes_count,return ERROR_INVALID_ARG;);
+    // assert(fs->inode_table[inode_idx].type == FILE_TYPE_DIR,return -1;);
+
+    // 先查目录项缓存，命中时不用读目录块
+    int64_t cached;
+    if(dcache_lookup(fs->dcache, inode_idx, name, &cached))
+    {
+        return cached == DCACHE_NEGATIVE ? ERROR_NOT_FOUND : cached;
+    }
+
+    ext2_dir_entry_t entry;
+    int64_t ret = ext2_get_entry(fs, inode_idx, name, &entry);
+    if(ret == SUCCESS) // 如果找到了目录项
+    {
+        dcache_insert(fs->dcache, inode_idx, name, (int64_t)entry.inode_idx);
+        return entry.inode_idx; // 返回对应的inode索引
+    }
+    else
+    {
+        // printf("Directory entry '%s' not found in inode %lu.\n", name, inode_idx);
+        if(ret == ERROR_NOT_FOUND)
+        {
+            dcache_insert(fs->dcache, inode_idx, name, DCACHE_NEGATIVE);
+        }
+        return ERROR_NOT_FOUND;
+    }
+    // 如果没有找到目录项
+
+    
+}
+
+
+/**
+ * @brief 初始化一个新的目录项
+ *
+ * 该函数用于初始化一个新的目录项，包括设置名称、inode索引和类型。
+ *
+ * @param fs 指向ext2文件系统的指针
+ * @param new_entry 指向要初始化的目录项结构体
+ * @param inode_idx 新目录项对应的inode索引
+ * @param name 新目录项的名称
+ * @param type 新目录项的类型（文件或目录）
+ *
+ * @return 成功返回0，失败返回-1。
+ */
+static int64_t ext2_init_entry(ext2_fs_t *fs, ext2_dir_entry_t *new_entry, uint64_t inode_idx, const char *name, uint32_t type)
+{
+    strncpy(new_entry->name, name, MAX_FILENAME_LEN);
+    new_entry->name[MAX_FILENAME_LEN - 1] = '\0';
+    new_entry->inode_idx =  inode_idx;// 分配一个新的inode
+    fs->inode_table[inode_idx].type = type; // 设置新inode的类型
+    fs->inode_table[inode_idx].priv = 0; // 设置新inode的权限为0
+    fs->inode_table[inode_idx].size = 0; 
+    ext2_map_init(fs, &fs->inode_table[inode_idx]);
+    return SUCCESS;
+}
+
+
+/**
+ * @brief 在指定目录中添加一个新的目录项
+ *
+ * 该函数用于在指定的目录中添加一个新的目录项，但是不会检查目录项是否重复。
+ * 文件系统开启EXT2_FEATURE_DIR_INDEX时，目录写满第一个块后改成索引目录。
+ *
+ * @param fs 指向ext2文件系统的指针
+ * @param dir_inode_idx 目录的inode索引
+ * @param name 要添加的目录项名称
+ *
+ * @return 成功添加返回新目录项的inode索引，失败返回-1。
+ */
+int64_t ext2_add_entry(ext2_fs_t *fs, uint64_t dir_inode_idx, const char *name,uint32_t type)
+{
+    assert(fs!=NULL,return -1;);
+    assert(name!=NULL,return -1;);
+    assert(dir_inode_idx<fs->super->inodes_count,return -1;);
+    assert(fs->inode_table[dir_inode_idx].type == FILE_TYPE_DIR,return -1;);
+    
+    // 获取目录的inode信息
+    ext2_inode_t *dir_inode = &fs->inode_table[dir_inode_idx];
+    
+    uint64_t entries_per_block = EXT2_DIR_ENTRIES_PER_BLOCK(fs);
+    bcache_buf_t *buf = NULL;
+    uint64_t slot = 0;
+
+    //遍历目录中所有的块，找到空位；索引目录按哈希值放，不在这里找
+    for(uint64_t i=0;i<dir_inode->blocks && buf==NULL && !(dir_inode->flags & EXT2_INODE_INDEX);i++)
+    {
+        uint64_t pblk, len;
+        if(ext2_bmap(fs, dir_inode, i, &pblk, &len) < 0)
+        {
+            return -1;
+        }
+        buf = bcache_get(fs->bcache, pblk);
+        if(buf == NULL)
+        {
+            return -1;
+        }
+        ext2_dir_entry_t *buffer = (ext2_dir_entry_t*)buf->data;
+        for(slot=0;slot<entries_per_block && buffer[slot].inode_idx!=0;slot++)
+        {
+        }
+        if(slot == entries_per_block)
+        {
+            bcache_put(fs->bcache, buf);
+            buf = NULL;
+        }
+    }
+    if(buf == NULL && !(dir_inode->flags & EXT2_INODE_INDEX))
+    {
+        if((fs->super->features & EXT2_FEATURE_DIR_INDEX) && dir_inode->blocks == 1)
+        {
+            // 第一个块满了，改成索引目录
+            if(ext2_dx_convert(fs, dir_inode_idx) < 0)
+            {
+                return -1;
+            }
+        }
+        else // 所有块都满了，在目录末尾分配一个新的块
+        {
+            uint64_t lblk;
+            buf = ext2_dir_new_block(fs, dir_inode_idx, &lblk);
+            if(buf == NULL)
+            {
+                return -1; // 分配块失败
+            }
+            slot = 0;
+        }
+    }
+
+    // 分配一个新的目录项
+    ext2_dir_entry_t new_entry;
+    uint64_t new_inode_idx;
+    int64_t ret = ext2_alloc_inode(fs, dir_inode_idx, type);
+    if(ret < 0) // 分配inode失败
+    {
+        printf("Failed to allocate inode.\n");
+        bcache_put(fs->bcache, buf);
+        return ret; // 返回错误
+    }
+    new_inode_idx = (uint64_t)ret; // 获取新分配的inode索引
+    ext2_init_entry(fs, &new_entry, new_inode_idx, name, type);
+
+    if(buf == NULL) // 索引目录
+    {
+        if(ext2_dx_add(fs, dir_inode_idx, &new_entry) < 0)
+        {
+            ext2_free_inode(fs, new_inode_idx, type);
+            memset(&fs->inode_table[new_inode_idx], 0, sizeof(ext2_inode_t));
+            ext2_mark_inode_dirty(fs, new_inode_idx);
+            return -1;
+        }
+    }
+    else
+    {
+        ((ext2_dir_entry_t*)buf->data)[slot] = new_entry;
+        bcache_mark_dirty(fs->bcache, buf);
+        bcache_put(fs->bcache, buf);
+    }
+    // 名字可能被截断过，按目录块中实际保存的名字更新缓存
+    dcache_insert(fs->dcache, dir_inode_idx, new_entry.name, (int64_t)new_inode_idx);
+
+    dir_inode->ctime++;
+    dir_inode->size += sizeof(ext2_dir_entry_t);
+    ext2_mark_inode_dirty(fs, dir_inode_idx);
+    ext2_mark_inode_dirty(fs, new_inode_idx);
+
+    return new_entry.inode_idx;
+}
+
+
+/**
+ * @brief 删除指定目录中的目录项
+ *
+ * 该函数用于在指定的目录中删除一个目录项。它会查找目录项，如果找到则释放对应的inode并更新目录的创建时间和大小。
+ *
+ * @param fs 指向ext2文件系统的指针
+ * @param dir_inode_idx 目录的inode索引
+ * @param name 要删除的目录项名称
+ *
+ * @return 成功删除返回0，失败返回-1。
+ */
+int64_t ext2_remove_entry(ext2_fs_t *fs, uint64_t dir_inode_idx, const char *name)
+{
+    assert(fs!=NULL,return -1;);
+    assert(name!=NULL,return -1;);
+    assert(dir_inode_idx<fs->super->inodes_count,return -1;);
+    assert(fs->inode_table[dir_inode_idx].type == FILE_TYPE_DIR,return -1;);
+
+    // 获取要删除的entry信息
+    uint64_t slot;
+    bcache_buf_t *buf = ext2_find_entry_slot(fs, dir_inode_idx, name, &slot);
+    if(buf == NULL) // 如果获取目录项失败
+    {
+        printf("Failed to get directory entry.\n");
+        return ERROR_NOT_FOUND; // 返回错误
+    }
+    ext2_dir_entry_t *entry_ptr = &((ext2_dir_entry_t*)buf->data)[slot];
+    ext2_dir_entry_t entry = *entry_ptr;
+    // 检查要删除的entry是否是目录
+    if (fs->inode_table[entry.inode_idx].type == FILE_TYPE_DIR) 
+    {
+        if(entry.inode_idx == ROOT_INODE_IDX) // 如果是根目录
+        {
+            printf("Cannot remove root directory.\n");
+            bcache_put(fs->bcache, buf);
+            return -1; // 返回错误
+        }
+        if(fs->inode_table[entry.inode_idx].size > 0)
+        {
+            // 不能删除非空目录
+            printf("Cannot remove non-empty directory.\n");
+            bcache_put(fs->bcache, buf);
+            return -1; // 返回错误
+        }
+    }
+    else if(fs->open_count[entry.inode_idx] > 0 || __atomic_load_n(&fs->view_count[entry.inode_idx], __ATOMIC_ACQUIRE) > 0)
+    {
+        // 还有句柄在读写或视图没释放，inode和块释放后可能被别的文件复用
+        printf("Cannot remove open file.\n");
+        bcache_put(fs->bcache, buf);
+        return ERROR_BUSY;
+    }
+    
+    ext2_delete_inode_data(fs, entry.inode_idx); // 删除inode数据
+    
+    // 清空目录块中的目录项
+    entry_ptr->name[0] = '\0'; // 清空名称
+    entry_ptr->inode_idx = 0; // 清空inode索引
+    bcache_mark_dirty(fs->bcache, buf);
+    bcache_put(fs->bcache, buf);
+    dcache_insert(fs->dcache, dir_inode_idx, entry.name, DCACHE_NEGATIVE);
+
+    // 更新目录的创建时间和大小
+    fs->inode_table[dir_inode_idx].ctime++;
+    fs->inode_table[dir_inode_idx].size -= sizeof(ext2_dir_entry_t);
+
+    ext2_mark_inode_dirty(fs, dir_inode_idx);
+    
+    return 0; // 成功删除
+}
+
+
+void print_entry(ext2_fs_t *fs,const ext2_dir_entry_t *entry) 
+{
+    // ANSI颜色代码定义
+    #define COLOR_RESET   "\033[0m"      // 重置颜色
+    #define COLOR_BLUE    "\033[1;34m"   // 蓝色（目录）
+    #define COLOR_WHITE   "\033[1;37m"   // 白色（普通文件）
+    #define COLOR_GREEN   "\033[1;32m"   // 绿色（可执行文件）
+    
+    if (entry->inode_idx == 0) {
+        return; // 跳过无效的目录项
+    }
+    
+    // 获取inode信息来判断文件类型
+    ext2_inode_t *inode = &fs->inode_table[entry->inode_idx];
+    
+    // 根据文件类型设置颜色
+    const char *color = COLOR_WHITE; // 默认白色
+    const char *type_indicator = "";
+    
+    if (inode->type == FILE_TYPE_DIR) {
+        color = COLOR_BLUE;
+        type_indicator = "/";
+    } else if (inode->type == FILE_TYPE_FILE) {
+        color = COLOR_WHITE;
+        type_indicator = "";
+    }
+    
+    // 输出带颜色的文件名和类型指示符
+    printf("%s%-20s%s%s  inode: %lu  size: %lu bytes\n", 
+           color, entry->name, type_indicator, COLOR_RESET, 
+           entry->inode_idx, inode->size);
+}
+
+
+/**
+ * @brief 遍历指定目录中的所有目录项
+ *
+ * 该函数用于遍历指定目录中的所有目录项，并对每个目录项执行回调函数。
+ *
+ * @param fs 指向ext2文件系统的指针
+ * @param dir_inode_idx 目录的inode索引
+ * @param callback 回调函数，用于处理每个目录项
+ *
+ * @return 成功返回0，失败返回-1。
+ */
+int64_t ext2_walk_entry(ext2_fs_t *fs, uint64_t dir_inode_idx, void (*callback)(ext2_fs_t *,const ext2_dir_entry_t *)) 
+{
+    assert(fs != NULL,return ERROR_INVALID_ARG;);
+    ext2_inode_t *inode = &fs->inode_table[dir_inode_idx];
+
+    if (inode->type != FILE_TYPE_DIR) {
+        return -1;  // 不是目录
+    }
+
+    if (inode->flags & EXT2_INODE_INDEX) {
+        // 索引节点不是目录项，从根开始只遍历叶子
+        bcache_buf_t *root = ext2_dir_get_block(fs, inode, 0);
+        if (root == NULL) {
+            return -1;
+        }
+        int64_t levels = ((ext2_dx_header_t *)root->data)->levels;
+        bcache_put(fs->bcache, root);
+        return ext2_dx_walk(fs, inode, 0, levels, callback);
+    }
+
+    uint64_t entries_per_block = EXT2_DIR_ENTRIES_PER_BLOCK(fs);
+
+    for (uint64_t i = 0; i < inode->blocks; i++) {
+        uint64_t pblk, len;
+        if (ext2_bmap(fs, inode, i, &pblk, &len) < 0) {
+            return -1;
+        }
+        bcache_buf_t *buf = bcache_get(fs->bcache, pblk);
+        if (buf == NULL) {
+            return -1;
+        }
+        ext2_dir_entry_t *entries = (ext2_dir_entry_t *)buf->data;
+
+        for (uint64_t j = 0; j < entries_per_block; j++) {
+            if (entries[j].inode_idx != 0) {
+                callback(fs,&entries[j]);
+            }
+        }
+        bcache_put(fs->bcache, buf);
+    }
+
+    return 0;
+}
+
+
+/**
+ * @brief 获取指定inode的大小
+ *
+ * 该函数用于获取指定inode的大小（以字节为单位）。
+ *
+ * @param fs 指向ext2文件系统的指针
+ * @param inode_idx 要获取大小的inode索引
+ *
+ * @return 返回inode的大小，如果发生错误则返回-1。
+ */
+int64_t ext2_get_inode_size(ext2_fs_t *fs, uint64_t inode_idx)
+{
+    assert(fs!=NULL,return -1;);
+    assert(inode_idx<fs->super->inodes_count,return -1;);
+    return fs->inode_table[inode_idx].size;
+}
+
+
+// 路径遍历状态，放在调用者的栈上，不修改路径也不分配内存
+typedef struct ext2_path_walk
+{
+    const char *next;            // 还没有遍历的部分
+    char name[MAX_FILENAME_LEN]; // 当前分量，带结束符
+    uint64_t last;               // 当前分量是不是最后一个
+}ext2_path_walk_t;
+
+
+/**
+ * @brief 取出路径的下一个分量
+ *
+ * 开头、连续和结尾的'/'都被跳过，"/a//b/"和"a/b"得到同样的分量。
+ *
+ * @param w 遍历状态，第一次调用前把next设为路径
+ *
+ * @return 取到分量返回1，路径结束返回0，分量超过MAX_FILENAME_LEN-1个字符返回ERROR_INVALID_ARG。
+ */
+static int64_t ext2_path_next(ext2_path_walk_t *w)
+{
+    const char *p = w->next;
+    while(*p == '/')
+    {
+        p++;
+    }
+    if(*p == '\0')
+    {
+        w->next = p;
+        return 0;
+    }
+
+    const char *start = p;
+    while(*p != '\0' && *p != '/')
+    {
+        p++;
+    }
+    uint64_t len = (uint64_t)(p - start);
+    if(len > MAX_FILENAME_LEN - 1)
+    {
+        printf("File name exceeds maximum allowed length.\n");
+        return ERROR_INVALID_ARG;
+    }
+    memcpy(w->name, start, len);
+    w->name[len] = '\0';
+
+    while(*p == '/')
+    {
+        p++;
+    }
+    w->next = p;
+    w->last = (*p == '\0');
+    return 1;
+}
+
+
+/**
+ * @brief 根据路径查找或创建对应的inode
+ *
+ * 该函数用于根据给定的路径查找对应的inode，如果不存在则根据auto_create参数决定是否自动创建目录。
+ * 路径总是从根目录开始解析。
+ *
+ * @param fs 指向ext2文件系统的指针
+ * @param path 要查找的路径字符串
+ * @param auto_create 是否允许自动创建目录（0表示不允许，1表示允许）
+ *
+ * @return 返回找到的inode索引，如果没有找到且不允许自动创建则返回-1。
+ */
+static int64_t ext2_find_inode_by_path(ext2_fs_t *fs,const char *path,uint64_t auto_create)
+{
+    ext2_path_walk_t w;
+    w.next = path;
+    int64_t parent_inode_idx = ROOT_INODE_IDX;
+    int64_t ret;
+    while((ret = ext2_path_next(&w)) > 0)
+    {
+        ext2_inode_rdlock(fs, (uint64_t)parent_inode_idx);
+        int64_t child_inode_idx = ext2_find_entry(fs, parent_inode_idx, w.name);
+        ext2_inode_unlock(fs, (uint64_t)parent_inode_idx);
+        if(child_inode_idx < 0) // 如果没有找到父目录,那就建立对应目录
+        {
+            if(auto_create == 0) // 如果不允许自动创建目录
+            {
+                printf("Directory %s not found.\n", w.name);
+                return -1; // 返回错误
+            }
+            ext2_journal_start(fs);
+            ext2_inode_wrlock(fs, (uint64_t)parent_inode_idx);
+            child_inode_idx = ext2_find_entry(fs, parent_inode_idx, w.name); // 别的线程可能刚建好
+            if(child_inode_idx < 0)
+            {
+                child_inode_idx = ext2_add_entry(fs, parent_inode_idx, w.name, FILE_TYPE_DIR); // 在父目录下添加新的子目录
+            }
+            ext2_inode_unlock(fs, (uint64_t)parent_inode_idx);
+            ext2_journal_stop(fs);
+            if(child_inode_idx < 0) // 如果添加目录失败
+            {
+                return -1; // 返回错误
+            }
+        }
+        parent_inode_idx = child_inode_idx; // 更新父目录的inode索引
+    }
+    return ret < 0 ? -1 : parent_inode_idx; // 返回最后找到的inode索引
+}
+
+
+/**
+ * @brief 找到路径最后一个分量所在的目录
+ *
+ * 只遍历一遍路径，代替先取目录名再取文件名的两次扫描，整个路径也不再受MAX_FILENAME_LEN限制。
+ *
+ * @param fs 指向ext2文件系统的指针
+ * @param path 文件路径
+ * @param name 返回最后一个分量，大小至少为MAX_FILENAME_LEN
+ *
+ * @return 成功返回所在目录的inode索引，目录不存在或路径中没有文件名返回-1。
+ */
+static int64_t ext2_find_parent_by_path(ext2_fs_t *fs, const char *path, char *name)
+{
+    ext2_path_walk_t w;
+    w.next = path;
+    int64_t dir_inode_idx = ROOT_INODE_IDX;
+    int64_t ret;
+    while((ret = ext2_path_next(&w)) > 0)
+    {
+        if(w.last)
+        {
+            memcpy(name, w.name, MAX_FILENAME_LEN);
+            return dir_inode_idx;
+        }
+        int64_t parent_inode_idx = dir_inode_idx;
+        ext2_inode_rdlock(fs, (uint64_t)parent_inode_idx);
+        dir_inode_idx = ext2_find_entry(fs, parent_inode_idx, w.name);
+        ext2_inode_unlock(fs, (uint64_t)parent_inode_idx);
+        if(dir_inode_idx < 0)
+        {
+            printf("Directory %s not found.\n", w.name);
+            return -1;
+        }
+    }
+    return -1; // 路径为空或只有'/'
+}
+
+
+/**
+ * @brief 根据路径创建目录
+ *
+ * 该函数用于根据给定的路径创建一个新的目录。如果路径是根目录，则不需要创建。
+ * 如果路径不存在，则会自动创建对应的目录。
+ *
+ * @param fs 指向ext2文件系统的指针
+ * @param path 要创建的目录路径
+ *
+ * @return 成功返回0，失败返回-1。
+ */
+int64_t ext2_create_dir_by_path(ext2_fs_t *fs, const char *path)
+{
+    assert(fs!=NULL&&path!=NULL,return -1;);
+
+    if(strcmp(path, "/") == 0) // 如果路径是根目录
+    {
+        return 0; // 根目录不需要创建
+    }
+    
+    if(ext2_find_inode_by_path(fs, path, 1)<0) // 查找路径对应的inode，如果不存在则创建
+    {
+        printf("Failed to create directory: %s\n", path);
+        return -1; // 返回错误
+    }
+    printf("Directory created successfully: %s\n", path);
+
+    return 0; // 成功创建目录
+}
+
+
+/**
+ * @brief 根据路径创建文件
+ *
+ * 该函数用于根据给定的路径创建一个新的文件。如果路径对应的目录不存在，则会自动创建目录。
+ *
+ * @param fs 指向ext2文件系统的指针
+ * @param path 要创建的文件路径
+ *
+ * @return 成功返回新创建文件的inode索引，失败返回-1。
+ */
+int64_t ext2_create_file_by_path(ext2_fs_t *fs, const char *path)
+{
+    assert(fs!=NULL&&path!=NULL,return -1;);
+
+    char base_name[MAX_FILENAME_LEN]; 
+    int64_t dir_inode_idx = ext2_find_parent_by_path(fs, path, base_name); // 查找文件所在目录的inode
+    if( dir_inode_idx < 0)
+    {
+        printf("Failed to find for file: %s\n", path);
+        return -1; // 返回错误
+    }
+    ext2_journal_start(fs);
+    ext2_inode_wrlock(fs, (uint64_t)dir_inode_idx);
+    int64_t file_inode_idx = ext2_add_entry(fs,  dir_inode_idx, base_name, FILE_TYPE_FILE);
+    ext2_inode_unlock(fs, (uint64_t)dir_inode_idx);
+    ext2_journal_stop(fs);
+    if(file_inode_idx < 0) // 如果添加文件失败
+    {
+        printf("Failed to create file: %s\n", base_name);
+        return -1; // 返回错误
+    }
+
+    printf("File created successfully: %s\n", path);
+
+    return file_inode_idx; // 返回新创建文件的inode索引
+}
+
+
+/**
+ * @brief 根据路径删除文件
+ *
+ * 该函数用于根据给定的路径删除一个文件。如果文件不存在，则返回错误。
+ *
+ * @param fs 指向ext2文件系统的指针
+ * @param path 要删除的文件路径
+ *
+ * @return 成功返回0，文件还有没关闭的句柄时返回ERROR_BUSY，其他失败返回负数。
+ */
+int64_t ext2_unlink_by_path(ext2_fs_t *fs, const char *path)
+{
+    assert(fs!=NULL&&path!=NULL,return -1;);
+    char base_name[MAX_FILENAME_LEN]; 
+    int64_t dir_inode_idx = ext2_find_parent_by_path(fs, path, base_name); // 查找文件所在目录的inode
+    if( dir_inode_idx < 0)
+    {
+        printf("Failed to find for file: %s\n", path);
+        return -1; // 返回错误
+    }
+    ext2_journal_start(fs);
+    ext2_inode_wrlock(fs, (uint64_t)dir_inode_idx);
+    int64_t inode_idx = ext2_find_entry(fs, (uint64_t)dir_inode_idx, base_name);
+    if(inode_idx >= 0)
+    {
+        ext2_inode_wrlock(fs, (uint64_t)inode_idx); // 要删的文件可能正被别的线程读写
+    }
+    int64_t ret = ext2_remove_entry(fs, (uint64_t)dir_inode_idx, base_name);
+    if(inode_idx >= 0)
+    {
+        ext2_inode_unlock(fs, (uint64_t)inode_idx);
+    }
+    ext2_inode_unlock(fs, (uint64_t)dir_inode_idx);
+    ext2_journal_stop(fs);
+    if(ret < 0) // 如果添加文件失败
+    {
+        printf("Failed to delete file: %s\n", base_name);
+        return ret; // 返回错误
+    }
+
+    printf("File deleted successfully: %s\n", path);
+ 
+    return SUCCESS; // 成功删除文件
+}
+
+
+/**
+ * @brief 追加数据到指定路径的文件
+ *
+ * 该函数用于将数据追加到指定路径的文件中。如果文件不存在，则返回错误。
+ *
+ * @param fs 指向ext2文件系统的指针
+ * @param path 要追加数据的文件路径
+ * @param data 要追加的数据
+ * @param size 要追加的数据大小
+ *
+ * @return 成功返回0，失败返回-1。
+ */
+int64_t ext2_append_file_by_path(ext2_fs_t *fs, const char *path, const void *data, uint64_t size)
+{
+    assert(fs!=NULL&&path!=NULL&&data!=NULL,return -1;);
+    int64_t inode_idx = ext2_find_inode_by_path(fs, path, 0); // 查找路径对应的inode
+    if(inode_idx<0)
+    {
+        printf("Failed to find for file: %s\n", path);
+        return -1; // 返回错误
+    }
+
+    ext2_journal_start(fs);
+    ext2_inode_wrlock(fs, (uint64_t)inode_idx);
+    int64_t ret = ext2_append_file(fs, inode_idx, data, size);
+    ext2_inode_unlock(fs, (uint64_t)inode_idx);
+    ext2_journal_stop(fs);
+    if(ret<0) // 如果追加文件失败
+    {
+        printf("Failed to write file: %s\n", path);
+        return -1; // 返回错误
+    }
+    printf("File written successfully: %s\n", path);
+    
+    return 0;
+}
+
+
+/**
+ * @brief 覆盖写数据到指定路径的文件
+ *
+ * 该函数用于将数据覆盖写到指定路径的文件中。如果文件不存在，则返回错误。
+ *
+ * @param fs 指向ext2文件系统的指针
+ * @param path 要覆盖写数据的文件路径
+ * @param data 要覆盖写的数据
+ * @param size 要覆盖写的数据大小
+ *
+ * @return 成功返回0，失败返回-1。
+ */
+int64_t ext2_overwrite_file_by_path(ext2_fs_t *fs, const char *path, const void *data, uint64_t size)
+{
+    assert(fs!=NULL&&path!=NULL&&data!=NULL,return -1;);
+    int64_t inode_idx = ext2_find_inode_by_path(fs, path, 0); // 查找路径对应的inode
+    if(inode_idx<0)
+    {
+        printf("Failed to find for file: %s\n", path);
+        return -1; // 返回错误
+    }
+
+    ext2_journal_start(fs);
+    ext2_inode_wrlock(fs, (uint64_t)inode_idx);
+    int64_t ret = ext2_overwrite_file(fs, inode_idx, data, size);
+    ext2_inode_unlock(fs, (uint64_t)inode_idx);
+    ext2_journal_stop(fs);
+    if(ret<0) // 如果覆盖文件失败
+    {
+        printf("Failed to write file: %s\n", path);
+        return -1; // 返回错误
+    }
+    printf("File written successfully: %s\n", path);
+    return 0;
+}
+
+
+/**
+ * @brief 根据路径读取文件内容
+ *
+ * 该函数用于根据给定的路径读取文件内容，并将其存储到buf中。如果文件不存在，则返回错误。
+ *
+ * @param fs 指向ext2文件系统的指针
+ * @param path 要读取的文件路径
+ * @param buf 用于存储读取的文件内容的缓冲区，至少为文件大小
+ *
+ * @return 成功返回0，失败返回-1。
+ */
+int64_t ext2_read_file_by_path(ext2_fs_t *fs, const char *path, void *buf)
+{
+    assert(fs!=NULL&&path!=NULL,return -1;);
+    int64_t inode_idx = ext2_find_inode_by_path(fs, path, 0); // 查找路径对应的inode
+    if(inode_idx<0)
+    {
+        printf("Failed to find or create directory for file: %s\n", path);
+        return -1; // 返回错误
+    }
+
+    ext2_inode_rdlock(fs, (uint64_t)inode_idx);
+    int64_t ret = ext2_read_file(fs, inode_idx, buf);
+    ext2_inode_unlock(fs, (uint64_t)inode_idx);
+    if(ret<0) // 如果读取文件失败
+    {
+        printf("Failed to read file: %s\n", path);
+     
+        return -1; // 返回错误
+    }
+    printf("File read successfully: %s\n", path);
+    return 0;
+}
+
+
+
+/**
+ * @brief 根据路径读取文件中的一段内容
+ *
+ * @param fs 指向ext2文件系统的指针
+ * @param path 要读取的文件路径
+ * @param buf 用于存储读取内容的缓冲区，至少len字节
+ * @param off 起始偏移
+ * @param len 要读的字节数
+ *
+ * @return 成功返回读到的字节数（off在文件末尾之后为0），失败返回-1。
+ */
+int64_t ext2_read_range_by_path(ext2_fs_t *fs, const char *path, void *buf, uint64_t off, uint64_t len)
+{
+    assert(fs!=NULL&&path!=NULL,return -1;);
+    int64_t inode_idx = ext2_find_inode_by_path(fs, path, 0); // 查找路径对应的inode
+    if(inode_idx<0)
+    {
+        printf("Failed to find file: %s\n", path);
+        return -1; // 返回错误
+    }
+    ext2_inode_rdlock(fs, (uint64_t)inode_idx);
+    int64_t ret = ext2_read_file_range(fs, (uint64_t)inode_idx, buf, off, len);
+    ext2_inode_unlock(fs, (uint64_t)inode_idx);
+    if(ret < 0)
+    {
+        printf("Failed to read file: %s\n", path);
+    }
+    return ret;
+}
+
+
+int64_t ext2_list_dir_by_path(ext2_fs_t *fs,const char *path)
+{
+    assert(fs!=NULL&&path!=NULL,return ERROR_INVALID_ARG;);
+    int64_t inode_idx = ext2_find_inode_by_path(fs, path, 0); // 查找路径对应的inode
+    if(inode_idx<0)
+    {
+         printf("Failed to find directory: %s\n", path);
+        return -1; // 返回错误
+    }
+    ext2_inode_rdlock(fs, (uint64_t)inode_idx);
+    int64_t ret = ext2_walk_entry(fs, inode_idx, print_entry);
+    ext2_inode_unlock(fs, (uint64_t)inode_idx);
+    return ret;
+}
+
+
+/**
+ * @brief 根据路径获取文件的大小
+ *
+ * 该函数用于根据给定的路径获取对应文件的大小（以字节为单位）。
+ *
+ * @param fs 指向ext2文件系统的指针
+ * @param path 要获取大小的文件或目录路径
+ *
+ * @return 返回文件的大小，如果发生错误则返回-1。
+ */
+int64_t ext2_get_inode_size_by_path(ext2_fs_t *fs, const char *path)
+{
+
+}
+
+
+
+// 打开的文件，记住inode和最近的块映射，读写时不用再解析路径
+typedef struct ext2_file
+{
+    ext2_fs_t *fs;
+    uint64_t inode_idx;
+    ext2_map_hint_t hint;
+}ext2_file_t;
+
+
+/**
+ * @brief 打开文件
+ *
+ * 只在打开时解析一次路径，之后的读写都通过句柄。句柄关闭之前删除这个文件会返回ERROR_BUSY。
+ *
+ * @param fs 指向ext2文件系统的指针
+ * @param path 文件路径
+ * @param flags EXT2_O_CREAT：不存在时创建；EXT2_O_TRUNC：打开后把文件截断为0
+ *
+ * @return 成功返回文件句柄，失败返回NULL。
+ */
+ext2_file_t* ext2_open(ext2_fs_t *fs, const char *path, uint64_t flags)
+{
+    assert(fs!=NULL&&path!=NULL,return NULL;);
+
+    char base_name[MAX_FILENAME_LEN];
+    int64_t dir_inode_idx = ext2_find_parent_by_path(fs, path, base_name);
+    if(dir_inode_idx < 0)
+    {
+        printf("Failed to find for file: %s\n", path);
+        return NULL;
+    }
+    ext2_journal_start(fs);
+    ext2_inode_wrlock(fs, (uint64_t)dir_inode_idx);
+    int64_t inode_idx = ext2_find_entry(fs, (uint64_t)dir_inode_idx, base_name);
+    if(inode_idx < 0 && (flags & EXT2_O_CREAT))
+    {
+        inode_idx = ext2_add_entry(fs, (uint64_t)dir_inode_idx, base_name, FILE_TYPE_FILE);
+    }
+    if(inode_idx >= 0)
+    {
+        ext2_inode_wrlock(fs, (uint64_t)inode_idx);
+    }
+    ext2_inode_unlock(fs, (uint64_t)dir_inode_idx);
+    if(inode_idx >= 0)
+    {
+        ext2_inode_t *inode = &fs->inode_table[inode_idx];
+        int64_t ok = inode->type == FILE_TYPE_FILE;
+        if(ok && (flags & EXT2_O_TRUNC) && inode->size > 0)
+        {
+            ok = ext2_map_truncate(fs, (uint64_t)inode_idx, 0) == 0;
+            if(ok)
+            {
+                inode->size = 0;
+                inode->ctime++;
+                ext2_mark_inode_dirty(fs, (uint64_t)inode_idx);
+            }
+        }
+        if(ok)
+        {
+            fs->open_count[inode_idx]++;
+        }
+        ext2_inode_unlock(fs, (uint64_t)inode_idx);
+        inode_idx = ok ? inode_idx : -1;
+    }
+    ext2_journal_stop(fs);
+    if(inode_idx < 0)
+    {
+        printf("Failed to open file: %s\n", path);
+        return NULL;
+    }
+
+    ext2_file_t *file = (ext2_file_t*)malloc(sizeof(ext2_file_t));
+    assert(file!=NULL,return NULL;);
+    file->fs = fs;
+    file->inode_idx = (uint64_t)inode_idx;
+    file->hint.len = 0;
+    pthread_mutex_init(&file->hint.lock, NULL);
+    return file;
+}
+
+
+/**
+ * @brief 关闭文件，修改的数据留在缓存中，由ext2_fs_sync或卸载时写回
+ *
+ * @param file 指向文件句柄的指针，成功后置为NULL
+ *
+ * @return 成功返回0，失败返回-1。
+ */
+int64_t ext2_close(ext2_file_t **file)
+{
+    assert(file!=NULL&&*file!=NULL,return -1;);
+    ext2_fs_t *fs = (*file)->fs;
+    ext2_inode_wrlock(fs, (*file)->inode_idx);
+    fs->open_count[(*file)->inode_idx]--;
+    ext2_inode_unlock(fs, (*file)->inode_idx);
+    pthread_mutex_destroy(&(*file)->hint.lock);
+    free(*file);
+    *file = NULL;
+    return 0;
+}
+
+
+/**
+ * @brief 从文件的off处读len字节
+ *
+ * 只读覆盖这段范围的块，读到文件末尾为止。
+ *
+ * @return 成功返回读到的字节数，off不小于文件大小时返回0，失败返回-1。
+ */
+int64_t ext2_pread(ext2_file_t *file, void *buf, uint64_t len, uint64_t off)
+{
+    assert(file!=NULL&&(buf!=NULL||len==0),return -1;);
+    ext2_inode_rdlock(file->fs, file->inode_idx);
+    int64_t ret = ext2_file_pread(file->fs, file->inode_idx, buf, len, off, &file->hint);
+    ext2_inode_unlock(file->fs, file->inode_idx);
+    return ret;
+}
+
+
+/**
+ * @brief 把len字节写到文件的off处
+ *
+ * 写到文件末尾之后时文件变大，原来的末尾和off之间补零。
+ *
+ * @return 成功返回写入的字节数，失败返回-1。
+ */
+int64_t ext2_pwrite(ext2_file_t *file, const void *buf, uint64_t len, uint64_t off)
+{
+    assert(file!=NULL&&(buf!=NULL||len==0),return -1;);
+    ext2_journal_start(file->fs);
+    ext2_inode_wrlock(file->fs, file->inode_idx);
+    int64_t ret = ext2_file_pwrite(file->fs, file->inode_idx, buf, len, off, &file->hint);
+    ext2_inode_unlock(file->fs, file->inode_idx);
+    ext2_journal_stop(file->fs);
+    return ret;
+}
+
+
+/**
+ * @brief 把iovcnt个片段首尾相接写到文件的off处
+ *
+ * 和把片段拼成一个缓冲区后调用ext2_pwrite的效果相同，但不需要拼接，
+ * 块只分配一次，inode只更新一次。追加时off取ext2_fsize(file)。
+ *
+ * @return 成功返回写入的总字节数，失败返回-1。
+ */
+int64_t ext2_pwritev(ext2_file_t *file, const ext2_iovec_t *iov, uint64_t iovcnt, uint64_t off)
+{
+    assert(file!=NULL&&(iov!=NULL||iovcnt==0),return -1;);
+    ext2_journal_start(file->fs);
+    ext2_inode_wrlock(file->fs, file->inode_idx);
+    int64_t ret = ext2_file_pwritev(file->fs, file->inode_idx, iov, iovcnt, off, &file->hint);
+    ext2_inode_unlock(file->fs, file->inode_idx);
+    ext2_journal_stop(file->fs);
+    return ret;
+}
+
+
+/**
+ * @brief 获取打开文件的大小
+ *
+ * @return 文件大小(字节)，失败返回-1。
+ */
+int64_t ext2_fsize(ext2_file_t *file)
+{
+    assert(file!=NULL,return -1;);
+    ext2_inode_rdlock(file->fs, file->inode_idx);
+    int64_t size = (int64_t)file->fs->inode_table[file->inode_idx].size;
+    ext2_inode_unlock(file->fs, file->inode_idx);
+    return size;
+}
+
+
+/**
+ * @brief 不拷贝地读取文件中[off, off+len)的内容
+ *
+ * 返回的视图只读，在调用ext2_unpin_views之前有效。期间文件不能被截断或删除，这些操作返回ERROR_BUSY；
+ * 其他句柄仍可以写这段范围，视图中看到的可能是写之前的内容，也可能是写之后的。
+ * 每次返回视图的调用都要用一次ext2_unpin_views把这次的视图一起释放。
+ * 只对内容做哈希、转发之类的处理时可以省掉所有中间拷贝。
+ *
+ * @param views 存放视图的数组，按文件顺序填写
+ * @param max 数组大小，视图不够时只覆盖前面一部分，覆盖的长度是各视图len之和
+ *
+ * @return 成功返回视图个数，off不小于文件大小时返回0，失败返回-1。
+ */
+int64_t ext2_pread_views(ext2_file_t *file, uint64_t off, uint64_t len, ext2_view_t *views, uint64_t max)
+{
+    assert(file!=NULL&&(views!=NULL||max==0),return -1;);
+    ext2_inode_rdlock(file->fs, file->inode_idx);
+    int64_t ret = ext2_file_views(file->fs, file->inode_idx, off, len, views, max, &file->hint);
+    if(ret > 0)
+    {
+        __atomic_fetch_add(&file->fs->view_count[file->inode_idx], 1, __ATOMIC_RELAXED); // 在读锁下加，截断在写锁下检查
+    }
+    ext2_inode_unlock(file->fs, file->inode_idx);
+    return ret;
+}
+
+
+/**
+ * @brief 释放ext2_pread_views一次返回的全部视图，解除对缓存块的引用，之后文件才能被截断或删除
+ */
+void ext2_unpin_views(ext2_file_t *file, ext2_view_t *views, uint64_t num)
+{
+    if(file==NULL || views==NULL || num==0)
+    {
+        return;
+    }
+    for(uint64_t i=0;i<num;i++)
+    {
+        bcache_put(file->fs->bcache, (bcache_buf_t*)views[i].pin);
+        views[i].pin = NULL;
+    }
+    __atomic_fetch_sub(&file->fs->view_count[file->inode_idx], 1, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * @brief 把目录dir_inode_idx下name的内容设为data，不存在时创建
+ *
+ * @return 成功返回文件的inode索引，失败返回-1。
+ */
+static int64_t ext2_batch_put(ext2_fs_t *fs, uint64_t dir_inode_idx, const char *name, const void *data, uint64_t size)
+{
+    ext2_inode_wrlock(fs, dir_inode_idx);
+    int64_t inode_idx = ext2_find_entry(fs, dir_inode_idx, name);
+    if(inode_idx < 0)
+    {
+        inode_idx = ext2_add_entry(fs, dir_inode_idx, name, FILE_TYPE_FILE);
+    }
+    if(inode_idx >= 0)
+    {
+        ext2_inode_wrlock(fs, (uint64_t)inode_idx); // 先锁住文件再放开目录，期间不会被删掉
+    }
+    ext2_inode_unlock(fs, dir_inode_idx);
+    if(inode_idx < 0)
+    {
+        return -1;
+    }
+
+    int64_t ret = inode_idx;
+    ext2_inode_t *inode = &fs->inode_table[inode_idx];
+    if(inode->type != FILE_TYPE_FILE)
+    {
+        ret = -1;
+    }
+    else if(inode->size > 0 && ext2_map_truncate(fs, (uint64_t)inode_idx, 0) < 0)
+    {
+        ret = -1;
+    }
+    else
+    {
+        if(inode->size > 0)
+        {
+            inode->size = 0;
+            ext2_mark_inode_dirty(fs, (uint64_t)inode_idx);
+        }
+        if(ext2_file_pwrite(fs, (uint64_t)inode_idx, data, size, 0, NULL) != (int64_t)size)
+        {
+            ret = -1;
+        }
+    }
+    ext2_inode_unlock(fs, (uint64_t)inode_idx);
+    return ret;
+}
+
+
+/**
+ * @brief 批量创建并写入文件
+ *
+ * 每个操作把path的内容设为data：文件不存在时创建，存在时先截断。
+ * 相邻的操作在同一个目录下时父目录只解析一次；元数据只在缓存中修改，
+ * 全部操作完成后统一写回一次，不逐个打印信息。
+ *
+ * @param fs 指向ext2文件系统的指针
+ * @param ops 操作数组，每个操作的ret填为文件的inode索引，失败时为-1
+ * @param num 操作个数
+ *
+ * @return 返回成功的操作数，写回失败返回-1。
+ */
+int64_t ext2_batch_write(ext2_fs_t *fs, ext2_batch_op_t *ops, uint64_t num)
+{
+    assert(fs!=NULL&&(ops!=NULL||num==0),return -1;);
+
+    const char *dir = NULL;  // 上一个操作的父目录路径
+    uint64_t dir_len = 0;
+    int64_t dir_inode_idx = -1;
+    int64_t done = 0;
+    for(uint64_t i=0;i<num;i++)
+    {
+        ext2_batch_op_t *op = &ops[i];
+        op->ret = -1;
+        if(op->path==NULL || (op->data==NULL && op->size>0))
+        {
+            continue;
+        }
+
+        char base_name[MAX_FILENAME_LEN];
+        const char *slash = strrchr(op->path, '/');
+        uint64_t len = slash==NULL ? 0 : (uint64_t)(slash - op->path);
+        uint64_t name_len = strlen(op->path + len + (slash!=NULL));
+        if(dir!=NULL && slash!=NULL && len==dir_len && strncmp(op->path, dir, len)==0 && name_len>0 && name_len<MAX_FILENAME_LEN)
+        {
+            memcpy(base_name, slash + 1, name_len + 1);
+        }
+        else
+        {
+            dir_inode_idx = ext2_find_parent_by_path(fs, op->path, base_name);
+            dir = slash!=NULL && name_len>0 ? op->path : NULL; // 以'/'结尾的路径不缓存
+            dir_len = len;
+        }
+        if(dir_inode_idx < 0)
+        {
+            dir = NULL;
+            continue;
+        }
+
+        ext2_journal_start(fs);
+        op->ret = ext2_batch_put(fs, (uint64_t)dir_inode_idx, base_name, op->data, op->size);
+        ext2_journal_stop(fs);
+        if(op->ret >= 0)
+        {
+            done++;
+        }
+    }
+
+    if(ext2_fs_sync(fs) < 0)
+    {
+        return -1;
+    }
+    return done;
+}
+
+
+#define EXT2_FSCK_CHUNK 256        // 检查线程每次领取的inode数
+#define EXT2_FSCK_MAX_THREADS 64   // 最多的检查线程数
+
+#define EXT2_FSCK_FREE   0 // inode没有被使用
+#define EXT2_FSCK_OK     1 // 在用，块映射完好，映射到的块已经记入ref
+#define EXT2_FSCK_BROKEN 2 // 在用，但块映射坏了，没有记入任何块
+
+// 一段物理上连续的块
+typedef struct ext2_fsck_run
+{
+    uint64_t start;
+    uint64_t len;
+}ext2_fsck_run_t;
+
+// 一个inode用到的所有块，包括间接块和extent节点，相邻的段合并
+typedef struct ext2_fsck_runs
+{
+    ext2_fsck_run_t *run;
+    uint64_t num;
+    uint64_t cap;
+    uint64_t data; // 其中的数据块数
+    uint64_t excess; // 不用extent时，指向inode->blocks之后的多余映射项数，它们指向的块不算在内
+}ext2_fsck_runs_t;
+
+typedef struct ext2_fsck
+{
+    ext2_fs_t *fs;
+    uint64_t flags;   // EXT2_FSCK_*
+    uint64_t *ref;    // 按块映射重建的块位图，和块位图一样按64位字存放，各线程原子地置位
+    uint64_t *dup;    // 被不止一个inode占用的块
+    uint8_t *state;   // 每个inode的EXT2_FSCK_FREE/OK/BROKEN
+    uint32_t *links;  // 每个inode被目录项引用的次数
+    uint64_t next;    // 下一段要领取的inode
+    uint64_t pass;    // 当前是第几遍
+    int64_t bad;      // 发现的问题数
+}ext2_fsck_t;
+
+
+static void ext2_fsck_report(ext2_fsck_t *ck)
+{
+    __atomic_fetch_add(&ck->bad, 1, __ATOMIC_RELAXED);
+}
+
+
+static int64_t ext2_fsck_add(ext2_fs_t *fs, ext2_fsck_runs_t *r, uint64_t start, uint64_t len)
+{
+    if(start == 0 || len == 0 || start + len > fs->super->blocks_count || start + len < start)
+    {
+        return -1;
+    }
+    if(r->num > 0 && r->run[r->num - 1].start + r->run[r->num - 1].len == start)
+    {
+        r->run[r->num - 1].len += len;
+        return 0;
+    }
+    if(r->num == r->cap)
+    {
+        uint64_t cap = r->cap ? r->cap * 2 : 16;
+        ext2_fsck_run_t *run = (ext2_fsck_run_t*)realloc(r->run, cap * sizeof(ext2_fsck_run_t));
+        if(run == NULL)
+        {
+            return -1;
+        }
+        r->run = run;
+        r->cap = cap;
+    }
+    r->run[r->num++] = (ext2_fsck_run_t){start, len};
+    return 0;
+}
+
+
+// 收集一棵间接块子树用到的块，[base, n)之内不能有空洞，之外的项记为多余，repair为1时清掉
+static int64_t ext2_fsck_ind(ext2_fs_t *fs, ext2_fsck_runs_t *r, uint64_t blk, uint64_t level, uint64_t base, uint64_t n, int repair)
+{
+    uint64_t span = 1;
+    for(uint64_t i = 1;i<level;i++)
+    {
+        span *= EXT2_PTRS_PER_BLOCK(fs);
+    }
+    if(ext2_fsck_add(fs, r, blk, 1) < 0)
+    {
+        return -1;
+    }
+    bcache_buf_t *buf = bcache_get(fs->bcache, blk);
+    if(buf == NULL)
+    {
+        return -1;
+    }
+    uint64_t *ptr = (uint64_t*)buf->data;
+    int64_t ret = 0;
+    for(uint64_t i = 0;i<EXT2_PTRS_PER_BLOCK(fs) && ret==0;i++)
+    {
+        uint64_t start = base + i * span;
+        if(start >= n)
+        {
+            if(ptr[i] != 0)
+            {
+                r->excess++;
+                if(repair)
+                {
+                    ptr[i] = 0;
+                    bcache_mark_dirty(fs->bcache, buf);
+                }
+            }
+            continue;
+        }
+        if(ptr[i] == 0)
+        {
+            ret = -1; // n之前不能有空洞
+            continue;
+        }
+        if(level == 1)
+        {
+            ret = ext2_fsck_add(fs, r, ptr[i], 1);
+            r->data++;
+            continue;
+        }
+        ret = ext2_fsck_ind(fs, r, ptr[i], level - 1, start, n, repair);
+    }
+    bcache_put(fs->bcache, buf);
+    return ret;
+}
+
+
+// 收集一棵extent子树用到的块，叶子必须从逻辑块0开始首尾相接
+static int64_t ext2_fsck_ext(ext2_fs_t *fs, ext2_fsck_runs_t *r, ext2_extent_header_t *h, uint64_t max, uint64_t *next)
+{
+    if(h->magic != EXT2_EXT_MAGIC || h->max > max || h->entries > h->max || h->depth > EXT2_EXT_MAX_DEPTH)
+    {
+        return -1;
+    }
+    if(h->depth == 0)
+    {
+        for(uint64_t i = 0;i<h->entries;i++)
+        {
+            ext2_extent_t *e = &EXT2_EXT_LEAF(h)[i];
+            if(e->lblk != *next || ext2_fsck_add(fs, r, e->pblk, e->len) < 0)
+            {
+                return -1;
+            }
+            *next += e->len;
+            r->data += e->len;
+        }
+        return 0;
+    }
+    int64_t ret = 0;
+    for(uint64_t i = 0;i<h->entries && ret==0;i++)
+    {
+        ext2_extent_idx_t *x = &EXT2_EXT_INDEX(h)[i];
+        if(ext2_fsck_add(fs, r, x->child, 1) < 0)
+        {
+            return -1;
+        }
+        bcache_buf_t *buf = bcache_get(fs->bcache, x->child);
+        if(buf == NULL)
+        {
+            return -1;
+        }
+        ext2_extent_header_t *child = (ext2_extent_header_t*)buf->data;
+        ret = child->depth + 1 == h->depth ? ext2_fsck_ext(fs, r, child, EXT2_EXT_NODE_MAX(fs), next) : -1;
+        bcache_put(fs->bcache, buf);
+    }
+    return ret;
+}
+
+
+/**
+ * @brief 收集inode用到的所有块
+ *
+ * inode->blocks之后的直接块和间接块项不算映射坏了，只计入r->excess，它们指向的块不收集，
+ * 修复时清掉这些项，块在重建位图时成为空闲块，inode->blocks之内的块保留。
+ *
+ * @param repair 为1时清掉多余的项，调用者负责把inode标脏
+ *
+ * @return 块映射完好并且正好映射了inode->blocks个数据块返回0，否则返回-1
+ */
+static int64_t ext2_fsck_map(ext2_fs_t *fs, ext2_inode_t *inode, ext2_fsck_runs_t *r, int repair)
+{
+    r->num = 0;
+    r->data = 0;
+    r->excess = 0;
+    if(inode->flags & EXT2_INODE_EXTENTS)
+    {
+        uint64_t next = 0;
+        if(ext2_fsck_ext(fs, r, (ext2_extent_header_t*)inode->blk_idx, EXT2_EXT_ROOT_MAX, &next) < 0)
+        {
+            return -1;
+        }
+        return r->data == inode->blocks ? 0 : -1;
+    }
+
+    uint64_t n = inode->blocks;
+    for(uint64_t i = 0;i<EXT2_NDIR_BLOCKS;i++)
+    {
+        if(i >= n && inode->blk_idx[i] != 0)
+        {
+            r->excess++;
+            if(repair)
+            {
+                inode->blk_idx[i] = 0;
+            }
+            continue;
+        }
+        if(inode->blk_idx[i] == 0 && i < n)
+        {
+            return -1;
+        }
+        if(i < n)
+        {
+            if(ext2_fsck_add(fs, r, inode->blk_idx[i], 1) < 0)
+            {
+                return -1;
+            }
+            r->data++;
+        }
+    }
+    uint64_t base = EXT2_NDIR_BLOCKS, span = EXT2_PTRS_PER_BLOCK(fs);
+    for(uint64_t level = 1;level<=3;level++)
+    {
+        uint64_t blk = inode->blk_idx[EXT2_IND_BLOCK + level - 1];
+        if(blk != 0 && base >= n)
+        {
+            r->excess++;
+            if(repair)
+            {
+                inode->blk_idx[EXT2_IND_BLOCK + level - 1] = 0;
+            }
+        }
+        else if(blk == 0 && base < n)
+        {
+            return -1;
+        }
+        else if(blk != 0 && ext2_fsck_ind(fs, r, blk, level, base, n, repair) < 0)
+        {
+            return -1;
+        }
+        base += span;
+        span *= EXT2_PTRS_PER_BLOCK(fs);
+    }
+    return r->data == n ? 0 : -1;
+}
+
+
+// 在ref中记下[start, start+len)，返回其中已经被别的inode占用的块数
+static uint64_t ext2_fsck_claim(ext2_fsck_t *ck, uint64_t start, uint64_t len)
+{
+    uint64_t twice = 0;
+    while(len > 0)
+    {
+        uint64_t w = start / 64, b = start % 64;
+        uint64_t n = 64 - b < len ? 64 - b : len;
+        uint64_t mask = (n == 64 ? ~0ULL : (1ULL << n) - 1) << b;
+        uint64_t old = __atomic_fetch_or(&ck->ref[w], mask, __ATOMIC_RELAXED) & mask;
+        if(old != 0)
+        {
+            __atomic_fetch_or(&ck->dup[w], old, __ATOMIC_RELAXED);
+            twice += (uint64_t)__builtin_popcountll(old);
+        }
+        start += n;
+        len -= n;
+    }
+    return twice;
+}
+
+
+// 从ref中去掉[start, start+len)，同时被别的inode占用的块保留
+static void ext2_fsck_unclaim(ext2_fsck_t *ck, uint64_t start, uint64_t len)
+{
+    for(uint64_t b = start;b<start + len;b++)
+    {
+        if(!(ck->dup[b / 64] & (1ULL << (b % 64))))
+        {
+            ck->ref[b / 64] &= ~(1ULL << (b % 64));
+        }
+    }
+}
+
+
+// 第一遍：检查inode的类型和块映射，把映射到的块记入ref
+static void ext2_fsck_inode(ext2_fsck_t *ck, uint64_t idx, ext2_fsck_runs_t *r)
+{
+    ext2_fs_t *fs = ck->fs;
+    ext2_inode_t *inode = &fs->inode_table[idx];
+    if(bitmap_test_bit(fs->inode_bitmap, idx) != 1)
+    {
+        return;
+    }
+    if(inode->type != FILE_TYPE_FILE && inode->type != FILE_TYPE_DIR)
+    {
+        printf("fsck: inode %lu is in use but has bad type %u\n", idx, inode->type);
+        ext2_fsck_report(ck);
+        return; // 当作空闲，指向它的目录项在第二遍中处理
+    }
+    int repair = (ck->flags & EXT2_FSCK_REPAIR) != 0;
+    if(ext2_fsck_map(fs, inode, r, repair) < 0)
+    {
+        printf("fsck: inode %lu has a bad block map\n", idx);
+        ext2_fsck_report(ck);
+        ck->state[idx] = EXT2_FSCK_BROKEN;
+        return;
+    }
+    if(r->excess > 0)
+    {
+        printf("fsck: inode %lu has %lu excess mapping entries past its %u blocks\n", idx, r->excess, inode->blocks);
+        ext2_fsck_report(ck);
+        if(repair)
+        {
+            ext2_mark_inode_dirty(fs, idx);
+        }
+    }
+    ck->state[idx] = EXT2_FSCK_OK;
+    for(uint64_t i = 0;i<r->num;i++)
+    {
+        uint64_t twice = ext2_fsck_claim(ck, r->run[i].start, r->run[i].len);
+        if(twice > 0)
+        {
+            printf("fsck: inode %lu claims %lu blocks from %lu that are already in use\n", idx, twice, r->run[i].start);
+            ext2_fsck_report(ck);
+        }
+    }
+    if(inode->type == FILE_TYPE_FILE && inode->size > (uint64_t)inode->blocks * fs->block_size)
+    {
+        printf("fsck: inode %lu size %lu is beyond its %u blocks\n", idx, inode->size, inode->blocks);
+        ext2_fsck_report(ck);
+        if(repair)
+        {
+            inode->size = (uint64_t)inode->blocks * fs->block_size;
+            ext2_mark_inode_dirty(fs, idx);
+        }
+    }
+}
+
+
+// 核对一个目录块中的目录项，指向空闲inode的和重复链接的项在修复时删掉
+static void ext2_fsck_entries(ext2_fsck_t *ck, uint64_t dir, bcache_buf_t *buf, uint64_t *live)
+{
+    ext2_fs_t *fs = ck->fs;
+    ext2_dir_entry_t *entries = (ext2_dir_entry_t*)buf->data;
+    int dirty = 0;
+    for(uint64_t j = 0;j<EXT2_DIR_ENTRIES_PER_BLOCK(fs);j++)
+    {
+        uint64_t t = entries[j].inode_idx;
+        if(t == 0)
+        {
+            continue;
+        }
+        const char *why = NULL;
+        if(t >= fs->super->inodes_count || ck->state[t] == EXT2_FSCK_FREE)
+        {
+            why = "points to free inode";
+        }
+        else if(__atomic_fetch_add(&ck->links[t], 1, __ATOMIC_RELAXED) > 0)
+        {
+            why = "is another link to inode";
+        }
+        if(why == NULL)
+        {
+            (*live)++;
+            continue;
+        }
+        printf("fsck: entry \"%.*s\" in directory %lu %s %lu\n", MAX_FILENAME_LEN, entries[j].name, dir, why, t);
+        ext2_fsck_report(ck);
+        if(ck->flags & EXT2_FSCK_REPAIR)
+        {
+            entries[j].name[0] = '\0';
+            entries[j].inode_idx = 0;
+            dirty = 1;
+        }
+    }
+    if(dirty)
+    {
+        bcache_mark_dirty(fs->bcache, buf);
+    }
+}
+
+
+// 按索引遍历索引目录的叶子块，levels含义同ext2_dx_walk
+static int64_t ext2_fsck_dx(ext2_fsck_t *ck, uint64_t dir, uint64_t lblk, int64_t levels, uint64_t *live)
+{
+    ext2_fs_t *fs = ck->fs;
+    ext2_inode_t *inode = &fs->inode_table[dir];
+    bcache_buf_t *buf = lblk < inode->blocks ? ext2_dir_get_block(fs, inode, lblk) : NULL;
+    if(buf == NULL)
+    {
+        return -1;
+    }
+    int64_t ret = 0;
+    if(levels < 0)
+    {
+        ext2_fsck_entries(ck, dir, buf, live);
+    }
+    else
+    {
+        ext2_dx_header_t *h = (ext2_dx_header_t*)buf->data;
+        if(h->magic != EXT2_DX_MAGIC || h->count > h->limit || h->limit > EXT2_DX_LIMIT(fs) || h->levels != levels)
+        {
+            ret = -1;
+        }
+        for(uint64_t i = 0;i<h->count && ret==0;i++)
+        {
+            ret = ext2_fsck_dx(ck, dir, EXT2_DX_ENTRIES(h)[i].lblk, levels - 1, live);
+        }
+    }
+    bcache_put(fs->bcache, buf);
+    return ret;
+}
+
+
+// 第二遍：统计每个inode被目录项引用的次数，核对目录大小
+static void ext2_fsck_dir(ext2_fsck_t *ck, uint64_t idx)
+{
+    ext2_fs_t *fs = ck->fs;
+    ext2_inode_t *inode = &fs->inode_table[idx];
+    if(ck->state[idx] != EXT2_FSCK_OK || inode->type != FILE_TYPE_DIR)
+    {
+        return;
+    }
+    uint64_t live = 0;
+    int64_t ret = 0;
+    if(inode->flags & EXT2_INODE_INDEX)
+    {
+        bcache_buf_t *root = inode->blocks > 0 ? ext2_dir_get_block(fs, inode, 0) : NULL;
+        int64_t levels = root != NULL ? ((ext2_dx_header_t*)root->data)->levels : -1;
+        if(root != NULL)
+        {
+            bcache_put(fs->bcache, root);
+        }
+        ret = levels >= 0 && levels <= EXT2_DX_MAX_LEVELS ? ext2_fsck_dx(ck, idx, 0, levels, &live) : -1;
+    }
+    else
+    {
+        for(uint64_t lblk = 0;lblk<inode->blocks && ret==0;lblk++)
+        {
+            bcache_buf_t *buf = ext2_dir_get_block(fs, inode, lblk);
+            if(buf == NULL)
+            {
+                ret = -1;
+                break;
+            }
+            ext2_fsck_entries(ck, idx, buf, &live);
+            bcache_put(fs->bcache, buf);
+        }
+    }
+    if(ret < 0)
+    {
+        printf("fsck: directory %lu has a bad index\n", idx);
+        ext2_fsck_report(ck);
+        return;
+    }
+    if(inode->size != live * sizeof(ext2_dir_entry_t))
+    {
+        printf("fsck: directory %lu size %lu, has %lu entries\n", idx, inode->size, live);
+        ext2_fsck_report(ck);
+        if(ck->flags & EXT2_FSCK_REPAIR)
+        {
+            inode->size = live * sizeof(ext2_dir_entry_t);
+            ext2_mark_inode_dirty(fs, idx);
+        }
+    }
+}
+
+
+static void* ext2_fsck_worker(void *arg)
+{
+    ext2_fsck_t *ck = (ext2_fsck_t*)arg;
+    ext2_fsck_runs_t runs = {NULL, 0, 0, 0, 0};
+    uint64_t num = ck->fs->super->inodes_count;
+    for(;;)
+    {
+        uint64_t lo = __atomic_fetch_add(&ck->next, EXT2_FSCK_CHUNK, __ATOMIC_RELAXED);
+        if(lo >= num)
+        {
+            break;
+        }
+        uint64_t hi = lo + EXT2_FSCK_CHUNK < num ? lo + EXT2_FSCK_CHUNK : num;
+        for(uint64_t i = lo;i<hi;i++)
+        {
+            if(ck->pass == 1)
+            {
+                ext2_fsck_inode(ck, i, &runs);
+            }
+            else
+            {
+                ext2_fsck_dir(ck, i);
+            }
+        }
+    }
+    free(runs.run);
+    return NULL;
+}
+
+
+// 用threads个线程(含调用者)跑一遍，各线程按EXT2_FSCK_CHUNK分段领取inode
+static void ext2_fsck_pass(ext2_fsck_t *ck, uint64_t pass, uint64_t threads)
+{
+    pthread_t tid[EXT2_FSCK_MAX_THREADS];
+    uint64_t n = 0;
+    ck->pass = pass;
+    ck->next = 0;
+    while(n + 1 < threads && pthread_create(&tid[n], NULL, ext2_fsck_worker, ck) == 0)
+    {
+        n++;
+    }
+    ext2_fsck_worker(ck);
+    for(uint64_t i = 0;i<n;i++)
+    {
+        pthread_join(tid[i], NULL);
+    }
+}
+
+
+/**
+ * @brief 第三遍：处理不在任何目录中的inode，比较重建的位图和现有的位图、计数
+ *
+ * 修复时块位图换成ref，inode位图按state重建，组描述符和超级块的计数按新位图重算。
+ */
+static void ext2_fsck_groups(ext2_fsck_t *ck, ext2_fsck_runs_t *r)
+{
+    ext2_fs_t *fs = ck->fs;
+    ext2_super_block_t *sb = fs->super;
+    int repair = (ck->flags & EXT2_FSCK_REPAIR) != 0;
+
+    for(uint64_t i = 0;i<sb->inodes_count;i++)
+    {
+        if(ck->state[i] == EXT2_FSCK_FREE)
+        {
+            continue;
+        }
+        if(ck->links[i] == 0 && i != ROOT_INODE_IDX)
+        {
+            printf("fsck: inode %lu is not in any directory\n", i);
+            ext2_fsck_report(ck);
+            if(repair)
+            {
+                // 块映射完好时把它的块从ref中去掉，和坏了的一样成为空闲块
+                if(ck->state[i] == EXT2_FSCK_OK && ext2_fsck_map(fs, &fs->inode_table[i], r, 0) == 0)
+                {
+                    for(uint64_t k = 0;k<r->num;k++)
+                    {
+                        ext2_fsck_unclaim(ck, r->run[k].start, r->run[k].len);
+                    }
+                }
+                ck->state[i] = EXT2_FSCK_FREE;
+            }
+        }
+        else if(ck->state[i] == EXT2_FSCK_BROKEN && repair)
+        {
+            // 还有目录项指向它，清空成一个没有块的文件
+            ext2_map_init(fs, &fs->inode_table[i]);
+            fs->inode_table[i].size = 0;
+            ext2_mark_inode_dirty(fs, i);
+            ck->state[i] = EXT2_FSCK_OK;
+        }
+    }
+    if(bitmap_test_bit(fs->inode_bitmap, ROOT_INODE_IDX) != 1 || fs->inode_table[ROOT_INODE_IDX].type != FILE_TYPE_DIR)
+    {
+        printf("fsck: root directory is missing\n");
+        ext2_fsck_report(ck);
+    }
+
+    uint64_t *old = (uint64_t*)bitmap_get_data(fs->block_bitmap);
+    uint64_t words = sb->blocks_per_group / 64; // 每组的块位图正好是整数个字
+    uint64_t ipg = sb->inodes_per_group;
+    uint64_t free_blocks = 0, free_inodes = 0, new_blocks = 0, new_inodes = 0;
+    for(uint64_t g = 0;g<sb->groups_count;g++)
+    {
+        uint64_t fb = 0, fi = 0, dirs = 0, nfb = 0, nfi = 0, ndirs = 0, marked_free = 0, leaked = 0, changed = 0;
+        for(uint64_t w = g*words;w<(g+1)*words;w++)
+        {
+            fb += 64 - (uint64_t)__builtin_popcountll(old[w]);
+            nfb += 64 - (uint64_t)__builtin_popcountll(ck->ref[w]);
+            marked_free += (uint64_t)__builtin_popcountll(ck->ref[w] & ~old[w]);
+            leaked += (uint64_t)__builtin_popcountll(old[w] & ~ck->ref[w]);
+        }
+        for(uint64_t i = g*ipg;i<(g+1)*ipg;i++)
+        {
+            int used = bitmap_test_bit(fs->inode_bitmap, i) == 1;
+            fi += !used;
+            dirs += used && fs->inode_table[i].type == FILE_TYPE_DIR;
+            nfi += ck->state[i] == EXT2_FSCK_FREE;
+            changed += used != (ck->state[i] != EXT2_FSCK_FREE);
+            ndirs += ck->state[i] != EXT2_FSCK_FREE && fs->inode_table[i].type == FILE_TYPE_DIR;
+        }
+        if(marked_free > 0)
+        {
+            printf("fsck: group %lu has %lu blocks in use but marked free\n", g, marked_free);
+            ext2_fsck_report(ck);
+        }
+        if(leaked > 0)
+        {
+            printf("fsck: group %lu has %lu blocks marked in use but not referenced\n", g, leaked);
+            ext2_fsck_report(ck);
+        }
+        ext2_group_descriptor_t *gd = &fs->group[g];
+        if(fb != gd->free_blocks_count || fi != gd->free_inodes_count || dirs != gd->used_dirs_count)
+        {
+            printf("fsck: group %lu counts free blocks %lu/%lu, free inodes %lu/%lu, dirs %lu/%lu\n", g,
+                   gd->free_blocks_count, fb, gd->free_inodes_count, fi, gd->used_dirs_count, dirs);
+            ext2_fsck_report(ck);
+        }
+        // 第0组总是在格式化时写好；修复时还带着未初始化标志的组交给下次提交写好再清掉标志
+        if((gd->flags & ~(uint64_t)EXT2_BG_UNINIT) || (g == 0 && gd->flags))
+        {
+            printf("fsck: group %lu has bad flags 0x%lx\n", g, gd->flags);
+            ext2_fsck_report(ck);
+            if(repair)
+            {
+                if(gd->flags & EXT2_BG_UNINIT)
+                {
+                    ext2_dirty_mark(&fs->group_init, g);
+                }
+                gd->flags &= EXT2_BG_UNINIT;
+                ext2_mark_group_dirty(fs, g);
+            }
+        }
+        free_blocks += fb;
+        free_inodes += fi;
+        new_blocks += nfb;
+        new_inodes += nfi;
+        if(repair && (marked_free || leaked || changed || nfb != gd->free_blocks_count || nfi != gd->free_inodes_count || ndirs != gd->used_dirs_count))
+        {
+            memcpy(&old[g*words], &ck->ref[g*words], words * sizeof(uint64_t));
+            for(uint64_t i = g*ipg;i<(g+1)*ipg;i++)
+            {
+                if(ck->state[i] == EXT2_FSCK_FREE)
+                {
+                    bitmap_clear_bit(fs->inode_bitmap, i);
+                }
+                else
+                {
+                    bitmap_set_bit(fs->inode_bitmap, i);
+                }
+            }
+            gd->free_blocks_count = nfb;
+            gd->free_inodes_count = nfi;
+            gd->used_dirs_count = ndirs;
+            ext2_dirty_mark(&fs->block_bitmap_dirty, g);
+            ext2_dirty_mark(&fs->inode_bitmap_dirty, g);
+            ext2_mark_group_dirty(fs, g);
+        }
+    }
+    if(free_blocks != sb->free_blocks_count || free_inodes != sb->free_inodes_count)
+    {
+        printf("fsck: super counts free blocks %lu/%lu, free inodes %lu/%lu\n", sb->free_blocks_count, free_blocks, sb->free_inodes_count, free_inodes);
+        ext2_fsck_report(ck);
+    }
+    if(repair && (new_blocks != sb->free_blocks_count || new_inodes != sb->free_inodes_count))
+    {
+        sb->free_blocks_count = new_blocks;
+        sb->free_inodes_count = new_inodes;
+        ext2_mark_super_dirty(fs);
+    }
+    if(repair)
+    {
+        bitmap_refresh(fs->block_bitmap);
+    }
+}
+
+
+/**
+ * @brief 并行检查文件系统，可选修复
+ *
+ * 第一遍各线程分段领取inode，检查类型和块映射，把用到的块(含间接块和extent节点)原子地记入重建的块位图，
+ * 同时发现被两个inode占用的块；第二遍各线程遍历自己领到的目录，统计每个inode被引用的次数，核对目录大小；
+ * 最后逐组比较重建的位图和现有的位图、计数，找出泄漏的块和不在任何目录中的inode。
+ * 修复时删掉指向空闲inode的目录项和重复的链接，释放不在目录中的inode，清掉inode->blocks之后多余的映射项，清空块映射坏了的inode，
+ * 再按重建的结果改写位图和计数并写回。被两个inode占用的块只报告不修复。
+ * 释放一个目录后它下面的inode才会变成孤儿，修复后应再检查一次，直到没有问题。
+ * 未初始化的组在加载时已经按全空建好，和其他组一样检查；后台初始化线程在检查期间暂停。
+ * 调用时不能有其他线程在使用文件系统。
+ *
+ * @param threads 检查线程数，为0时取在线的CPU数
+ * @param flags EXT2_FSCK_REPAIR表示修复
+ *
+ * @return 一致返回0，否则返回发现的问题数（每个问题都会打印出来），出错返回-1。
+ */
+int64_t ext2_fs_fsck(ext2_fs_t *fs, uint64_t threads, uint64_t flags)
+{
+    assert(fs!=NULL,return -1;);
+    int lazy = ext2_lazy_init_stop(fs);
+    // 把各线程的预留和缓存中的修改写回，之后内存中的位图和磁盘上一致
+    assert(ext2_fs_sync(fs)==0,return -1;);
+    ext2_super_block_t *sb = fs->super;
+    if(threads == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (uint64_t)cpus : 1;
+    }
+    if(threads > EXT2_FSCK_MAX_THREADS)
+    {
+        threads = EXT2_FSCK_MAX_THREADS;
+    }
+
+    uint64_t words = (EXT2_BLOCK_BITMAP_BITS(sb) + 63) / 64;
+    ext2_fsck_t ck = {fs, flags, NULL, NULL, NULL, NULL, 0, 0, 0};
+    ck.ref = (uint64_t*)calloc(words, sizeof(uint64_t));
+    ck.dup = (uint64_t*)calloc(words, sizeof(uint64_t));
+    ck.state = (uint8_t*)calloc(sb->inodes_count, sizeof(uint8_t));
+    ck.links = (uint32_t*)calloc(sb->inodes_count, sizeof(uint32_t));
+    ext2_fsck_runs_t runs = {NULL, 0, 0, 0, 0};
+    int64_t ret = -1;
+    if(ck.ref==NULL || ck.dup==NULL || ck.state==NULL || ck.links==NULL)
+    {
+        printf("ext2: fsck malloc error\n");
+        goto out;
+    }
+
+    // 超级块、组描述符表、每组的位图和inode表、日志区以及最后一组超出磁盘的部分都算作已占用
+    for(uint64_t g = 0;g<sb->groups_count;g++)
+    {
+        uint64_t start = g * sb->blocks_per_group;
+        uint64_t end = fs->group[g].data_block_start_idx;
+        if(end > start && end <= start + sb->blocks_per_group)
+        {
+            ext2_fsck_claim(&ck, start, end - start);
+        }
+    }
+    if(sb->features & EXT2_FEATURE_JOURNAL)
+    {
+        ext2_fsck_claim(&ck, sb->journal_start, sb->journal_blocks);
+    }
+    ext2_fsck_claim(&ck, sb->blocks_count, EXT2_BLOCK_BITMAP_BITS(sb) - sb->blocks_count);
+
+    ext2_fsck_pass(&ck, 1, threads);
+    ext2_fsck_pass(&ck, 2, threads);
+    ext2_fsck_groups(&ck, &runs);
+    ret = ck.bad;
+    if(ret > 0 && (flags & EXT2_FSCK_REPAIR))
+    {
+        dcache_clear(fs->dcache);
+        if(ext2_fs_sync(fs) < 0)
+        {
+            ret = -1;
+        }
+    }
+out:
+    free(runs.run);
+    free(ck.ref);
+    free(ck.dup);
+    free(ck.state);
+    free(ck.links);
+    if(lazy && ext2_fs_lazy_init(fs, 1) < 0)
+    {
+        ret = -1;
+    }
+    return ret;
+}
+
+
+/**
+ * @brief 只检查不修复，等同于ext2_fs_fsck(fs, 0, 0)
+ */
+int64_t ext2_fs_check(ext2_fs_t *fs)
+{
+    return ext2_fs_fsck(fs, 0, 0);
+}
@@ -11,21 +11,95 @@
 #define __EXT2_H__
 
 #include "stdint.h"
+#include "virtdisk.h"
 
 #define EXT2_SUPER_MAGIC 0xEF53
 
+#define EXT2_FEATURE_EXTENTS 0x1 // 新文件用extent映射数据块，否则用直接/间接块
+#define EXT2_FEATURE_DIR_INDEX 0x2 // 目录超过一个块后按文件名哈希建索引
+#define EXT2_FEATURE_JOURNAL 0x4 // 元数据先写进日志再写回原位，挂载时重放
+#define EXT2_FEATURE_LAZY_INIT 0x8 // 格式化时只写第0组的位图和inode表，其余组第一次用到时再写
+
+#define EXT2_DEFAULT_BLOCK_SIZE 512      // 默认块大小(字节)
+#define EXT2_MAX_BLOCK_SIZE 4096         // 最大块大小(字节)
+#define EXT2_DEFAULT_INODE_DENSITY 2048  // 默认每GiB的inode数
+
 typedef struct ext2_fs ext2_fs_t;
 
-extern ext2_fs_t* ext2_fs_create();
+// 创建文件系统的参数，为0的字段取默认值
+typedef struct ext2_fs_params
+{
+    uint64_t block_size;       // 块大小(字节)：512、1024、2048或4096，默认是能放下整个文件系统的最小块大小
+    uint64_t size;             // 文件系统大小(字节)，不超过磁盘大小，默认是整个磁盘
+    uint64_t inodes_count;     // inode总数，默认按inode_density计算，至少128个
+    uint64_t inode_density;    // 每GiB的inode数，只在没有指定inodes_count时使用
+    uint64_t reserved_percent; // 保留给目录和块映射的空间占总块数的百分比，文件数据不能用，默认不保留
+}ext2_fs_params_t;
+
+extern ext2_fs_t* ext2_fs_create(disk_t *disk, const ext2_fs_params_t *params); // params为NULL时全部取默认值
+extern int64_t ext2_fs_set_features(ext2_fs_t *fs, uint64_t features); // 格式化前设置EXT2_FEATURE_*
 extern int64_t ext2_fs_format(ext2_fs_t *fs);
 extern int64_t ext2_fs_load(ext2_fs_t *fs);
+extern int64_t ext2_fs_sync(ext2_fs_t *fs); // 写回缓存和元数据
+extern int64_t ext2_fs_unmount(ext2_fs_t **fs); // 写回并释放文件系统
+extern int64_t ext2_fs_set_cache_capacity(ext2_fs_t *fs, uint64_t capacity); // 调整块缓存容量
+extern int64_t ext2_fs_lazy_init(ext2_fs_t *fs, int background); // 写好格式化时跳过的组，background为1时在后台线程中进行
+extern int64_t ext2_fs_check(ext2_fs_t *fs); // 核对位图、空闲计数和块映射，返回发现的问题数
+
+#define EXT2_FSCK_REPAIR 0x1 // 修复发现的问题
+
+extern int64_t ext2_fs_fsck(ext2_fs_t *fs, uint64_t threads, uint64_t flags); // 多线程检查，threads为0时按CPU数，返回发现的问题数
 
 extern int64_t ext2_create_dir_by_path(ext2_fs_t *fs, const char *path);// 创建目录
 extern int64_t ext2_create_file_by_path(ext2_fs_t *fs, const char *path); // 创建文件
 extern int64_t ext2_overwrite_file_by_path(ext2_fs_t *fs, const char *path, const void *data, uint64_t size); // 覆盖写
 extern int64_t ext2_append_file_by_path(ext2_fs_t *fs, const char *path, const void *data, uint64_t size); // 追加写
 extern int64_t ext2_read_file_by_path(ext2_fs_t *fs, const char *path, void *buf); // 读取
+extern int64_t ext2_read_range_by_path(ext2_fs_t *fs, const char *path, void *buf, uint64_t off, uint64_t len); // 读取一段，返回读到的字节数
 extern int64_t ext2_unlink_by_path(ext2_fs_t *fs, const char *path);
 extern int64_t ext2_get_inode_size_by_path(ext2_fs_t *fs, const char *path); // 查询文件大小
 extern int64_t ext2_list_dir_by_path(ext2_fs_t *fs,const char *path);
+
+// 批量写入的一个操作：把path的内容设为data，不存在时创建
+typedef struct ext2_batch_op
+{
+    const char *path;
+    const void *data;
+    uint64_t size;
+    int64_t ret; // 完成后为文件的inode索引，失败为-1
+}ext2_batch_op_t;
+
+extern int64_t ext2_batch_write(ext2_fs_t *fs, ext2_batch_op_t *ops, uint64_t num); // 返回成功的操作数
+
+// 文件句柄：打开时解析一次路径，之后按偏移读写
+typedef struct ext2_file ext2_file_t;
+
+#define EXT2_O_CREAT 0x1 // 文件不存在时创建
+#define EXT2_O_TRUNC 0x2 // 打开时把文件截断为0
+
+extern ext2_file_t* ext2_open(ext2_fs_t *fs, const char *path, uint64_t flags);
+extern int64_t ext2_close(ext2_file_t **file);
+extern int64_t ext2_pread(ext2_file_t *file, void *buf, uint64_t len, uint64_t off); // 返回读到的字节数
+extern int64_t ext2_pwrite(ext2_file_t *file, const void *buf, uint64_t len, uint64_t off); // 返回写入的字节数
+extern int64_t ext2_fsize(ext2_file_t *file); // 文件大小
+
+// 分散写的一个片段
+typedef struct ext2_iovec
+{
+    const void *base;
+    uint64_t len;
+}ext2_iovec_t;
+
+extern int64_t ext2_pwritev(ext2_file_t *file, const ext2_iovec_t *iov, uint64_t iovcnt, uint64_t off); // 返回写入的总字节数
+
+// 文件内容的只读视图，指向块缓存或内存中的磁盘映像
+typedef struct ext2_view
+{
+    const void *data;
+    uint64_t len;
+    void *pin; // 被引用的缓存块，直接指向磁盘映像时为NULL
+}ext2_view_t;
+
+extern int64_t ext2_pread_views(ext2_file_t *file, uint64_t off, uint64_t len, ext2_view_t *views, uint64_t max); // 返回视图个数
+extern void ext2_unpin_views(ext2_file_t *file, ext2_view_t *views, uint64_t num); // 一次释放ext2_pread_views返回的全部视图，之前文件不能被截断或删除
 #endif
\ No newline at end of file
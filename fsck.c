@@ -0,0 +1,110 @@
+/**
+ * @FilePath: /simple_file_system_test/fsck.c
+ * @Description: 检查ext2镜像文件，可选修复
+ * @Copyright    : G AUTOMOBILE RESEARCH INSTITUTE CO.,LTD Copyright (c) 2025.
+*/
+#define _POSIX_C_SOURCE 200809L // clock_gettime
+#include "stdio.h"
+#include "stdlib.h"
+#include "string.h"
+#include "time.h"
+#include "unistd.h"
+#include "ext2.h"
+
+// 退出码和e2fsck一致：0没有问题，1问题已修复，4还有问题没修，8运行出错
+#define FSCK_OK          0
+#define FSCK_REPAIRED    1
+#define FSCK_UNCORRECTED 4
+#define FSCK_ERROR       8
+
+static void usage(const char *prog)
+{
+    printf("usage: %s [-y] [-j threads] image\n", prog);
+    printf("  -y          repair the problems found\n");
+    printf("  -j threads  number of checker threads, default is the number of CPUs\n");
+}
+
+int main(int argc, char *argv[])
+{
+    uint64_t flags = 0;
+    uint64_t threads = 0;
+    int opt;
+    while((opt = getopt(argc, argv, "yj:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 'y': flags |= EXT2_FSCK_REPAIR; break;
+            case 'j': threads = strtoull(optarg, NULL, 0); break;
+            default: usage(argv[0]); return FSCK_ERROR;
+        }
+    }
+    if(optind != argc - 1)
+    {
+        usage(argv[0]);
+        return FSCK_ERROR;
+    }
+    const char *path = argv[optind];
+    if(access(path, R_OK | W_OK) != 0)
+    {
+        printf("%s: cannot open %s\n", argv[0], path);
+        return FSCK_ERROR;
+    }
+
+    // 大小为0时按镜像文件的实际大小映射
+    disk_t *disk = disk_open(&disk_mmap_ops, path, 0);
+    if(disk == NULL)
+    {
+        return FSCK_ERROR;
+    }
+    ext2_fs_t *fs = ext2_fs_create(disk, NULL); // 块大小等参数从超级块读取
+    if(fs == NULL || ext2_fs_load(fs) < 0)
+    {
+        printf("%s: %s is not a valid image\n", argv[0], path);
+        if(fs != NULL)
+        {
+            ext2_fs_unmount(&fs);
+        }
+        disk_close(&disk);
+        return FSCK_ERROR;
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int64_t bad = ext2_fs_fsck(fs, threads, flags);
+    int64_t left = bad;
+    // 修复可能带出新的问题(释放的目录下的inode成为孤儿)，重复到没有问题或者问题不再减少
+    while((flags & EXT2_FSCK_REPAIR) && left > 0)
+    {
+        int64_t again = ext2_fs_fsck(fs, threads, flags);
+        if(again < 0 || again >= left)
+        {
+            left = again;
+            break;
+        }
+        left = again;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double t = (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) / 1e9;
+
+    int ret = FSCK_OK;
+    if(bad < 0 || left < 0)
+    {
+        printf("%s: check failed\n", path);
+        ret = FSCK_ERROR;
+    }
+    else if(bad == 0)
+    {
+        printf("%s: clean, %.3fs\n", path, t);
+    }
+    else
+    {
+        printf("%s: %ld problems, %ld left, %.3fs\n", path, bad, left, t);
+        ret = left == 0 ? FSCK_REPAIRED : FSCK_UNCORRECTED;
+    }
+    if(ext2_fs_unmount(&fs) < 0)
+    {
+        ret = FSCK_ERROR;
+    }
+    disk_close(&disk);
+    return ret;
+}
@@ -10,24 +10,312 @@
 #include "stdio.h"
 #include "ext2.h"
 #include "stddef.h"
+#include "stdlib.h"
+#include "string.h"
 #include "assert.h"
+#include <pthread.h>
 
-#define BLOCK_SIZE 512
-#define BLOCK_COUNT 4
+#define DISK_SIZE (64*1024*1024) // 内存磁盘或新建镜像文件的大小
+#define DATA_SIZE 2048            // 长文件读写测试的数据量
 
-int main()
+#define STRESS_THREADS 4 // 并发测试的线程数
+#define STRESS_FILES 16  // 每个线程创建的文件数
+#define SHARED_SIZE (256*1024) // 多个线程共用一个句柄读的文件大小
+#define SHARED_READS 200       // 每个线程读的次数
+#define CRASH_SIZE (256*1024) // 掉电测试中文件的大小，要比线程预留的块多，新文件才会用到刚释放的块
+#define NOSPC_DISK (1024*1024) // 空间用尽测试的磁盘大小，块大小512
+#define NOSPC_BLOCKS 73        // 直接块和一次间接块正好用满，再追加一块要新建二次间接块和它下面的一次间接块
+#define REPAIR_OFF_SIZE 8      // 修复测试中inode里size字段的偏移，和ext2.c中ext2_inode_t的布局一致
+#define REPAIR_OFF_BLOCKS 28   // 修复测试中inode里blocks字段的偏移
+
+typedef struct stress_arg
+{
+    ext2_fs_t *fs;
+    uint64_t id;
+    uint64_t bad; // 读回的内容和写入的不一致的次数
+    ext2_file_t *file; // 共享句柄测试中所有线程共用的句柄
+}stress_arg_t;
+
+// 每个线程在同一个目录下建自己的文件，写入后读回核对，再删掉其中一部分
+static void* stress_worker(void *p)
+{
+    stress_arg_t *arg = (stress_arg_t*)p;
+    char path[64];
+    uint8_t data[3000], back[3000];
+    for(uint64_t i = 0; i<STRESS_FILES;i++)
+    {
+        sprintf(path, "/stress/t%lu_%lu", arg->id, i);
+        uint64_t len = 100 + (arg->id * 131 + i * 977) % 2900;
+        for(uint64_t k = 0; k<len;k++)
+        {
+            data[k] = (uint8_t)(arg->id + i + k);
+        }
+        ext2_file_t *file = ext2_open(arg->fs, path, EXT2_O_CREAT | EXT2_O_TRUNC);
+        if(file == NULL)
+        {
+            arg->bad++;
+            continue;
+        }
+        if(ext2_pwrite(file, data, len, 0) != (int64_t)len || ext2_pread(file, back, len, 0) != (int64_t)len || memcmp(data, back, len) != 0)
+        {
+            arg->bad++;
+        }
+        ext2_close(&file);
+        if(i % 4 == 0)
+        {
+            ext2_unlink_by_path(arg->fs, path);
+        }
+    }
+    return NULL;
+}
+
+static uint8_t shared_byte(uint64_t off)
+{
+    return (uint8_t)(off * 7 + off / 509);
+}
+
+// 所有线程用同一个句柄读同一个文件的不同位置，句柄中的映射提示被轮流改写
+static void* shared_worker(void *p)
+{
+    stress_arg_t *arg = (stress_arg_t*)p;
+    uint8_t back[1000];
+    for(uint64_t i = 0; i<SHARED_READS;i++)
+    {
+        uint64_t off = (arg->id * 7919 + i * 104729) % (SHARED_SIZE - sizeof(back));
+        if(ext2_pread(arg->file, back, sizeof(back), off) != (int64_t)sizeof(back))
+        {
+            arg->bad++;
+            continue;
+        }
+        for(uint64_t k = 0; k<sizeof(back);k++)
+        {
+            if(back[k] != shared_byte(off + k))
+            {
+                arg->bad++;
+                break;
+            }
+        }
+    }
+    return NULL;
+}
+
+static int crash_dropped = 0; // 为1时丢掉所有写，模拟掉电
+
+static int64_t crash_write(disk_t *disk, const void *buf, uint64_t sector, uint64_t count)
+{
+    return crash_dropped ? 0 : disk_mem_ops.write(disk, buf, sector, count);
+}
+
+static int64_t crash_flush(disk_t *disk)
+{
+    return crash_dropped ? 0 : disk_mem_ops.flush(disk);
+}
+
+// 删掉已经提交的/A后建/B并写入，在下一次提交前掉电；重新加载后/A还在，内容不能被/B的数据覆盖
+static uint64_t crash_test(void)
+{
+    disk_ops_t ops = disk_mem_ops;
+    ops.write = crash_write;
+    ops.flush = crash_flush;
+    disk_t *disk = disk_open(&ops, NULL, DISK_SIZE);
+    ext2_fs_t *fs = ext2_fs_create(disk, NULL);
+    ext2_fs_format(fs);
+
+    uint8_t *data = malloc(CRASH_SIZE), *back = malloc(CRASH_SIZE);
+    memset(data, 'A', CRASH_SIZE);
+    ext2_file_t *file = ext2_open(fs, "/A", EXT2_O_CREAT);
+    ext2_pwrite(file, data, CRASH_SIZE, 0);
+    ext2_close(&file);
+    ext2_fs_sync(fs);
+
+    ext2_unlink_by_path(fs, "/A");
+    memset(data, 'B', CRASH_SIZE);
+    file = ext2_open(fs, "/B", EXT2_O_CREAT);
+    ext2_pwrite(file, data, CRASH_SIZE, 0);
+    ext2_close(&file);
+    crash_dropped = 1;
+    ext2_fs_unmount(&fs); // 卸载时的写全部丢掉，相当于没卸载就掉电
+    crash_dropped = 0;
+
+    uint64_t bad = 1;
+    fs = ext2_fs_create(disk, NULL);
+    if(fs != NULL && ext2_fs_load(fs) == 0)
+    {
+        memset(data, 'A', CRASH_SIZE);
+        file = ext2_open(fs, "/A", 0);
+        bad = file == NULL || ext2_pread(file, back, CRASH_SIZE, 0) != CRASH_SIZE || memcmp(data, back, CRASH_SIZE) != 0;
+        if(file != NULL)
+        {
+            ext2_close(&file);
+        }
+        bad += ext2_fs_check(fs) != 0;
+        ext2_fs_unmount(&fs);
+    }
+    disk_close(&disk);
+    free(data);
+    free(back);
+    return bad;
+}
+
+// 不用extent，文件用满直接块和一次间接块后只剩2个空闲块，再追加一块时数据块和二次间接块分配成功、下一级间接块分配失败；
+// 追加失败后文件的映射和内容不变，也不能留下没人引用的块
+static uint64_t nospc_test(void)
+{
+    disk_t *disk = disk_open(&disk_mem_ops, NULL, NOSPC_DISK);
+    ext2_fs_params_t params = {512, 0, 0, 0, 0};
+    ext2_fs_t *fs = ext2_fs_create(disk, &params);
+    ext2_fs_set_features(fs, EXT2_FEATURE_DIR_INDEX | EXT2_FEATURE_JOURNAL);
+    ext2_fs_format(fs);
+
+    uint8_t *data = malloc(NOSPC_BLOCKS*512), *back = malloc(NOSPC_BLOCKS*512);
+    for(uint64_t i = 0; i<NOSPC_BLOCKS*512;i++)
+    {
+        data[i] = shared_byte(i);
+    }
+    ext2_file_t *file = ext2_open(fs, "/A", EXT2_O_CREAT);
+    ext2_pwrite(file, data, NOSPC_BLOCKS*512, 0);
+    ext2_close(&file);
+    file = ext2_open(fs, "/S", EXT2_O_CREAT);
+    ext2_pwrite(file, data, 2*512, 0); // 两个直接块，删掉后正好空出2块
+    ext2_close(&file);
+    file = ext2_open(fs, "/F", EXT2_O_CREAT);
+    for(uint64_t off = 0; ext2_pwrite(file, data, 512, off) == 512;off+=512);
+    ext2_close(&file);
+    ext2_unlink_by_path(fs, "/S");
+    ext2_fs_sync(fs);
+
+    file = ext2_open(fs, "/A", 0);
+    uint64_t bad = ext2_pwrite(file, data, 512, NOSPC_BLOCKS*512) == 512; // 应当因为空间不足失败
+    bad += ext2_fsize(file) != NOSPC_BLOCKS*512;
+    bad += ext2_pread(file, back, NOSPC_BLOCKS*512, 0) != NOSPC_BLOCKS*512 || memcmp(data, back, NOSPC_BLOCKS*512) != 0;
+    ext2_close(&file);
+    ext2_fs_sync(fs);
+    bad += ext2_fs_check(fs) != 0;
+    ext2_fs_unmount(&fs);
+    disk_close(&disk);
+    free(data);
+    free(back);
+    return bad;
+}
+
+// 改写磁盘映像，把用到二次间接块的文件的blocks和size减成NOSPC_BLOCKS，二次间接块就成了多余的映射；
+// 修复后只去掉二次间接块这棵子树，前NOSPC_BLOCKS块的内容保留
+static uint64_t repair_test(void)
+{
+    disk_t *disk = disk_open(&disk_mem_ops, NULL, NOSPC_DISK);
+    ext2_fs_params_t params = {512, 0, 0, 0, 0};
+    ext2_fs_t *fs = ext2_fs_create(disk, &params);
+    ext2_fs_set_features(fs, EXT2_FEATURE_DIR_INDEX | EXT2_FEATURE_JOURNAL);
+    ext2_fs_format(fs);
+
+    uint64_t len = (NOSPC_BLOCKS + 1) * 512;
+    uint8_t *data = malloc(len), *back = malloc(len), *image = malloc(NOSPC_DISK);
+    for(uint64_t i = 0; i<len;i++)
+    {
+        data[i] = shared_byte(i);
+    }
+    ext2_file_t *file = ext2_open(fs, "/A", EXT2_O_CREAT);
+    ext2_pwrite(file, data, len, 0);
+    ext2_close(&file);
+    ext2_fs_unmount(&fs);
+
+    // 按type、size和blocks找到/A的inode，日志区里可能还有一份inode表块的副本，一起改掉
+    uint64_t found = 0;
+    disk_read_range(disk, image, 0, NOSPC_DISK / disk->sector_size);
+    for(uint64_t off = 0; off + REPAIR_OFF_BLOCKS + 4 <= NOSPC_DISK;off+=8)
+    {
+        uint32_t type, blocks;
+        uint64_t size;
+        memcpy(&type, image + off, 4);
+        memcpy(&size, image + off + REPAIR_OFF_SIZE, 8);
+        memcpy(&blocks, image + off + REPAIR_OFF_BLOCKS, 4);
+        if(type == 2 && size == len && blocks == NOSPC_BLOCKS + 1)
+        {
+            size = NOSPC_BLOCKS * 512;
+            blocks = NOSPC_BLOCKS;
+            memcpy(image + off + REPAIR_OFF_SIZE, &size, 8);
+            memcpy(image + off + REPAIR_OFF_BLOCKS, &blocks, 4);
+            found++;
+        }
+    }
+    disk_write_range(disk, image, 0, NOSPC_DISK / disk->sector_size);
+
+    uint64_t bad = found == 0;
+    fs = ext2_fs_create(disk, NULL);
+    if(fs != NULL && ext2_fs_load(fs) == 0)
+    {
+        bad += ext2_fs_fsck(fs, 0, EXT2_FSCK_REPAIR) <= 0; // 应当发现多余的映射和泄漏的块
+        bad += ext2_fs_check(fs) != 0;
+        file = ext2_open(fs, "/A", 0);
+        bad += file == NULL || ext2_fsize(file) != NOSPC_BLOCKS * 512;
+        bad += file == NULL || ext2_pread(file, back, len, 0) != NOSPC_BLOCKS * 512 || memcmp(data, back, NOSPC_BLOCKS * 512) != 0;
+        if(file != NULL)
+        {
+            ext2_close(&file);
+        }
+        ext2_fs_unmount(&fs);
+    }
+    disk_close(&disk);
+    free(data);
+    free(back);
+    free(image);
+    return bad;
+}
+
+// 视图没释放时另一个句柄截断文件要失败，块不能被释放给别的文件；释放后才能截断
+static uint64_t views_test(ext2_fs_t *fs)
+{
+    uint8_t data[4096];
+    memset(data, 'V', sizeof(data));
+    ext2_file_t *file = ext2_open(fs, "/views", EXT2_O_CREAT | EXT2_O_TRUNC);
+    ext2_pwrite(file, data, sizeof(data), 0);
+    ext2_view_t views[16];
+    int64_t num = ext2_pread_views(file, 0, sizeof(data), views, 16);
+    ext2_file_t *trunc = ext2_open(fs, "/views", EXT2_O_TRUNC);
+    uint64_t bad = num <= 0 || trunc != NULL || ext2_unlink_by_path(fs, "/views") == 0;
+    for(int64_t i = 0; i<num;i++)
+    {
+        bad += memcmp(views[i].data, data, views[i].len) != 0;
+    }
+    ext2_unpin_views(file, views, (uint64_t)num);
+    if(trunc != NULL)
+    {
+        ext2_close(&trunc);
+    }
+    trunc = ext2_open(fs, "/views", EXT2_O_TRUNC);
+    bad += trunc == NULL || ext2_fsize(file) != 0;
+    if(trunc != NULL)
+    {
+        ext2_close(&trunc);
+    }
+    ext2_close(&file);
+    bad += ext2_unlink_by_path(fs, "/views") != 0;
+    return bad;
+}
+
+int main(int argc, char *argv[])
 {
 
-    char *long_data = malloc(BLOCK_SIZE * BLOCK_COUNT);
-    char *read = malloc(BLOCK_SIZE * BLOCK_COUNT);
+    char *long_data = malloc(DATA_SIZE);
+    char *read = malloc(DATA_SIZE);
 // 填充重复数据
-    for (int i = 0; i < BLOCK_SIZE * BLOCK_COUNT-100; ++i) {
+    for (int i = 0; i < DATA_SIZE-100; ++i) {
         long_data[i] = 'A' ;
         long_data[i+1] = 0;
     }
     
 
-    ext2_fs_t *fs = ext2_fs_create();
+    // 带参数时把文件系统建在主机镜像文件上，否则使用内存磁盘；第二个参数选择文件后端(mmap/file/uring)
+    const disk_ops_t *ops = &disk_mem_ops;
+    if(argc > 1)
+    {
+        ops = &disk_mmap_ops;
+        if(argc > 2 && strcmp(argv[2], "file") == 0) ops = &disk_file_ops;
+        if(argc > 2 && strcmp(argv[2], "uring") == 0) ops = &disk_uring_ops;
+    }
+    disk_t *disk = disk_open(ops, argc > 1 ? argv[1] : NULL, DISK_SIZE);
+    assert(disk != NULL,printf("disk open failed\n");return -1;);
+    ext2_fs_t *fs = ext2_fs_create(disk, NULL);
     assert(fs != NULL,printf("NULL prt\n");); 
     ext2_fs_format(fs);
     // ext2_fs_load(fs);
@@ -41,11 +329,71 @@ int main()
         sprintf(long_data,"/a/b/testfile%lu.txt",i);
         ext2_create_file_by_path(fs, long_data);
         ext2_append_file_by_path(fs, long_data, long_data,strlen(long_data));
+        memset(read, 0, DATA_SIZE); // 只读回文件大小那么多字节，不带结束符
         ext2_read_file_by_path(fs, long_data, read);
         printf("read file %s:\n%s\n", long_data, read);
     }
 
-    
+    // 同样的小文件用批量接口一次写入，父目录只解析一次，元数据最后统一写回
+    char batch_path[20][32];
+    ext2_batch_op_t batch[20];
+    for(uint64_t i = 0; i<20;i++)
+    {
+        sprintf(batch_path[i],"/a/b/batch%lu.txt",i);
+        batch[i] = (ext2_batch_op_t){batch_path[i], batch_path[i], strlen(batch_path[i]), -1};
+    }
+    printf("batch write %ld files\n", ext2_batch_write(fs, batch, 20));
+
+    // 多个线程同时在一个目录下建文件、读写、删除，结束后核对位图和计数
+    ext2_create_dir_by_path(fs, "/stress");
+    pthread_t threads[STRESS_THREADS];
+    stress_arg_t args[STRESS_THREADS];
+    for(uint64_t i = 0; i<STRESS_THREADS;i++)
+    {
+        args[i] = (stress_arg_t){fs, i, 0, NULL};
+        pthread_create(&threads[i], NULL, stress_worker, &args[i]);
+    }
+    uint64_t stress_bad = 0;
+    for(uint64_t i = 0; i<STRESS_THREADS;i++)
+    {
+        pthread_join(threads[i], NULL);
+        stress_bad += args[i].bad;
+    }
+    ext2_fs_sync(fs);
+    printf("stress bad %lu, check %ld\n", stress_bad, ext2_fs_check(fs));
+
+    // 和另一个文件交替追加，文件的块分成许多段，读的时候各线程的映射提示互相覆盖
+    uint8_t chunk[512];
+    ext2_file_t *shared = ext2_open(fs, "/stress/shared", EXT2_O_CREAT | EXT2_O_TRUNC);
+    ext2_file_t *filler = ext2_open(fs, "/stress/filler", EXT2_O_CREAT | EXT2_O_TRUNC);
+    for(uint64_t off = 0; off<SHARED_SIZE;off+=sizeof(chunk))
+    {
+        for(uint64_t k = 0; k<sizeof(chunk);k++)
+        {
+            chunk[k] = shared_byte(off + k);
+        }
+        ext2_pwrite(shared, chunk, sizeof(chunk), off);
+        ext2_pwrite(filler, chunk, sizeof(chunk), off);
+    }
+    ext2_close(&filler);
+    for(uint64_t i = 0; i<STRESS_THREADS;i++)
+    {
+        args[i] = (stress_arg_t){fs, i, 0, shared};
+        pthread_create(&threads[i], NULL, shared_worker, &args[i]);
+    }
+    stress_bad = 0;
+    for(uint64_t i = 0; i<STRESS_THREADS;i++)
+    {
+        pthread_join(threads[i], NULL);
+        stress_bad += args[i].bad;
+    }
+    ext2_close(&shared);
+    printf("shared handle bad %lu\n", stress_bad);
+    printf("views bad %lu\n", views_test(fs));
+    printf("crash bad %lu\n", crash_test());
+    printf("nospc bad %lu\n", nospc_test());
+    printf("repair bad %lu\n", repair_test());
+
     ext2_list_dir_by_path(fs,"/");
     ext2_list_dir_by_path(fs,"/a");
     ext2_list_dir_by_path(fs,"/a/b");
@@ -54,6 +402,8 @@ int main()
     ext2_unlink_by_path(fs, "/a/b");
     ext2_unlink_by_path(fs, "/a");
 
+    ext2_fs_unmount(&fs);
+    disk_close(&disk);
 
 
 
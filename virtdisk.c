@@ -7,22 +7,884 @@
  * @LastEditors: scuec_weiqiang scuec_weiqiang@qq.com
  * @Copyright    : G AUTOMOBILE RESEARCH INSTITUTE CO.,LTD Copyright (c) 2025.
 */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#ifdef __linux__
+#include <linux/io_uring.h>
+#endif
 #include "stdint.h"
 #include "string.h"
 #include "virtdisk.h"
 #include "stdio.h"
-uint8_t hard_disk[DISK_SIZE];//64m虚拟磁盘
+#include "malloc.h"
 
-void  disk_read(uint8_t* buf, uint64_t sector)
-{   
-    memcpy(buf, hard_disk + 512 * sector, 512);
+#define DISK_IOV_MAX 1024 // 单次preadv/pwritev最多携带的缓冲区数
+#define DISK_URING_DEPTH 128 // io_uring提交队列深度
+
+/*------------------------------------ 内存后端 ------------------------------------*/
+
+static int64_t mem_open(disk_t *disk, const char *path, uint64_t size)
+{
+    (void)path;
+    if(size==0)
+    {
+        printf("disk: mem disk size error\n");
+        return -1;
+    }
+    // 匿名映射按需分配物理页，大磁盘不会在创建时就占满内存
+    void *base = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if(base==MAP_FAILED)
+    {
+        printf("disk: mem disk mmap error\n");
+        return -1;
+    }
+    disk->base = (uint8_t*)base;
+    disk->size = size;
+    return 0;
+}
+
+static int64_t mem_read(disk_t *disk, void *buf, uint64_t sector, uint64_t count)
+{
+    memcpy(buf, disk->base + disk->sector_size * sector, disk->sector_size * count);
+    return 0;
+}
+
+static int64_t mem_write(disk_t *disk, const void *buf, uint64_t sector, uint64_t count)
+{
+    memcpy(disk->base + disk->sector_size * sector, buf, disk->sector_size * count);
+    return 0;
+}
+
+static int64_t mem_flush(disk_t *disk)
+{
+    (void)disk;
+    return 0;
 }
 
-void  disk_write(uint8_t* buf, uint64_t sector)
+static int64_t mem_close(disk_t *disk)
 {
-    memcpy(hard_disk + 512 * sector, buf, 512);
-    // for(uint64_t i=0;i<2048;i++)
-    // {
-    //     printf("1%c",hard_disk[68*BLOCK_SIZE+i]);
-    // }
-}
\ No newline at end of file
+    munmap(disk->base, disk->size);
+    disk->base = NULL;
+    return 0;
+}
+
+const disk_ops_t disk_mem_ops = {
+    .name  = "mem",
+    .open  = mem_open,
+    .read  = mem_read,
+    .write = mem_write,
+    .flush = mem_flush,
+    .close = mem_close,
+};
+
+
+/*------------------------------------ 映射文件后端 ------------------------------------*/
+
+/**
+ * @brief 打开一个主机文件并把它调整到需要的大小
+ *
+ * size为0时使用文件现有大小（挂载已有镜像）；size大于文件大小时把文件扩展到size（稀疏文件，不会真正写零）。
+ *
+ * @return 成功返回文件描述符，失败返回-1
+ */
+static int host_file_open(const char *path, uint64_t *size)
+{
+    if(path==NULL)
+    {
+        printf("disk: file disk needs a path\n");
+        return -1;
+    }
+
+    int fd = open(path, O_RDWR|O_CREAT, 0644);
+    if(fd<0)
+    {
+        printf("disk: open %s error\n", path);
+        return -1;
+    }
+
+    struct stat st;
+    if(fstat(fd, &st)<0)
+    {
+        close(fd);
+        return -1;
+    }
+    if(*size==0)
+    {
+        *size = (uint64_t)st.st_size;
+    }
+    else if((uint64_t)st.st_size<*size && ftruncate(fd, (off_t)*size)<0)
+    {
+        printf("disk: resize %s error\n", path);
+        close(fd);
+        return -1;
+    }
+    if(*size==0)
+    {
+        printf("disk: %s is empty\n", path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief 打开并映射一个主机文件作为磁盘
+ *
+ * 映射后读写只是内存拷贝，页面由内核按需调入，挂载大镜像不需要把整个文件读进来。
+ */
+static int64_t mmap_open(disk_t *disk, const char *path, uint64_t size)
+{
+    int fd = host_file_open(path, &size);
+    if(fd<0)
+    {
+        return -1;
+    }
+
+    void *base = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if(base==MAP_FAILED)
+    {
+        printf("disk: mmap %s error\n", path);
+        close(fd);
+        return -1;
+    }
+
+    disk->base = (uint8_t*)base;
+    disk->size = size;
+    disk->fd = fd;
+    return 0;
+}
+
+static int64_t mmap_flush(disk_t *disk)
+{
+    return msync(disk->base, disk->size, MS_SYNC)==0?0:-1;
+}
+
+static int64_t mmap_close(disk_t *disk)
+{
+    msync(disk->base, disk->size, MS_SYNC);
+    munmap(disk->base, disk->size);
+    close(disk->fd);
+    disk->base = NULL;
+    disk->fd = -1;
+    return 0;
+}
+
+const disk_ops_t disk_mmap_ops = {
+    .name  = "mmap",
+    .open  = mmap_open,
+    .read  = mem_read,
+    .write = mem_write,
+    .flush = mmap_flush,
+    .close = mmap_close,
+};
+
+
+/*------------------------------------ 文件后端 ------------------------------------*/
+
+static int64_t file_open(disk_t *disk, const char *path, uint64_t size)
+{
+    int fd = host_file_open(path, &size);
+    if(fd<0)
+    {
+        return -1;
+    }
+    disk->size = size;
+    disk->fd = fd;
+    return 0;
+}
+
+/**
+ * @brief 在一次preadv/pwritev中传输一组扇区相邻的缓冲区
+ *
+ * 普通文件只会在末尾出现短读写，这里仍然按已传输的字节数推进，直到全部完成。
+ */
+static int64_t file_rw_run(int fd, struct iovec *vec, int cnt, off_t off, int is_write)
+{
+    while(cnt>0)
+    {
+        ssize_t ret = is_write ? pwritev(fd, vec, cnt, off) : preadv(fd, vec, cnt, off);
+        if(ret<=0)
+        {
+            printf("disk: %s error at offset %ld\n", is_write?"pwritev":"preadv", (long)off);
+            return -1;
+        }
+        off += ret;
+        while(cnt>0 && (size_t)ret>=vec->iov_len)
+        {
+            ret -= vec->iov_len;
+            vec++;
+            cnt--;
+        }
+        if(cnt>0)
+        {
+            vec->iov_base = (uint8_t*)vec->iov_base + ret;
+            vec->iov_len -= ret;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief 把请求列表中扇区相邻的段收集到同一个iovec数组里，每组只发一次系统调用
+ */
+static int64_t file_rw_v(disk_t *disk, const disk_iovec_t *iov, uint64_t iovcnt, int is_write)
+{
+    struct iovec vec[DISK_IOV_MAX];
+    uint64_t i = 0;
+    while(i<iovcnt)
+    {
+        off_t off = (off_t)(iov[i].sector * disk->sector_size);
+        uint64_t next_sector = iov[i].sector;
+        int cnt = 0;
+        while(i<iovcnt && cnt<DISK_IOV_MAX && iov[i].sector==next_sector)
+        {
+            vec[cnt].iov_base = iov[i].buf;
+            vec[cnt].iov_len = iov[i].count * disk->sector_size;
+            next_sector += iov[i].count;
+            cnt++;
+            i++;
+        }
+        if(file_rw_run(disk->fd, vec, cnt, off, is_write)<0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int64_t file_readv(disk_t *disk, const disk_iovec_t *iov, uint64_t iovcnt)
+{
+    return file_rw_v(disk, iov, iovcnt, 0);
+}
+
+static int64_t file_writev(disk_t *disk, const disk_iovec_t *iov, uint64_t iovcnt)
+{
+    return file_rw_v(disk, iov, iovcnt, 1);
+}
+
+static int64_t file_read(disk_t *disk, void *buf, uint64_t sector, uint64_t count)
+{
+    disk_iovec_t iov = {sector, count, buf};
+    return file_rw_v(disk, &iov, 1, 0);
+}
+
+static int64_t file_write(disk_t *disk, const void *buf, uint64_t sector, uint64_t count)
+{
+    disk_iovec_t iov = {sector, count, (void*)buf};
+    return file_rw_v(disk, &iov, 1, 1);
+}
+
+static int64_t file_flush(disk_t *disk)
+{
+    return fdatasync(disk->fd)==0?0:-1;
+}
+
+static int64_t file_close(disk_t *disk)
+{
+    fdatasync(disk->fd);
+    close(disk->fd);
+    disk->fd = -1;
+    return 0;
+}
+
+const disk_ops_t disk_file_ops = {
+    .name   = "file",
+    .open   = file_open,
+    .read   = file_read,
+    .write  = file_write,
+    .readv  = file_readv,
+    .writev = file_writev,
+    .flush  = file_flush,
+    .close  = file_close,
+};
+
+
+/*------------------------------------ io_uring后端 ------------------------------------*/
+
+#if defined(__linux__) && defined(__NR_io_uring_setup)
+
+typedef struct uring
+{
+    int ring_fd;
+
+    void *sq_ptr;
+    size_t sq_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+
+    void *cq_ptr;
+    size_t cq_size;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+
+    pthread_mutex_t lock; // 提交/完成队列只能由一个线程操作
+}uring_t;
+
+// 一次向量请求中扇区相邻的一段，对应一个SQE
+typedef struct uring_req
+{
+    off_t off;
+    struct iovec *vec;
+    int cnt;
+    uint64_t len;
+}uring_req_t;
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static void uring_destroy(uring_t *ring)
+{
+    if(ring->sqes!=NULL && ring->sqes!=MAP_FAILED)
+    {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if(ring->cq_ptr!=NULL && ring->cq_ptr!=MAP_FAILED && ring->cq_ptr!=ring->sq_ptr)
+    {
+        munmap(ring->cq_ptr, ring->cq_size);
+    }
+    if(ring->sq_ptr!=NULL && ring->sq_ptr!=MAP_FAILED)
+    {
+        munmap(ring->sq_ptr, ring->sq_size);
+    }
+    if(ring->ring_fd>=0)
+    {
+        close(ring->ring_fd);
+    }
+    pthread_mutex_destroy(&ring->lock);
+    free(ring);
+}
+
+/**
+ * @brief 建立io_uring并映射提交/完成队列
+ *
+ * 内核不支持或被禁用时返回NULL，由调用者退回同步后端。
+ */
+static uring_t* uring_create(unsigned entries)
+{
+    uring_t *ring = (uring_t*)malloc(sizeof(uring_t));
+    if(ring==NULL)
+    {
+        return NULL;
+    }
+    memset(ring, 0, sizeof(uring_t));
+    pthread_mutex_init(&ring->lock, NULL);
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring->ring_fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if(ring->ring_fd<0)
+    {
+        pthread_mutex_destroy(&ring->lock);
+        free(ring);
+        return NULL;
+    }
+
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if(ring->cq_size>ring->sq_size)
+        {
+            ring->sq_size = ring->cq_size;
+        }
+        ring->cq_size = ring->sq_size;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->ring_fd, IORING_OFF_SQ_RING);
+    if(ring->sq_ptr==MAP_FAILED)
+    {
+        uring_destroy(ring);
+        return NULL;
+    }
+    if(p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ring->cq_ptr = ring->sq_ptr;
+    }
+    else
+    {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->ring_fd, IORING_OFF_CQ_RING);
+        if(ring->cq_ptr==MAP_FAILED)
+        {
+            uring_destroy(ring);
+            return NULL;
+        }
+    }
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = (struct io_uring_sqe*)mmap(NULL, ring->sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring->ring_fd, IORING_OFF_SQES);
+    if(ring->sqes==MAP_FAILED)
+    {
+        uring_destroy(ring);
+        return NULL;
+    }
+
+    uint8_t *sq = (uint8_t*)ring->sq_ptr;
+    ring->sq_head = (unsigned*)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + p.sq_off.array);
+    ring->sq_entries = p.sq_entries;
+
+    uint8_t *cq = (uint8_t*)ring->cq_ptr;
+    ring->cq_head = (unsigned*)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return ring;
+}
+
+static void uring_push(uring_t *ring, int fd, uring_req_t *req, uint64_t tag, int is_write)
+{
+    unsigned tail = *ring->sq_tail;
+    unsigned idx = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = is_write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->off = (uint64_t)req->off;
+    sqe->addr = (uint64_t)(uintptr_t)req->vec;
+    sqe->len = (unsigned)req->cnt;
+    sqe->user_data = tag;
+    ring->sq_array[idx] = idx;
+    // 先写好SQE再发布tail，内核用acquire读取
+    __atomic_store_n(ring->sq_tail, tail+1, __ATOMIC_RELEASE);
+}
+
+/**
+ * @brief 把一组请求全部提交到io_uring并等待完成
+ *
+ * 扇区相邻的段合成一个READV/WRITEV，队列没满就一直往里放，一次io_uring_enter提交整批并收割已完成的请求。
+ * 短读写的剩余部分用同步接口补齐。io_uring_enter出错时撤回内核还没取走的SQE，和没放进队列的请求一起用同步接口完成，
+ * 已经提交的请求要等它们全部完成后才能返回，否则内核还在用vec，它们的CQE也会被下一次调用当成自己的。
+ */
+static int64_t uring_rw_v(disk_t *disk, const disk_iovec_t *iov, uint64_t iovcnt, int is_write)
+{
+    uring_t *ring = (uring_t*)disk->priv;
+    struct iovec *vec = (struct iovec*)malloc(sizeof(struct iovec)*iovcnt);
+    uring_req_t *reqs = (uring_req_t*)malloc(sizeof(uring_req_t)*iovcnt);
+    if(vec==NULL||reqs==NULL)
+    {
+        free(vec);
+        free(reqs);
+        printf("disk: uring request malloc error\n");
+        return -1;
+    }
+
+    uint64_t req_num = 0;
+    for(uint64_t i=0;i<iovcnt;)
+    {
+        uring_req_t *req = &reqs[req_num++];
+        req->off = (off_t)(iov[i].sector * disk->sector_size);
+        req->vec = &vec[i];
+        req->cnt = 0;
+        req->len = 0;
+        uint64_t next_sector = iov[i].sector;
+        while(i<iovcnt && req->cnt<DISK_IOV_MAX && iov[i].sector==next_sector)
+        {
+            vec[i].iov_base = iov[i].buf;
+            vec[i].iov_len = iov[i].count * disk->sector_size;
+            req->len += vec[i].iov_len;
+            next_sector += iov[i].count;
+            req->cnt++;
+            i++;
+        }
+    }
+
+    int64_t ret = 0;
+    uint64_t next = 0, done = 0, inflight = 0;
+    unsigned pending = 0;
+    int failed = 0;
+    pthread_mutex_lock(&ring->lock);
+    while(done<req_num)
+    {
+        while(!failed && next<req_num && inflight<ring->sq_entries)
+        {
+            uring_push(ring, disk->fd, &reqs[next], next, is_write);
+            next++;
+            inflight++;
+            pending++;
+        }
+
+        int n = uring_enter(ring->ring_fd, pending, 1, IORING_ENTER_GETEVENTS);
+        if(n<0 && errno!=EINTR && errno!=EAGAIN && errno!=EBUSY)
+        {
+            if(!failed)
+            {
+                printf("disk: io_uring_enter error %d, finishing synchronously\n", errno);
+                failed = 1;
+                // 没有SQPOLL时内核只在io_uring_enter中读SQ，最后pending个SQE还没被取走，可以撤回
+                __atomic_store_n(ring->sq_tail, *ring->sq_tail - pending, __ATOMIC_RELEASE);
+                inflight -= pending;
+                for(uint64_t k = next - pending;k<req_num;k++)
+                {
+                    if(file_rw_run(disk->fd, reqs[k].vec, reqs[k].cnt, reqs[k].off, is_write)<0)
+                    {
+                        ret = -1;
+                    }
+                    done++;
+                }
+                next = req_num;
+                pending = 0;
+            }
+            else
+            {
+                sched_yield(); // 等已经提交的请求完成，CQE不经过io_uring_enter也会出现在CQ中
+            }
+        }
+        else if(n>0)
+        {
+            pending -= (unsigned)n;
+        }
+
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        while(head!=tail)
+        {
+            struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+            uring_req_t *req = &reqs[cqe->user_data];
+            if(cqe->res<0)
+            {
+                printf("disk: io_uring %s error %d\n", is_write?"write":"read", -cqe->res);
+                ret = -1;
+            }
+            else if((uint64_t)cqe->res<req->len)
+            {
+                // 短读写：剩余部分同步补齐
+                uint64_t skip = (uint64_t)cqe->res;
+                struct iovec *v = req->vec;
+                int cnt = req->cnt;
+                while(skip>=v->iov_len)
+                {
+                    skip -= v->iov_len;
+                    v++;
+                    cnt--;
+                }
+                v->iov_base = (uint8_t*)v->iov_base + skip;
+                v->iov_len -= skip;
+                if(file_rw_run(disk->fd, v, cnt, req->off + cqe->res, is_write)<0)
+                {
+                    ret = -1;
+                }
+            }
+            head++;
+            done++;
+            inflight--;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&ring->lock);
+
+    free(vec);
+    free(reqs);
+    return ret;
+}
+
+static int64_t uring_open(disk_t *disk, const char *path, uint64_t size)
+{
+    if(file_open(disk, path, size)<0)
+    {
+        return -1;
+    }
+    uring_t *ring = uring_create(DISK_URING_DEPTH);
+    if(ring==NULL)
+    {
+        // 内核没有io_uring或被禁用，改用同步的pread/pwrite后端
+        printf("disk: io_uring unavailable, falling back to %s\n", disk_file_ops.name);
+        disk->ops = &disk_file_ops;
+        return 0;
+    }
+    disk->priv = ring;
+    return 0;
+}
+
+static int64_t uring_readv(disk_t *disk, const disk_iovec_t *iov, uint64_t iovcnt)
+{
+    return uring_rw_v(disk, iov, iovcnt, 0);
+}
+
+static int64_t uring_writev(disk_t *disk, const disk_iovec_t *iov, uint64_t iovcnt)
+{
+    return uring_rw_v(disk, iov, iovcnt, 1);
+}
+
+static int64_t uring_read(disk_t *disk, void *buf, uint64_t sector, uint64_t count)
+{
+    disk_iovec_t iov = {sector, count, buf};
+    return uring_rw_v(disk, &iov, 1, 0);
+}
+
+static int64_t uring_write(disk_t *disk, const void *buf, uint64_t sector, uint64_t count)
+{
+    disk_iovec_t iov = {sector, count, (void*)buf};
+    return uring_rw_v(disk, &iov, 1, 1);
+}
+
+static int64_t uring_close(disk_t *disk)
+{
+    uring_destroy((uring_t*)disk->priv);
+    disk->priv = NULL;
+    return file_close(disk);
+}
+
+const disk_ops_t disk_uring_ops = {
+    .name   = "io_uring",
+    .open   = uring_open,
+    .read   = uring_read,
+    .write  = uring_write,
+    .readv  = uring_readv,
+    .writev = uring_writev,
+    .flush  = file_flush,
+    .close  = uring_close,
+};
+
+#else
+
+// 非Linux平台没有io_uring，直接使用同步后端
+static int64_t uring_open(disk_t *disk, const char *path, uint64_t size)
+{
+    disk->ops = &disk_file_ops;
+    return file_open(disk, path, size);
+}
+
+const disk_ops_t disk_uring_ops = {
+    .name   = "io_uring",
+    .open   = uring_open,
+    .read   = file_read,
+    .write  = file_write,
+    .readv  = file_readv,
+    .writev = file_writev,
+    .flush  = file_flush,
+    .close  = file_close,
+};
+
+#endif
+
+
+/*------------------------------------ 通用接口 ------------------------------------*/
+
+/**
+ * @brief 用指定的后端打开一个磁盘
+ *
+ * @param ops 后端操作接口
+ * @param path 后端需要的路径（内存后端忽略）
+ * @param size 磁盘大小(字节)，文件后端为0时使用文件大小
+ *
+ * @return 成功返回磁盘指针，失败返回NULL
+ */
+disk_t* disk_open(const disk_ops_t *ops, const char *path, uint64_t size)
+{
+    if(ops==NULL)
+    {
+        return NULL;
+    }
+
+    disk_t *disk = (disk_t*)malloc(sizeof(disk_t));
+    if(disk==NULL)
+    {
+        printf("disk: disk malloc error\n");
+        return NULL;
+    }
+    memset(disk, 0, sizeof(disk_t));
+    disk->ops = ops;
+    disk->fd = -1;
+
+    if(ops->open(disk, path, size)<0)
+    {
+        free(disk);
+        return NULL;
+    }
+    disk->sector_size = DISK_SECTOR_SIZE;
+    disk->sector_num = disk->size / DISK_SECTOR_SIZE;
+    return disk;
+}
+
+
+/**
+ * @brief 设置读写接口使用的扇区大小
+ *
+ * 文件系统把它设成自己的块大小，之后读写接口中的扇区号就是块号。
+ *
+ * @param size 扇区大小(字节)，必须是DISK_SECTOR_SIZE的2的幂倍
+ *
+ * @return 成功返回0，参数错误返回-1
+ */
+int64_t disk_set_sector_size(disk_t *disk, uint64_t size)
+{
+    if(disk==NULL || size<DISK_SECTOR_SIZE || (size & (size-1))!=0)
+    {
+        printf("disk: sector size %lu error\n", size);
+        return -1;
+    }
+    disk->sector_size = size;
+    disk->sector_num = disk->size / size;
+    return 0;
+}
+
+int64_t disk_close(disk_t **disk)
+{
+    if(disk==NULL||(*disk)==NULL)
+    {
+        return -1;
+    }
+    int64_t ret = (*disk)->ops->close(*disk);
+    free(*disk);
+    *disk = NULL;
+    return ret;
+}
+
+int64_t disk_flush(disk_t *disk)
+{
+    return disk->ops->flush(disk);
+}
+
+int64_t disk_read_range(disk_t *disk, void *buf, uint64_t sector, uint64_t count)
+{
+    if(sector>=disk->sector_num || count>disk->sector_num-sector)
+    {
+        printf("disk: read sector %lu+%lu out of range\n", sector, count);
+        return -1;
+    }
+    if(count==0)
+    {
+        return 0;
+    }
+    return disk->ops->read(disk, buf, sector, count);
+}
+
+int64_t disk_write_range(disk_t *disk, const void *buf, uint64_t sector, uint64_t count)
+{
+    if(sector>=disk->sector_num || count>disk->sector_num-sector)
+    {
+        printf("disk: write sector %lu+%lu out of range\n", sector, count);
+        return -1;
+    }
+    if(count==0)
+    {
+        return 0;
+    }
+    return disk->ops->write(disk, buf, sector, count);
+}
+
+int64_t disk_read(disk_t *disk, uint8_t* buf, uint64_t sector)
+{
+    return disk_read_range(disk, buf, sector, 1);
+}
+
+int64_t disk_write(disk_t *disk, const uint8_t* buf, uint64_t sector)
+{
+    return disk_write_range(disk, buf, sector, 1);
+}
+
+/**
+ * @brief 合并请求列表中扇区相邻、缓冲区也相邻的段
+ *
+ * 合并结果写入out，返回合并后的段数；越界请求返回-1。
+ */
+static int64_t disk_merge_iov(disk_t *disk, const disk_iovec_t *iov, uint64_t iovcnt, disk_iovec_t *out)
+{
+    uint64_t n = 0;
+    for(uint64_t i=0;i<iovcnt;i++)
+    {
+        if(iov[i].sector>=disk->sector_num || iov[i].count>disk->sector_num-iov[i].sector)
+        {
+            printf("disk: sector %lu+%lu out of range\n", iov[i].sector, iov[i].count);
+            return -1;
+        }
+        if(iov[i].count==0)
+        {
+            continue;
+        }
+        if(n>0 && out[n-1].sector+out[n-1].count==iov[i].sector
+               && (uint8_t*)out[n-1].buf+out[n-1].count*disk->sector_size==(uint8_t*)iov[i].buf)
+        {
+            out[n-1].count += iov[i].count;
+            continue;
+        }
+        out[n++] = iov[i];
+    }
+    return (int64_t)n;
+}
+
+static int64_t disk_rw_v(disk_t *disk, const disk_iovec_t *iov, uint64_t iovcnt, int is_write)
+{
+    disk_iovec_t stack_iov[64];
+    disk_iovec_t *merged = stack_iov;
+    if(iovcnt>64)
+    {
+        merged = (disk_iovec_t*)malloc(sizeof(disk_iovec_t)*iovcnt);
+        if(merged==NULL)
+        {
+            printf("disk: iovec malloc error\n");
+            return -1;
+        }
+    }
+
+    int64_t ret = disk_merge_iov(disk, iov, iovcnt, merged);
+    if(ret>0)
+    {
+        uint64_t n = (uint64_t)ret;
+        ret = 0;
+        if(is_write && disk->ops->writev)
+        {
+            ret = disk->ops->writev(disk, merged, n);
+        }
+        else if(!is_write && disk->ops->readv)
+        {
+            ret = disk->ops->readv(disk, merged, n);
+        }
+        else
+        {
+            for(uint64_t i=0;i<n && ret==0;i++)
+            {
+                ret = is_write ? disk->ops->write(disk, merged[i].buf, merged[i].sector, merged[i].count)
+                               : disk->ops->read(disk, merged[i].buf, merged[i].sector, merged[i].count);
+            }
+        }
+    }
+
+    if(merged!=stack_iov)
+    {
+        free(merged);
+    }
+    return ret<0?-1:0;
+}
+
+/**
+ * @brief 分散读：一次读取多段扇区
+ *
+ * 扇区相邻且缓冲区相邻的段会合并成一次传输；支持向量接口的后端把扇区相邻的段放进同一次系统调用。
+ *
+ * @param disk 磁盘
+ * @param iov 请求列表
+ * @param iovcnt 请求数
+ *
+ * @return 成功返回0，失败返回-1
+ */
+int64_t disk_readv(disk_t *disk, const disk_iovec_t *iov, uint64_t iovcnt)
+{
+    return disk_rw_v(disk, iov, iovcnt, 0);
+}
+
+/**
+ * @brief 聚集写：一次写入多段扇区，合并规则同disk_readv
+ */
+int64_t disk_writev(disk_t *disk, const disk_iovec_t *iov, uint64_t iovcnt)
+{
+    return disk_rw_v(disk, iov, iovcnt, 1);
+}
@@ -12,26 +12,61 @@
 
 #include "stdint.h"
 
-#define BLOCK_SIZE 512
-#define DISK_SIZE 64*1024*1024
-
-void  disk_read(uint8_t* buf, uint64_t sector);
-void  disk_write(uint8_t* buf, uint64_t sector);
-
-#define DISK_READ(buf, start,num) \
-    do{\
-        for(uint64_t sector = start;sector < (start+num);++sector) \
-        {\
-            disk_read(((uint8_t*)buf+sector*BLOCK_SIZE), sector); \
-        }\
-    }while(0) \
-
-#define DISK_WRITE(data, start,num) \
-    do{\
-        for(uint64_t sector = start;sector < (start+num);++sector) \
-        {\
-            disk_write(((uint8_t*)data+sector*BLOCK_SIZE), sector); \
-        }\
-    }while(0) \
-
-#endif
\ No newline at end of file
+#define DISK_SECTOR_SIZE 512 // 默认扇区大小(字节)
+
+typedef struct disk disk_t;
+
+// 一段连续扇区的传输请求
+typedef struct disk_iovec
+{
+    uint64_t sector; // 起始扇区
+    uint64_t count;  // 扇区数
+    void *buf;       // 数据缓冲区，大小为count*sector_size
+}disk_iovec_t;
+
+// 块设备操作接口，不同的后端（内存、映射文件……）各自实现一套
+typedef struct disk_ops
+{
+    const char *name;
+    int64_t (*open)(disk_t *disk, const char *path, uint64_t size);
+    int64_t (*read)(disk_t *disk, void *buf, uint64_t sector, uint64_t count);
+    int64_t (*write)(disk_t *disk, const void *buf, uint64_t sector, uint64_t count);
+    // 可选，一次提交多段请求；为NULL时逐段调用read/write
+    int64_t (*readv)(disk_t *disk, const disk_iovec_t *iov, uint64_t iovcnt);
+    int64_t (*writev)(disk_t *disk, const disk_iovec_t *iov, uint64_t iovcnt);
+    int64_t (*flush)(disk_t *disk);
+    int64_t (*close)(disk_t *disk);
+}disk_ops_t;
+
+typedef struct disk
+{
+    const disk_ops_t *ops;
+    uint64_t size;       // 磁盘大小(字节)
+    uint64_t sector_size; // 扇区大小(字节)，读写接口中的扇区号和扇区数都以它为单位
+    uint64_t sector_num; // 扇区数
+    uint8_t *base;       // 内存/映射后端的起始地址，其他后端为NULL
+    int fd;              // 文件后端的文件描述符，没有则为-1
+    void *priv;          // 后端私有数据
+}disk_t;
+
+extern const disk_ops_t disk_mem_ops;  // 内存后端，进程退出即丢失
+extern const disk_ops_t disk_mmap_ops; // 主机文件映射后端，大小任意
+extern const disk_ops_t disk_file_ops; // 主机文件pread/pwrite后端，相邻扇区合并成一次系统调用
+extern const disk_ops_t disk_uring_ops; // 主机文件io_uring异步后端，批量提交、批量收割；不可用时退回disk_file_ops
+
+disk_t* disk_open(const disk_ops_t *ops, const char *path, uint64_t size);
+int64_t disk_close(disk_t **disk);
+int64_t disk_flush(disk_t *disk);
+int64_t disk_set_sector_size(disk_t *disk, uint64_t size);
+
+int64_t disk_read(disk_t *disk, uint8_t* buf, uint64_t sector);
+int64_t disk_write(disk_t *disk, const uint8_t* buf, uint64_t sector);
+int64_t disk_read_range(disk_t *disk, void *buf, uint64_t sector, uint64_t count);
+int64_t disk_write_range(disk_t *disk, const void *buf, uint64_t sector, uint64_t count);
+int64_t disk_readv(disk_t *disk, const disk_iovec_t *iov, uint64_t iovcnt);
+int64_t disk_writev(disk_t *disk, const disk_iovec_t *iov, uint64_t iovcnt);
+
+#define DISK_READ(disk, buf, start,num) disk_read_range(disk, buf, start, num)
+#define DISK_WRITE(disk, data, start,num) disk_write_range(disk, data, start, num)
+
+#endif